@@ -0,0 +1,1006 @@
+#include <fcntl.h>        // open
+#include <sys/resource.h> // getrusage
+#include <sys/wait.h>     // waitpid
+#include <unistd.h>       // sysconf, close, unlink, fork, execl, dup2, access
+
+#include <algorithm> // std::sort
+#include <array>     // std::array
+#include <chrono>    // std::chrono::steady_clock
+#include <cstdio>    // std::snprintf
+#include <cstdlib>   // std::atof, std::malloc, std::free, mkstemp
+#include <cstring>   // std::memcmp
+#include <fstream>   // std::ifstream
+#include <iostream>  // std::cout
+#include <memory>    // std::make_unique
+#include <new>       // std::bad_alloc
+#include <sstream>   // std::istringstream
+#include <stdexcept> // std::exception
+#include <string>    // std::string
+#include <thread>    // std::thread
+#include <vector>    // std::vector
+
+#include "cpu.h"
+#include "debugger.h"
+#include "embedded.h"
+#include "interpreter.h"
+#include "miniasm.h"
+#include "program.h"
+#include "rom.h"
+#include "scheduler.h"
+#include "server.h"
+#include "snapshot.h"
+#include "syntax.h"
+#include "trace.h"
+
+/*
+ * Benchmark suite, run by "make bench".
+ *
+ * Every workload is run with every engine for at least min_time seconds.
+ * Results are printed as one JSON object per line:
+ *   {"workload": "arith", "engine": "threaded", "instructions": 123,
+ *    "seconds": 0.5, "instructions_per_second": 246, "ns_per_instruction": 4.06,
+ *    "peak_rss_kb": 3400, "allocations": 0}
+ * Parse throughput is reported in lines instead of instructions.
+ *
+ * allocations counts the heap allocations made while the prepared program
+ * runs again on a machine it already ran on. Every engine but the JIT must
+ * run without any, the suite fails otherwise.
+ *
+ * The threads workload runs the workloads with every engine on as many
+ * threads as cores (4 at least), each thread one workload over and over on
+ * machines of its own, sharing the prepared programs. Every run must end
+ * with the registers, steps and RAM of a run on a single thread, the suite
+ * fails otherwise.
+ *
+ * The memory workload compares the paged RAM of machines with the flat
+ * arrays they used to hold: resident memory per instance, then the latency
+ * of byte accesses.
+ *
+ * The snapshot workload runs the end of a program after a long setup, once
+ * per variant: by running the whole program again, by forking a new machine
+ * from a snapshot, and by restoring one machine in place. The setup fills
+ * every RAM page, which the snapshot shares and restoring does not copy.
+ *
+ * The embedded workload runs a short routine given as a string literal,
+ * parsing it on every call as hosts did before embedded.h, then assembled
+ * while compiling.
+ *
+ * The startup workload gets a machine to the end of that setup, either from
+ * the source or by mapping a warm-start image saved there.
+ *
+ * The library workload runs the embedded routine through the C interface of
+ * libminiasm, resetting the machine between calls, then by starting
+ * ./mini-asm --batch for every run as hosts driving the CLI do. The second
+ * half is skipped when ./mini-asm was not built.
+ *
+ * The scheduler workload runs 10000 green VMs of a mailbox server over 4
+ * threads: each VM blocks on an empty mailbox, the host posts to the blocked
+ * ones between rounds. It reports the instructions run per second, Jain's
+ * fairness index, the latency of slices and the bytes a parked VM holds.
+ *
+ * The serve workload sends the embedded routine to a daemon started in the
+ * suite, from 1 then 8 connections at once, and reports the p50 and p99
+ * latency of a request. "cold" requests all send a new source, which the
+ * daemon decodes, "warm" ones the same, found in its cache.
+ *
+ * The frontend workload loads a generated file of 65535 instructions, the
+ * most PC reaches, and a label every 8 lines, with read_program from a
+ * stream, then mapped by load_program on 1, 2, 4 and 8 threads. Every load
+ * must decode the same program as the first. Both loaders must then refuse a
+ * file of 70000 instructions, and a straight program of 65535 instructions
+ * must run to its end.
+ *
+ * The trace workload records the arith, stack, branch, compare and ram
+ * workloads with the threaded engine, and reports the time per instruction
+ * against untraced runs, the trace bytes per instruction, then the time per
+ * instruction of a replay, which must run as many as were recorded. Each
+ * workload is recorded twice: by default, then listing what every block
+ * changed ("changes": true).
+ *
+ * The debugger workload runs the same workloads under the debugger: with
+ * nothing to stop at, which must cost nothing, with a breakpoint on the last
+ * instruction, and watching Y. It reports the stops of a run on Y, which
+ * changes once per outer iteration in most workloads.
+ *
+ * Usage: mini-asm-bench [--time=seconds] [workload...]
+ */
+
+namespace {
+
+u64 allocations = 0; //!< Calls to operator new so far
+
+} // namespace
+
+void* operator new(std::size_t size) {
+  allocations++;
+  if (auto const memory = std::malloc(size ? size : 1)) return memory;
+  throw std::bad_alloc{};
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+  std::free(memory);
+}
+
+namespace {
+
+using Asm::Interpreter::Engine;
+using Clock = std::chrono::steady_clock;
+
+struct Workload {
+  const char* name;
+  const char* source;
+};
+
+// Each workload runs 255 * 255 iterations of its inner loop
+const Workload workloads[] = {
+  {"arith",
+   "mov y, 0\n"
+   "outer:\n"
+   "mov x, 0\n"
+   "inner:\n"
+   "add a, 3\n"
+   "xor a, 0x55\n"
+   "shl a, 1\n"
+   "sub a, x\n"
+   "or a, 1\n"
+   "add x, 1\n"
+   "cmp x, 255\n"
+   "jne inner\n"
+   "add y, 1\n"
+   "cmp y, 255\n"
+   "jne outer\n"},
+  {"stack",
+   "mov *200, 0\n"
+   "outer:\n"
+   "mov x, 0\n"
+   "inner:\n"
+   "push x\n"
+   "push a\n"
+   "push 7\n"
+   "pop y\n"
+   "pop a\n"
+   "pop y\n"
+   "add a, y\n"
+   "add x, 1\n"
+   "cmp x, 255\n"
+   "jne inner\n"
+   "add *200, 1\n"
+   "cmp *200, 255\n"
+   "jne outer\n"},
+  {"branch",
+   "mov y, 0\n"
+   "outer:\n"
+   "mov x, 0\n"
+   "inner:\n"
+   "mov a, x\n"
+   "and a, 3\n"
+   "cmp a, 1\n"
+   "je one\n"
+   "jl zero\n"
+   "cmp a, 2\n"
+   "jg three\n"
+   "add *2, 1\n"
+   "jmp next\n"
+   "one:\n"
+   "add *1, 1\n"
+   "jmp next\n"
+   "zero:\n"
+   "add *0, 1\n"
+   "jmp next\n"
+   "three:\n"
+   "add *3, 1\n"
+   "next:\n"
+   "add x, 1\n"
+   "cmp x, 255\n"
+   "jne inner\n"
+   "add y, 1\n"
+   "cmp y, 255\n"
+   "jne outer\n"},
+  {"compare",
+   "mov y, 0\n"
+   "outer:\n"
+   "mov x, 0\n"
+   "inner:\n"
+   "cmp x, y\n"
+   "jl below\n"
+   "je same\n"
+   "add a, 1\n"
+   "jmp next\n"
+   "below:\n"
+   "cmp x, 128\n"
+   "jge next\n"
+   "cmp a, x\n"
+   "jle next\n"
+   "add a, 2\n"
+   "jmp next\n"
+   "same:\n"
+   "add a, 3\n"
+   "next:\n"
+   "add x, 1\n"
+   "cmp x, 255\n"
+   "jne inner\n"
+   "add y, 1\n"
+   "cmp y, 255\n"
+   "jne outer\n"},
+  {"ram",
+   "mov *100, 0\n"
+   "outer:\n"
+   "mov *101, 0\n"
+   "inner:\n"
+   "mov *10, *101\n"
+   "add *11, *10\n"
+   "xor *12, *11\n"
+   "mov a, *12\n"
+   "add *13, a\n"
+   "sub *14, *13\n"
+   "add *101, 1\n"
+   "cmp *101, 255\n"
+   "jne inner\n"
+   "add *100, 1\n"
+   "cmp *100, 255\n"
+   "jne outer\n"},
+};
+
+struct EngineConfig {
+  const char* name;
+  Engine engine;
+  bool optimize;
+  bool allocates; //!< Compiles while its blocks warm up
+};
+
+const EngineConfig engines[] = {
+  {"basic", Engine::basic, false, false},
+  {"switch", Engine::switched, true, false},
+  {"threaded-noopt", Engine::threaded, false, false},
+  {"threaded", Engine::threaded, true, false},
+  {"jit", Engine::jit, true, true},
+};
+
+long peak_rss_kb() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void report(std::string const& workload, std::string const& engine, u64 count, double seconds, u64 allocated) {
+  std::cout << "{\"workload\": \"" << workload << "\", \"engine\": \"" << engine
+    << "\", \"" << (engine == "parse" ? "lines" : "instructions") << "\": " << count
+    << ", \"seconds\": " << seconds
+    << ", \"" << (engine == "parse" ? "lines" : "instructions") << "_per_second\": " << count / seconds
+    << ", \"ns_per_" << (engine == "parse" ? "line" : "instruction") << "\": " << seconds * 1e9 / count
+    << ", \"peak_rss_kb\": " << peak_rss_kb() << ", \"allocations\": " << allocated << "}" << std::endl;
+}
+
+double elapsed(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/**
+ * @brief Measures Asm::Syntax on the lines of every workload
+ */
+void bench_parse(double min_time) {
+  std::vector<std::string> lines;
+  for (auto const& workload : workloads) {
+    std::istringstream source{workload.source};
+    std::string line;
+    while (std::getline(source, line)) lines.push_back(line);
+  }
+  u64 count = 0;
+  unsigned recognized = 0;
+  auto const before = allocations;
+  auto const start = Clock::now();
+  do {
+    for (auto const& line : lines) {
+      Asm::Syntax::Parsed parsed;
+      Asm::Syntax::Token name;
+      recognized += Asm::Syntax::parse_instruction(line, parsed) || Asm::Syntax::parse_label(line.data(), line.size(), name);
+    }
+    count += lines.size();
+  } while (elapsed(start) < min_time);
+  auto const seconds = elapsed(start);
+  if (recognized != count) std::cerr << "Unrecognized lines in the workloads\n";
+  report("syntax", "parse", count, seconds, allocations - before);
+}
+
+/**
+ * @returns False if an engine which should not allocate did
+ */
+bool bench_run(Workload const& workload, double min_time) {
+  Labels labels;
+  std::istringstream source{workload.source};
+  auto const program = Asm::read_program(source, labels);
+  bool clean = true;
+  for (auto const& engine : engines) {
+    Asm::Interpreter::Executable const executable{program, engine.engine, engine.optimize};
+    u64 steps = 0;
+    u64 allocated = 0;
+    // The first run commits the RAM pages the program writes
+    auto const machine = std::make_unique<Machine>();
+    executable.run(*machine);
+    auto const start = Clock::now();
+    do {
+      machine->registers = Registers{};
+      machine->steps = 0;
+      auto const before = allocations;
+      executable.run(*machine);
+      allocated += allocations - before;
+      steps += machine->steps;
+    } while (elapsed(start) < min_time);
+    report(workload.name, engine.name, steps, elapsed(start), allocated);
+    if (allocated != 0 && !engine.allocates) {
+      std::cerr << workload.name << " allocated " << allocated << " times with " << engine.name << "\n";
+      clean = false;
+    }
+  }
+  return clean;
+}
+
+/**
+ * @brief Checks if two machines ended in the same state
+ */
+bool same_state(Machine const& lhs, Machine const& rhs) noexcept {
+  auto const& a = lhs.registers;
+  auto const& b = rhs.registers;
+  if (a.A != b.A || a.X != b.X || a.Y != b.Y || a.P.value() != b.P.value() || a.PC != b.PC || a.S != b.S) return false;
+  if (lhs.steps != rhs.steps) return false;
+  for (std::size_t page = 0; page < Memory::pages; page++) {
+    auto const size = std::min(Memory::page_size, Memory::capacity - page * Memory::page_size);
+    if (std::memcmp(lhs.RAM.page(page), rhs.RAM.page(page), size) != 0) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Runs every workload at once, one per thread, with each engine
+ * @returns False if a run did not end as it does on a single thread
+ */
+bool bench_threads(double min_time) {
+  constexpr std::size_t count = sizeof(workloads) / sizeof(workloads[0]);
+  auto const threads = std::max(std::thread::hardware_concurrency(), 4u);
+  std::vector<Asm::Program> programs;
+  for (auto const& workload : workloads) {
+    Labels labels;
+    std::istringstream source{workload.source};
+    programs.push_back(Asm::read_program(source, labels));
+  }
+  bool clean = true;
+  for (auto const& engine : engines) {
+    std::vector<std::unique_ptr<Asm::Interpreter::Executable>> executables;
+    std::vector<std::unique_ptr<Machine>> expected;
+    for (auto const& program : programs) {
+      executables.push_back(std::make_unique<Asm::Interpreter::Executable>(program, engine.engine, engine.optimize));
+      expected.push_back(std::make_unique<Machine>());
+      executables.back()->run(*expected.back());
+    }
+    std::vector<u64> runs(threads, 0);
+    std::vector<u64> mismatches(threads, 0);
+    std::vector<std::thread> workers;
+    auto const start = Clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([&, t] {
+        auto const w = t % count;
+        do {
+          auto const machine = std::make_unique<Machine>();
+          executables[w]->run(*machine);
+          if (!same_state(*machine, *expected[w])) mismatches[t]++;
+          runs[t]++;
+        } while (elapsed(start) < min_time);
+      });
+    }
+    for (auto& worker : workers) worker.join();
+    auto const seconds = elapsed(start);
+    u64 total = 0, wrong = 0;
+    for (unsigned t = 0; t < threads; t++) {
+      total += runs[t];
+      wrong += mismatches[t];
+    }
+    std::cout << "{\"workload\": \"threads\", \"engine\": \"" << engine.name << "\", \"threads\": " << threads
+      << ", \"runs\": " << total << ", \"seconds\": " << seconds << ", \"runs_per_second\": " << total / seconds
+      << ", \"mismatches\": " << wrong << "}" << std::endl;
+    if (wrong != 0) {
+      std::cerr << wrong << " of " << total << " runs on " << threads << " threads differ from a single thread with "
+        << engine.name << "\n";
+      clean = false;
+    }
+  }
+  return clean;
+}
+
+/**
+ * @brief Machine state as it was before paged memory
+ */
+struct FlatMachine {
+  Registers registers;
+  Stack<0xff> stack;
+  std::array<u8, 0xffff> RAM{};
+  std::array<u8, 0xffff> VRAM{};
+};
+
+u8& byte(FlatMachine& machine, std::size_t addr) { return machine.RAM[addr]; }
+u8& byte(Machine& machine, std::size_t addr) { return machine.RAM.write(addr); }
+
+long resident_kb() {
+  long pages = 0;
+  long resident = 0;
+  std::ifstream statm{"/proc/self/statm"};
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+void report_memory(std::string const& engine, std::string const& metric, double value) {
+  std::cout << "{\"workload\": \"memory\", \"engine\": \"" << engine << "\", \"" << metric << "\": " << value
+    << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+}
+
+/**
+ * @brief Measures the resident memory of many machines which write a few bytes
+ */
+template <typename Instance>
+void bench_density(std::string const& name, unsigned count) {
+  std::vector<std::unique_ptr<Instance>> instances;
+  instances.reserve(count);
+  auto const before = resident_kb();
+  for (unsigned i = 0; i < count; i++) {
+    instances.push_back(std::make_unique<Instance>());
+    auto& instance = *instances.back();
+    byte(instance, 1) = 5;
+    byte(instance, 2) = static_cast<u8>(byte(instance, 2) + byte(instance, 1));
+  }
+  report_memory(name, "kb_per_instance", static_cast<double>(resident_kb() - before) / count);
+}
+
+template <typename Access>
+void bench_latency(std::string const& name, double min_time, Access access) {
+  u64 count = 0;
+  unsigned sink = 0;
+  auto const start = Clock::now();
+  do {
+    for (unsigned i = 0; i < 0x10000; i++) sink += access(i * 37 & 0xff);
+    count += 0x10000;
+  } while (elapsed(start) < min_time);
+  auto const seconds = elapsed(start);
+  if (sink == 1) std::cerr << "\n"; // Keeps the accesses
+  report_memory(name, "ns_per_access", seconds * 1e9 / count);
+}
+
+void bench_memory(double min_time) {
+  constexpr unsigned count = 2000;
+  bench_density<FlatMachine>("flat", count);
+  bench_density<Machine>("paged", count);
+
+  auto const flat = std::make_unique<FlatMachine>();
+  auto const machine = std::make_unique<Machine>();
+  bench_latency("flat", min_time, [&](unsigned addr) { return flat->RAM[addr]++; });
+  bench_latency("paged", min_time, [&](unsigned addr) { return machine->RAM.write(addr)++; });
+  auto const page = machine->RAM.page(0);
+  bench_latency("paged-engine", min_time, [&](unsigned addr) { return page[addr]++; });
+}
+
+const char* const snapshot_source =
+  "mov x, 0\n"
+  "setup:\n"
+  "mov y, 0\n"
+  "inner:\n"
+  "add *0, y\n"
+  "add y, 1\n"
+  "cmp y, 200\n"
+  "jne inner\n"
+  "add x, 1\n"
+  "cmp x, 50\n"
+  "jne setup\n"
+  "ready:\n"
+  "mov a, *0\n"
+  "add a, 7\n"
+  "mov *1, a\n"
+  "push a\n"
+  "pop y\n";
+
+void report_snapshot(std::string const& engine, u64 count, double seconds, u64 allocated) {
+  std::cout << "{\"workload\": \"snapshot\", \"engine\": \"" << engine << "\", \"variants\": " << count
+    << ", \"seconds\": " << seconds << ", \"ns_per_variant\": " << seconds * 1e9 / count
+    << ", \"peak_rss_kb\": " << peak_rss_kb() << ", \"allocations\": " << allocated << "}" << std::endl;
+}
+
+template <typename Variant>
+void bench_variants(std::string const& name, double min_time, Variant variant) {
+  u64 count = 0;
+  auto const before = allocations;
+  auto const start = Clock::now();
+  do {
+    for (unsigned i = 0; i < 100; i++) variant();
+    count += 100;
+  } while (elapsed(start) < min_time);
+  report_snapshot(name, count, elapsed(start), allocations - before);
+}
+
+void bench_snapshot(double min_time) {
+  Labels labels;
+  std::istringstream source{snapshot_source};
+  auto const program = Asm::read_program(source, labels);
+  Asm::Interpreter::Executable const executable{program};
+
+  auto const setup = std::make_unique<Machine>();
+  for (std::size_t addr = 0; addr < Memory::capacity; addr += Memory::page_size) setup->RAM.write(addr) = 1;
+  std::shared_ptr<const Memory> const filled = std::make_shared<Memory>(setup->RAM);
+  setup->RAM.reset(filled);
+  auto const snapshot = Asm::run_to(*setup, program, static_cast<u16>(labels.at("ready")));
+
+  auto const machine = std::make_unique<Machine>();
+  bench_variants("rerun", min_time, [&] {
+    machine->registers = Registers{};
+    machine->RAM.reset(filled);
+    executable.run(*machine);
+  });
+  bench_variants("fork", min_time, [&] {
+    auto const fork = std::make_unique<Machine>();
+    snapshot.restore(*fork);
+    executable.run(*fork);
+  });
+  bench_variants("restore", min_time, [&] {
+    snapshot.restore(*machine);
+    executable.run(*machine);
+  });
+}
+
+#define EMBEDDED_SOURCE \
+  "mov x, 8\n"        \
+  "loop:\n"           \
+  "add a, x\n"        \
+  "shl a, 1\n"        \
+  "sub x, 1\n"        \
+  "cmp x, 0\n"        \
+  "jne loop\n"
+
+constexpr auto embedded = Asm::Embedded::assemble(EMBEDDED_SOURCE);
+
+void bench_embedded(double min_time) {
+  auto const report_call = [](std::string const& engine, u64 count, double seconds, u64 allocated) {
+    std::cout << "{\"workload\": \"embedded\", \"engine\": \"" << engine << "\", \"calls\": " << count
+      << ", \"seconds\": " << seconds << ", \"ns_per_call\": " << seconds * 1e9 / count
+      << ", \"peak_rss_kb\": " << peak_rss_kb() << ", \"allocations\": " << allocated << "}" << std::endl;
+  };
+  auto const machine = std::make_unique<Machine>();
+  u64 count = 0;
+  auto before = allocations;
+  auto start = Clock::now();
+  do {
+    machine->registers = Registers{};
+    Labels labels;
+    std::istringstream source{EMBEDDED_SOURCE};
+    Asm::Interpreter::run(*machine, Asm::read_program(source, labels), Engine::basic);
+    count++;
+  } while (elapsed(start) < min_time);
+  report_call("parsed", count, elapsed(start), allocations - before);
+
+  count = 0;
+  before = allocations;
+  start = Clock::now();
+  do {
+    machine->registers = Registers{};
+    Asm::Embedded::run<decltype(embedded), embedded>(*machine);
+    count++;
+  } while (elapsed(start) < min_time);
+  report_call("constexpr", count, elapsed(start), allocations - before);
+}
+
+void bench_startup(double min_time) {
+  char path[] = "/tmp/mini-asm-bench-XXXXXX";
+  auto const fd = mkstemp(path);
+  if (fd < 0) throw std::runtime_error{"Cannot create a temporary image"};
+  close(fd);
+  {
+    Labels labels;
+    std::istringstream source{snapshot_source};
+    auto const program = Asm::read_program(source, labels);
+    auto const machine = std::make_unique<Machine>();
+    Asm::Rom::save(path, program, labels, Asm::run_to(*machine, program, static_cast<u16>(labels.at("ready"))));
+  }
+
+  auto const report_start = [](std::string const& engine, u64 count, double seconds) {
+    std::cout << "{\"workload\": \"startup\", \"engine\": \"" << engine << "\", \"starts\": " << count
+      << ", \"seconds\": " << seconds << ", \"us_per_start\": " << seconds * 1e6 / count
+      << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+  };
+  u64 count = 0;
+  auto start = Clock::now();
+  do {
+    auto const machine = std::make_unique<Machine>();
+    std::istringstream source{snapshot_source};
+    auto const program = Asm::read_program(source, machine->jmp_tokens);
+    Asm::run_to(*machine, program, static_cast<u16>(machine->jmp_tokens.at("ready")));
+    count++;
+  } while (elapsed(start) < min_time);
+  report_start("source", count, elapsed(start));
+
+  count = 0;
+  start = Clock::now();
+  do {
+    auto const machine = std::make_unique<Machine>();
+    auto const image = Asm::Rom::map(path);
+    Asm::Rom::install(*machine, image);
+    count++;
+  } while (elapsed(start) < min_time);
+  report_start("image", count, elapsed(start));
+  unlink(path);
+}
+
+void bench_library(double min_time) {
+  auto const report_call = [](std::string const& engine, u64 count, double seconds) {
+    std::cout << "{\"workload\": \"library\", \"engine\": \"" << engine << "\", \"calls\": " << count
+      << ", \"seconds\": " << seconds << ", \"calls_per_second\": " << count / seconds
+      << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+  };
+  std::unique_ptr<miniasm_machine, decltype(&miniasm_destroy)> const machine{miniasm_create(), &miniasm_destroy};
+  if (!machine) throw std::bad_alloc{};
+  if (miniasm_load_source(machine.get(), EMBEDDED_SOURCE, sizeof(EMBEDDED_SOURCE) - 1) != MINIASM_OK) {
+    throw std::runtime_error{miniasm_last_error(machine.get())};
+  }
+  u64 count = 0;
+  auto start = Clock::now();
+  do {
+    miniasm_reset(machine.get());
+    if (miniasm_run(machine.get(), 0, nullptr) != MINIASM_OK) throw std::runtime_error{miniasm_last_error(machine.get())};
+    count++;
+  } while (elapsed(start) < min_time);
+  report_call("api", count, elapsed(start));
+
+  if (access("./mini-asm", X_OK) != 0) {
+    std::cerr << "library: ./mini-asm not found, process runs skipped\n";
+    return;
+  }
+  char path[] = "/tmp/mini-asm-bench-XXXXXX";
+  auto const fd = mkstemp(path);
+  if (fd < 0) throw std::runtime_error{"Cannot create a temporary source"};
+  if (write(fd, EMBEDDED_SOURCE, sizeof(EMBEDDED_SOURCE) - 1) < 0) throw std::runtime_error{"Cannot write a temporary source"};
+  close(fd);
+  count = 0;
+  start = Clock::now();
+  do {
+    auto const pid = fork();
+    if (pid < 0) throw std::runtime_error{"Cannot start ./mini-asm"};
+    if (pid == 0) {
+      auto const null = open("/dev/null", O_RDWR);
+      dup2(null, 0);
+      dup2(null, 1);
+      execl("./mini-asm", "mini-asm", "--batch", path, static_cast<char*>(nullptr));
+      _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) throw std::runtime_error{"./mini-asm failed"};
+    count++;
+  } while (elapsed(start) < min_time);
+  report_call("process", count, elapsed(start));
+  unlink(path);
+}
+
+const char scheduler_source[] = R"(
+serve:
+mov a, *0
+cmp a, 0
+je wait
+add *1, a
+mov *0, 0
+mov x, 50
+work:
+sub x, 1
+cmp x, 0
+jne work
+jmp serve
+wait:
+jmp serve
+)";
+
+void bench_scheduler(double min_time) {
+  Labels labels;
+  std::istringstream source{scheduler_source};
+  auto const program = Asm::read_program(source, labels);
+  Asm::Interpreter::Executable executable{program};
+  executable.trap(static_cast<u16>(labels.at("wait")));
+  std::ostringstream output;
+  unsigned const vms = 10000;
+  Asm::Scheduler scheduler{4, 1000, output};
+  for (unsigned i = 0; i < vms; i++) scheduler.spawn(executable);
+  u64 posts = 0;
+  auto const start = Clock::now();
+  do {
+    for (unsigned i = 0; i < vms; i++) {
+      if (scheduler.state(i) != Asm::Scheduler::State::blocked) continue;
+      scheduler.post(i, 0, 1);
+      posts++;
+    }
+    scheduler.run(~u64{0});
+  } while (elapsed(start) < min_time);
+  auto const seconds = elapsed(start);
+  for (unsigned i = 0; i < vms; i++) {
+    if (scheduler.state(i) != Asm::Scheduler::State::blocked) throw std::runtime_error{"A VM of the scheduler did not block"};
+  }
+  auto const stats = scheduler.stats();
+  std::cout << "{\"workload\": \"scheduler\", \"engine\": \"threaded\", \"vms\": " << vms
+    << ", \"posts\": " << posts << ", \"rounds\": " << stats.rounds << ", \"slices\": " << stats.slices
+    << ", \"instructions\": " << stats.instructions << ", \"seconds\": " << seconds
+    << ", \"instructions_per_second\": " << stats.instructions / seconds << ", \"fairness\": " << stats.fairness
+    << ", \"latency_p50_us\": " << stats.latency_p50 * 1e6 << ", \"latency_p99_us\": " << stats.latency_p99 * 1e6
+    << ", \"latency_max_us\": " << stats.latency_max * 1e6 << ", \"bytes_per_vm\": " << scheduler.footprint() / vms
+    << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+}
+
+void bench_serve(double min_time) {
+  char path[] = "/tmp/mini-asm-bench-XXXXXX";
+  auto const fd = mkstemp(path);
+  if (fd < 0) throw std::runtime_error{"Cannot create a temporary socket"};
+  close(fd);
+  unlink(path); // Only the name was wanted
+  Asm::Serve::Server server{path, Engine::threaded, true, 8};
+  std::thread serving{[&] { server.serve(); }};
+  for (auto const cold : {true, false}) {
+    for (unsigned const concurrency : {1u, 8u}) {
+      std::vector<std::vector<double>> latencies(concurrency);
+      std::vector<std::thread> clients;
+      auto const start = Clock::now();
+      for (unsigned c = 0; c < concurrency; c++) {
+        clients.emplace_back([&, c] {
+          Asm::Serve::Client client{path};
+          Asm::Serve::Request request;
+          u64 count = 0;
+          do {
+            request.source = EMBEDDED_SOURCE;
+            if (cold) request.source += "; " + std::to_string(c) + " " + std::to_string(count) + "\n";
+            auto const sent = Clock::now();
+            if (client.run(request).status != MINIASM_OK) return;
+            latencies[c].push_back(elapsed(sent));
+            count++;
+          } while (elapsed(start) < min_time);
+        });
+      }
+      for (auto& client : clients) client.join();
+      auto const seconds = elapsed(start);
+      std::vector<double> all;
+      for (auto const& latency : latencies) all.insert(all.end(), latency.begin(), latency.end());
+      if (all.empty()) throw std::runtime_error{"The daemon served no request"};
+      std::sort(all.begin(), all.end());
+      std::cout << "{\"workload\": \"serve\", \"engine\": \"" << (cold ? "cold" : "warm") << "\", \"concurrency\": " << concurrency
+        << ", \"requests\": " << all.size() << ", \"seconds\": " << seconds << ", \"requests_per_second\": " << all.size() / seconds
+        << ", \"latency_p50_us\": " << all[all.size() / 2] * 1e6 << ", \"latency_p99_us\": " << all[all.size() * 99 / 100] * 1e6
+        << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+    }
+  }
+  server.stop();
+  serving.join();
+}
+
+void bench_frontend(double min_time) {
+  char path[] = "/tmp/mini-asm-bench-XXXXXX";
+  auto const fd = mkstemp(path);
+  if (fd < 0) throw std::runtime_error{"Cannot create a temporary source"};
+  close(fd);
+  unsigned lines = 0;
+  {
+    std::ofstream file{path};
+    char const* const body[] = {"mov a, *%u", "add a, %u", "cmp a, x", "jne L%u", "push a", "pop *%u", "Print A ; %u"};
+    char line[32];
+    for (std::size_t instructions = 0; instructions < Asm::Rom::max_instructions; lines++) {
+      auto const i = lines;
+      if (i % 8 == 0) std::snprintf(line, sizeof(line), "L%u:", i / 8);
+      else std::snprintf(line, sizeof(line), body[i % 7], (i * 37 + 11) % 256 + (i % 7 == 3) * (i / 8 + 1));
+      instructions += (i % 8 != 0);
+      file << line << "\n";
+    }
+    if (!file) throw std::runtime_error{"Cannot write a temporary source"};
+  }
+  auto const report_load = [&](std::string const& engine, u64 count, double seconds) {
+    std::cout << "{\"workload\": \"frontend\", \"engine\": \"" << engine << "\", \"lines\": " << count * lines
+      << ", \"seconds\": " << seconds << ", \"lines_per_second\": " << count * lines / seconds
+      << ", \"ms_per_load\": " << seconds * 1e3 / count << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+  };
+  Labels expected_labels;
+  Asm::Program expected;
+  u64 count = 0;
+  auto start = Clock::now();
+  do {
+    std::ifstream file{path};
+    expected_labels.clear();
+    expected = Asm::read_program(file, expected_labels);
+    count++;
+  } while (elapsed(start) < min_time);
+  report_load("stream", count, elapsed(start));
+
+  for (unsigned const jobs : {1u, 2u, 4u, 8u}) {
+    count = 0;
+    start = Clock::now();
+    do {
+      Labels labels;
+      auto const program = Asm::load_program(path, labels, jobs);
+      if (labels != expected_labels || program.source != expected.source || program.faults != expected.faults
+        || program.code.size() != expected.code.size()
+        || std::memcmp(program.code.data(), expected.code.data(), program.code.size() * sizeof(Asm::Instruction)) != 0) {
+        unlink(path);
+        throw std::runtime_error{"The parallel front-end decoded another program"};
+      }
+      count++;
+    } while (elapsed(start) < min_time);
+    report_load("mapped-" + std::to_string(jobs), count, elapsed(start));
+  }
+
+  auto const write_straight = [&](std::size_t instructions) {
+    std::ofstream file{path};
+    for (std::size_t i = 0; i < instructions; i++) file << "add a, 1\n";
+    if (!file) throw std::runtime_error{"Cannot write a temporary source"};
+  };
+  write_straight(70000);
+  unsigned refused = 0;
+  try {
+    Labels labels;
+    Asm::load_program(path, labels);
+  } catch (std::runtime_error const&) {
+    refused++;
+  }
+  try {
+    Labels labels;
+    std::ifstream file{path};
+    Asm::read_program(file, labels);
+  } catch (std::runtime_error const&) {
+    refused++;
+  }
+  write_straight(Asm::Rom::max_instructions);
+  Labels labels;
+  auto const program = Asm::load_program(path, labels);
+  unlink(path);
+  if (refused != 2) throw std::runtime_error{"A program of 70000 instructions was loaded"};
+  auto const machine = std::make_unique<Machine>();
+  start = Clock::now();
+  Asm::Interpreter::Executable{program}.run(*machine);
+  auto const seconds = elapsed(start);
+  if (machine->steps != Asm::Rom::max_instructions || machine->registers.PC != Asm::Rom::max_instructions) {
+    throw std::runtime_error{"A program of 65535 instructions did not run to its end"};
+  }
+  std::cout << "{\"workload\": \"frontend\", \"engine\": \"largest\", \"instructions\": " << machine->steps
+    << ", \"seconds\": " << seconds << ", \"refused_instructions\": 70000}" << std::endl;
+}
+
+void bench_trace(double min_time) {
+  char path[] = "/tmp/mini-asm-bench-XXXXXX";
+  auto const fd = mkstemp(path);
+  if (fd < 0) throw std::runtime_error{"Cannot create a temporary trace"};
+  close(fd);
+  for (auto const& workload : workloads) {
+    Labels labels;
+    std::istringstream source{workload.source};
+    auto const program = Asm::read_program(source, labels);
+    auto const machine = std::make_unique<Machine>();
+    Asm::Interpreter::Executable const executable{program, Engine::threaded};
+    u64 steps = 0;
+    auto start = Clock::now();
+    do {
+      machine->registers = Registers{};
+      machine->steps = 0;
+      executable.run(*machine);
+      steps += machine->steps;
+    } while (elapsed(start) < min_time);
+    auto const untraced = elapsed(start) * 1e9 / steps;
+
+    for (auto const changes : {false, true}) {
+      Asm::Trace::Recorder::Stats stats;
+      start = Clock::now();
+      {
+        Asm::Trace::Recorder recorder{program, path, Engine::threaded, true, Asm::Trace::Recorder::default_interval, changes};
+        do {
+          machine->registers = Registers{};
+          machine->steps = 0;
+          recorder.run(*machine);
+        } while (elapsed(start) < min_time);
+        recorder.close();
+        stats = recorder.stats();
+      }
+      auto const traced = elapsed(start) * 1e9 / stats.instructions;
+
+      Asm::Trace::Replayer replayer{path, program, Engine::threaded};
+      start = Clock::now();
+      auto const replayed = replayer.replay(*machine);
+      auto const replay = elapsed(start) * 1e9 / replayed;
+      if (replayed != stats.instructions) {
+        unlink(path);
+        throw std::runtime_error{"The replay of " + std::string{workload.name} + " ran another number of instructions"};
+      }
+      std::cout << "{\"workload\": \"trace\", \"engine\": \"" << workload.name << "\", \"changes\": " << (changes ? "true" : "false")
+        << ", \"instructions\": " << stats.instructions
+        << ", \"ns_per_instruction\": " << traced << ", \"untraced_ns_per_instruction\": " << untraced
+        << ", \"overhead\": " << traced / untraced << ", \"blocks\": " << stats.blocks
+        << ", \"checkpoints\": " << stats.checkpoints << ", \"trace_bytes\": " << stats.bytes
+        << ", \"bytes_per_instruction\": " << static_cast<double>(stats.bytes) / stats.instructions
+        << ", \"replay_ns_per_instruction\": " << replay << ", \"peak_rss_kb\": " << peak_rss_kb() << "}" << std::endl;
+    }
+  }
+  unlink(path);
+}
+
+void bench_debugger(double min_time) {
+  for (auto const& workload : workloads) {
+    Labels labels;
+    std::istringstream source{workload.source};
+    auto const program = Asm::read_program(source, labels);
+    auto const machine = std::make_unique<Machine>();
+    auto const last = static_cast<u16>(program.code.size() - 1);
+    Asm::Interpreter::Executable const executable{program, Engine::threaded};
+    u64 steps = 0;
+    auto start = Clock::now();
+    do {
+      machine->registers = Registers{};
+      machine->steps = 0;
+      executable.run(*machine);
+      steps += machine->steps;
+    } while (elapsed(start) < min_time);
+    auto const plain = elapsed(start) * 1e9 / steps;
+
+    u64 stops = 0;
+    auto const debugged = [&](Asm::Debugger& debugger) {
+      u64 steps = 0;
+      u64 runs = 0;
+      stops = 0;
+      auto const start = Clock::now();
+      do {
+        machine->registers = Registers{};
+        machine->steps = 0;
+        while (debugger.resume(*machine).reason != Asm::Debugger::Reason::ended) stops++;
+        steps += machine->steps;
+        runs++;
+      } while (elapsed(start) < min_time);
+      stops /= runs;
+      return elapsed(start) * 1e9 / steps;
+    };
+    Asm::Debugger debugger{program, labels, Engine::threaded};
+    auto const idle = debugged(debugger);
+    debugger.break_at(last);
+    auto const breakpoint = debugged(debugger);
+    debugger.clear(last);
+    debugger.watch("y");
+    auto const watch = debugged(debugger);
+    std::cout << "{\"workload\": \"debugger\", \"engine\": \"" << workload.name << "\", \"ns_per_instruction\": " << idle
+      << ", \"plain_ns_per_instruction\": " << plain << ", \"overhead\": " << idle / plain
+      << ", \"breakpoint_ns_per_instruction\": " << breakpoint << ", \"watch_ns_per_instruction\": " << watch
+      << ", \"watch_stops_per_run\": " << stops << "}" << std::endl;
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  double min_time = 0.5;
+  std::vector<std::string> selected;
+  for (int i = 1; i < argc; i++) {
+    std::string const arg{argv[i]};
+    if (arg.compare(0, 7, "--time=") == 0) min_time = std::atof(arg.c_str() + 7);
+    else selected.push_back(arg);
+  }
+  auto const wanted = [&](std::string const& name) {
+    if (selected.empty()) return true;
+    for (auto const& s : selected) if (s == name) return true;
+    return false;
+  };
+  bool clean = true;
+  try {
+    if (wanted("syntax")) bench_parse(min_time);
+    for (auto const& workload : workloads) {
+      if (wanted(workload.name)) clean = bench_run(workload, min_time) && clean;
+    }
+    if (wanted("threads")) clean = bench_threads(min_time) && clean;
+    if (wanted("memory")) bench_memory(min_time);
+    if (wanted("snapshot")) bench_snapshot(min_time);
+    if (wanted("embedded")) bench_embedded(min_time);
+    if (wanted("startup")) bench_startup(min_time);
+    if (wanted("library")) bench_library(min_time);
+    if (wanted("scheduler")) bench_scheduler(min_time);
+    if (wanted("serve")) bench_serve(min_time);
+    if (wanted("frontend")) bench_frontend(min_time);
+    if (wanted("trace")) bench_trace(min_time);
+    if (wanted("debugger")) bench_debugger(min_time);
+  } catch (std::exception const& e) {
+    std::cerr << "Error: " << e.what() << "\n";
+    return 1;
+  }
+  return clean ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+MOV A, 0X1F
+Loop:
+  SUB A, 1 ; comment
+  CMP A, 0
+  JNE LOOP
+PRINT A
+print *0
@@ -0,0 +1,12 @@
+; Faulty lines raise their error only when they run
+mov a, 1
+jmp skip
+mov s, 2
+bogus a
+skip:
+add a, 1
+cmp a, 2
+je end
+push 'A'
+end:
+add c, 1
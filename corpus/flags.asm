@@ -0,0 +1,27 @@
+mov a, 5
+cmp a, 7
+jl less
+mov y, 99
+less:
+cmp a, 5
+jle le
+mov y, 1
+le:
+cmp a, 3
+jg gt
+mov x, 1
+gt:
+jge ge
+ge:
+  je nope
+mov *0x10, 0xff
+shl a, 2
+shr *0x10, 3
+shl x, 9
+or a, 0b11110000111
+and a, *16
+xor y, 300
+mov a, 0xfffffffff
+push x
+print registers
+nope:
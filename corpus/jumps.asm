@@ -0,0 +1,27 @@
+; Every conditional jump, taken and not, to labels and to line numbers
+mov x, 0
+again:
+cmp x, 3
+je equal
+jne differ
+equal:
+add y, 1
+differ:
+jl lower
+jg greater
+jmp next
+lower:
+add a, 1
+jle next
+greater:
+add a, 0x10
+jge next
+next:
+jge 15
+add y, 0x40
+add x, 1
+cmp x, 6
+jle again
+mov *20, a
+mov *21, y
+print registers
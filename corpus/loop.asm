@@ -0,0 +1,9 @@
+mov a, 0
+mov x, 200
+loop:
+add a, 3
+sub x, 1
+cmp x, 0
+jne loop
+mov *10, a
+print registers
@@ -0,0 +1,19 @@
+; Nested loops summing into RAM, with the stack as a counter
+mov x, 0
+outer:
+mov y, 0
+inner:
+add *0, y
+add *1, *0
+push y
+pop a
+xor *2, a
+add y, 1
+cmp y, 200
+jne inner
+add x, 1
+cmp x, 40
+jne outer
+print *0
+print *1
+print *2
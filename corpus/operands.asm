@@ -0,0 +1,21 @@
+mov a, 0xff
+mov x, 0b101
+mov y, 3
+mov *1, a
+mov *0x02, x
+mov *0b11, y
+add a, *1
+sub x, *0x02
+or y, 0x80
+and a, 0b11110000
+xor *1, y
+shl *2, x
+shr *3, 1
+shr y, *3
+shl a, 0
+cmp *1, *2
+print registers
+print *1
+print *2
+print *3
+mov a, 2147483648
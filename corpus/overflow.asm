@@ -0,0 +1,3 @@
+top:
+push 1
+jmp top
@@ -0,0 +1,10 @@
+; stack test
+push 1
+push 0x22
+push 0b101
+pop a
+pop x
+pop *3
+print *3
+push y
+pop
@@ -0,0 +1 @@
+pop a
@@ -0,0 +1,47 @@
+#include "aot.h"
+
+#include <cstring>   // std::strcmp
+#include <exception> // std::exception
+#include <iostream>  // std::cout
+#include <memory>    // std::make_unique
+#include <string>    // std::string
+
+/**
+ * @brief Runs a translated program on a new machine
+ * @param argc, argv Arguments of the program: --state prints the final state
+ * the way --batch does, without the time
+ * @param program The translated program
+ * @param name The file it was translated from
+ * @details Errors are printed the way mini-asm prints them.
+ * @returns 0, or 1 if the program failed
+ * @throw /
+ */
+int Asm::Aot::main(int argc, char** argv, Translated program, const char* name) {
+  auto const state = argc > 1 && std::strcmp(argv[1], "--state") == 0;
+  std::string error;
+  auto const machine = std::make_unique<Machine>();
+  try {
+    program(*machine);
+  } catch (std::exception const& e) {
+    error = e.what();
+  }
+  if (!state) {
+    if (!error.empty()) std::cout << "Error: " << error;
+    return error.empty() ? 0 : 1;
+  }
+  auto const& registers = machine->registers;
+  std::cout << name << ":"
+    << " A=" << static_cast<unsigned>(registers.A)
+    << " X=" << static_cast<unsigned>(registers.X)
+    << " Y=" << static_cast<unsigned>(registers.Y)
+    << " P=" << static_cast<unsigned>(registers.P.value())
+    << " PC=" << registers.PC
+    << " S=" << static_cast<unsigned>(registers.S)
+    << " steps=" << machine->steps;
+  if (!error.empty()) {
+    while (!error.empty() && error.back() == '\n') error.pop_back();
+    std::cout << " error: " << error;
+  }
+  std::cout << "\n";
+  return error.empty() ? 0 : 1;
+}
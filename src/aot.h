@@ -0,0 +1,40 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include "cpu.h"
+
+/*
+ * Runtime of the C++ translation units written by mini-asm --emit-cpp.
+ * A translated program only needs this header, aot.cc and memory.cc:
+ *   make aot PROGRAM=prog.cc
+ */
+
+namespace Asm {
+namespace Aot {
+
+using Translated = void (*)(Machine& machine);
+
+int main(int argc, char** argv, Translated program, const char* name);
+
+} // namespace Asm::Aot
+} // namespace Asm
+
+/**
+ * @brief Stores the registers and step count a translated program keeps in
+ * locals, which RAM writes cannot alias
+ */
+#define MINIASM_AOT_STORE()     \
+  machine.registers.A = A;      \
+  machine.registers.X = X;      \
+  machine.registers.Y = Y;      \
+  machine.registers.P = P;      \
+  machine.steps = steps;
+
+/**
+ * @brief Same with the PC, before an instruction which may throw or print them
+ */
+#define MINIASM_AOT_SYNC(next_pc) \
+  MINIASM_AOT_STORE()             \
+  machine.registers.PC = (next_pc);
+
+#endif // __AOT_H__
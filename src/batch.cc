@@ -0,0 +1,240 @@
+#include "batch.h"
+#include "pool.h"    // WorkStealingPool
+#include "program.h" // load_program
+#include "rom.h"     // Image, is_image, map, install
+#include "syntax.h"  // Token, parse_number, parse_address
+
+#include <dirent.h>   // opendir, readdir, closedir
+#include <sys/stat.h> // stat, S_ISDIR, S_ISREG
+#include <climits>    // PATH_MAX
+#include <cstdlib>    // realpath
+
+#include <algorithm>  // std::sort
+#include <chrono>     // std::chrono::steady_clock
+#include <map>        // std::map
+#include <memory>     // std::make_unique
+#include <sstream>    // std::ostringstream
+#include <stdexcept>  // std::runtime_error
+
+namespace {
+
+struct Loaded {
+  Asm::Rom::Image image; //!< Only program and labels are set for source files
+  std::unique_ptr<Asm::Interpreter::Executable const> executable; //!< Refers to image.program, run by every copy
+  std::string error;
+};
+
+bool ends_with(std::string const& str, std::string const& suffix) {
+  return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * @brief Returns the .asm files of a directory, sorted by name
+ */
+std::vector<std::string> directory_files(std::string const& dir) {
+  std::vector<std::string> files;
+  auto const handle = opendir(dir.c_str());
+  if (!handle) return files;
+  auto const prefix = ends_with(dir, "/") ? dir : dir + "/";
+  while (auto const entry = readdir(handle)) {
+    std::string const name{entry->d_name};
+    struct stat info;
+    if (ends_with(name, ".asm") && stat((prefix + name).c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+      files.push_back(prefix + name);
+    }
+  }
+  closedir(handle);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+/**
+ * @brief Returns a name identifying the file, whatever path leads to it
+ */
+std::string identity_of(std::string const& file) {
+  char resolved[PATH_MAX];
+  return realpath(file.c_str(), resolved) ? std::string{resolved} : file;
+}
+
+/**
+ * @brief Sets the registers and RAM bytes a variant lists
+ * @param variant Assignments separated by spaces, ex: "a=5 *10=0x20"
+ * @throw std::runtime_error If an assignment is invalid
+ */
+void apply(Machine& machine, std::string const& variant) {
+  std::istringstream in{variant};
+  std::string assignment;
+  while (in >> assignment) {
+    auto const equal = assignment.find('=');
+    if (equal == std::string::npos) throw std::runtime_error{"Invalid assignment " + assignment};
+    Asm::Syntax::Token const name{assignment.data(), equal};
+    Asm::Syntax::Token const number{assignment.data() + equal + 1, assignment.size() - equal - 1};
+    u8 value{}, addr{};
+    if (!Asm::Syntax::parse_number(number, value)) throw std::runtime_error{"Invalid value in " + assignment};
+    auto const target = name.str();
+    if (target == "a") machine.registers.A = value;
+    else if (target == "x") machine.registers.X = value;
+    else if (target == "y") machine.registers.Y = value;
+    else if (Asm::Syntax::parse_address(name, addr)) machine.RAM.write(addr) = value;
+    else throw std::runtime_error{"Invalid register or address in " + assignment};
+  }
+}
+
+} // namespace
+
+/**
+ * @brief Expands the directories of a list of paths to the .asm files they contain
+ * @param paths Files and directories
+ * @details ROM images are only run when they are named explicitly.
+ * @returns The files, in the order they were given
+ * @throw /
+ */
+std::vector<std::string> Asm::Batch::list_files(std::vector<std::string> const& paths) {
+  std::vector<std::string> files;
+  for (auto const& path : paths) {
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+      auto const found = directory_files(path);
+      files.insert(files.end(), found.begin(), found.end());
+    } else {
+      files.push_back(path);
+    }
+  }
+  return files;
+}
+
+/**
+ * @brief Loads and runs programs in parallel, each on its own machine
+ * @param files The programs; a file given twice is loaded and prepared once
+ * @param engine The dispatch engine
+ * @param optimize Lets the engine use the peephole optimizer
+ * @param jobs Number of threads, 0 for one per core
+ * @param cache Where source files are looked up first, null to decode them all
+ * @returns One result per file, in the same order
+ * @throw std::system_error If a thread cannot be started
+ */
+std::vector<Asm::Batch::Result> Asm::Batch::run(std::vector<std::string> const& files, Interpreter::Engine engine, bool optimize, unsigned jobs, Cache* cache) {
+  std::map<std::string, std::size_t> index_of;
+  std::vector<std::string> unique;
+  std::vector<std::size_t> program_of;
+  for (auto const& file : files) {
+    auto const inserted = index_of.insert({identity_of(file), unique.size()});
+    if (inserted.second) unique.push_back(file);
+    program_of.push_back(inserted.first->second);
+  }
+
+  WorkStealingPool pool{jobs};
+  std::vector<Loaded> loaded(unique.size());
+  pool.run(unique.size(), [&](std::size_t i) {
+    try {
+      auto& image = loaded[i].image;
+      if (cache) image = cache->load(unique[i], 1);
+      else if (Rom::is_image(unique[i])) image = Rom::map(unique[i]);
+      else image.program = load_program(unique[i], image.labels, 1); // Files are already loaded in parallel
+      loaded[i].executable = std::make_unique<Interpreter::Executable const>(image.program, engine, optimize);
+    } catch (std::exception const& e) {
+      loaded[i].error = e.what();
+    }
+  });
+
+  std::vector<Result> results(files.size());
+  pool.run(files.size(), [&](std::size_t i) {
+    auto& result = results[i];
+    auto const& source = loaded[program_of[i]];
+    try { // Tasks must not throw, not even std::bad_alloc
+      result.file = files[i];
+      if (!source.error.empty()) {
+        result.error = source.error;
+        return;
+      }
+      auto const machine = std::make_unique<Machine>();
+      Rom::install(*machine, source.image);
+      std::ostringstream output;
+      machine->output = &output;
+      auto const start = std::chrono::steady_clock::now();
+      try {
+        source.executable->run(*machine);
+      } catch (std::exception const& e) {
+        result.error = e.what();
+      }
+      result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      result.registers = machine->registers;
+      result.steps = machine->steps;
+      result.output = output.str();
+    } catch (std::exception const& e) {
+      result.error = e.what();
+    }
+  });
+  return results;
+}
+
+/**
+ * @brief Runs the rest of a program once per variant, each forked from a snapshot
+ * @param program The program the snapshot was taken in
+ * @param snapshot Where every variant starts from
+ * @param variants Registers and RAM bytes each variant sets first, ex: "a=5 *10=0x20"
+ * @param engine The dispatch engine
+ * @param optimize Lets the engine use the peephole optimizer
+ * @param jobs Number of threads, 0 for one per core
+ * @details The program is prepared once. Every thread restores its machine
+ * in place between variants, which only reverts the RAM pages the previous
+ * variant wrote.
+ * @returns One result per variant, named "variant N"
+ * @throw std::system_error If a thread cannot be started
+ */
+std::vector<Asm::Batch::Result> Asm::Batch::run_variants(Program const& program, Snapshot const& snapshot, std::vector<std::string> const& variants, Interpreter::Engine engine, bool optimize, unsigned jobs) {
+  Interpreter::Executable const executable{program, engine, optimize};
+  WorkStealingPool pool{jobs};
+  std::vector<std::unique_ptr<Machine>> machines(pool.workers());
+  std::vector<Result> results(variants.size());
+  pool.run(variants.size(), [&](std::size_t i, unsigned worker) {
+    auto& result = results[i];
+    try { // Tasks must not throw, not even std::bad_alloc
+      result.file = "variant " + std::to_string(i + 1);
+      auto& machine = machines[worker];
+      if (!machine) machine = std::make_unique<Machine>();
+      snapshot.restore(*machine);
+      std::ostringstream output;
+      machine->output = &output;
+      auto const start = std::chrono::steady_clock::now();
+      try {
+        apply(*machine, variants[i]);
+        executable.run(*machine);
+      } catch (std::exception const& e) {
+        result.error = e.what();
+      }
+      result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      result.registers = machine->registers;
+      result.steps = machine->steps;
+      result.output = output.str();
+    } catch (std::exception const& e) {
+      result.error = e.what();
+    }
+  });
+  return results;
+}
+
+/**
+ * @brief Writes what a program printed, then one line with its final state
+ * @details Ex: "loop.asm: A=8 X=0 Y=0 P=2 PC=6 S=0 steps=804 time=5us", with
+ * " error: " and the message at the end if it failed.
+ * @throw /
+ */
+void Asm::Batch::print(std::ostream& out, Result const& result) {
+  auto const& registers = result.registers;
+  out << result.output << result.file << ":"
+    << " A=" << static_cast<unsigned>(registers.A)
+    << " X=" << static_cast<unsigned>(registers.X)
+    << " Y=" << static_cast<unsigned>(registers.Y)
+    << " P=" << static_cast<unsigned>(registers.P.value())
+    << " PC=" << registers.PC
+    << " S=" << static_cast<unsigned>(registers.S)
+    << " steps=" << result.steps
+    << " time=" << static_cast<u64>(result.seconds * 1e6) << "us";
+  if (!result.error.empty()) {
+    auto error = result.error;
+    while (!error.empty() && error.back() == '\n') error.pop_back();
+    out << " error: " << error;
+  }
+  out << "\n";
+}
@@ -0,0 +1,36 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <ostream> // std::ostream
+#include <string>  // std::string
+#include <vector>  // std::vector
+
+#include "cache.h"
+#include "cpu.h"
+#include "interpreter.h"
+#include "snapshot.h"
+
+namespace Asm {
+namespace Batch {
+
+/**
+ * @brief What running one program of a batch gave
+ */
+struct Result {
+  std::string file;     //!< File as it was given
+  Registers registers;  //!< Final registers
+  u64 steps = 0;        //!< Instructions executed
+  double seconds = 0;   //!< Wall time of the run, loading excluded
+  std::string output;   //!< What the program printed
+  std::string error;    //!< Empty if the program ran to its end
+};
+
+std::vector<std::string> list_files(std::vector<std::string> const& paths);
+std::vector<Result> run(std::vector<std::string> const& files, Interpreter::Engine engine, bool optimize, unsigned jobs, Cache* cache = nullptr);
+std::vector<Result> run_variants(Program const& program, Snapshot const& snapshot, std::vector<std::string> const& variants, Interpreter::Engine engine, bool optimize, unsigned jobs);
+void print(std::ostream& out, Result const& result);
+
+} // namespace Asm::Batch
+} // namespace Asm
+
+#endif // __BATCH_H__
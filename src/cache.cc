@@ -0,0 +1,183 @@
+#include "cache.h"
+#include "infos.h"    // App::version
+#include "program.h"  // parse_program, load_program
+#include "strmanip.h" // hash_bytes
+
+#include <dirent.h>   // opendir, readdir, closedir
+#include <fcntl.h>    // open, AT_FDCWD
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat, fchmod, stat, mkdir, utimensat
+#include <unistd.h>   // close, unlink
+
+#include <algorithm>  // std::sort
+#include <cerrno>     // errno
+#include <cstdio>     // std::rename, std::snprintf
+#include <cstdlib>    // mkstemp
+#include <ctime>      // std::time
+#include <stdexcept>  // std::runtime_error
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+namespace {
+
+constexpr char suffix[] = ".masm";
+constexpr char temporary[] = ".tmp-";
+constexpr long stale_seconds = 3600; //!< Age of the temporary files of a dead process
+
+bool ends_with(std::string const& str, std::string const& end) {
+  return str.size() >= end.size() && str.compare(str.size() - end.size(), end.size(), end) == 0;
+}
+
+} // namespace
+
+/**
+ * @brief Opens a cache, creating its directory if needed
+ * @param capacity Bytes of images kept at most
+ * @throw std::runtime_error If the directory cannot be created
+ */
+Asm::Cache::Cache(std::string const& directory, u64 capacity)
+  : directory_(ends_with(directory, "/") ? directory : directory + "/"), capacity_(capacity) {
+  if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+    throw std::runtime_error{"Cannot create cache directory " + directory};
+  }
+}
+
+/**
+ * @brief Loads a source file from its cached image, or decodes it and stores
+ * the image
+ * @param jobs Threads decoding a source on a miss, 0 for one per core
+ * @returns The program and labels. A miss also gives the source lines, which
+ * images do not keep. ROM images, pipes and other files which are not
+ * regular are loaded as they are.
+ * @throw std::runtime_error If the file cannot be opened or a label is defined twice
+ */
+Asm::Rom::Image Asm::Cache::load(std::string const& filename, unsigned jobs) {
+  Rom::Image image;
+  if (Rom::is_image(filename)) return Rom::map(filename);
+  auto const fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error{"Cannot open file " + filename};
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+    close(fd);
+    image.program = load_program(filename, image.labels, jobs);
+    return image;
+  }
+  auto const size = static_cast<std::size_t>(info.st_size);
+  auto const mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error{"Cannot map file " + filename};
+  }
+  auto const data = static_cast<const char*>(mem);
+  std::string const version = "mini-asm " + App::version + " image " + std::to_string(Rom::version);
+  auto const key = hash_bytes(version.data(), version.size(), hash_bytes(data, size));
+  char name[48];
+  std::snprintf(name, sizeof(name), "%016llx-%llx", static_cast<unsigned long long>(key), static_cast<unsigned long long>(size));
+  auto const path = directory_ + name + suffix;
+
+  try {
+    struct stat cached;
+    if (stat(path.c_str(), &cached) == 0) {
+      try {
+        image = Rom::map(path);
+        munmap(mem, size);
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0); // Most recently used
+        hits_++;
+        return image;
+      } catch (std::runtime_error const&) {
+        unlink(path.c_str()); // Damaged, replaced below
+      }
+    }
+    misses_++;
+    image.program = parse_program(data, size, image.labels, jobs);
+  } catch (...) {
+    munmap(mem, size);
+    throw;
+  }
+  munmap(mem, size);
+  if (image.program.code.size() > Rom::max_instructions) return image; // No image can hold it
+  try {
+    store(path, image.program, image.labels);
+  } catch (std::runtime_error const&) {
+    // The directory cannot be written, the next load is a miss again
+  }
+  return image;
+}
+
+/**
+ * @brief Returns the loads so far
+ * @throw /
+ */
+Asm::Cache::Stats Asm::Cache::stats() const noexcept {
+  Stats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  return stats;
+}
+
+/**
+ * @brief Writes an image under a temporary name, then renames it into place
+ * @throw std::runtime_error If the image cannot be written
+ */
+void Asm::Cache::store(std::string const& path, Program const& program, Labels const& labels) {
+  auto pattern = directory_ + temporary + "XXXXXX";
+  auto const fd = mkstemp(&pattern[0]);
+  if (fd < 0) {
+    throw std::runtime_error{"Cannot create a file in " + directory_};
+  }
+  fchmod(fd, 0644); // mkstemp only lets the owner read it
+  close(fd);
+  try {
+    Rom::assemble(pattern, program, labels, {});
+  } catch (...) {
+    unlink(pattern.c_str());
+    throw;
+  }
+  if (std::rename(pattern.c_str(), path.c_str()) != 0) {
+    unlink(pattern.c_str());
+    throw std::runtime_error{"Cannot write " + path};
+  }
+  evict();
+}
+
+/**
+ * @brief Removes the least recently used images until the others fit in the
+ * capacity, and the temporary files processes left behind
+ */
+void Asm::Cache::evict() {
+  struct Entry {
+    std::string path;
+    u64 size;
+    struct timespec used;
+  };
+  std::vector<Entry> entries;
+  u64 total = 0;
+  auto const handle = opendir(directory_.c_str());
+  if (!handle) return;
+  auto const now = std::time(nullptr);
+  while (auto const entry = readdir(handle)) {
+    std::string const name{entry->d_name};
+    auto const path = directory_ + name;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) continue;
+    if (name.compare(0, sizeof(temporary) - 1, temporary) == 0) {
+      if (now - info.st_mtime > stale_seconds) unlink(path.c_str());
+    } else if (ends_with(name, suffix)) {
+      entries.push_back({path, static_cast<u64>(info.st_size), info.st_mtim});
+      total += static_cast<u64>(info.st_size);
+    }
+  }
+  closedir(handle);
+  if (total <= capacity_) return;
+  std::sort(entries.begin(), entries.end(), [](Entry const& lhs, Entry const& rhs) {
+    return lhs.used.tv_sec != rhs.used.tv_sec ? lhs.used.tv_sec < rhs.used.tv_sec : lhs.used.tv_nsec < rhs.used.tv_nsec;
+  });
+  for (auto const& entry : entries) {
+    if (total <= capacity_) break;
+    if (unlink(entry.path.c_str()) == 0) evictions_++;
+    total -= entry.size;
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <atomic> // std::atomic
+#include <string> // std::string
+
+#include "cpu.h"
+#include "rom.h"
+
+namespace Asm {
+
+/**
+ * @brief Directory of ROM images assembled from source files, shared by
+ * every process loading them
+ * @details An image is named after a hash of the source bytes, their size,
+ * App::version and the image format, so an edited source or another build
+ * never finds a stale one. Loading a cached source maps its image, which is
+ * validated as any image. Images are written to a temporary file renamed
+ * into place, so concurrent processes only ever see whole images, and the
+ * least recently used go once the directory holds more than its capacity.
+ * The cache is best effort: a directory which cannot be written, or a
+ * program longer than an image holds, only makes every load a miss.
+ */
+class Cache {
+public:
+  /**
+   * @brief Loads since the cache was created
+   */
+  struct Stats {
+    u64 hits = 0;
+    u64 misses = 0;    //!< Sources decoded, and stored if the directory allows
+    u64 evictions = 0; //!< Images removed to stay under the capacity
+  };
+
+  Cache(std::string const& directory, u64 capacity);
+
+  Rom::Image load(std::string const& filename, unsigned jobs = 0);
+  Stats stats() const noexcept;
+
+private:
+  void store(std::string const& path, Program const& program, Labels const& labels);
+  void evict();
+
+  std::string directory_;
+  u64 capacity_; //!< Bytes of images kept at most
+  std::atomic<u64> hits_{0};
+  std::atomic<u64> misses_{0};
+  std::atomic<u64> evictions_{0};
+};
+
+} // namespace Asm
+
+#endif // __CACHE_H__
@@ -2,23 +2,22 @@
 #define __CPU_H__
 
 #include <array>    // std::array
-#include <cstdint>  // uint8_t, uint16_t
+#include <cstdint>  // uint8_t, uint16_t, uint32_t, uint64_t
+#include <iostream> // std::cout
 #include <map>      // std::map
+#include <ostream>  // std::ostream
+#include <string>   // std::string
 #include <vector>   // std::vector
 
 #include "errors.h"
+#include "memory.h"
 
 using u8 = uint8_t;
 using u16 = uint16_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
 
-namespace registers {
-  extern u8 A;  // Accumulator
-  extern u8 X;  // Index X
-  extern u8 Y;  // Index Y
-  extern u8 P;  // Program status
-  extern u16 PC; // Program Counter
-  extern u8 S;  // Stack pointer
-} // namespace registers
+using Labels = std::map<std::string, unsigned>; //!< @brief Mapping JMP token <-> address
 
 enum Flags {
   negative = 0x01,
@@ -27,31 +26,144 @@ enum Flags {
   greater = 0x08
 }; // namespace flags
 
+/**
+ * @brief Program status register, evaluated lazily
+ * @details CMP only records its operands. The flags are worked out when a
+ * conditional jump, PRINT REGISTERS or anything else reads them, and value()
+ * gives the byte P always held: 0 before the first CMP, then equal, lower or
+ * greater.
+ */
+class Status {
+public:
+  void compare(u8 lhs, u8 rhs) noexcept {
+    lhs_ = lhs;
+    rhs_ = rhs;
+    compared_ = true;
+  }
+
+  /**
+   * @brief Sets P from its byte value, as value() returns it
+   * @throw /
+   */
+  void assign(u8 flags) noexcept {
+    lhs_ = (flags & Flags::greater) ? 1 : 0;
+    rhs_ = (flags & Flags::lower) ? 1 : 0;
+    compared_ = flags != 0;
+  }
+
+  /**
+   * @brief Checks if assign() takes a byte so that value() gives it back:
+   * 0 or a single flag among equal, lower and greater
+   * @throw /
+   */
+  static bool holds(u8 flags) noexcept {
+    return flags == 0 || flags == Flags::equal || flags == Flags::lower || flags == Flags::greater;
+  }
+
+  u8 value() const noexcept {
+    if (!compared_) return 0;
+    return (lhs_ == rhs_) ? Flags::equal : (lhs_ > rhs_) ? Flags::greater : Flags::lower;
+  }
+
+  bool equal() const noexcept { return compared_ && lhs_ == rhs_; }
+  bool lower() const noexcept { return compared_ && lhs_ < rhs_; }
+  bool greater() const noexcept { return compared_ && lhs_ > rhs_; }
+
+private:
+  u8 lhs_ = 0;            //!< First operand of the last CMP
+  u8 rhs_ = 0;            //!< Second operand of the last CMP
+  bool compared_ = false; //!< No flag is set before the first CMP
+};
+
+/**
+ * @brief Here are the registers used in MiniASM
+ */
+struct Registers {
+  u8 A   = 0x00; //!< @brief Accumulator
+  u8 X   = 0x00; //!< @brief X index
+  u8 Y   = 0x00; //!< @brief Y index
+  Status P;      //!< @brief Program status
+  u16 PC = 0x00; //!< @brief Program counter
+  u8 S   = 0x00; //!< @brief Stack pointer
+};
+
+/**
+ * @brief Writes the registers one per line, as PRINT REGISTERS does
+ * @throw /
+ */
+inline void print_registers(std::ostream& out, Registers const& registers) {
+  out << "Register A: " << static_cast<unsigned>(registers.A) << std::endl;
+  out << "Register X: " << static_cast<unsigned>(registers.X) << std::endl;
+  out << "Register Y: " << static_cast<unsigned>(registers.Y) << std::endl;
+  out << "Register P: " << static_cast<unsigned>(registers.P.value()) << std::endl;
+  out << "Register PC: " << static_cast<unsigned>(registers.PC) << std::endl;
+  out << "Register S: " << static_cast<unsigned>(registers.S) << std::endl;
+}
+
 template <unsigned size>
 class Stack {
   using OutOfRangeException = Asm::Errors::OutOfRangeException;
 public:
+  static constexpr unsigned capacity = size;
+
   Stack() noexcept {
     static_assert(size > 0, "Stack size must be superior than 0");
   }
-  void push(u8 value) {
-    if (registers::S >= size) throw OutOfRangeException{"Stack overflow"};
-    buffer_[registers::S] = value;
-    registers::S++;
+  void push(u8& pointer, u8 value) {
+    if (pointer >= size) throw OutOfRangeException{"Stack overflow"};
+    buffer_[pointer] = value;
+    pointer++;
   }
-  u8 pop() {
-    if (registers::S == 0) throw OutOfRangeException{"Stack is empty"};
-    registers::S--;
-    return buffer_[registers::S];
+  u8 pop(u8& pointer) {
+    if (pointer == 0) throw OutOfRangeException{"Stack is empty"};
+    pointer--;
+    return buffer_[pointer];
+  }
+  /**
+   * @brief Pushes without the bounds check, for code proven not to overflow
+   * @throw /
+   */
+  void push_unchecked(u8& pointer, u8 value) noexcept {
+    buffer_[pointer++] = value;
+  }
+  u8 pop_unchecked(u8& pointer) noexcept {
+    return buffer_[--pointer];
+  }
+  bool full(u8 pointer) const noexcept {
+    return pointer >= size;
+  }
+  u8* data() noexcept {
+    return buffer_.data();
+  }
+  const u8* data() const noexcept {
+    return buffer_.data();
   }
 
 private:
-  std::array<u8, size> buffer_;
+  std::array<u8, size> buffer_{};
 };
 
-extern Stack<0xff> stack;
-extern std::map<std::string, unsigned> jmp_tokens;
-extern std::array<u8, 0xffff> RAM;
-extern std::vector<u8> ROM;
+/**
+ * @brief A complete machine: registers, stack, memory and labels
+ * @details Machines only share read-only memory pages, so independent
+ * machines can run concurrently, one per thread.
+ */
+struct Machine {
+  Registers registers;            //!< @brief Registers
+  Stack<0xff> stack;              //!< @brief Stack, indexed by registers.S
+  Labels jmp_tokens;              //!< @brief Labels of the loaded program
+  Memory RAM;                     //!< @brief RAM
+  Memory VRAM;                    //!< @brief Video RAM (Not used yet)
+  std::vector<u8> ROM;            //!< @brief Buffer in which will be loader the ROM
+  u64 steps = 0;                  //!< @brief Instructions executed by the engines
+  std::ostream* output = &std::cout; //!< @brief Where PRINT writes
+
+  void push(u8 value) {
+    stack.push(registers.S, value);
+  }
+  u8 pop() {
+    return stack.pop(registers.S);
+  }
+};
 
 #endif // __CPU_H__
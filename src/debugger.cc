@@ -0,0 +1,287 @@
+#include "debugger.h"
+#include "syntax.h" // parse_address
+
+#include <algorithm> // std::sort, std::lower_bound, std::upper_bound, std::all_of, std::find_if
+#include <stdexcept> // std::runtime_error
+#include <utility>   // std::move
+
+namespace {
+
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+
+constexpr const char* register_names[] = {"a", "x", "y", "p", "s"};
+
+/**
+ * @brief Checks if an instruction writes its dst operand
+ */
+bool writes_dst(Opcode op) noexcept {
+  switch (op) {
+  case Opcode::mov: case Opcode::add: case Opcode::sub: case Opcode::or_: case Opcode::and_:
+  case Opcode::xor_: case Opcode::shl: case Opcode::shr: case Opcode::pop:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * @brief Checks if an instruction may change a register or a RAM byte
+ * @param ram True for the RAM byte at index, false for register index (A, X,
+ * Y, P or S)
+ */
+bool writes(Instruction const& inst, bool ram, u8 index) noexcept {
+  if (ram) return inst.dst_kind == OperandKind::addr && inst.dst == index && writes_dst(inst.op);
+  switch (index) {
+  case 3: return inst.op == Opcode::cmp;
+  case 4: return inst.op == Opcode::push || inst.op == Opcode::pop;
+  default: return inst.dst_kind == OperandKind::reg && inst.dst == index && writes_dst(inst.op);
+  }
+}
+
+} // namespace
+
+/**
+ * @brief Prepares a program for debugging, without breakpoints nor watchpoints
+ * @param program The program, which must outlive the debugger
+ * @param labels Its labels, which must outlive the debugger too
+ * @throw std::bad_alloc If the program cannot be prepared
+ */
+Asm::Debugger::Debugger(Program const& program, Labels const& labels, Interpreter::Engine engine, bool optimize)
+  : program_(program), labels_(labels), executable_(program, engine, optimize), lines_(program.code.size()),
+    breakpoints_(program.code.size()), watchers_(program.code.size()), trapped_(program.code.size()) {
+  std::vector<unsigned> label_pcs;
+  for (auto const& label : labels) label_pcs.push_back(label.second);
+  std::sort(label_pcs.begin(), label_pcs.end());
+  for (std::size_t pc = 0; pc < lines_.size(); pc++) {
+    auto const before = std::upper_bound(label_pcs.begin(), label_pcs.end(), pc) - label_pcs.begin();
+    lines_[pc] = static_cast<unsigned>(pc + 1 + before); // Label lines decode to no instruction
+  }
+}
+
+/**
+ * @brief Finds the PC of a label, or of the first instruction from a line
+ * @param where A label name, or a line number of the source file
+ * @throw std::runtime_error If there is no such label or line
+ */
+u16 Asm::Debugger::locate(std::string const& where) const {
+  if (!where.empty() && where.size() < 10 && std::all_of(where.begin(), where.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+    auto const line = std::lower_bound(lines_.begin(), lines_.end(), std::stoul(where));
+    if (line == lines_.end()) {
+      throw std::runtime_error{"Line " + where + " is past the last instruction\n"};
+    }
+    return static_cast<u16>(line - lines_.begin());
+  }
+  auto const label = labels_.find(where);
+  if (label == labels_.end()) {
+    throw std::runtime_error{"Unknown label " + where + "\n"};
+  }
+  return static_cast<u16>(label->second);
+}
+
+/**
+ * @brief Describes where an instruction is, ex: "12: add x, 1"
+ * @throw std::bad_alloc If the description cannot be allocated
+ */
+std::string Asm::Debugger::line_of(u16 pc) const {
+  if (pc >= lines_.size()) return "end of the program";
+  auto const line = std::to_string(lines_[pc]);
+  if (pc >= program_.source.size() || program_.source[pc].empty()) return line;
+  return line + ": " + program_.source[pc];
+}
+
+/**
+ * @brief Stops runs before an instruction
+ * @throw std::runtime_error If pc is past the last instruction
+ */
+void Asm::Debugger::break_at(u16 pc) {
+  if (pc >= breakpoints_.size()) {
+    throw std::runtime_error{"No instruction to break at after the last one\n"};
+  }
+  breakpoints_[pc] = true;
+  update_trap(pc);
+}
+
+/**
+ * @brief Removes the breakpoint of an instruction, if any
+ * @throw /
+ */
+void Asm::Debugger::clear(u16 pc) {
+  if (pc >= breakpoints_.size()) return;
+  breakpoints_[pc] = false;
+  update_trap(pc);
+}
+
+/**
+ * @brief Stops runs after an instruction changes a register or a RAM byte
+ * @param name "a", "x", "y", "p", "s" or an address such as "*0x10"
+ * @details Watching a value twice does nothing.
+ * @throw std::runtime_error If name is neither
+ */
+void Asm::Debugger::watch(std::string const& name) {
+  auto watch = parse_watch(name);
+  for (auto const& watched : watches_) {
+    if (watched.ram == watch.ram && watched.index == watch.index) return;
+  }
+  for (std::size_t pc = 0; pc < watchers_.size(); pc++) {
+    if (!writes(program_.code[pc], watch.ram, watch.index)) continue;
+    watchers_[pc]++;
+    update_trap(static_cast<u16>(pc));
+  }
+  watches_.push_back(std::move(watch));
+}
+
+/**
+ * @brief Removes a watchpoint
+ * @throw std::runtime_error If name is not watched
+ */
+void Asm::Debugger::unwatch(std::string const& name) {
+  auto const watch = parse_watch(name);
+  auto const watched = std::find_if(watches_.begin(), watches_.end(), [&](Watch const& other) {
+    return other.ram == watch.ram && other.index == watch.index;
+  });
+  if (watched == watches_.end()) {
+    throw std::runtime_error{"Not watching " + name + "\n"};
+  }
+  watches_.erase(watched);
+  for (std::size_t pc = 0; pc < watchers_.size(); pc++) {
+    if (!writes(program_.code[pc], watch.ram, watch.index)) continue;
+    watchers_[pc]--;
+    update_trap(static_cast<u16>(pc));
+  }
+}
+
+/**
+ * @brief Returns the PCs of the breakpoints, in order
+ * @throw std::bad_alloc If the list cannot be allocated
+ */
+std::vector<u16> Asm::Debugger::breakpoints() const {
+  std::vector<u16> pcs;
+  for (std::size_t pc = 0; pc < breakpoints_.size(); pc++) {
+    if (breakpoints_[pc]) pcs.push_back(static_cast<u16>(pc));
+  }
+  return pcs;
+}
+
+/**
+ * @brief Returns the watched values, in the order they were added
+ * @throw std::bad_alloc If the list cannot be allocated
+ */
+std::vector<std::string> Asm::Debugger::watchpoints() const {
+  std::vector<std::string> names;
+  for (auto const& watch : watches_) names.push_back(watch.name);
+  return names;
+}
+
+/**
+ * @brief Runs instructions from the machine's PC
+ * @param machine The machine we work with
+ * @param count Instructions to run at most
+ * @returns The event which stopped the machine first: the end of the
+ * program, a breakpoint past the first instruction, a watched value which
+ * changed, or the count reached
+ * @throw std::runtime_error If a faulty instruction is executed, the machine
+ * stays on it
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+Asm::Debugger::Event Asm::Debugger::step(Machine& machine, u64 count) {
+  auto const size = program_.code.size();
+  Event event;
+  for (auto first = true; count > 0; first = false) {
+    auto const pc = machine.registers.PC;
+    if (pc >= size) break;
+    if (!first && breakpoints_[pc]) {
+      event.reason = Reason::breakpoint;
+      event.pc = pc;
+      return event;
+    }
+    if (watchers_[pc] > 0) {
+      count--;
+      if (single_step(machine, event)) return event;
+    } else if (traps_ == 0 && count == ~u64{0}) {
+      executable_.run(machine); // Nothing to stop at, the engine runs at full speed
+    } else {
+      auto const steps = machine.steps;
+      executable_.run(machine, count); // Stops before the next trap
+      count -= machine.steps - steps;
+    }
+  }
+  event.reason = machine.registers.PC >= size ? Reason::ended : Reason::stepped;
+  event.pc = machine.registers.PC;
+  return event;
+}
+
+/**
+ * @brief Runs the program until it ends, reaches a breakpoint or changes a
+ * watched value
+ * @details A run from a breakpoint first runs its instruction.
+ * @throw std::runtime_error If a faulty instruction is executed, the machine
+ * stays on it
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+Asm::Debugger::Event Asm::Debugger::resume(Machine& machine) {
+  return step(machine, ~u64{0});
+}
+
+Asm::Debugger::Watch Asm::Debugger::parse_watch(std::string const& name) {
+  u8 address{};
+  if (Syntax::parse_address({name.data(), name.size()}, address)) return {name, true, address, 0};
+  for (u8 i = 0; i < 5; i++) {
+    if (name == register_names[i]) return {name, false, i, 0};
+  }
+  throw std::runtime_error{"Cannot watch " + name + ", expected a, x, y, p, s or an address\n"};
+}
+
+u8 Asm::Debugger::value_of(Machine const& machine, Watch const& watch) noexcept {
+  if (watch.ram) return machine.RAM.read(watch.index);
+  auto const& registers = machine.registers;
+  switch (watch.index) {
+  case 0: return registers.A;
+  case 1: return registers.X;
+  case 2: return registers.Y;
+  case 3: return registers.P.value();
+  default: return registers.S;
+  }
+}
+
+/**
+ * @brief Runs the instruction of a watched PC alone
+ * @returns True if it changed a watched value, which event receives
+ */
+bool Asm::Debugger::single_step(Machine& machine, Event& event) {
+  auto const& inst = program_.code[machine.registers.PC];
+  for (auto& watch : watches_) {
+    if (writes(inst, watch.ram, watch.index)) watch.value = value_of(machine, watch);
+  }
+  executable_.run(machine, 1);
+  for (auto const& watch : watches_) {
+    if (!writes(inst, watch.ram, watch.index)) continue;
+    auto const value = value_of(machine, watch);
+    if (value == watch.value) continue;
+    event.reason = Reason::watchpoint;
+    event.pc = machine.registers.PC;
+    event.watch = watch.name;
+    event.before = watch.value;
+    event.after = value;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Traps a PC if it holds a breakpoint or may change a watched value,
+ * and only then
+ */
+void Asm::Debugger::update_trap(u16 pc) {
+  bool const wanted = breakpoints_[pc] || watchers_[pc] > 0;
+  if (wanted == trapped_[pc]) return;
+  trapped_[pc] = wanted;
+  if (wanted) {
+    executable_.trap(pc);
+    traps_++;
+  } else {
+    executable_.untrap(pc);
+    traps_--;
+  }
+}
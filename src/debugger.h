@@ -0,0 +1,92 @@
+#ifndef __DEBUGGER_H__
+#define __DEBUGGER_H__
+
+#include <string> // std::string
+#include <vector> // std::vector
+
+#include "cpu.h"
+#include "interpreter.h"
+#include "program.h"
+
+namespace Asm {
+
+/**
+ * @brief Runs a program step by step or up to breakpoints and watchpoints
+ * @details Breakpoints are traps of the executable: the engine runs the
+ * code of budgeted runs, where a trap entry replaced the instruction, and
+ * stops there. Instructions name their RAM addresses and registers in the
+ * decoded code, so a watchpoint traps every instruction which may write the
+ * watched byte, runs it alone and compares the value. Without breakpoints
+ * nor watchpoints, continuing is a run without a budget, as fast as a run
+ * without the debugger.
+ */
+class Debugger {
+public:
+  /**
+   * @enum Reason
+   * @brief Why the debugger gave control back
+   */
+  enum class Reason {
+    ended,      //!< PC left the program
+    stepped,    //!< The instructions asked for ran
+    breakpoint, //!< PC reached a breakpoint, which did not run yet
+    watchpoint  //!< The instruction before PC changed a watched value
+  };
+
+  /**
+   * @brief Where and why the machine stopped
+   */
+  struct Event {
+    Reason reason = Reason::ended;
+    u16 pc = 0;
+    std::string watch; //!< The watched value which changed, for a watchpoint
+    u8 before = 0;
+    u8 after = 0;
+  };
+
+  Debugger(Program const& program, Labels const& labels,
+    Interpreter::Engine engine = Interpreter::Engine::threaded, bool optimize = true);
+
+  u16 locate(std::string const& where) const;
+  std::string line_of(u16 pc) const;
+
+  void break_at(u16 pc);
+  void clear(u16 pc);
+  void watch(std::string const& name);
+  void unwatch(std::string const& name);
+  std::vector<u16> breakpoints() const;
+  std::vector<std::string> watchpoints() const;
+
+  Event step(Machine& machine, u64 count = 1);
+  Event resume(Machine& machine);
+
+private:
+  /**
+   * @brief A watched register (A, X, Y, P or S) or RAM address
+   */
+  struct Watch {
+    std::string name;
+    bool ram;
+    u8 index; //!< Address, or 0 to 4 for A, X, Y, P and S
+    u8 value; //!< Before the instruction single_step() runs
+  };
+
+  static Watch parse_watch(std::string const& name);
+  static u8 value_of(Machine const& machine, Watch const& watch) noexcept;
+  bool single_step(Machine& machine, Event& event);
+  void update_trap(u16 pc);
+
+  Program const& program_;
+  Labels const& labels_;
+  Interpreter::Executable executable_;
+  std::vector<unsigned> lines_;     //!< Source line of each PC, labels counted
+  std::vector<bool> breakpoints_;
+  std::vector<Watch> watches_;
+  std::vector<unsigned> watchers_;  //!< Watches each PC may change
+  std::vector<bool> trapped_;       //!< PCs with a breakpoint or a watcher
+  unsigned traps_ = 0;              //!< PCs trapped
+};
+
+} // namespace Asm
+
+#endif // __DEBUGGER_H__
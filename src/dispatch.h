@@ -0,0 +1,239 @@
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include "program.h"
+
+/*
+ * Operand-specialized handlers shared by the dispatch engines.
+ * MINIASM_HANDLERS(X) calls X(name, body) for each handler. Bodies use the
+ * R_DST, M_DST, R_SRC, M_SRC, I_SRC, P_REG (a Status) and TARGET accessors, the
+ * local machine, pc and steps, the shift_left and shift_right helpers, the
+ * SLOW_PATH statement, the STOP statement, which leaves the engine before
+ * the current entry, the JUMP(target) statement, which moves pc to a taken
+ * jump's target, and VERIFIED, true when the program was proven safe, which
+ * the engines define before expanding the list.
+ *
+ * Families are laid out as reg_reg, reg_imm, reg_addr, addr_reg, addr_imm,
+ * addr_addr (dst kind, then src kind), which handler_of relies on.
+ *
+ * The handlers after jge are superinstructions made by the optimizer. They
+ * stand for several instructions and skip all but the first one themselves,
+ * with MINIASM_SKIP, so the dispatch itself always moves to the next entry.
+ */
+
+#define MINIASM_FAMILY(X, name, STMT)   \
+  X(name##_reg_reg, STMT(R_DST, R_SRC))   \
+  X(name##_reg_imm, STMT(R_DST, I_SRC))   \
+  X(name##_reg_addr, STMT(R_DST, M_SRC))  \
+  X(name##_addr_reg, STMT(M_DST, R_SRC))  \
+  X(name##_addr_imm, STMT(M_DST, I_SRC))  \
+  X(name##_addr_addr, STMT(M_DST, M_SRC))
+
+#define MINIASM_MOV(dst, src) dst = src;
+#define MINIASM_ADD(dst, src) dst += src;
+#define MINIASM_SUB(dst, src) dst -= src;
+#define MINIASM_OR(dst, src) dst |= src;
+#define MINIASM_AND(dst, src) dst &= src;
+#define MINIASM_XOR(dst, src) dst ^= src;
+#define MINIASM_SHL(dst, src) dst = shift_left(dst, src);
+#define MINIASM_SHR(dst, src) dst = shift_right(dst, src);
+#define MINIASM_CMP(dst, src) P_REG.compare(dst, src);
+
+#define MINIASM_IF_E (P_REG.equal())
+#define MINIASM_IF_NE (!P_REG.equal())
+#define MINIASM_IF_L (P_REG.lower())
+#define MINIASM_IF_LE (P_REG.lower() || P_REG.equal())
+#define MINIASM_IF_G (P_REG.greater())
+#define MINIASM_IF_GE (P_REG.greater() || P_REG.equal())
+
+#define MINIASM_SKIP(count) pc += count; steps += count;
+
+// cmp then a conditional jump to TARGET, which tests the operands directly
+#define MINIASM_CMP_JCC(dst, src, cond)  \
+  {                                      \
+    u8 const lhs = dst;                  \
+    u8 const rhs = src;                  \
+    P_REG.compare(lhs, rhs);             \
+    MINIASM_SKIP(1)                      \
+    if (lhs cond rhs) JUMP(TARGET)       \
+  }
+#define MINIASM_CMP_JE(dst, src) MINIASM_CMP_JCC(dst, src, ==)
+#define MINIASM_CMP_JNE(dst, src) MINIASM_CMP_JCC(dst, src, !=)
+#define MINIASM_CMP_JL(dst, src) MINIASM_CMP_JCC(dst, src, <)
+#define MINIASM_CMP_JLE(dst, src) MINIASM_CMP_JCC(dst, src, <=)
+#define MINIASM_CMP_JG(dst, src) MINIASM_CMP_JCC(dst, src, >)
+#define MINIASM_CMP_JGE(dst, src) MINIASM_CMP_JCC(dst, src, >=)
+
+// mov then an operation with the immediate kept in TARGET
+#define MINIASM_LOAD_ADD(dst, src) dst = src; dst += static_cast<u8>(TARGET); MINIASM_SKIP(1)
+#define MINIASM_LOAD_SUB(dst, src) dst = src; dst -= static_cast<u8>(TARGET); MINIASM_SKIP(1)
+#define MINIASM_LOAD_OR(dst, src) dst = src; dst |= static_cast<u8>(TARGET); MINIASM_SKIP(1)
+#define MINIASM_LOAD_AND(dst, src) dst = src; dst &= static_cast<u8>(TARGET); MINIASM_SKIP(1)
+#define MINIASM_LOAD_XOR(dst, src) dst = src; dst ^= static_cast<u8>(TARGET); MINIASM_SKIP(1)
+
+// Verified programs cannot overflow or underflow the stack
+#define MINIASM_PUSH(value) \
+  (VERIFIED ? machine.stack.push_unchecked(machine.registers.S, value) : machine.push(value))
+#define MINIASM_POP() \
+  (VERIFIED ? machine.stack.pop_unchecked(machine.registers.S) : machine.pop())
+
+// push then pop, which only moves the value unless the push overflows
+#define MINIASM_PUSH_POP(dst, src)                            \
+  if (VERIFIED || !machine.stack.full(machine.registers.S)) { \
+    machine.stack.data()[machine.registers.S] = src;          \
+    dst = src;                                                \
+    MINIASM_SKIP(1)                                           \
+  } else {                                                    \
+    SLOW_PATH                                                 \
+  }
+
+#define MINIASM_HANDLERS(X)                                                   \
+  X(nop, )                                                                    \
+  X(slow, SLOW_PATH)                                                          \
+  X(trap, STOP)                                                               \
+  MINIASM_FAMILY(X, mov, MINIASM_MOV)                                         \
+  MINIASM_FAMILY(X, add, MINIASM_ADD)                                         \
+  MINIASM_FAMILY(X, sub, MINIASM_SUB)                                         \
+  MINIASM_FAMILY(X, bit_or, MINIASM_OR)                                       \
+  MINIASM_FAMILY(X, bit_and, MINIASM_AND)                                     \
+  MINIASM_FAMILY(X, bit_xor, MINIASM_XOR)                                     \
+  MINIASM_FAMILY(X, shl, MINIASM_SHL)                                         \
+  MINIASM_FAMILY(X, shr, MINIASM_SHR)                                         \
+  MINIASM_FAMILY(X, cmp, MINIASM_CMP)                                         \
+  X(push_reg, MINIASM_PUSH(R_SRC);)                                           \
+  X(push_imm, MINIASM_PUSH(I_SRC);)                                           \
+  X(push_addr, MINIASM_PUSH(M_SRC);)                                          \
+  X(pop_reg, R_DST = MINIASM_POP();)                                          \
+  X(pop_addr, M_DST = MINIASM_POP();)                                         \
+  X(jmp, JUMP(TARGET))                                                        \
+  X(je, if (MINIASM_IF_E) JUMP(TARGET))                                       \
+  X(jne, if (MINIASM_IF_NE) JUMP(TARGET))                                     \
+  X(jl, if (MINIASM_IF_L) JUMP(TARGET))                                       \
+  X(jle, if (MINIASM_IF_LE) JUMP(TARGET))                                     \
+  X(jg, if (MINIASM_IF_G) JUMP(TARGET))                                       \
+  X(jge, if (MINIASM_IF_GE) JUMP(TARGET))                                     \
+  MINIASM_FAMILY(X, cmp_je, MINIASM_CMP_JE)                                   \
+  MINIASM_FAMILY(X, cmp_jne, MINIASM_CMP_JNE)                                 \
+  MINIASM_FAMILY(X, cmp_jl, MINIASM_CMP_JL)                                   \
+  MINIASM_FAMILY(X, cmp_jle, MINIASM_CMP_JLE)                                 \
+  MINIASM_FAMILY(X, cmp_jg, MINIASM_CMP_JG)                                   \
+  MINIASM_FAMILY(X, cmp_jge, MINIASM_CMP_JGE)                                 \
+  MINIASM_FAMILY(X, load_add, MINIASM_LOAD_ADD)                               \
+  MINIASM_FAMILY(X, load_sub, MINIASM_LOAD_SUB)                               \
+  MINIASM_FAMILY(X, load_or, MINIASM_LOAD_OR)                                 \
+  MINIASM_FAMILY(X, load_and, MINIASM_LOAD_AND)                               \
+  MINIASM_FAMILY(X, load_xor, MINIASM_LOAD_XOR)                               \
+  MINIASM_FAMILY(X, push_pop, MINIASM_PUSH_POP)                               \
+  X(skip, MINIASM_SKIP(TARGET))                                               \
+  X(set_reg, R_DST = I_SRC; MINIASM_SKIP(TARGET))                             \
+  X(set_addr, M_DST = I_SRC; MINIASM_SKIP(TARGET))                            \
+  X(shl_run_reg, R_DST = shift_left(R_DST, I_SRC); MINIASM_SKIP(TARGET))      \
+  X(shl_run_addr, M_DST = shift_left(M_DST, I_SRC); MINIASM_SKIP(TARGET))     \
+  X(shr_run_reg, R_DST = shift_right(R_DST, I_SRC); MINIASM_SKIP(TARGET))     \
+  X(shr_run_addr, M_DST = shift_right(M_DST, I_SRC); MINIASM_SKIP(TARGET))
+
+namespace Asm {
+
+#define MINIASM_HANDLER_ENUM(name, body) name,
+
+/**
+ * @enum Handler
+ * @brief Operand-specialized handler of a decoded instruction
+ */
+enum class Handler : u8 {
+  MINIASM_HANDLERS(MINIASM_HANDLER_ENUM)
+  count
+};
+
+#undef MINIASM_HANDLER_ENUM
+
+static_assert(static_cast<unsigned>(Handler::count) <= 0x100, "Handlers must fit in a byte");
+
+/**
+ * @brief Decoded instruction lowered for the switched and threaded engines
+ * @details skip, set_* and *_run_* handlers keep in target the number of
+ * following instructions they stand for.
+ */
+struct Lowered {
+  Handler handler;
+  u8 dst;
+  u8 src;
+  u16 target;
+};
+
+/**
+ * @brief Lowered instruction holding the address of its handler, for the
+ * threaded engine
+ */
+struct Threaded {
+  const void* handler;
+  u8 dst;
+  u8 src;
+  u16 target;
+};
+
+/**
+ * @brief Returns how many instructions an entry runs, at most
+ * @details Fused pairs run two, skip, set_* and *_run_* handlers the ones
+ * they stand for.
+ * @throw /
+ */
+inline unsigned span_of(Lowered const& inst) noexcept {
+  auto const index = static_cast<unsigned>(inst.handler);
+  if (index >= static_cast<unsigned>(Handler::skip)) return 1u + inst.target;
+  if (index >= static_cast<unsigned>(Handler::cmp_je_reg_reg)) return 2;
+  return 1;
+}
+
+/**
+ * @brief Picks the specialized handler of an instruction
+ * @details Instructions without a specialized handler (commands, faults, bad
+ * operands) get Handler::slow, which runs the generic interpreter.
+ * @throw /
+ */
+inline Handler handler_of(Instruction const& inst) noexcept {
+  auto const in_family = [&inst](Handler first) {
+    if (inst.dst_kind != OperandKind::reg && inst.dst_kind != OperandKind::addr) return Handler::slow;
+    unsigned offset = (inst.dst_kind == OperandKind::addr) ? 3 : 0;
+    switch (inst.src_kind) {
+    case OperandKind::reg: break;
+    case OperandKind::imm: offset += 1; break;
+    case OperandKind::addr: offset += 2; break;
+    default: return Handler::slow;
+    }
+    return static_cast<Handler>(static_cast<unsigned>(first) + offset);
+  };
+  switch (inst.op) {
+  case Opcode::nop: return Handler::nop;
+  case Opcode::mov: return in_family(Handler::mov_reg_reg);
+  case Opcode::add: return in_family(Handler::add_reg_reg);
+  case Opcode::sub: return in_family(Handler::sub_reg_reg);
+  case Opcode::or_: return in_family(Handler::bit_or_reg_reg);
+  case Opcode::and_: return in_family(Handler::bit_and_reg_reg);
+  case Opcode::xor_: return in_family(Handler::bit_xor_reg_reg);
+  case Opcode::shl: return in_family(Handler::shl_reg_reg);
+  case Opcode::shr: return in_family(Handler::shr_reg_reg);
+  case Opcode::cmp: return in_family(Handler::cmp_reg_reg);
+  case Opcode::push:
+    if (inst.src_kind == OperandKind::reg) return Handler::push_reg;
+    if (inst.src_kind == OperandKind::imm) return Handler::push_imm;
+    if (inst.src_kind == OperandKind::addr) return Handler::push_addr;
+    return Handler::slow;
+  case Opcode::pop:
+    if (inst.dst_kind == OperandKind::reg) return Handler::pop_reg;
+    if (inst.dst_kind == OperandKind::addr) return Handler::pop_addr;
+    return Handler::slow;
+  case Opcode::jmp: return Handler::jmp;
+  case Opcode::je: return Handler::je;
+  case Opcode::jne: return Handler::jne;
+  case Opcode::jl: return Handler::jl;
+  case Opcode::jle: return Handler::jle;
+  case Opcode::jg: return Handler::jg;
+  case Opcode::jge: return Handler::jge;
+  default: return Handler::slow;
+  }
+}
+
+} // namespace Asm
+
+#endif // __DISPATCH_H__
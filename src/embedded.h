@@ -0,0 +1,436 @@
+#ifndef __EMBEDDED_H__
+#define __EMBEDDED_H__
+
+#include <cstddef>     // std::size_t
+#include <stdexcept>   // std::runtime_error
+#include <string>      // std::string, std::to_string
+#include <type_traits> // std::integral_constant
+#include <utility>     // std::index_sequence, std::make_index_sequence
+
+#include "cpu.h"
+#include "program.h"
+#include "syntax.h"
+
+/*
+ * Assembler of programs embedded in C++ code, run while compiling:
+ *
+ *   static constexpr auto program = Asm::Embedded::assemble(
+ *     "mov a, 42\n"
+ *     "print a\n");
+ *   Asm::Embedded::run<decltype(program), program>(machine);
+ *
+ * It decodes lines with the grammar of syntax.h exactly like load_program,
+ * except that lines the interpreter would only reject when running them
+ * (syntax errors, bad operands, unknown labels) do not compile: the error is
+ * a call to the non-constexpr function naming it. run() dispatches to one
+ * function per instruction, whose operation and operands are template
+ * arguments, so nothing is decoded while running.
+ */
+
+namespace Asm {
+namespace Embedded {
+
+/**
+ * @brief A label of an assembled program, whose name is in Assembled::text
+ */
+struct Label {
+  std::size_t begin;
+  std::size_t size;
+  u16 pc;
+};
+
+/**
+ * @brief A program assembled at compile time
+ * @details capacity is the size of the source, which bounds the number of
+ * lines and labels.
+ */
+template <std::size_t capacity>
+struct Assembled {
+  char text[capacity] = {};          //!< Lowered source
+  Instruction code[capacity] = {};   //!< Decoded instructions
+  std::size_t size = 0;              //!< Instructions in code
+  Label labels[capacity] = {};       //!< Labels, in the order they are defined
+  std::size_t label_count = 0;       //!< Labels in labels
+
+  constexpr bool names(Label const& label, const char* name, std::size_t size) const noexcept {
+    if (label.size != size) return false;
+    for (std::size_t i = 0; i < size; i++) {
+      if (text[label.begin + i] != name[i]) return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Finds a label by its lowered name
+   * @returns Its PC, or capacity (past any PC) if there is none
+   * @throw /
+   */
+  constexpr std::size_t find(const char* name, std::size_t size) const noexcept {
+    for (std::size_t i = 0; i < label_count; i++) {
+      if (names(labels[i], name, size)) return labels[i].pc;
+    }
+    return capacity;
+  }
+
+  /**
+   * @brief Converts the program for the engines of the interpreter
+   * @throw std::bad_alloc If the program cannot be allocated
+   */
+  Program program() const {
+    Program result;
+    result.code.reserve(size);
+    for (std::size_t i = 0; i < size; i++) result.code.push_back(code[i]);
+    return result;
+  }
+
+  /**
+   * @brief Returns the labels as load_program gives them
+   * @throw std::bad_alloc If the labels cannot be allocated
+   */
+  Labels label_table() const {
+    Labels result;
+    for (std::size_t i = 0; i < label_count; i++) {
+      result.insert({std::string{text + labels[i].begin, labels[i].size}, labels[i].pc});
+    }
+    return result;
+  }
+};
+
+/*
+ * Errors of assemble(). They are not constexpr, so reaching one while
+ * compiling fails with its name; at run time they throw.
+ */
+
+[[noreturn]] inline void invalid_instruction(std::size_t line) {
+  throw std::runtime_error{"Invalid instruction at line " + std::to_string(line)};
+}
+
+[[noreturn]] inline void invalid_operand(std::size_t line) {
+  throw std::runtime_error{"Invalid operand at line " + std::to_string(line)};
+}
+
+[[noreturn]] inline void unknown_label(std::size_t line) {
+  throw std::runtime_error{"Unknown label at line " + std::to_string(line)};
+}
+
+[[noreturn]] inline void multiple_definitions_of_label(std::size_t line) {
+  throw std::runtime_error{"Multiple definitions of the label at line " + std::to_string(line)};
+}
+
+namespace Decoder {
+
+using Syntax::Token;
+
+struct Operand {
+  OperandKind kind;
+  u8 value;
+};
+
+constexpr bool is_space(const char* line, std::size_t size) noexcept {
+  for (std::size_t i = 0; i < size; i++) {
+    auto const c = line[i];
+    if (c != ' ' && c != '\t' && c != '\r' && c != '\v' && c != '\f') return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Decodes A, X or Y, the only registers instructions can name
+ */
+constexpr Operand register_operand(Token const& name, std::size_t line) {
+  switch (name.size == 1 ? name.begin[0] : '\0') {
+  case 'a': return {OperandKind::reg, 0};
+  case 'x': return {OperandKind::reg, 1};
+  case 'y': return {OperandKind::reg, 2};
+  default: invalid_operand(line);
+  }
+}
+
+constexpr Operand read_operand(Token const& token, std::size_t line) {
+  if (Syntax::is_register_name(token)) return register_operand(token, line);
+  u8 value{};
+  if (Syntax::parse_address(token, value)) return {OperandKind::addr, value};
+  if (Syntax::parse_number(token, value)) return {OperandKind::imm, value};
+  invalid_operand(line);
+}
+
+constexpr Operand write_operand(Token const& token, std::size_t line) {
+  if (Syntax::is_register_name(token)) return register_operand(token, line);
+  u8 value{};
+  if (Syntax::parse_address(token, value)) return {OperandKind::addr, value};
+  invalid_operand(line);
+}
+
+template <std::size_t capacity>
+constexpr u16 jump_target(Assembled<capacity> const& program, Token const& param, std::size_t line) {
+  u8 value{};
+  if (Syntax::parse_number(param, value)) return value;
+  auto const pc = program.find(param.begin, param.size);
+  if (pc == capacity) unknown_label(line);
+  return static_cast<u16>(pc);
+}
+
+/**
+ * @brief Decodes a lowered line without its comment, like decode_line
+ * @param program The program, whose labels are all known
+ * @param number Number of the line in the source, for errors
+ */
+template <std::size_t capacity>
+constexpr Instruction decode(Assembled<capacity> const& program, const char* line, std::size_t size, std::size_t number) {
+  Instruction inst{};
+  Syntax::Parsed parsed{};
+  if (is_space(line, size)) {
+    inst.op = Opcode::nop;
+    return inst;
+  }
+  if (Syntax::parse_command(line, size, parsed)) {
+    inst.op = parsed.op;
+    if (parsed.params == 1) {
+      auto const src = read_operand(parsed.param1, number);
+      inst.src_kind = src.kind;
+      inst.src = src.value;
+    }
+    return inst;
+  }
+  if (!Syntax::parse_instruction(line, size, parsed)) invalid_instruction(number);
+  inst.op = parsed.op;
+  switch (inst.op) {
+  case Opcode::push: {
+    auto const src = read_operand(parsed.param1, number);
+    inst.src_kind = src.kind;
+    inst.src = src.value;
+    break;
+  }
+  case Opcode::pop: {
+    auto const dst = write_operand(parsed.param1, number);
+    inst.dst_kind = dst.kind;
+    inst.dst = dst.value;
+    break;
+  }
+  case Opcode::jmp: case Opcode::je: case Opcode::jne: case Opcode::jl:
+  case Opcode::jle: case Opcode::jg: case Opcode::jge:
+    inst.target = jump_target(program, parsed.param1, number);
+    break;
+  default: {
+    auto const dst = (inst.op == Opcode::cmp) ? read_operand(parsed.param1, number) : write_operand(parsed.param1, number);
+    auto const src = read_operand(parsed.param2, number);
+    inst.dst_kind = dst.kind;
+    inst.dst = dst.value;
+    inst.src_kind = src.kind;
+    inst.src = src.value;
+    break;
+  }
+  }
+  return inst;
+}
+
+/**
+ * @brief Finds the end of the line starting at begin, a '\n' or the end of text
+ */
+constexpr std::size_t line_end(const char* text, std::size_t size, std::size_t begin) noexcept {
+  while (begin < size && text[begin] != '\n') begin++;
+  return begin;
+}
+
+/**
+ * @brief Finds where the comment of a line starts, its end if it has none
+ */
+constexpr std::size_t comment_start(const char* text, std::size_t begin, std::size_t end) noexcept {
+  while (begin < end && text[begin] != ';') begin++;
+  return begin;
+}
+
+} // namespace Asm::Embedded::Decoder
+
+/**
+ * @brief Assembles a program while compiling
+ * @param source The source, a string literal
+ * @returns The decoded instructions and the labels
+ * @details Lines are split and labels defined like read_program does, before
+ * decoding, so jumps may go forward.
+ * @throw std::runtime_error When called at run time with an invalid source
+ */
+template <std::size_t capacity>
+constexpr Assembled<capacity> assemble(const char (&source)[capacity]) {
+  Assembled<capacity> program{};
+  auto const size = capacity - 1; // Without the terminating null character
+  for (std::size_t i = 0; i < size; i++) program.text[i] = Syntax::Grammar::lower_char(source[i]);
+  auto const text = program.text;
+
+  std::size_t pc = 0;
+  for (std::size_t begin = 0, number = 1; begin < size; number++) {
+    auto const end = Decoder::line_end(text, size, begin);
+    Syntax::Token name{};
+    if (Syntax::parse_label(text + begin, end - begin, name)) {
+      if (program.find(name.begin, name.size) != capacity) multiple_definitions_of_label(number);
+      program.labels[program.label_count++] = {static_cast<std::size_t>(name.begin - text), name.size, static_cast<u16>(pc)};
+    } else {
+      pc++;
+    }
+    begin = end + 1;
+  }
+  for (std::size_t begin = 0, number = 1; begin < size; number++) {
+    auto const end = Decoder::line_end(text, size, begin);
+    Syntax::Token name{};
+    if (!Syntax::parse_label(text + begin, end - begin, name)) {
+      auto const code_end = Decoder::comment_start(text, begin, end);
+      program.code[program.size] = Decoder::decode(program, text + begin, code_end - begin, number);
+      program.size++;
+    }
+    begin = end + 1;
+  }
+  return program;
+}
+
+/**
+ * @brief Gives access to an operand whose kind is known while compiling
+ */
+template <OperandKind kind>
+struct Access;
+
+template <>
+struct Access<OperandKind::reg> {
+  static u8& at(Machine& machine, u8*, u8 index) noexcept {
+    return (index == 0) ? machine.registers.A : (index == 1) ? machine.registers.X : machine.registers.Y;
+  }
+  static u8 read(Machine& machine, u8* ram, u8 index) noexcept { return at(machine, ram, index); }
+};
+
+template <>
+struct Access<OperandKind::addr> {
+  static u8& at(Machine&, u8* ram, u8 index) noexcept { return ram[index]; }
+  static u8 read(Machine&, u8* ram, u8 index) noexcept { return ram[index]; }
+};
+
+template <>
+struct Access<OperandKind::imm> {
+  static u8 read(Machine&, u8*, u8 value) noexcept { return value; }
+};
+
+/**
+ * @brief Executes an instruction whose operands are template arguments
+ * @details One overload per operation: only the one called is instantiated,
+ * so operand kinds an operation does not take are never accessed.
+ */
+template <OperandKind dst_kind, u8 dst, OperandKind src_kind, u8 src, u16 target>
+struct Step {
+  template <Opcode op>
+  using Op = std::integral_constant<Opcode, op>;
+  using Dst = Access<dst_kind>;
+  using Src = Access<src_kind>;
+
+  static u16 run(Op<Opcode::nop>, Machine&, u8*, u16 next) noexcept { return next; }
+  static u16 run(Op<Opcode::mov>, Machine& m, u8* ram, u16 next) noexcept {
+    Dst::at(m, ram, dst) = Src::read(m, ram, src);
+    return next;
+  }
+  static u16 run(Op<Opcode::add>, Machine& m, u8* ram, u16 next) noexcept {
+    Dst::at(m, ram, dst) += Src::read(m, ram, src);
+    return next;
+  }
+  static u16 run(Op<Opcode::sub>, Machine& m, u8* ram, u16 next) noexcept {
+    Dst::at(m, ram, dst) -= Src::read(m, ram, src);
+    return next;
+  }
+  static u16 run(Op<Opcode::cmp>, Machine& m, u8* ram, u16 next) noexcept {
+    m.registers.P.compare(Dst::read(m, ram, dst), Src::read(m, ram, src));
+    return next;
+  }
+  static u16 run(Op<Opcode::or_>, Machine& m, u8* ram, u16 next) noexcept {
+    Dst::at(m, ram, dst) |= Src::read(m, ram, src);
+    return next;
+  }
+  static u16 run(Op<Opcode::and_>, Machine& m, u8* ram, u16 next) noexcept {
+    Dst::at(m, ram, dst) &= Src::read(m, ram, src);
+    return next;
+  }
+  static u16 run(Op<Opcode::xor_>, Machine& m, u8* ram, u16 next) noexcept {
+    Dst::at(m, ram, dst) ^= Src::read(m, ram, src);
+    return next;
+  }
+  static u16 run(Op<Opcode::push>, Machine& m, u8* ram, u16 next) {
+    m.push(Src::read(m, ram, src));
+    return next;
+  }
+  static u16 run(Op<Opcode::pop>, Machine& m, u8* ram, u16 next) {
+    auto const value = m.pop();
+    Dst::at(m, ram, dst) = value;
+    return next;
+  }
+  static u16 run(Op<Opcode::jmp>, Machine&, u8*, u16) noexcept { return target; }
+  static u16 run(Op<Opcode::je>, Machine& m, u8*, u16 next) noexcept {
+    return m.registers.P.equal() ? target : next;
+  }
+  static u16 run(Op<Opcode::jne>, Machine& m, u8*, u16 next) noexcept {
+    return !m.registers.P.equal() ? target : next;
+  }
+  static u16 run(Op<Opcode::jl>, Machine& m, u8*, u16 next) noexcept {
+    return m.registers.P.lower() ? target : next;
+  }
+  static u16 run(Op<Opcode::jle>, Machine& m, u8*, u16 next) noexcept {
+    return (m.registers.P.lower() || m.registers.P.equal()) ? target : next;
+  }
+  static u16 run(Op<Opcode::jg>, Machine& m, u8*, u16 next) noexcept {
+    return m.registers.P.greater() ? target : next;
+  }
+  static u16 run(Op<Opcode::jge>, Machine& m, u8*, u16 next) noexcept {
+    return (m.registers.P.greater() || m.registers.P.equal()) ? target : next;
+  }
+  static u16 run(Op<Opcode::shl>, Machine& m, u8* ram, u16 next) noexcept {
+    auto const count = Src::read(m, ram, src);
+    auto& value = Dst::at(m, ram, dst);
+    value = (count < 8) ? static_cast<u8>(value << count) : 0;
+    return next;
+  }
+  static u16 run(Op<Opcode::shr>, Machine& m, u8* ram, u16 next) noexcept {
+    auto const count = Src::read(m, ram, src);
+    auto& value = Dst::at(m, ram, dst);
+    value = (count < 8) ? static_cast<u8>(value >> count) : 0;
+    return next;
+  }
+  static u16 run(Op<Opcode::print>, Machine& m, u8* ram, u16 next) {
+    *m.output << static_cast<unsigned>(Src::read(m, ram, src)) << "\n";
+    return next;
+  }
+  static u16 run(Op<Opcode::print_registers>, Machine& m, u8*, u16 next) {
+    print_registers(*m.output, m.registers);
+    return next;
+  }
+};
+
+using Handler = u16 (*)(Machine& machine, u8* ram, u16 next);
+
+template <typename Source, Source& program, std::size_t pc>
+u16 step(Machine& machine, u8* ram, u16 next) {
+  constexpr Instruction inst = program.code[pc];
+  using Instance = Step<inst.dst_kind, inst.dst, inst.src_kind, inst.src, inst.target>;
+  return Instance::run(std::integral_constant<Opcode, inst.op>{}, machine, ram, next);
+}
+
+template <typename Source, Source& program, std::size_t... pcs>
+void run(Machine& machine, std::index_sequence<pcs...>) {
+  static constexpr Handler handlers[] = {&step<Source, program, pcs>..., nullptr};
+  auto const ram = machine.RAM.page(0);
+  auto& registers = machine.registers;
+  while (registers.PC < sizeof...(pcs)) {
+    machine.steps++;
+    auto const pc = registers.PC++;
+    registers.PC = handlers[pc](machine, ram, registers.PC);
+  }
+}
+
+/**
+ * @brief Runs an assembled program until PC leaves it
+ * @details program must be a constexpr variable with static storage, ex:
+ * run<decltype(program), program>(machine).
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+template <typename Source, Source& program>
+void run(Machine& machine) {
+  run<Source, program>(machine, std::make_index_sequence<program.size>{});
+}
+
+} // namespace Asm::Embedded
+} // namespace Asm
+
+#endif // __EMBEDDED_H__
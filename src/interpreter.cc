@@ -1,295 +1,581 @@
 #include "interpreter.h"
-#include "cpu.h"      // registers
-#include "strmanip.h" // to_lower, to_upper
-#include "syntax.h"   // is_inst
-
-#include <bitset>     // std::bitset
-#include <cassert>    // assert
-#include <regex>      // std::regex, std::regex_match
-#include <sstream>    // std::stringstream
+#include "cpu.h"      // Machine
+#include "dispatch.h" // MINIASM_HANDLERS, handler_of
+#include "jit.h"      // Asm::Jit::Cache
+#include "optimizer.h" // lower
+#include "trace.h"    // Recorder
+#include "verifier.h" // verify
+
+#include <algorithm>  // std::max, std::none_of
+#include <memory>     // std::make_unique
+#include <ostream>    // std::ostream, std::endl
 #include <stdexcept>  // std::runtime_error
+#include <utility>    // std::move
+#include <vector>     // std::vector
 
-void exec(std::string const& op, std::string const& param1, std::string const& param2);
+namespace {
 
-/*
- * @brief Interprets an ASM instruction
- * @param inst Full ASM instruction (ex: "mov A, 42)
- * @throw std::runtime_error If inst is not a correct ASM instruction
- */
-void Asm::Interpreter::intepret_instruction(std::string const& inst) {
-  using namespace Asm::Syntax;
-  auto instruction = to_lower(inst.substr(0, inst.find(";")));
-  if (!is_inst(instruction)) {
-    throw std::runtime_error{"Invalid instruction '" + instruction + "'\n"};
-  }
-  auto op = extract_op(instruction);
-  auto param1 = (has_1_parameter(instruction)) ? extract_param1(instruction) : "";
-  auto param2 = (has_2_parameters(instruction)) ? extract_param2(instruction) : "";
-  exec(to_lower(op), to_lower(param1), to_lower(param2));
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+using Asm::Program;
+
+[[noreturn]] void raise(Program const& program, Instruction const& inst) {
+  throw std::runtime_error{program.faults[inst.target]};
 }
 
 /**
- * @brief Checks if val is the name of a register
- * @param val The string we test
- * @returns True if val is the name of a register, false otherwise
- * @throw /
+ * @brief Returns a reference to A, X or Y from its operand index
  */
-inline bool is_register(std::string const& name) noexcept {
-  return name == "a" || name == "x" || name == "y"
-    || name == "p" || name == "pc" || name == "s";
+inline u8& general_register(Machine& machine, u8 idx) noexcept {
+  return (idx == 0) ? machine.registers.A : (idx == 1) ? machine.registers.X : machine.registers.Y;
 }
 
 /**
- * @brief Checks if val is an address
- * @param val The string we test
- * @returns True if val is an address, false otherwise
- * @throw /
+ * @brief Returns the value of an operand
+ * @throw std::runtime_error If the operand is bad
  */
-inline bool is_address(std::string const& val) noexcept {
-  return std::regex_match(val, std::regex{"\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+"});
-}
-
-inline bool is_lower(std::string const& str) noexcept {
-  for (auto const& c : str) {
-    if (c >= 'a' && c <= 'Z' && !islower(c)) {
-      return false;
-    }
+inline u8 read(Machine& machine, Program const& program, Instruction const& inst, OperandKind kind, u8 value) {
+  switch (kind) {
+  case OperandKind::reg: return general_register(machine, value);
+  case OperandKind::addr: return machine.RAM.read(value);
+  case OperandKind::imm: return value;
+  default: raise(program, inst);
   }
-  return true;
 }
 
 /**
- * @brief Returns a reference to one of the registers
- * @param name Name of a register
- * @pre name must be a name of a register
- * @throw std::runtime_error if name is not correct
+ * @brief Returns a reference to the written operand
+ * @throw std::runtime_error If the operand is bad
  */
-u8& get_register(std::string const& name) {
-  assert(is_lower(name) && "String must be a lower string");
-  if (name == "a") return registers::A;
-  if (name == "x") return registers::X;
-  if (name == "y") return registers::Y;
-  if (name == "s" || name == "p" || name == "pc") {
-    throw std::runtime_error{"Cannot access to register '" + to_upper(name) + "'\n"};
-  }
-  throw std::runtime_error{"Invalid token '" + name + "'\n"};
+inline u8& ref_to(Machine& machine, Program const& program, Instruction const& inst) {
+  if (inst.dst_kind == OperandKind::reg) return general_register(machine, inst.dst);
+  if (inst.dst_kind == OperandKind::addr) return machine.RAM.write(inst.dst);
+  raise(program, inst);
 }
 
-inline u8 from_hex(std::string const& hex) {
-  unsigned x;
-  std::stringstream ss;
-  ss << std::hex << hex;
-  ss >> x;
-  return static_cast<u8>(x);
+inline u8 src_of(Machine& machine, Program const& program, Instruction const& inst) {
+  return read(machine, program, inst, inst.src_kind, inst.src);
 }
 
-inline u8 from_bin(std::string const& bin) {
-  return static_cast<u8>(std::bitset<8>(bin).to_ulong());
+inline void jump_if(Registers& registers, Instruction const& inst, bool cond) noexcept {
+  if (cond) registers.PC = inst.target;
 }
 
-u8 index_from(std::string const& val) {
-  assert(is_lower(val) && "String must be a lower string");
-  if (std::regex_match(val, std::regex{ "\\*[0-9]+" })) return static_cast<u8>(std::stoi(val.substr(1))); // Decimal
-  if (std::regex_match(val, std::regex{"\\*0x[0-9a-f]+"})) return from_hex(val.substr(3)); // Hex
-  if (std::regex_match(val, std::regex{"\\*0b[0-1]+"})) return from_bin(val.substr(3)); // Bin
-  throw std::runtime_error{"Invalid token '" + val + "'"};
+/**
+ * @brief Shifts a u8, shifting by 8 or more always gives 0
+ */
+inline u8 shift_left(u8 value, u8 count) noexcept {
+  return (count < 8) ? static_cast<u8>(value << count) : 0;
 }
 
-u8 value_of(std::string const& val) {
-  assert(is_lower(val) && "String must be a lower string");
-  // Register
-  if (is_register(val)) return get_register(val);
-  // Address
-  if (is_address(val)) return RAM[index_from(val)];
-  // Simple value
-  else {
-    if (std::regex_match(val, std::regex{"[0-9]+"})) return static_cast<u8>(std::stoi(val)); // Decimal
-    if (std::regex_match(val, std::regex{"0x[0-9a-f]+"})) return from_hex(val.substr(2)); // Hex
-    if (std::regex_match(val, std::regex{"0b[0-1]+"})) return from_bin(val.substr(2)); // Bin
-  }
-  throw std::runtime_error{"Invalid token '" + val + "'"};
+inline u8 shift_right(u8 value, u8 count) noexcept {
+  return (count < 8) ? static_cast<u8>(value >> count) : 0;
 }
 
-inline u8& ref_to(std::string const& param) {
-  assert(is_lower(param) && "String must be a lower string");
-  if (is_register(param)) return get_register(param);
-  if (is_address(param)) return RAM[index_from(param)];
-  throw std::runtime_error{"Invalid value " + param};
-}
+// regs is the engine's local table of A, X and Y, ram the page holding every address
+#define R_DST (*regs[inst->dst])
+#define M_DST (ram[inst->dst])
+#define R_SRC (*regs[inst->src])
+#define M_SRC (ram[inst->src])
+#define I_SRC (inst->src)
+#define P_REG (machine.registers.P)
+#define TARGET (inst->target)
+#define VERIFIED (verified)
+#define JUMP(to)                                                     \
+  {                                                                  \
+    if (traced) recorder->jump(pc, to, machine.steps + steps);       \
+    pc = to;                                                         \
+  }
+#define SLOW_PATH                                                    \
+  machine.registers.PC = pc;                                         \
+  Asm::Interpreter::execute(machine, program, program.code[pc - 1]); \
+  pc = machine.registers.PC;
 
-void exec_mov(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  if (is_register(param1)) ref_to(param1) = value_of(param2);
-  else if (is_address(param1)) RAM[index_from(param1)] = value_of(param2);
-  else throw std::runtime_error{"Cannot execute MOV\n"};
+/**
+ * @brief Runs instructions one by one, budget of them at most
+ */
+void run_basic(Machine& machine, Program const& program, u64 budget, Asm::Trace::Recorder* recorder = nullptr) {
+  auto const size = program.code.size();
+  for (; budget > 0 && machine.registers.PC < size; budget--) {
+    auto const next = machine.registers.PC + 1u;
+    machine.steps++;
+    Asm::Interpreter::execute(machine, program, program.code[machine.registers.PC++]);
+    if (recorder && machine.registers.PC != next) recorder->jump(next, machine.registers.PC, machine.steps);
+  }
 }
 
-void exec_add(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) += value_of(param2);
+/**
+ * @brief Runs lowered code, budgeted runs stop once limit instructions ran,
+ * traced ones call recorder back on taken jumps
+ */
+template <bool verified, bool budgeted, bool traced = false>
+void run_switched(Machine& machine, Program const& program, std::vector<Asm::Lowered> const& code, u64 limit,
+  Asm::Trace::Recorder* recorder = nullptr) {
+  u8* const regs[] = {&machine.registers.A, &machine.registers.X, &machine.registers.Y};
+  auto const ram = machine.RAM.page(0);
+  auto const size = program.code.size();
+  u16 pc = machine.registers.PC;
+  u64 steps = 0;
+  try {
+#define STOP pc--; steps--; goto stopped;
+    while (pc < size && (!budgeted || steps < limit)) {
+      auto const inst = &code[pc++];
+      steps++;
+      switch (inst->handler) {
+#define MINIASM_CASE(name, body) case Asm::Handler::name: { body } break;
+      MINIASM_HANDLERS(MINIASM_CASE)
+#undef MINIASM_CASE
+      case Asm::Handler::count: break;
+      }
+    }
+#undef STOP
+  stopped:;
+  } catch (...) {
+    machine.registers.PC = pc;
+    machine.steps += steps;
+    throw;
+  }
+  machine.registers.PC = pc;
+  machine.steps += steps;
 }
 
-void exec_sub(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) -= value_of(param2);
-}
+#ifdef MINIASM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wgnu-label-as-value"
+#endif
 
-void exec_cmp(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  auto val1 = value_of(param1);
-  auto val2 = value_of(param2);
-  registers::P = 0;
-  if (val1 == val2) registers::P |= Flags::equal;
-  else if (val1 > val2) registers::P |= Flags::greater;
-  else if (val1 < val2) registers::P |= Flags::lower;
+inline const void* handler_in(Asm::Threaded const& inst, const void* const*) noexcept {
+  return inst.handler;
 }
 
-void exec_or(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) |= value_of(param2);
+inline const void* handler_in(Asm::Lowered const& inst, const void* const* handlers) noexcept {
+  return handlers[static_cast<unsigned>(inst.handler)];
 }
 
-void exec_and(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) &= value_of(param2);
+/**
+ * @brief Runs threaded code, or only returns the handler addresses without a machine
+ * @details Label addresses only exist inside this function, so the code is
+ * prepared from the table a call without a machine returns. The last entry of
+ * the table, at Handler::count, stops the program. Verified code cannot jump
+ * past it, so its PC is not clamped. Budgeted runs read lowered code through
+ * the table and stop once limit instructions ran, traced ones too and call
+ * recorder back on taken jumps.
+ */
+template <bool verified, bool budgeted, typename Code, bool traced = false>
+const void* const* run_threaded(Machine* running, Program const& program, Code const* code, u64 limit,
+  Asm::Trace::Recorder* recorder = nullptr) {
+#define MINIASM_LABEL(name, body) &&handler_##name,
+  static const void* const handlers[] = {MINIASM_HANDLERS(MINIASM_LABEL) &&done};
+#undef MINIASM_LABEL
+  if (!running) return handlers;
+  auto& machine = *running;
+  u8* const regs[] = {&machine.registers.A, &machine.registers.X, &machine.registers.Y};
+  auto const ram = machine.RAM.page(0);
+  auto const size = program.code.size();
+  u16 pc = machine.registers.PC;
+  u64 steps = 0;
+  Code const* inst;
+#define DISPATCH()                                    \
+  if (budgeted && steps >= limit) goto paused;        \
+  inst = &code[(verified || pc < size) ? pc : size];  \
+  pc++;                                               \
+  steps++;                                            \
+  goto *handler_in(*inst, handlers)
+  try {
+    DISPATCH();
+#define STOP goto done;
+#define MINIASM_HANDLER(name, body) handler_##name: { body } DISPATCH();
+    MINIASM_HANDLERS(MINIASM_HANDLER)
+#undef MINIASM_HANDLER
+#undef STOP
+  done:
+    pc--;
+    steps--;
+  paused:;
+  } catch (...) {
+    machine.registers.PC = pc;
+    machine.steps += steps;
+    throw;
+  }
+#undef DISPATCH
+  machine.registers.PC = pc;
+  machine.steps += steps;
+  return handlers;
 }
 
-void exec_xor(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) ^= value_of(param2);
-}
+#pragma GCC diagnostic pop
+#endif // MINIASM_COMPUTED_GOTO
 
-void exec_push(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  stack.push(value_of(param1));
-}
+#undef R_DST
+#undef M_DST
+#undef R_SRC
+#undef M_SRC
+#undef I_SRC
+#undef P_REG
+#undef TARGET
+#undef VERIFIED
+#undef JUMP
+#undef SLOW_PATH
+
+} // namespace
 
-void exec_pop(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-   ref_to(param1) = stack.pop();
+/**
+ * @brief Interprets a line typed in shell mode
+ * @param machine The machine we work with
+ * @param inst Full ASM instruction (ex: "mov A, 42") or command (ex: "print A")
+ * @throw std::runtime_error If inst is not a correct ASM instruction
+ */
+void Asm::Interpreter::intepret_instruction(Machine& machine, std::string const& inst) {
+  Program program;
+  append_line(program, inst, machine.jmp_tokens);
+  execute(machine, program, program.code.front());
 }
 
-inline void jump_if(std::string const& param1, bool cond) {
-  assert(is_lower(param1) && "String must be a lower string");
-  if (cond) {
-    if (std::regex_match(param1, std::regex{"(0b[0-1]+|0x[0-9a-f]+|[0-9]+)"})) {
-      u8 idx{};
-      if (std::regex_match(param1, std::regex{"[0-9]+"})) idx = static_cast<u8>(std::stoi(param1)); // Decimal
-      if (std::regex_match(param1, std::regex{"0x[0-9a-f]+"})) idx = from_hex(param1.substr(2)); // Hex
-      if (std::regex_match(param1, std::regex{"0b[0-1]+"})) idx = from_bin(param1.substr(2)); // Bin
-      registers::PC = idx;
-    }
-    else registers::PC = jmp_tokens[param1];
+/**
+ * @brief Executes one decoded instruction
+ * @param machine The machine we work with
+ * @param program The program inst belongs to
+ * @param inst The instruction
+ * @throw std::runtime_error If inst is faulty
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+void Asm::Interpreter::execute(Machine& machine, Program const& program, Instruction const& inst) {
+  auto& registers = machine.registers;
+  switch (inst.op) {
+  case Opcode::nop:
+    break;
+  case Opcode::mov: {
+    auto const val = src_of(machine, program, inst);
+    ref_to(machine, program, inst) = val;
+    break;
+  }
+  case Opcode::add: {
+    auto const val = src_of(machine, program, inst);
+    ref_to(machine, program, inst) += val;
+    break;
+  }
+  case Opcode::sub: {
+    auto const val = src_of(machine, program, inst);
+    ref_to(machine, program, inst) -= val;
+    break;
+  }
+  case Opcode::cmp: {
+    auto const val1 = read(machine, program, inst, inst.dst_kind, inst.dst);
+    registers.P.compare(val1, src_of(machine, program, inst));
+    break;
+  }
+  case Opcode::or_: {
+    auto const val = src_of(machine, program, inst);
+    ref_to(machine, program, inst) |= val;
+    break;
+  }
+  case Opcode::and_: {
+    auto const val = src_of(machine, program, inst);
+    ref_to(machine, program, inst) &= val;
+    break;
+  }
+  case Opcode::xor_: {
+    auto const val = src_of(machine, program, inst);
+    ref_to(machine, program, inst) ^= val;
+    break;
+  }
+  case Opcode::push:
+    machine.push(src_of(machine, program, inst));
+    break;
+  case Opcode::pop: {
+    auto const val = machine.pop();
+    ref_to(machine, program, inst) = val;
+    break;
+  }
+  case Opcode::jmp:
+    jump_if(registers, inst, true);
+    break;
+  case Opcode::je:
+    jump_if(registers, inst, registers.P.equal());
+    break;
+  case Opcode::jne:
+    jump_if(registers, inst, !registers.P.equal());
+    break;
+  case Opcode::jl:
+    jump_if(registers, inst, registers.P.lower());
+    break;
+  case Opcode::jle:
+    jump_if(registers, inst, registers.P.lower() || registers.P.equal());
+    break;
+  case Opcode::jg:
+    jump_if(registers, inst, registers.P.greater());
+    break;
+  case Opcode::jge:
+    jump_if(registers, inst, registers.P.greater() || registers.P.equal());
+    break;
+  case Opcode::shl: {
+    auto const val = src_of(machine, program, inst);
+    auto& dst = ref_to(machine, program, inst);
+    dst = shift_left(dst, val);
+    break;
+  }
+  case Opcode::shr: {
+    auto const val = src_of(machine, program, inst);
+    auto& dst = ref_to(machine, program, inst);
+    dst = shift_right(dst, val);
+    break;
+  }
+  case Opcode::print:
+    *machine.output << static_cast<unsigned>(src_of(machine, program, inst)) << "\n";
+    break;
+  case Opcode::print_registers:
+    print_registers(*machine.output, registers);
+    break;
+  case Opcode::fault:
+    raise(program, inst);
   }
 }
 
-void exec_jmp(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, true);
+/**
+ * @brief Reads the name of an engine (basic, switch, threaded or jit)
+ * @param name The name we read
+ * @param engine Receives the engine
+ * @returns True if name is an engine, false otherwise
+ * @throw /
+ */
+bool Asm::Interpreter::engine_from(std::string const& name, Engine& engine) noexcept {
+  if (name == "basic") engine = Engine::basic;
+  else if (name == "switch") engine = Engine::switched;
+  else if (name == "threaded") engine = Engine::threaded;
+  else if (name == "jit") engine = Engine::jit;
+  else return false;
+  return true;
 }
 
-void exec_je(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, (registers::P & Flags::equal) != 0);
+/**
+ * @brief Runs a decoded program until PC leaves it
+ * @param machine The machine we work with
+ * @param program The program
+ * @param engine The dispatch engine, which does not change the results
+ * @param optimize Lets the switched and threaded engines use the peephole
+ * optimizer, which does not change the results either
+ * @throw std::runtime_error If a faulty instruction is executed
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+void Asm::Interpreter::run(Machine& machine, Program const& program, Engine engine, bool optimize) {
+  Executable{program, engine, optimize}.run(machine);
 }
 
-void exec_jne(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, !(registers::P & Flags::equal));
+namespace {
+
+#ifdef MINIASM_COMPUTED_GOTO
+/**
+ * @brief Turns lowered code into threaded code for one instantiation of run_threaded
+ */
+template <bool verified>
+std::vector<Asm::Threaded> thread(Program const& program, std::vector<Asm::Lowered> const& lowered) {
+  auto const handlers = run_threaded<verified, false, Asm::Threaded>(nullptr, program, nullptr, 0);
+  std::vector<Asm::Threaded> code;
+  code.reserve(lowered.size() + 1);
+  for (auto const& inst : lowered) {
+    code.push_back({handlers[static_cast<unsigned>(inst.handler)], inst.dst, inst.src, inst.target});
+  }
+  code.push_back({handlers[static_cast<unsigned>(Asm::Handler::count)], 0, 0, 0});
+  return code;
+}
+#endif
+
+} // namespace
+
+/**
+ * @brief Prepares a program for an engine
+ * @param program The program, which must outlive the executable
+ * @param engine The dispatch engine, falling back like run() if unavailable
+ * @param optimize Lets the switched and threaded engines use the peephole optimizer
+ * @details The switched and threaded engines verify the program and run it
+ * without stack bounds checks when it is proven safe. Every engine but the
+ * basic one also prepares the code of budgeted runs, which the JIT runs
+ * threaded: its native blocks chain without counting.
+ * @throw std::bad_alloc If the lowered code cannot be allocated
+ */
+Asm::Interpreter::Executable::Executable(Program const& program, Engine engine, bool optimize)
+  : program_(program), engine_(engine) {
+  if (engine_ == Engine::jit && !Asm::Jit::available()) engine_ = Engine::threaded;
+#ifndef MINIASM_COMPUTED_GOTO
+  if (engine_ == Engine::threaded) engine_ = Engine::switched;
+#endif
+  if (engine_ == Engine::basic) return;
+  auto verification = Asm::verify(program);
+  if (verification.safe) depth_ = std::move(verification.depth);
+  resumable_ = Asm::lower(program, optimize, true);
+  for (auto const& inst : resumable_) span_ = std::max(span_, Asm::span_of(inst));
+  resumable_.push_back({Asm::Handler::count, 0, 0, 0});
+  if (engine_ == Engine::jit) {
+    jit_ = std::make_unique<Asm::Jit::Cache>(program);
+    return;
+  }
+  lowered_ = Asm::lower(program, optimize);
+#ifdef MINIASM_COMPUTED_GOTO
+  if (engine_ == Engine::threaded) {
+    threaded_ = thread<false>(program, lowered_);
+    if (!depth_.empty()) verified_ = thread<true>(program, lowered_);
+    lowered_.clear();
+    lowered_.shrink_to_fit();
+  }
+#endif
 }
 
-void exec_jl(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, (registers::P & Flags::lower) != 0);
+/**
+ * @brief Checks if a run may skip the checks the verifier proved useless
+ * @details It must start from a PC the verifier reached, with the stack
+ * depth it found there.
+ * @throw /
+ */
+bool Asm::Interpreter::Executable::verified_for(Machine const& machine) const noexcept {
+  auto const pc = machine.registers.PC;
+  return pc < depth_.size() && depth_[pc] == machine.registers.S;
 }
 
-void exec_jle(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, registers::P & Flags::lower || registers::P & Flags::equal);
+/**
+ * @brief Runs the program until PC leaves it
+ * @param machine The machine we work with, which may be reused between runs
+ * @throw std::runtime_error If a faulty instruction is executed
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+void Asm::Interpreter::Executable::run(Machine& machine) const {
+  switch (engine_) {
+  case Engine::basic:
+    run_basic(machine, program_, ~u64{0});
+    break;
+  case Engine::switched:
+    if (verified_for(machine)) run_switched<true, false>(machine, program_, lowered_, 0);
+    else run_switched<false, false>(machine, program_, lowered_, 0);
+    break;
+  case Engine::threaded:
+#ifdef MINIASM_COMPUTED_GOTO
+    if (verified_for(machine)) run_threaded<true, false>(&machine, program_, verified_.data(), 0);
+    else run_threaded<false, false>(&machine, program_, threaded_.data(), 0);
+#endif
+    break;
+  case Engine::jit:
+    jit_->run(machine);
+    break;
+  }
 }
 
-void exec_jg(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, (registers::P & Flags::greater) != 0);
+/**
+ * @brief Makes runs with a budget stop before an instruction
+ * @param pc The PC of the instruction, ignored past the end of the program
+ * @details The trap replaces the entry of the instruction in the code of
+ * budgeted runs, and the superinstructions which would run over it are split
+ * back into their instructions.
+ * @throw std::bad_alloc If the traps cannot be allocated
+ */
+void Asm::Interpreter::Executable::trap(u16 pc) {
+  auto const size = program_.code.size();
+  if (pc >= size) return;
+  if (traps_.empty()) traps_.assign(size, false);
+  traps_[pc] = true;
+  if (resumable_.empty()) return;
+  for (std::size_t head = pc; head-- > 0 && pc - head < span_;) {
+    if (Asm::span_of(resumable_[head]) <= pc - head) continue;
+    auto const& inst = program_.code[head];
+    resumable_[head] = {Asm::handler_of(inst), inst.dst, inst.src, inst.target};
+  }
+  resumable_[pc] = {Asm::Handler::trap, 0, 0, 0};
 }
 
-void exec_jge(std::string const& param1) {
-  assert(is_lower(param1) && "String must be a lower string");
-  jump_if(param1, registers::P & Flags::greater || registers::P & Flags::equal);
+/**
+ * @brief Lets runs with a budget go through an instruction again
+ * @param pc The PC of a trap, ignored if there is none
+ * @details The superinstructions trap() split stay split, runs without a
+ * budget never see either.
+ * @throw /
+ */
+void Asm::Interpreter::Executable::untrap(u16 pc) {
+  if (pc >= traps_.size() || !traps_[pc]) return;
+  traps_[pc] = false;
+  if (!resumable_.empty()) {
+    auto const& inst = program_.code[pc];
+    resumable_[pc] = {Asm::handler_of(inst), inst.dst, inst.src, inst.target};
+  }
+  if (std::none_of(traps_.begin(), traps_.end(), [](bool trap) { return trap; })) traps_.clear();
 }
 
-void exec_shl(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) <<= value_of(param2);
+/**
+ * @brief Runs the program until PC leaves it, like run(machine), and calls a
+ * recorder back on every taken jump
+ * @param machine The machine we work with
+ * @param recorder Told the PC after the jump, its target and the steps once
+ * it ran. The basic engine calls it after every instruction which did not go
+ * to the next one.
+ * @details The other engines run the code of budgeted runs, without a
+ * budget: the jump handlers are the only ones which call back. Traps are
+ * run through as runs without a budget do.
+ * @throw std::runtime_error If a faulty instruction is executed, or what the
+ * recorder throws
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+void Asm::Interpreter::Executable::run(Machine& machine, Trace::Recorder& recorder) const {
+  auto const size = program_.code.size();
+  while (machine.registers.PC < size) {
+    if (engine_ == Engine::basic) {
+      run_basic(machine, program_, ~u64{0}, &recorder);
+      break;
+    }
+    auto const verified = verified_for(machine);
+    if (engine_ == Engine::switched) {
+      if (verified) run_switched<true, false, true>(machine, program_, resumable_, 0, &recorder);
+      else run_switched<false, false, true>(machine, program_, resumable_, 0, &recorder);
+    }
+#ifdef MINIASM_COMPUTED_GOTO
+    else if (verified) run_threaded<true, false, Asm::Lowered, true>(&machine, program_, resumable_.data(), 0, &recorder);
+    else run_threaded<false, false, Asm::Lowered, true>(&machine, program_, resumable_.data(), 0, &recorder);
+#endif
+    run_basic(machine, program_, 1, &recorder); // Stopped on a trap
+  }
 }
 
-void exec_shr(std::string const& param1, std::string const& param2) {
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  ref_to(param1) >>= value_of(param2);
+bool Asm::Interpreter::Executable::trapped(Machine const& machine) const noexcept {
+  auto const pc = machine.registers.PC;
+  return pc < traps_.size() && traps_[pc];
 }
 
-void exec(std::string const& op, std::string const& param1, std::string const& param2) {
-  assert(is_lower(op) && "String must be a lower string");
-  assert(is_lower(param1) && "String must be a lower string");
-  assert(is_lower(param2) && "String must be a lower string");
-  if (op == "mov") {
-    exec_mov(param1, param2);
-  } else if (op == "add") {
-    exec_add(param1, param2);
-  } else if (op == "sub") {
-    exec_sub(param1, param2);
-  } else if (op == "cmp") {
-    exec_cmp(param1, param2);
-  } else if (op == "or") {
-    exec_or(param1, param2);
-  } else if (op == "and") {
-    exec_and(param1, param2);
-  } else if (op == "xor") {
-    exec_xor(param1, param2);
-  } else if (op == "push") {
-    exec_push(param1);
-  } else if (op == "pop") {
-    exec_pop(param1);
-  } else if (op == "jmp") {
-    exec_jmp(param1);
-  } else if (op == "je") {
-    exec_je(param1);
-  } else if (op == "jne") {
-    exec_jne(param1);
-  } else if (op == "jl") {
-    exec_jl(param1);
-  } else if (op == "jle") {
-    exec_jle(param1);
-  } else if (op == "jg") {
-    exec_jg(param1);
-  } else if (op == "jge") {
-    exec_jge(param1);
-  } else if (op == "shl") {
-    exec_shl(param1, param2);
-  } else if (op == "shr") {
-    exec_shr(param1, param2);
-  } else if (op == "jmp") {
-    exec_jmp(param1);
-  } else if (op == "je") {
-    exec_je(param1);
-  } else if (op == "jne") {
-    exec_jne(param1);
-  } else if (op == "jl") {
-    exec_jl(param1);
-  } else if (op == "jle") {
-    exec_jle(param1);
-  } else if (op == "jg") {
-    exec_jg(param1);
-  } else if (op == "jge") {
-    exec_jge(param1);
+/**
+ * @brief Runs the program until PC leaves it, budget instructions ran or PC
+ * reaches a trap
+ * @param machine The machine we work with
+ * @param budget Instructions to run at most, counted exactly whatever the
+ * optimizer fused
+ * @returns Why the run returned. The machine is left exactly as the basic
+ * engine would leave it, and running it again resumes the program.
+ * @details A run starting on a trap first runs its instruction, so it does
+ * not stop there again. The engine then runs while a whole entry still fits
+ * in the budget, the basic engine runs the last few instructions one by one.
+ * @throw std::runtime_error If a faulty instruction is executed
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+Asm::Interpreter::Stop Asm::Interpreter::Executable::run(Machine& machine, u64 budget) const {
+  auto const size = program_.code.size();
+  auto const start = machine.steps;
+  if (budget > 0 && trapped(machine)) run_basic(machine, program_, 1);
+  auto left = budget - (machine.steps - start);
+  if (engine_ != Engine::basic && left >= span_) {
+    auto const limit = left - span_ + 1;
+    auto const verified = verified_for(machine);
+    if (engine_ == Engine::switched) {
+      if (verified) run_switched<true, true>(machine, program_, resumable_, limit);
+      else run_switched<false, true>(machine, program_, resumable_, limit);
+    }
+#ifdef MINIASM_COMPUTED_GOTO
+    else if (verified) run_threaded<true, true>(&machine, program_, resumable_.data(), limit);
+    else run_threaded<false, true>(&machine, program_, resumable_.data(), limit);
+#endif
+    left = budget - (machine.steps - start);
+  }
+  if (traps_.empty()) {
+    run_basic(machine, program_, left);
+  } else {
+    for (; left > 0 && machine.registers.PC < size && !trapped(machine); left--) run_basic(machine, program_, 1);
   }
+  if (machine.registers.PC >= size) return Stop::ended;
+  return trapped(machine) ? Stop::trap : Stop::budget;
 }
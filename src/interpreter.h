@@ -1,19 +1,90 @@
 #ifndef __INTERPRETER_H__
 #define __INTERPRETER_H__
 
-#include "syntax.h"
+#include <memory> // std::unique_ptr
 #include <string> // std::string
+#include <vector> // std::vector
 #include "cpu.h"
+#include "dispatch.h"
+#include "jit.h"
+#include "program.h"
+
+#if defined(__GNUC__) && !defined(MINIASM_NO_COMPUTED_GOTO)
+#define MINIASM_COMPUTED_GOTO // Labels as values are available
+#endif
 
 namespace Asm {
+
+namespace Trace {
+class Recorder;
+} // namespace Asm::Trace
+
 namespace Interpreter {
 
-void intepret_instruction(std::string const& inst);
+/**
+ * @enum Engine
+ * @brief How decoded programs are dispatched
+ */
+enum class Engine {
+  basic,    //!< Generic execute() per instruction
+  switched, //!< Specialized handlers behind a switch
+  threaded, //!< Specialized handlers chained by computed gotos (switched if unavailable)
+  jit       //!< Hot basic blocks compiled to native code (threaded if unavailable)
+};
+
+/**
+ * @enum Stop
+ * @brief Why a run with a budget returned
+ */
+enum class Stop {
+  ended,  //!< PC left the program
+  budget, //!< The budget ran out, the next run resumes the program
+  trap    //!< PC reached a trap, the next run starts with its instruction
+};
+
+bool engine_from(std::string const& name, Engine& engine) noexcept;
+void intepret_instruction(Machine& machine, std::string const& inst);
+void execute(Machine& machine, Program const& program, Instruction const& inst);
+void run(Machine& machine, Program const& program, Engine engine = Engine::threaded, bool optimize = true);
+
+/**
+ * @brief A program prepared once for an engine
+ * @details Lowering, optimizing and verifying happen in the constructor, so run() makes
+ * no heap allocation with the basic, switched and threaded engines (errors
+ * aside, and whatever machine.output does). The JIT compiles its hot blocks
+ * while it runs and keeps them for the next runs. A run with a budget stops after that many
+ * instructions, exactly, or before an instruction marked by trap() until
+ * untrap(), and the next run resumes there. Runs without a budget ignore
+ * traps. Traced runs call a recorder back on every taken jump, engines run
+ * untraced otherwise.
+ */
+class Executable {
+public:
+  Executable(Program const& program, Engine engine = Engine::threaded, bool optimize = true);
+
+  void trap(u16 pc);
+  void untrap(u16 pc);
+  void run(Machine& machine) const;
+  Stop run(Machine& machine, u64 budget) const;
+  void run(Machine& machine, Trace::Recorder& recorder) const;
+
+private:
+  bool verified_for(Machine const& machine) const noexcept;
+  bool trapped(Machine const& machine) const noexcept;
+
+  Program const& program_;
+  Engine engine_;
+  std::vector<int> depth_;         //!< Stack depth at each PC, empty unless the program is verified
+  std::vector<Lowered> lowered_;   //!< Code of the switched engine
+  std::vector<Threaded> threaded_; //!< Code of the threaded engine, ended by a stop entry
+  std::vector<Threaded> verified_; //!< Same without the checks, empty unless the program is verified
+  std::vector<Lowered> resumable_; //!< Code of budgeted runs, ended by a stop entry
+  unsigned span_ = 1;              //!< Most instructions an entry of resumable_ runs
+  std::vector<bool> traps_;        //!< PCs budgeted runs stop at, empty without traps
+  std::unique_ptr<Jit::Cache> jit_; //!< Native code of the JIT engine, null for the others
+};
 
 } // namespace Asm
 } // namespace Asm::Interpreter
 
-u8& get_register(std::string const& name);
-u8 value_of(std::string const& value);
-
 #endif // __INTERPRETER_H__
@@ -0,0 +1,522 @@
+#include "jit.h"
+#include "cpu.h"            // Machine
+#include "interpreter.h"    // execute
+
+#ifdef MINIASM_JIT
+
+#include <sys/mman.h>       // mmap, mprotect, munmap
+
+#include <cstring>          // std::memcpy
+#include <initializer_list> // std::initializer_list
+#include <new>              // std::bad_alloc
+#include <utility>          // std::move
+#include <vector>           // std::vector
+
+/*
+ * Block JIT for x86-64.
+ *
+ * Basic blocks start at a jump target or after a jump and end at a jump. Every
+ * entry of a block is counted by the interpreter loop; at hot_threshold
+ * entries the block (or its longest compilable prefix) is translated into
+ * native code. Native code keeps the machine in host registers:
+ *   rdi = JitState*, rsi = RAM, r8d = A, r9d = X, r10d = Y, r11d = P, edx = S,
+ *   eax and ecx are scratch.
+ * Registers hold zero-extended bytes and are only modified through 8-bit
+ * operations. Leaving native code returns the next PC to interpret. Exits to a
+ * block which is compiled later are patched to jump straight into it. A block
+ * adds its length to the executed instructions on entry, side exits take back
+ * what they skip.
+ */
+
+namespace {
+
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+using Asm::Program;
+
+/**
+ * @brief Machine state exchanged with native code
+ */
+struct JitState {
+  u8* ram;   // +0
+  u8* stack; // +8
+  u32 a;     // +16
+  u32 x;     // +20
+  u32 y;     // +24
+  u32 p;     // +28
+  u32 s;     // +32
+  u64 steps; // +40
+};
+
+using Trampoline = u32 (*)(JitState* state, const u8* block);
+
+constexpr std::size_t buffer_size = 1 << 20;
+constexpr u32 side_exit = 0x10000; //!< Set in the returned PC when the instruction must be interpreted
+constexpr std::size_t max_block_code = 64; //!< Upper bound of the code of one instruction
+constexpr u8 ecx = 1;
+constexpr u8 eax = 0;
+
+/**
+ * @brief Where an operand lives in native code
+ */
+struct Location {
+  bool memory; //!< RAM[value] if true, host register r(8 + value) otherwise
+  u8 value;
+};
+
+inline bool is_location(OperandKind kind) noexcept {
+  return kind == OperandKind::reg || kind == OperandKind::addr;
+}
+
+bool compilable(Instruction const& inst) noexcept {
+  switch (inst.op) {
+  case Opcode::nop:
+  case Opcode::jmp: case Opcode::je: case Opcode::jne: case Opcode::jl:
+  case Opcode::jle: case Opcode::jg: case Opcode::jge:
+    return true;
+  case Opcode::mov: case Opcode::add: case Opcode::sub: case Opcode::cmp:
+  case Opcode::or_: case Opcode::and_: case Opcode::xor_:
+  case Opcode::shl: case Opcode::shr:
+    return is_location(inst.dst_kind) && (is_location(inst.src_kind) || inst.src_kind == OperandKind::imm);
+  case Opcode::push:
+    return is_location(inst.src_kind) || inst.src_kind == OperandKind::imm;
+  case Opcode::pop:
+    return is_location(inst.dst_kind);
+  default:
+    return false;
+  }
+}
+
+inline bool is_jump(Opcode op) noexcept {
+  return op >= Opcode::jmp && op <= Opcode::jge;
+}
+
+struct Block {
+  u16 start;
+  u16 end;                           //!< One past the last instruction
+  unsigned count;                    //!< Entries counted so far
+  const u8* code;                    //!< Native code, null until compiled
+  bool failed;                       //!< Nothing compilable, never retried
+  std::vector<std::size_t> pending;  //!< rel32 sites waiting for this block
+};
+
+/**
+ * @brief Executable memory, writable only while compiling
+ */
+class CodeBuffer {
+public:
+  CodeBuffer() {
+    auto const mem = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) throw std::bad_alloc{};
+    begin_ = static_cast<u8*>(mem);
+  }
+  ~CodeBuffer() {
+    munmap(begin_, buffer_size);
+  }
+  CodeBuffer(CodeBuffer const&) = delete;
+  CodeBuffer& operator=(CodeBuffer const&) = delete;
+
+  void writable() noexcept { mprotect(begin_, buffer_size, PROT_READ | PROT_WRITE); }
+  void executable() noexcept { mprotect(begin_, buffer_size, PROT_READ | PROT_EXEC); }
+
+  std::size_t size() const noexcept { return size_; }
+  bool has_room(std::size_t bytes) const noexcept { return size_ + bytes <= buffer_size; }
+  const u8* at(std::size_t offset) const noexcept { return begin_ + offset; }
+
+  void byte(u8 b) noexcept { begin_[size_++] = b; }
+  void bytes(std::initializer_list<u8> bs) noexcept { for (auto b : bs) byte(b); }
+  void dword(u32 d) noexcept {
+    std::memcpy(begin_ + size_, &d, 4);
+    size_ += 4;
+  }
+  /**
+   * @brief Points the rel32 at offset site to offset target
+   */
+  void patch(std::size_t site, std::size_t target) noexcept {
+    auto const rel = static_cast<u32>(static_cast<int>(target) - static_cast<int>(site + 4));
+    std::memcpy(begin_ + site, &rel, 4);
+  }
+
+private:
+  u8* begin_;
+  std::size_t size_ = 0;
+};
+
+} // namespace
+
+class Asm::Jit::Compiler {
+public:
+  explicit Compiler(Program const& program) : program_(program), block_at_(program.code.size(), -1) {
+    find_blocks();
+    buffer_.writable();
+    emit_trampoline();
+    buffer_.executable();
+  }
+
+  /**
+   * @brief Returns the native code of the block starting at pc, compiling it when it gets hot
+   * @returns Null if pc is not the start of a compiled block
+   */
+  const u8* native(u16 pc) {
+    auto const idx = block_at_[pc];
+    if (idx < 0) return nullptr;
+    auto& block = blocks_[idx];
+    if (block.code || block.failed) return block.code;
+    if (++block.count >= Asm::Jit::hot_threshold) compile(block);
+    return block.code;
+  }
+
+  /**
+   * @brief Runs native code from a block until it exits
+   * @returns The PC to continue from, with side_exit set if the instruction
+   * at this PC must be interpreted (it would raise an error)
+   */
+  u32 enter(Machine& machine, u8* ram, const u8* code) noexcept {
+    auto& registers = machine.registers;
+    JitState state{ram, machine.stack.data(), registers.A, registers.X, registers.Y, registers.P.value(), registers.S, 0};
+    Trampoline trampoline;
+    auto const entry = buffer_.at(0);
+    std::memcpy(&trampoline, &entry, sizeof(trampoline));
+    auto const pc = trampoline(&state, code);
+    registers.A = static_cast<u8>(state.a);
+    registers.X = static_cast<u8>(state.x);
+    registers.Y = static_cast<u8>(state.y);
+    registers.P.assign(static_cast<u8>(state.p));
+    registers.S = static_cast<u8>(state.s);
+    machine.steps += state.steps;
+    return pc;
+  }
+
+private:
+  struct Exit {
+    std::size_t site; //!< rel32 to point at the exit stub
+    u16 pc;           //!< PC returned by the exit
+    bool chain;       //!< Patched into the block at pc once it is compiled
+  };
+
+  void find_blocks() {
+    auto const size = program_.code.size();
+    std::vector<bool> leader(size, false);
+    if (size > 0) leader[0] = true;
+    for (std::size_t pc = 0; pc < size; pc++) {
+      auto const& inst = program_.code[pc];
+      if (!is_jump(inst.op)) continue;
+      if (inst.target < size) leader[inst.target] = true;
+      if (pc + 1 < size) leader[pc + 1] = true;
+    }
+    for (std::size_t pc = 0; pc < size;) {
+      auto end = pc + 1;
+      while (end < size && !leader[end] && !is_jump(program_.code[end - 1].op)) end++;
+      block_at_[pc] = static_cast<int>(blocks_.size());
+      blocks_.push_back({static_cast<u16>(pc), static_cast<u16>(end), 0, nullptr, false, {}});
+      pc = end;
+    }
+  }
+
+  void emit_trampoline() noexcept {
+    buffer_.bytes({0x48, 0x89, 0xf0});       // mov rax, rsi
+    buffer_.bytes({0x48, 0x8b, 0x37});       // mov rsi, [rdi]
+    buffer_.bytes({0x44, 0x8b, 0x47, 16});   // mov r8d, [rdi+16]
+    buffer_.bytes({0x44, 0x8b, 0x4f, 20});   // mov r9d, [rdi+20]
+    buffer_.bytes({0x44, 0x8b, 0x57, 24});   // mov r10d, [rdi+24]
+    buffer_.bytes({0x44, 0x8b, 0x5f, 28});   // mov r11d, [rdi+28]
+    buffer_.bytes({0x8b, 0x57, 32});         // mov edx, [rdi+32]
+    buffer_.bytes({0xff, 0xe0});             // jmp rax
+    exit_ = buffer_.size();
+    buffer_.bytes({0x44, 0x89, 0x47, 16});   // mov [rdi+16], r8d
+    buffer_.bytes({0x44, 0x89, 0x4f, 20});   // mov [rdi+20], r9d
+    buffer_.bytes({0x44, 0x89, 0x57, 24});   // mov [rdi+24], r10d
+    buffer_.bytes({0x44, 0x89, 0x5f, 28});   // mov [rdi+28], r11d
+    buffer_.bytes({0x89, 0x57, 32});         // mov [rdi+32], edx
+    buffer_.byte(0xc3);                      // ret
+  }
+
+  /**
+   * @brief Emits an instruction working on a r/m8 operand
+   * @param opcode The opcode
+   * @param reg The ModRM reg field (register or opcode extension)
+   */
+  void emit_rm(u8 opcode, u8 reg, Location const& rm) noexcept {
+    if (rm.memory) {
+      buffer_.bytes({opcode, static_cast<u8>(0x80 | (reg << 3) | 6)}); // [rsi+disp32]
+      buffer_.dword(rm.value);
+    } else {
+      buffer_.bytes({0x41, opcode, static_cast<u8>(0xc0 | (reg << 3) | rm.value)}); // r8b..r10b
+    }
+  }
+
+  static Location location(OperandKind kind, u8 value) noexcept {
+    return {kind == OperandKind::addr, value};
+  }
+
+  /**
+   * @brief Loads a non-immediate src into cl
+   * @returns True if src is an immediate, which stays in the instruction
+   */
+  bool load_src(Instruction const& inst) noexcept {
+    if (inst.src_kind == OperandKind::imm) return true;
+    emit_rm(0x8a, ecx, location(inst.src_kind, inst.src)); // mov cl, src
+    return false;
+  }
+
+  /**
+   * @brief Emits dst op= src for the ALU ops sharing the 00-38 / 80 /digit encodings
+   */
+  void emit_alu(Instruction const& inst, u8 opcode, u8 digit) noexcept {
+    auto const dst = location(inst.dst_kind, inst.dst);
+    if (load_src(inst)) {
+      emit_rm(0x80, digit, dst); // op dst, imm8
+      buffer_.byte(inst.src);
+    } else {
+      emit_rm(opcode, ecx, dst); // op dst, cl
+    }
+  }
+
+  void emit_mov(Instruction const& inst) noexcept {
+    auto const dst = location(inst.dst_kind, inst.dst);
+    if (load_src(inst)) {
+      emit_rm(0xc6, 0, dst); // mov dst, imm8
+      buffer_.byte(inst.src);
+    } else {
+      emit_rm(0x88, ecx, dst); // mov dst, cl
+    }
+  }
+
+  /**
+   * @brief Emits a shift, which gives 0 for counts of 8 or more
+   * @param digit 4 for shl, 5 for shr
+   */
+  void emit_shift(Instruction const& inst, u8 digit) noexcept {
+    auto const dst = location(inst.dst_kind, inst.dst);
+    if (load_src(inst)) {
+      if (inst.src < 8) {
+        emit_rm(0xc0, digit, dst); // shl/shr dst, imm8
+        buffer_.byte(inst.src);
+      } else {
+        emit_rm(0xc6, 0, dst); // mov dst, 0
+        buffer_.byte(0);
+      }
+    } else {
+      buffer_.bytes({0x80, 0xf9, 8}); // cmp cl, 8
+      buffer_.bytes({0x19, 0xc0});    // sbb eax, eax (al = 0xff if cl < 8)
+      emit_rm(0xd2, digit, dst);      // shl/shr dst, cl
+      emit_rm(0x20, eax, dst);        // and dst, al
+    }
+  }
+
+  void emit_cmp(Instruction const& inst) noexcept {
+    emit_alu(inst, 0x38, 7);
+    buffer_.bytes({0x41, 0xbb}); buffer_.dword(Flags::lower);   // mov r11d, lower
+    buffer_.byte(0xb8); buffer_.dword(Flags::greater);          // mov eax, greater
+    buffer_.bytes({0x44, 0x0f, 0x47, 0xd8});                    // cmova r11d, eax
+    buffer_.byte(0xb8); buffer_.dword(Flags::equal);            // mov eax, equal
+    buffer_.bytes({0x44, 0x0f, 0x44, 0xd8});                    // cmove r11d, eax
+  }
+
+  void emit_push(Instruction const& inst, u16 pc, std::vector<Exit>& exits) noexcept {
+    if (load_src(inst)) buffer_.bytes({0xb1, inst.src});  // mov cl, imm8
+    buffer_.bytes({0x80, 0xfa, 0xff});                     // cmp dl, 0xff
+    emit_jcc(0x83, pc, exits, false);                      // jae -> interpreter (overflow)
+    buffer_.bytes({0x48, 0x8b, 0x47, 8});                  // mov rax, [rdi+8]
+    buffer_.bytes({0x88, 0x0c, 0x10});                     // mov [rax+rdx], cl
+    buffer_.bytes({0xfe, 0xc2});                           // inc dl
+  }
+
+  void emit_pop(Instruction const& inst, u16 pc, std::vector<Exit>& exits) noexcept {
+    buffer_.bytes({0x84, 0xd2});                           // test dl, dl
+    emit_jcc(0x84, pc, exits, false);                      // jz -> interpreter (empty)
+    buffer_.bytes({0xfe, 0xca});                           // dec dl
+    buffer_.bytes({0x48, 0x8b, 0x47, 8});                  // mov rax, [rdi+8]
+    buffer_.bytes({0x8a, 0x0c, 0x10});                     // mov cl, [rax+rdx]
+    emit_rm(0x88, ecx, location(inst.dst_kind, inst.dst)); // mov dst, cl
+  }
+
+  /**
+   * @brief Points the rel32 at site to the block at pc if compiled, to an exit otherwise
+   * @param chain False for side exits, which must always return to the interpreter
+   */
+  void link(std::size_t site, u16 pc, std::vector<Exit>& exits, bool chain) noexcept {
+    auto const idx = (chain && pc < block_at_.size()) ? block_at_[pc] : -1;
+    if (idx >= 0 && blocks_[idx].code) {
+      buffer_.patch(site, static_cast<std::size_t>(blocks_[idx].code - buffer_.at(0)));
+    } else {
+      exits.push_back({site, pc, chain});
+    }
+  }
+
+  void emit_jmp(u16 pc, std::vector<Exit>& exits) noexcept {
+    buffer_.byte(0xe9);
+    auto const site = buffer_.size();
+    buffer_.dword(0);
+    link(site, pc, exits, true);
+  }
+
+  void emit_jcc(u8 cc, u16 pc, std::vector<Exit>& exits, bool chain = true) noexcept {
+    buffer_.bytes({0x0f, cc});
+    auto const site = buffer_.size();
+    buffer_.dword(0);
+    link(site, pc, exits, chain);
+  }
+
+  void emit_conditional(u8 mask, u8 cc, Instruction const& inst, std::vector<Exit>& exits) noexcept {
+    buffer_.bytes({0x41, 0xf6, 0xc3, mask}); // test r11b, mask
+    emit_jcc(cc, inst.target, exits);
+  }
+
+  void emit(Instruction const& inst, u16 pc, std::vector<Exit>& exits) noexcept {
+    constexpr u8 jz = 0x84, jnz = 0x85;
+    switch (inst.op) {
+    case Opcode::nop: break;
+    case Opcode::mov: emit_mov(inst); break;
+    case Opcode::add: emit_alu(inst, 0x00, 0); break;
+    case Opcode::or_: emit_alu(inst, 0x08, 1); break;
+    case Opcode::and_: emit_alu(inst, 0x20, 4); break;
+    case Opcode::sub: emit_alu(inst, 0x28, 5); break;
+    case Opcode::xor_: emit_alu(inst, 0x30, 6); break;
+    case Opcode::cmp: emit_cmp(inst); break;
+    case Opcode::shl: emit_shift(inst, 4); break;
+    case Opcode::shr: emit_shift(inst, 5); break;
+    case Opcode::push: emit_push(inst, pc, exits); break;
+    case Opcode::pop: emit_pop(inst, pc, exits); break;
+    case Opcode::jmp: emit_jmp(inst.target, exits); break;
+    case Opcode::je: emit_conditional(Flags::equal, jnz, inst, exits); break;
+    case Opcode::jne: emit_conditional(Flags::equal, jz, inst, exits); break;
+    case Opcode::jl: emit_conditional(Flags::lower, jnz, inst, exits); break;
+    case Opcode::jle: emit_conditional(Flags::lower | Flags::equal, jnz, inst, exits); break;
+    case Opcode::jg: emit_conditional(Flags::greater, jnz, inst, exits); break;
+    case Opcode::jge: emit_conditional(Flags::greater | Flags::equal, jnz, inst, exits); break;
+    default: break;
+    }
+  }
+
+  void compile(Block& block) {
+    u16 end = block.start;
+    while (end < block.end && compilable(program_.code[end])) end++;
+    if (end == block.start || !buffer_.has_room((end - block.start + 2u) * max_block_code)) {
+      block.failed = true;
+      return;
+    }
+    buffer_.writable();
+    auto const start = buffer_.size();
+    block.code = buffer_.at(start);
+    std::vector<Exit> exits;
+    buffer_.bytes({0x48, 0x81, 0x47, 40});        // add qword [rdi+40], length
+    buffer_.dword(end - block.start);
+    for (u16 pc = block.start; pc < end; pc++) {
+      emit(program_.code[pc], pc, exits);
+    }
+    // Falls through to the next instruction unless the block ended with jmp
+    if (program_.code[end - 1].op != Opcode::jmp) {
+      emit_jmp(end, exits);
+    }
+    for (auto const& exit : exits) {
+      buffer_.patch(exit.site, buffer_.size());
+      if (!exit.chain) {
+        buffer_.bytes({0x48, 0x81, 0x6f, 40});    // sub qword [rdi+40], skipped
+        buffer_.dword(end - exit.pc);
+      }
+      buffer_.byte(0xb8);                         // mov eax, pc
+      buffer_.dword(exit.chain ? exit.pc : exit.pc | side_exit);
+      buffer_.byte(0xe9);                         // jmp exit
+      buffer_.dword(0);
+      buffer_.patch(buffer_.size() - 4, exit_);
+      auto const idx = (exit.chain && exit.pc < block_at_.size()) ? block_at_[exit.pc] : -1;
+      if (idx >= 0) blocks_[idx].pending.push_back(exit.site);
+    }
+    for (auto const site : block.pending) {
+      buffer_.patch(site, start);
+    }
+    block.pending.clear();
+    buffer_.executable();
+  }
+
+  Program const& program_;
+  std::vector<int> block_at_; //!< Block starting at each PC, -1 if none
+  std::vector<Block> blocks_;
+  CodeBuffer buffer_;
+  std::size_t exit_ = 0;      //!< Offset of the code leaving native code
+};
+
+/**
+ * @brief Checks if native code can be generated on this platform
+ * @throw /
+ */
+bool Asm::Jit::available() noexcept {
+  return true;
+}
+
+/**
+ * @brief Prepares an empty cache, compilers are made by the first runs
+ * @param program The program, which must outlive the cache
+ * @throw /
+ */
+Asm::Jit::Cache::Cache(Program const& program) noexcept : program_(program) {}
+
+Asm::Jit::Cache::~Cache() = default;
+
+/**
+ * @brief Runs the program, compiling its hot basic blocks to native code
+ * @param machine The machine we work with
+ * @details Cold code and instructions which cannot be compiled (commands,
+ * faults) are interpreted. Results are the same as the interpreter's. Blocks
+ * stay compiled and counted for the next runs.
+ * @throw std::runtime_error If a faulty instruction is executed
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ * @throw std::bad_alloc If executable memory cannot be allocated
+ */
+void Asm::Jit::Cache::run(Machine& machine) {
+  std::unique_ptr<Compiler> compiler;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (!idle_.empty()) {
+      compiler = std::move(idle_.back());
+      idle_.pop_back();
+    } else {
+      idle_.reserve(++made_); // Giving every compiler back never allocates
+    }
+  }
+  if (!compiler) compiler = std::make_unique<Compiler>(program_);
+  struct Giveback {
+    Cache& cache;
+    std::unique_ptr<Compiler>& compiler;
+    ~Giveback() {
+      std::lock_guard<std::mutex> lock{cache.mutex_};
+      cache.idle_.push_back(std::move(compiler));
+    }
+  } giveback{*this, compiler};
+
+  auto const size = program_.code.size();
+  auto const ram = machine.RAM.page(0); // Holds every address native code uses
+  u16 pc = machine.registers.PC;
+  while (pc < size) {
+    if (auto const code = compiler->native(pc)) {
+      auto const next = compiler->enter(machine, ram, code);
+      pc = static_cast<u16>(next);
+      if (!(next & side_exit)) continue;
+    }
+    machine.registers.PC = static_cast<u16>(pc + 1);
+    machine.steps++;
+    Asm::Interpreter::execute(machine, program_, program_.code[pc]);
+    pc = machine.registers.PC;
+  }
+  machine.registers.PC = pc;
+}
+
+#else // MINIASM_JIT
+
+class Asm::Jit::Compiler {};
+
+bool Asm::Jit::available() noexcept {
+  return false;
+}
+
+Asm::Jit::Cache::Cache(Program const& program) noexcept : program_(program) {}
+
+Asm::Jit::Cache::~Cache() = default;
+
+void Asm::Jit::Cache::run(Machine& machine) {
+  Asm::Interpreter::run(machine, program_, Asm::Interpreter::Engine::threaded);
+}
+
+#endif // MINIASM_JIT
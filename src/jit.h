@@ -0,0 +1,52 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <memory> // std::unique_ptr
+#include <mutex>  // std::mutex
+#include <vector> // std::vector
+
+#include "cpu.h"
+#include "program.h"
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(MINIASM_NO_JIT)
+#define MINIASM_JIT // Native code can be generated
+#endif
+
+namespace Asm {
+namespace Jit {
+
+/**
+ * @brief Executions of a basic block before it is compiled
+ */
+constexpr unsigned hot_threshold = 16;
+
+class Compiler;
+
+/**
+ * @brief The native code and hot counters of a program, kept between runs
+ * @details A run borrows a compiler and gives it back, so later runs start
+ * from the blocks earlier ones compiled. Concurrent runs each borrow their
+ * own, the cache holds as many as runs ever overlapped.
+ */
+class Cache {
+public:
+  explicit Cache(Program const& program) noexcept;
+  ~Cache();
+  Cache(Cache const&) = delete;
+  Cache& operator=(Cache const&) = delete;
+
+  void run(Machine& machine);
+
+private:
+  Program const& program_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Compiler>> idle_; //!< Compilers no run holds
+  std::size_t made_ = 0;                        //!< Compilers made, idle_ has room for them all
+};
+
+bool available() noexcept;
+
+} // namespace Asm::Jit
+} // namespace Asm
+
+#endif // __JIT_H__
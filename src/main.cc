@@ -1,10 +1,31 @@
-#include <fstream>  // std::ifstream
-#include <iostream> // std::cout
-#include <map>      // std::map
+#include <signal.h> // sigaction
 
+#include <fstream>   // std::ifstream, std::ofstream
+#include <iostream>  // std::cout
+#include <iterator>  // std::istreambuf_iterator
+#include <memory>    // std::unique_ptr, std::make_unique
+#include <new>       // std::bad_alloc
+#include <sstream>   // std::istringstream
+#include <stdexcept> // std::runtime_error
+#include <string>    // std::string
+#include <vector>    // std::vector
+
+#include "batch.h"
+#include "cache.h"
 #include "cpu.h"
+#include "debugger.h"
 #include "infos.h"
 #include "interpreter.h"
+#include "miniasm.h"
+#include "profiler.h"
+#include "program.h"
+#include "rom.h"
+#include "scheduler.h"
+#include "server.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "verifier.h"
+#include "translator.h"
 #include "strmanip.h" // to_lower, to_upper
 
 /**
@@ -16,84 +37,282 @@ constexpr u16 SwapBytes(u16 value) noexcept { // Not used yet
   return ((value & 0xff) << 8) + (value >> 8);
 }
 
-void start_shell_mode();
-void read_from_file(std::string const& filename);
+/**
+ * @brief Command-line options
+ */
+struct Options {
+  Asm::Interpreter::Engine engine = Asm::Interpreter::Engine::threaded;
+  bool optimize = true; //!< Peephole optimizer of the switch and threaded engines
+  bool batch = false; //!< Runs every file, or every .asm file of a directory
+  unsigned jobs = 0;  //!< Threads of the batch mode, 0 for one per core
+  std::string assemble; //!< ROM image written instead of running the file
+  std::string ram;      //!< File holding the initial RAM contents of the image
+  std::string profile;  //!< Prefix of the profile files, empty if not profiling
+  bool verify = false;  //!< Reports what the verifier found instead of running the file
+  std::string snapshot; //!< Label where the variants fork from
+  std::string variants; //!< File with one variant per line, empty if not forking
+  std::string save_image; //!< Warm-start image written at the snapshot label instead of running on
+  std::string load_image; //!< Warm-start image run instead of a file
+  bool emit_cpp = false;  //!< Prints the file translated to C++ instead of running it
+  unsigned vms = 0;       //!< Copies of the file the scheduler runs together, 0 to run it alone
+  u64 slice = 10000;      //!< Instructions of a VM per round of the scheduler
+  std::string serve;      //!< Socket the daemon listens on, empty if not serving
+  std::string connect;    //!< Socket of the daemon the file is sent to, empty to run it here
+  u64 budget = 0;         //!< Instructions the daemon runs at most, 0 for its own limit
+  std::string cache;      //!< Directory of decoded programs, empty to decode every file
+  u64 cache_size = 64 << 20; //!< Bytes the cache directory holds at most
+  bool verbose = false;   //!< Reports the cache hits and misses, and what traces hold, on standard error
+  std::string record;     //!< Trace written while the file then the shell run, empty if not recording
+  bool record_changes = false; //!< The blocks of the trace list what they changed, for replays to check each
+  std::string replay;     //!< Trace replayed over the file instead of running it
+  u64 seek = ~u64{0};     //!< Instructions the replay stops after, all of them by default
+  bool debug = false;     //!< Runs the file under the debugger shell
+  std::vector<std::string> files;
+};
+
+using Handle = std::unique_ptr<miniasm_machine, decltype(&miniasm_destroy)>;
+
+Handle open_machine(Options const& options);
+void start_shell_mode(miniasm_machine* machine);
+void read_from_file(miniasm_machine* machine, std::string const& filename, bool verbose = false);
+void profile(Options const& options);
+void run_batch(Options const& options);
+void assemble(Options const& options);
+void run_variants(Options const& options);
+void save_image(Options const& options);
+void load_image(Options const& options);
+void emit_cpp(Options const& options);
+void run_vms(Options const& options);
+void serve(Options const& options);
+void run_remote(Options const& options);
+void record(Options const& options);
+void replay(Options const& options);
+void debug(Options const& options);
+bool verify(Options const& options);
+
+/**
+ * @brief Reads a count, of jobs for instance
+ * @param what What is counted, for the error message
+ * @throw std::runtime_error If value is not a number
+ */
+u64 parse_count(std::string const& value, std::string const& what) {
+  if (value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != std::string::npos) {
+    throw std::runtime_error{"Wrong number of " + what + " " + value};
+  }
+  return std::stoull(value);
+}
+
+unsigned parse_jobs(std::string const& value) {
+  return static_cast<unsigned>(parse_count(value, "jobs"));
+}
+
+/**
+ * @brief Reads the options (--engine=basic|switch|threaded|jit, --batch, -j N,
+ * --assemble=image, --ram=file, --profile[=prefix], --no-optimize, --verify,
+ * --snapshot=label, --variants=file, --save-image=image, --load-image=image,
+ * --emit-cpp, --vms=N, --slice=N, --serve socket, --connect=socket,
+ * --budget=N, --cache=directory, --cache-size=bytes, -v|--verbose,
+ * --record=trace, --record-changes, --replay=trace, --seek=N, --debug) and
+ * file names
+ * @throw std::runtime_error If an option is unknown
+ */
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string const arg{argv[i]};
+    if (arg.compare(0, 9, "--engine=") == 0) {
+      if (!Asm::Interpreter::engine_from(arg.substr(9), options.engine)) {
+        throw std::runtime_error{"Unknown engine " + arg.substr(9)};
+      }
+    } else if (arg.compare(0, 11, "--assemble=") == 0) {
+      options.assemble = arg.substr(11);
+    } else if (arg.compare(0, 6, "--ram=") == 0) {
+      options.ram = arg.substr(6);
+    } else if (arg == "--no-optimize") {
+      options.optimize = false;
+    } else if (arg == "--profile") {
+      options.profile = "profile";
+    } else if (arg.compare(0, 10, "--profile=") == 0 && arg.size() > 10) {
+      options.profile = arg.substr(10);
+    } else if (arg.compare(0, 11, "--snapshot=") == 0) {
+      options.snapshot = to_lower(arg.substr(11));
+    } else if (arg.compare(0, 11, "--variants=") == 0) {
+      options.variants = arg.substr(11);
+    } else if (arg.compare(0, 13, "--save-image=") == 0) {
+      options.save_image = arg.substr(13);
+    } else if (arg.compare(0, 13, "--load-image=") == 0) {
+      options.load_image = arg.substr(13);
+    } else if (arg == "--emit-cpp") {
+      options.emit_cpp = true;
+    } else if (arg.compare(0, 6, "--vms=") == 0) {
+      options.vms = static_cast<unsigned>(parse_count(arg.substr(6), "VMs"));
+    } else if (arg.compare(0, 8, "--slice=") == 0) {
+      options.slice = parse_count(arg.substr(8), "instructions per slice");
+    } else if (arg == "--serve") {
+      if (++i == argc) throw std::runtime_error{"Missing socket after --serve"};
+      options.serve = argv[i];
+    } else if (arg.compare(0, 8, "--serve=") == 0) {
+      options.serve = arg.substr(8);
+    } else if (arg.compare(0, 10, "--connect=") == 0) {
+      options.connect = arg.substr(10);
+    } else if (arg.compare(0, 9, "--budget=") == 0) {
+      options.budget = parse_count(arg.substr(9), "instructions");
+    } else if (arg.compare(0, 8, "--cache=") == 0 && arg.size() > 8) {
+      options.cache = arg.substr(8);
+    } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+      options.cache_size = parse_count(arg.substr(13), "bytes");
+    } else if (arg == "-v" || arg == "--verbose") {
+      options.verbose = true;
+    } else if (arg.compare(0, 9, "--record=") == 0 && arg.size() > 9) {
+      options.record = arg.substr(9);
+    } else if (arg == "--record-changes") {
+      options.record_changes = true;
+    } else if (arg.compare(0, 9, "--replay=") == 0 && arg.size() > 9) {
+      options.replay = arg.substr(9);
+    } else if (arg.compare(0, 7, "--seek=") == 0) {
+      options.seek = parse_count(arg.substr(7), "instructions");
+    } else if (arg == "--debug") {
+      options.debug = true;
+    } else if (arg == "--verify") {
+      options.verify = true;
+    } else if (arg == "--batch") {
+      options.batch = true;
+    } else if (arg == "-j") {
+      if (++i == argc) throw std::runtime_error{"Missing number of jobs after -j"};
+      options.jobs = parse_jobs(argv[i]);
+    } else if (arg.compare(0, 2, "-j") == 0) {
+      options.jobs = parse_jobs(arg.substr(2));
+    } else if (arg.compare(0, 2, "--") == 0) {
+      throw std::runtime_error{"Unknown option " + arg};
+    } else {
+      options.files.push_back(arg);
+    }
+  }
+  return options;
+}
 
 int main(int argc, char **argv) {
   try {
-    switch (argc) {
-    case 1:
-      start_shell_mode();
+    auto const options = parse_options(argc, argv);
+    if (options.batch) {
+      run_batch(options);
+      return 0;
+    }
+    if (!options.assemble.empty()) {
+      assemble(options);
+      return 0;
+    }
+    if (options.verify) {
+      return verify(options) ? 0 : 1;
+    }
+    if (options.emit_cpp) {
+      emit_cpp(options);
+      return 0;
+    }
+    if (!options.serve.empty()) {
+      serve(options);
+      return 0;
+    }
+    if (!options.connect.empty()) {
+      run_remote(options);
+      return 0;
+    }
+    if (options.vms > 0) {
+      run_vms(options);
+      return 0;
+    }
+    if (!options.variants.empty()) {
+      run_variants(options);
+      return 0;
+    }
+    if (!options.save_image.empty()) {
+      save_image(options);
+      return 0;
+    }
+    if (!options.record.empty()) {
+      record(options);
+      return 0;
+    }
+    if (!options.replay.empty()) {
+      replay(options);
+      return 0;
+    }
+    if (options.debug) {
+      debug(options);
+      return 0;
+    }
+    if (!options.profile.empty()) {
+      profile(options);
+      return 0;
+    }
+    if (!options.load_image.empty()) {
+      load_image(options);
+      return 0;
+    }
+    auto const machine = open_machine(options);
+    switch (options.files.size()) {
+    case 0:
+      start_shell_mode(machine.get());
       break;
-    case 2:
-      read_from_file(std::string{argv[1]});
-      start_shell_mode();
+    case 1:
+      read_from_file(machine.get(), options.files.front(), options.verbose);
+      start_shell_mode(machine.get());
       break;
     default:
       std::cout << "Wrong number of arguments: expected file name or no argument for shell mode";
       break;
     }
   } catch (std::exception const& e) {
-    std::cout << std::string{"Error: "} + e.what();
+    std::string const message{e.what()};
+    std::cout << "Error: " << message << (message.empty() || message.back() != '\n' ? "\n" : "");
   }
-  std::cin.get();
 }
 
-const std::vector<std::regex> command_regexes = {
-  std::regex{"print registers"},
-  std::regex{"print (a|x|y|p|s|pc)"},
-  std::regex{"print (\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+)"}
-};
-
-bool is_command(std::string const& line) {
-  for (auto const& regex : command_regexes) {
-    if (std::regex_match(line, regex)) {
-      return true;
-    }
-  }
-  return false;
-}
-
-void print_registers() {
-  std::cout << "Register A: " << static_cast<unsigned>(registers::A) << std::endl;
-  std::cout << "Register X: " << static_cast<unsigned>(registers::X) << std::endl;
-  std::cout << "Register Y: " << static_cast<unsigned>(registers::Y) << std::endl;
-  std::cout << "Register P: " << static_cast<unsigned>(registers::P) << std::endl;
-  std::cout << "Register PC: " << static_cast<unsigned>(registers::PC) << std::endl;
-  std::cout << "Register S: " << static_cast<unsigned>(registers::S) << std::endl;
-}
-
-void interpret_command(std::string const& command) {
-  if (command == "print registers") {
-    print_registers();
-  } else if (std::regex_match(command, std::regex{"print (a|x|y|p|s|pc)"})
-    || std::regex_match(command, std::regex{"print (\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+)"})) {
-    std::cout << static_cast<unsigned>(value_of(command.substr(6))) << "\n";
-  }
+/**
+ * @brief Throws the message of a library call which failed
+ */
+void check(miniasm_machine const* machine, miniasm_status status) {
+  if (status < 0) throw std::runtime_error{miniasm_last_error(machine)};
 }
 
-inline bool is_space(std::string const& str) noexcept {
-  for (auto c : str) {
-    if (!isspace(c)) {
-      return false;
-    }
+/**
+ * @brief Creates a machine of the library, running with the engine options
+ * @throw std::bad_alloc If the machine cannot be allocated
+ */
+Handle open_machine(Options const& options) {
+  Handle machine{miniasm_create(), &miniasm_destroy};
+  if (!machine) throw std::bad_alloc{};
+  check(machine.get(), miniasm_set_engine(machine.get(), static_cast<miniasm_engine>(options.engine), options.optimize));
+  if (!options.cache.empty()) {
+    check(machine.get(), miniasm_set_cache(machine.get(), options.cache.c_str(), options.cache_size));
   }
-  return true;
+  return machine;
 }
 
-inline bool is_comment(std::string const& str) noexcept {
-  unsigned i{};
-  for (; i < str.size() && isspace(str[i]); i++);
-  return i < str.size() && str[i] == ';';
+/**
+ * @brief Opens the cache of --cache, null without it
+ * @throw std::runtime_error If the directory cannot be created
+ */
+std::unique_ptr<Asm::Cache> open_cache(Options const& options) {
+  if (options.cache.empty()) return nullptr;
+  return std::make_unique<Asm::Cache>(options.cache, options.cache_size);
 }
 
-void interpret(std::string const& line) {
-  if (is_space(line) || is_comment(line)) return;
-  if (is_command(line)) interpret_command(line);
-  else Asm::Interpreter::intepret_instruction(line);
+/**
+ * @brief Prints the hits and misses of a cache on standard error, in verbose mode
+ */
+void report_cache(Options const& options, Asm::Cache const* cache) {
+  if (!options.verbose || !cache) return;
+  auto const stats = cache->stats();
+  std::cerr << "Cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions\n";
 }
 
-void start_shell_mode() {
+/**
+ * @brief Reads lines until 'exit' or the end of the input, and hands each
+ * one to execute, which throws what the shell reports
+ */
+template <typename Execute>
+void run_shell(Execute const& execute) {
   std::cout << "Mini ASM version " + App::version 
     << "\nCreated by Vincent P.\n"
     << "Shell mode - Type 'exit' to stop\n";
@@ -101,51 +320,429 @@ void start_shell_mode() {
   while (true) {
     try {
       std::cout << "> ";
-      std::getline(std::cin, line);
-      if (line == "exit") break;
-      interpret(to_lower(line));
+      if (!std::getline(std::cin, line) || line == "exit") break;
+      execute(line);
     } catch (std::exception const& e) {
       std::cout << std::string{"Error: "} + e.what();
     }
   }
 }
 
-std::string extract_jmp_token(std::string const& line) {
-  unsigned i{};
-  for (; i < line.size() && std::isspace(line[i]); i++);
-  std::string token;
-  for (; i < line.size() && !std::isspace(line[i]) && line[i] != ':'; i++) {
-    token += line[i];
+void start_shell_mode(miniasm_machine* machine) {
+  run_shell([machine](std::string const& line) { check(machine, miniasm_execute_line(machine, line.c_str())); });
+}
+
+/**
+ * @brief Loads a file on a machine and runs it
+ * @param verbose Prints the hits and misses of its cache once loaded, if it has one
+ */
+void read_from_file(miniasm_machine* machine, std::string const& filename, bool verbose) {
+  check(machine, miniasm_load_file(machine, filename.c_str()));
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  if (verbose && miniasm_cache_stats(machine, &hits, &misses) == MINIASM_OK) {
+    std::cerr << "Cache: " << hits << " hits, " << misses << " misses\n";
   }
-  return to_lower(token);
+  check(machine, miniasm_run(machine, 0, nullptr));
 }
 
-void read_from_file(std::string const& filename) {
-  std::ifstream file{filename};
-  if (!file) {
-    throw std::runtime_error{"Cannot open file " + filename};
+/**
+ * @brief Writes prefix.txt (report) and prefix.folded (flame graph input)
+ */
+void write_profile(Asm::Profiler const& profiler, std::string const& prefix) {
+  std::ofstream report{prefix + ".txt"};
+  profiler.report(report);
+  std::ofstream folded{prefix + ".folded"};
+  profiler.folded(folded);
+  if (!report || !folded) {
+    throw std::runtime_error{"Cannot write the profile " + prefix};
   }
-  std::string line;
-  std::vector<std::string> code;
-  // We need to use a vector because of JMP instructions
-  const std::regex jmp_token_regex{"[ \t]*[_a-zA-Z]*[_a-zA-Z0-9]+[ \t]*:"};
-  unsigned i{};
-  while (std::getline(file, line)) {
-    if (std::regex_match(line, jmp_token_regex)) {
-      auto token = extract_jmp_token(line);
-      // If token already exists
-      auto fun =  [=](auto const& tok) -> bool { return token == tok.first; };
-      if (std::find_if(jmp_tokens.begin(), jmp_tokens.end(), fun) != jmp_tokens.end()) {
-        throw std::runtime_error{"Multiple definitions of token " + token};
-      } else {
-        jmp_tokens.insert({token, i});
-      }
-      continue;
-    }
-    code.push_back(to_lower(line.substr(0, line.find(';'))));
-    i++;
+}
+
+/**
+ * @brief Loads a source file or a ROM image on a machine
+ * @param image Receives the program, and the rest of the image for ROM files
+ */
+void load_file(Machine& machine, Asm::Rom::Image& image, std::string const& filename) {
+  if (Asm::Rom::is_image(filename)) {
+    image = Asm::Rom::map(filename);
+    Asm::Rom::install(machine, image);
+  } else {
+    image.program = Asm::load_program(filename, machine.jmp_tokens);
+  }
+}
+
+/**
+ * @brief Runs a file, or the warm-start image of --load-image, under the profiler
+ */
+void profile(Options const& options) {
+  auto const machine = std::make_unique<Machine>(); // Too big for the stack
+  Asm::Rom::Image image;
+  if (options.load_image.empty() && options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to profile"};
+  }
+  load_file(*machine, image, options.load_image.empty() ? options.files.front() : options.load_image);
+  Asm::Profiler profiler{image.program, machine->jmp_tokens};
+  try {
+    profiler.run(*machine);
+  } catch (...) {
+    write_profile(profiler, options.profile);
+    throw;
+  }
+  write_profile(profiler, options.profile);
+}
+
+void assemble(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to assemble"};
+  }
+  std::vector<u8> ram;
+  if (!options.ram.empty()) {
+    std::ifstream file{options.ram, std::ios::binary};
+    if (!file) throw std::runtime_error{"Cannot open file " + options.ram};
+    ram.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+  }
+  Labels labels;
+  auto const program = Asm::load_program(options.files.front(), labels);
+  Asm::Rom::assemble(options.assemble, program, labels, ram);
+}
+
+void run_batch(Options const& options) {
+  auto const files = Asm::Batch::list_files(options.files);
+  auto const cache = open_cache(options);
+  for (auto const& result : Asm::Batch::run(files, options.engine, options.optimize, options.jobs, cache.get())) {
+    Asm::Batch::print(std::cout, result);
   }
-  while (registers::PC < code.size()) {
-    interpret(code[registers::PC++]);
+  report_cache(options, cache.get());
+}
+
+/**
+ * @brief Loads the file on a machine and runs it up to the snapshot label
+ * @param image Receives the program, and the rest of the image for ROM files
+ */
+Asm::Snapshot run_to_label(Machine& machine, Asm::Rom::Image& image, Options const& options) {
+  if (options.files.size() != 1 || options.snapshot.empty()) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file and --snapshot=label"};
+  }
+  load_file(machine, image, options.files.front());
+  auto const label = machine.jmp_tokens.find(options.snapshot);
+  if (label == machine.jmp_tokens.end()) {
+    throw std::runtime_error{"Unknown label " + options.snapshot};
+  }
+  return Asm::run_to(machine, image.program, static_cast<u16>(label->second));
+}
+
+/**
+ * @brief Runs a program up to a label once, then the rest of it once per variant
+ * @details Each line of the variants file sets registers and RAM bytes, ex:
+ * "a=5 *10=0x20". Every variant forks from the same snapshot, so the part
+ * before the label, and what it printed, are not repeated.
+ */
+void run_variants(Options const& options) {
+  std::ifstream file{options.variants};
+  if (!file) throw std::runtime_error{"Cannot open file " + options.variants};
+  std::vector<std::string> variants;
+  for (std::string line; std::getline(file, line);) {
+    if (line.find_first_not_of(" \t\r") != std::string::npos) variants.push_back(to_lower(line));
+  }
+
+  auto const machine = std::make_unique<Machine>();
+  Asm::Rom::Image image;
+  auto const snapshot = run_to_label(*machine, image, options);
+  for (auto const& result : Asm::Batch::run_variants(image.program, snapshot, variants, options.engine, options.optimize, options.jobs)) {
+    Asm::Batch::print(std::cout, result);
+  }
+}
+
+/**
+ * @brief Runs a file up to the snapshot label, then saves the machine as a
+ * warm-start image
+ */
+void save_image(Options const& options) {
+  auto const machine = std::make_unique<Machine>();
+  Asm::Rom::Image image;
+  auto const snapshot = run_to_label(*machine, image, options);
+  Asm::Rom::save(options.save_image, image.program, machine->jmp_tokens, snapshot);
+}
+
+/**
+ * @brief Runs a warm-start image from where it was saved, without the shell
+ */
+void load_image(Options const& options) {
+  if (!options.files.empty()) {
+    throw std::runtime_error{"Wrong number of arguments: --load-image runs the image alone"};
+  }
+  auto const machine = open_machine(options);
+  read_from_file(machine.get(), options.load_image, options.verbose);
+}
+
+/**
+ * @brief Prints a file translated to C++
+ */
+void emit_cpp(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to translate"};
+  }
+  auto const& filename = options.files.front();
+  if (Asm::Rom::is_image(filename)) {
+    Asm::emit_cpp(std::cout, Asm::Rom::map(filename).program, filename);
+    return;
+  }
+  Labels labels;
+  Asm::emit_cpp(std::cout, Asm::load_program(filename, labels), filename);
+}
+
+/**
+ * @brief Prints the problems the verifier finds in a file
+ * @returns True if the file is verified, its checks are then skipped when it runs
+ */
+bool verify(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to verify"};
+  }
+  auto const& filename = options.files.front();
+  Asm::Verification verification;
+  if (Asm::Rom::is_image(filename)) {
+    auto const image = Asm::Rom::map(filename);
+    verification = Asm::verify(image.program, &image.labels);
+  } else {
+    Labels labels;
+    auto const program = Asm::load_program(filename, labels);
+    verification = Asm::verify(program, &labels);
   }
+  for (auto const& problem : verification.problems) {
+    std::cout << filename << ": " << problem << "\n";
+  }
+  std::cout << filename << (verification.safe ? ": verified\n" : ": not verified\n");
+  return verification.safe;
+}
+
+/**
+ * @brief Runs copies of a file as green VMs until none is ready, then prints
+ * the scheduler statistics
+ * @details The VMs share the program and its initial RAM, PRINT output comes
+ * a slice at a time. -j sets the threads, --slice the instructions per round.
+ */
+void run_vms(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to run with --vms"};
+  }
+  auto const& filename = options.files.front();
+  auto const cache = open_cache(options);
+  Asm::Rom::Image image;
+  if (cache) image = cache->load(filename);
+  else if (Asm::Rom::is_image(filename)) image = Asm::Rom::map(filename);
+  else image.program = Asm::load_program(filename, image.labels);
+  report_cache(options, cache.get());
+  Asm::Interpreter::Executable const executable{image.program, options.engine, options.optimize};
+  Asm::Scheduler scheduler{options.jobs, options.slice, std::cout};
+  for (unsigned i = 0; i < options.vms; i++) {
+    if (image.state) scheduler.spawn(executable, *image.state);
+    else scheduler.spawn(executable, image.ram);
+  }
+  scheduler.run(~u64{0});
+
+  unsigned counts[4] = {};
+  std::string error;
+  for (std::size_t i = 0; i < scheduler.size(); i++) {
+    auto const state = scheduler.state(i);
+    counts[static_cast<unsigned>(state)]++;
+    if (state == Asm::Scheduler::State::failed && error.empty()) error = scheduler.error(i);
+  }
+  auto const stats = scheduler.stats();
+  std::cout << "vms=" << scheduler.size() << " ended=" << counts[static_cast<unsigned>(Asm::Scheduler::State::ended)]
+    << " blocked=" << counts[static_cast<unsigned>(Asm::Scheduler::State::blocked)]
+    << " failed=" << counts[static_cast<unsigned>(Asm::Scheduler::State::failed)]
+    << " rounds=" << stats.rounds << " slices=" << stats.slices << " steps=" << stats.instructions
+    << " fairness=" << stats.fairness << " latency_p50=" << stats.latency_p50 * 1e6 << "us"
+    << " latency_p99=" << stats.latency_p99 * 1e6 << "us bytes_per_vm=" << scheduler.footprint() / scheduler.size();
+  if (!error.empty()) std::cout << " error: " << error;
+  std::cout << "\n";
+}
+
+namespace {
+
+Asm::Serve::Server* serving = nullptr; //!< Stopped by SIGINT and SIGTERM
+
+void interrupt(int) {
+  if (serving) serving->stop();
+}
+
+} // namespace
+
+/**
+ * @brief Runs the daemon until SIGINT or SIGTERM
+ * @details -j sets the machines created up front, the engine options apply
+ * to every program. --budget=N caps the instructions of every request,
+ * Server::default_budget by default.
+ */
+void serve(Options const& options) {
+  if (!options.files.empty()) {
+    throw std::runtime_error{"Wrong number of arguments: --serve takes programs from its clients"};
+  }
+  Asm::Serve::Server server{options.serve, options.engine, options.optimize, options.jobs, options.budget};
+  serving = &server;
+  struct sigaction action{};
+  action.sa_handler = interrupt;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  try {
+    server.serve();
+  } catch (...) {
+    serving = nullptr;
+    throw;
+  }
+  serving = nullptr;
+  auto const stats = server.stats();
+  std::cout << "requests=" << stats.requests << " hits=" << stats.hits << " misses=" << stats.misses << "\n";
+}
+
+/**
+ * @brief Runs a file on the daemon listening on --connect, then prints what
+ * it printed and how it stopped
+ */
+void run_remote(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to send with --connect"};
+  }
+  auto const& filename = options.files.front();
+  std::ifstream file{filename, std::ios::binary};
+  if (!file) throw std::runtime_error{"Cannot open file " + filename};
+  Asm::Serve::Request request;
+  request.source.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+  request.budget = options.budget;
+  Asm::Serve::Client client{options.connect};
+  auto const response = client.run(request);
+  std::cout << response.output;
+  if (response.status == MINIASM_BUDGET) {
+    std::cout << "Budget of " << response.executed << " instructions ran out at PC " << response.registers.PC << "\n";
+  } else if (response.status != MINIASM_OK) {
+    throw std::runtime_error{response.error};
+  }
+}
+
+/**
+ * @brief Runs a file then the shell, as without options, recording both in
+ * the trace of --record
+ * @details The trace is complete once the shell exits, or once the file
+ * failed. With --record-changes, it lists what every block changed. -v
+ * prints what it holds.
+ */
+void record(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to record"};
+  }
+  auto const machine = std::make_unique<Machine>();
+  Asm::Rom::Image image;
+  load_file(*machine, image, options.files.front());
+  Asm::Trace::Recorder recorder{image.program, options.record, options.engine, options.optimize,
+    Asm::Trace::Recorder::default_interval, options.record_changes};
+  auto const report = [&] {
+    if (!options.verbose) return;
+    auto const stats = recorder.stats();
+    std::cerr << "Trace: " << stats.instructions << " instructions, " << stats.blocks << " blocks, "
+      << stats.inputs << " inputs, " << stats.checkpoints << " checkpoints, " << stats.bytes << " bytes\n";
+  };
+  try {
+    recorder.run(*machine);
+  } catch (...) {
+    recorder.close();
+    report();
+    throw;
+  }
+  run_shell([&](std::string const& line) { recorder.input(*machine, to_lower(line)); });
+  recorder.close();
+  report();
+}
+
+/**
+ * @brief Replays the trace of --replay over the file it was recorded from
+ * @details A whole replay prints again what the file and the shell lines
+ * printed, and fails with the error the file failed with, if it did. With --seek=N, the machine stops once N instructions ran, prints
+ * its registers and starts the shell there.
+ * @throw std::runtime_error If the replay diverges from the trace
+ */
+void replay(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file the trace was recorded from"};
+  }
+  auto const machine = std::make_unique<Machine>();
+  Asm::Rom::Image image;
+  load_file(*machine, image, options.files.front());
+  Asm::Trace::Replayer replayer{options.replay, image.program, options.engine, options.optimize};
+  if (options.seek == ~u64{0}) {
+    auto const ran = replayer.replay(*machine);
+    if (options.verbose) std::cerr << "Replay: " << ran << " of " << replayer.instructions() << " instructions\n";
+    return;
+  }
+  replayer.seek(*machine, options.seek);
+  std::cout << "Steps: " << machine->steps << "\n";
+  print_registers(std::cout, machine->registers);
+  run_shell([&](std::string const& line) { Asm::Interpreter::intepret_instruction(*machine, to_lower(line)); });
+}
+
+/**
+ * @brief Prints where the debugger stopped, and why
+ */
+void print_event(Asm::Debugger const& debugger, Machine const& machine, Asm::Debugger::Event const& event) {
+  switch (event.reason) {
+  case Asm::Debugger::Reason::ended:
+    std::cout << "Ended after " << machine.steps << " instructions\n";
+    return;
+  case Asm::Debugger::Reason::stepped:
+    break;
+  case Asm::Debugger::Reason::breakpoint:
+    std::cout << "Breakpoint, ";
+    break;
+  case Asm::Debugger::Reason::watchpoint:
+    std::cout << "Watchpoint " << to_upper(event.watch) << ": " << static_cast<unsigned>(event.before)
+      << " -> " << static_cast<unsigned>(event.after) << ", ";
+    break;
+  }
+  std::cout << "at " << debugger.line_of(event.pc) << "\n";
+}
+
+/**
+ * @brief Runs a file under the debugger shell
+ * @details The program waits on its first instruction. Besides
+ * instructions, the shell takes "break where", "delete where" (where is a
+ * line or a label), "watch what", "unwatch what" (what is a, x, y, p, s or
+ * an address), "step [count]", "continue" and "info".
+ */
+void debug(Options const& options) {
+  if (options.files.size() != 1) {
+    throw std::runtime_error{"Wrong number of arguments: expected the file to debug"};
+  }
+  auto const machine = std::make_unique<Machine>();
+  Asm::Rom::Image image;
+  load_file(*machine, image, options.files.front());
+  Asm::Debugger debugger{image.program, machine->jmp_tokens, options.engine, options.optimize};
+  run_shell([&](std::string const& typed) {
+    auto const line = to_lower(typed);
+    std::istringstream words{line};
+    std::string command, argument, extra;
+    words >> command >> argument >> extra;
+    if ((command == "break" || command == "b") && !argument.empty() && extra.empty()) {
+      auto const pc = debugger.locate(argument);
+      debugger.break_at(pc);
+      std::cout << "Breakpoint at " << debugger.line_of(pc) << "\n";
+    } else if ((command == "delete" || command == "d") && !argument.empty() && extra.empty()) {
+      debugger.clear(debugger.locate(argument));
+    } else if (command == "watch" && !argument.empty() && extra.empty()) {
+      debugger.watch(argument);
+    } else if (command == "unwatch" && !argument.empty() && extra.empty()) {
+      debugger.unwatch(argument);
+    } else if ((command == "step" || command == "s") && extra.empty()) {
+      print_event(debugger, *machine, debugger.step(*machine, argument.empty() ? 1 : parse_count(argument, "steps")));
+    } else if ((command == "continue" || command == "c") && argument.empty()) {
+      print_event(debugger, *machine, debugger.resume(*machine));
+    } else if (command == "info" && argument.empty()) {
+      for (auto const pc : debugger.breakpoints()) std::cout << "Breakpoint at " << debugger.line_of(pc) << "\n";
+      for (auto const& name : debugger.watchpoints()) std::cout << "Watching " << to_upper(name) << "\n";
+      std::cout << "At " << debugger.line_of(machine->registers.PC) << " after " << machine->steps << " instructions\n";
+    } else {
+      Asm::Interpreter::intepret_instruction(*machine, line);
+    }
+  });
 }
@@ -0,0 +1,112 @@
+#include "memory.h"
+
+#include <algorithm> // std::copy
+#include <utility>   // std::move, std::swap
+
+namespace {
+
+const uint8_t zero_page[Memory::page_size] = {};
+
+} // namespace
+
+/**
+ * @brief Creates a memory full of zeros which commits nothing
+ * @throw /
+ */
+Memory::Memory() noexcept {
+  view_.fill(zero_page);
+}
+
+/**
+ * @brief Copies the committed pages of other and shares the rest
+ * @throw std::bad_alloc If a page cannot be allocated
+ */
+Memory::Memory(Memory const& other) : view_(other.view_), base_(other.base_), owner_(other.owner_) {
+  for (std::size_t i = 0; i < pages; i++) {
+    if (other.owned_[i]) commit(i);
+  }
+}
+
+Memory& Memory::operator=(Memory const& other) {
+  if (this != &other) {
+    Memory copy{other};
+    std::swap(view_, copy.view_);
+    std::swap(owned_, copy.owned_);
+    std::swap(base_, copy.base_);
+    std::swap(owner_, copy.owner_);
+  }
+  return *this;
+}
+
+Memory::~Memory() {
+  release();
+}
+
+/**
+ * @brief Gives a page its own copy of what it read from
+ * @throw std::bad_alloc If the page cannot be allocated
+ */
+uint8_t* Memory::commit(std::size_t index) {
+  auto const page = new uint8_t[page_size];
+  std::copy(view_[index], view_[index] + page_size, page);
+  view_[index] = page;
+  owned_[index] = true;
+  return page;
+}
+
+void Memory::release() noexcept {
+  for (std::size_t i = 0; owned_.any() && i < pages; i++) {
+    if (owned_[i]) delete[] view_[i];
+  }
+  owned_.reset();
+}
+
+/**
+ * @brief Makes the memory read an image in place, from address 0
+ * @param owner Keeps data alive as long as a page reads from it
+ * @param data The image
+ * @param size Bytes of the image, at most capacity
+ * @details A last partial page is copied, since reading past the image is
+ * not allowed.
+ * @throw std::bad_alloc If the partial page cannot be allocated
+ */
+void Memory::map(std::shared_ptr<const void> owner, const uint8_t* data, std::size_t size) {
+  clear();
+  owner_ = std::move(owner);
+  auto const full = size / page_size;
+  for (std::size_t i = 0; i < full; i++) view_[i] = data + i * page_size;
+  auto const rest = size % page_size;
+  if (rest > 0) std::copy(data + full * page_size, data + size, page(full));
+}
+
+/**
+ * @brief Makes the memory read base, releasing the pages it wrote
+ * @param base The frozen memory to start from, null for zeros
+ * @details Resetting to the base already in use only reverts the pages
+ * written since, so its cost is proportional to them.
+ * @throw /
+ */
+void Memory::reset(std::shared_ptr<const Memory> base) noexcept {
+  if (base && base == base_) {
+    for (std::size_t i = 0; owned_.any() && i < pages; i++) {
+      if (!owned_[i]) continue;
+      delete[] view_[i];
+      view_[i] = base_->view_[i];
+      owned_[i] = false;
+    }
+    return;
+  }
+  release();
+  if (base) view_ = base->view_;
+  else view_.fill(zero_page);
+  base_ = std::move(base);
+  owner_.reset();
+}
+
+/**
+ * @brief Resets the memory to zeros
+ * @throw /
+ */
+void Memory::clear() noexcept {
+  reset(nullptr);
+}
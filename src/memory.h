@@ -0,0 +1,78 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include <array>   // std::array
+#include <bitset>  // std::bitset
+#include <cstddef> // std::size_t
+#include <cstdint> // uint8_t
+#include <memory>  // std::shared_ptr
+
+/**
+ * @brief Paged memory committed on first write
+ * @details Pages nobody wrote read from a shared zero page, or from a base
+ * memory set by reset(), which is frozen and may be shared by many machines
+ * (a ROM image, a snapshot). Writing to such a page first copies it into a
+ * page of its own, so a machine only pays for the pages it writes.
+ * Instructions name addresses 0 to 255, which all live in page 0: the
+ * engines take page(0) once and index it directly.
+ */
+class Memory {
+public:
+  static constexpr std::size_t page_size = 0x100;
+  static constexpr std::size_t capacity = 0xffff;
+  static constexpr std::size_t pages = (capacity + page_size - 1) / page_size;
+
+  Memory() noexcept;
+  Memory(Memory const& other);
+  Memory& operator=(Memory const& other);
+  ~Memory();
+
+  std::size_t size() const noexcept { return capacity; }
+
+  uint8_t read(std::size_t addr) const noexcept {
+    return view_[addr / page_size][addr % page_size];
+  }
+
+  /**
+   * @brief Returns a writable byte, committing its page
+   * @throw std::bad_alloc If the page cannot be allocated
+   */
+  uint8_t& write(std::size_t addr) {
+    return page(addr / page_size)[addr % page_size];
+  }
+
+  /**
+   * @brief Returns a writable page, committing it
+   * @throw std::bad_alloc If the page cannot be allocated
+   */
+  uint8_t* page(std::size_t index) {
+    return owned_[index] ? const_cast<uint8_t*>(view_[index]) : commit(index);
+  }
+
+  const uint8_t* page(std::size_t index) const noexcept {
+    return view_[index];
+  }
+
+  /**
+   * @brief Checks if a page was written since the memory was last reset
+   * @throw /
+   */
+  bool committed(std::size_t index) const noexcept {
+    return owned_[index];
+  }
+
+  void map(std::shared_ptr<const void> owner, const uint8_t* data, std::size_t size);
+  void reset(std::shared_ptr<const Memory> base) noexcept;
+  void clear() noexcept;
+
+private:
+  uint8_t* commit(std::size_t index);
+  void release() noexcept;
+
+  std::array<const uint8_t*, pages> view_; //!< Where each page is read from
+  std::bitset<pages> owned_;               //!< Pages allocated by this memory
+  std::shared_ptr<const Memory> base_;     //!< Memory the pages not owned come from, null for zeros
+  std::shared_ptr<const void> owner_;      //!< Keeps the bytes given to map() alive
+};
+
+#endif // __MEMORY_H__
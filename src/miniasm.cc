@@ -0,0 +1,409 @@
+#include "miniasm.h"
+#include "cache.h"
+#include "cpu.h"
+#include "errors.h"      // OutOfRangeException
+#include "infos.h"       // App::version
+#include "interpreter.h" // Executable, intepret_instruction
+#include "program.h"
+#include "rom.h"
+#include "snapshot.h"
+#include "strmanip.h"    // to_lower
+
+#include <fstream>   // std::ifstream
+#include <iostream>  // std::cout
+#include <memory>    // std::unique_ptr, std::make_unique
+#include <new>       // std::bad_alloc
+#include <ostream>   // std::ostream
+#include <sstream>   // std::istringstream
+#include <streambuf> // std::streambuf
+#include <string>    // std::string
+#include <utility>   // std::move
+
+/*
+ * C interface of the interpreter.
+ *
+ * A handle owns a machine and the program loaded on it, held by a ROM image
+ * (source programs only fill its program and labels) so that the prepared
+ * executable, which refers to it, stays valid until the next load. Exceptions never
+ * leave this file: guard() turns them into statuses and keeps their message.
+ */
+
+using Asm::Interpreter::Engine;
+
+static_assert(static_cast<int>(Engine::basic) == MINIASM_ENGINE_BASIC, "Engines must line up");
+static_assert(static_cast<int>(Engine::switched) == MINIASM_ENGINE_SWITCH, "Engines must line up");
+static_assert(static_cast<int>(Engine::threaded) == MINIASM_ENGINE_THREADED, "Engines must line up");
+static_assert(static_cast<int>(Engine::jit) == MINIASM_ENGINE_JIT, "Engines must line up");
+
+namespace {
+
+/**
+ * @brief Hands what PRINT writes to a callback, unbuffered
+ */
+class Callback : public std::streambuf {
+public:
+  Callback(miniasm_output output, void* user) noexcept : output_(output), user_(user) {}
+
+protected:
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    auto const ch = traits_type::to_char_type(c);
+    output_(user_, &ch, 1);
+    return c;
+  }
+
+  std::streamsize xsputn(const char* data, std::streamsize size) override {
+    output_(user_, data, static_cast<std::size_t>(size));
+    return size;
+  }
+
+private:
+  miniasm_output output_;
+  void* user_;
+};
+
+} // namespace
+
+struct miniasm_machine {
+  Machine machine;
+  std::unique_ptr<Asm::Rom::Image> image;                     //!< Loaded program, null before the first load
+  std::unique_ptr<Asm::Interpreter::Executable> executable;   //!< Prepared for engine, null before the first load
+  std::unique_ptr<Asm::Snapshot> start;                       //!< State right after the load, for miniasm_reset
+  Engine engine = Engine::threaded;
+  bool optimize = true;
+  std::unique_ptr<Callback> callback;                         //!< Set by miniasm_set_output, null for std::cout
+  std::unique_ptr<std::ostream> output;
+  std::unique_ptr<Asm::Cache> cache;                          //!< Set by miniasm_set_cache, null to decode every load
+  std::string error;                                          //!< Message of the last failing call
+};
+
+namespace {
+
+miniasm_status fail(miniasm_machine* machine, miniasm_status status, std::string const& message) noexcept {
+  try {
+    machine->error = message;
+  } catch (...) {
+    machine->error.clear();
+  }
+  return status;
+}
+
+/**
+ * @brief Runs body, turning what it throws into a status
+ * @param failure Status of the std::runtime_error it throws
+ */
+template <typename Body>
+miniasm_status guard(miniasm_machine* machine, miniasm_status failure, Body&& body) noexcept {
+  try {
+    return body();
+  } catch (Asm::Errors::OutOfRangeException const& e) {
+    return fail(machine, MINIASM_ERROR_STACK, e.what());
+  } catch (std::bad_alloc const&) {
+    return fail(machine, MINIASM_ERROR_MEMORY, "Out of memory");
+  } catch (std::exception const& e) {
+    return fail(machine, failure, e.what());
+  } catch (...) {
+    return fail(machine, failure, "Unknown error");
+  }
+}
+
+/**
+ * @brief Replaces the program of a machine, which starts over from the image
+ * @details The machine only changes once the executable is prepared, so it
+ * keeps its program if this throws.
+ */
+void install(miniasm_machine& handle, std::unique_ptr<Asm::Rom::Image> image) {
+  auto executable = std::make_unique<Asm::Interpreter::Executable>(image->program, handle.engine, handle.optimize);
+  auto& machine = handle.machine;
+  machine.registers = Registers{};
+  machine.stack = Stack<0xff>{};
+  machine.steps = 0;
+  machine.RAM.clear();
+  Asm::Rom::install(machine, *image);
+  handle.start = std::make_unique<Asm::Snapshot>(machine);
+  handle.executable = std::move(executable);
+  handle.image = std::move(image);
+}
+
+} // namespace
+
+/**
+ * @brief Returns the version of the library, as mini-asm prints it
+ * @throw /
+ */
+const char* miniasm_version(void) {
+  return App::version.c_str();
+}
+
+/**
+ * @brief Creates a machine without a program, printing to standard output
+ * @returns The machine, or null if it cannot be allocated
+ * @throw /
+ */
+miniasm_machine* miniasm_create(void) {
+  try {
+    return new miniasm_machine;
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+/**
+ * @brief Destroys a machine, null is ignored
+ * @throw /
+ */
+void miniasm_destroy(miniasm_machine* machine) {
+  delete machine;
+}
+
+/**
+ * @brief Returns the message of the last call which failed on a machine
+ * @returns The message, empty if no call failed, valid until the next call
+ * @throw /
+ */
+const char* miniasm_last_error(const miniasm_machine* machine) {
+  return machine ? machine->error.c_str() : "";
+}
+
+/**
+ * @brief Loads an ASM source, the machine starts over with it
+ * @param source The source, which does not have to be null-terminated
+ * @param size Its size in bytes
+ * @returns MINIASM_ERROR_LOAD if a label is defined twice or there are more
+ * than 65535 instructions. Invalid lines only fail when they run, as in files.
+ * @throw /
+ */
+miniasm_status miniasm_load_source(miniasm_machine* machine, const char* source, size_t size) {
+  if (!machine || (!source && size > 0)) return machine ? fail(machine, MINIASM_ERROR_ARGUMENT, "Null source") : MINIASM_ERROR_ARGUMENT;
+  return guard(machine, MINIASM_ERROR_LOAD, [&] {
+    std::istringstream input{std::string(source ? source : "", size)};
+    auto image = std::make_unique<Asm::Rom::Image>();
+    image->program = Asm::read_program(input, image->labels);
+    install(*machine, std::move(image));
+    return MINIASM_OK;
+  });
+}
+
+/**
+ * @brief Loads an ASM file or a ROM image, the machine starts over with it
+ * @details Images start with their initial RAM, warm-start images from the
+ * state they were saved in.
+ * @returns MINIASM_ERROR_IO if the file cannot be opened, MINIASM_ERROR_LOAD
+ * if it is not a valid image, a label is defined twice or there are more than
+ * 65535 instructions
+ * @throw /
+ */
+miniasm_status miniasm_load_file(miniasm_machine* machine, const char* path) {
+  if (!machine || !path) return machine ? fail(machine, MINIASM_ERROR_ARGUMENT, "Null path") : MINIASM_ERROR_ARGUMENT;
+  return guard(machine, MINIASM_ERROR_LOAD, [&] {
+    std::string const filename{path};
+    if (!std::ifstream{filename}) return fail(machine, MINIASM_ERROR_IO, "Cannot open file " + filename);
+    auto image = std::make_unique<Asm::Rom::Image>();
+    if (machine->cache) *image = machine->cache->load(filename);
+    else if (Asm::Rom::is_image(filename)) *image = Asm::Rom::map(filename);
+    else image->program = Asm::load_program(filename, image->labels);
+    install(*machine, std::move(image));
+    return MINIASM_OK;
+  });
+}
+
+/**
+ * @brief Picks the engine of the next runs, which does not change the results
+ * @param optimize Lets the switch and threaded engines use the peephole optimizer if not 0
+ * @throw /
+ */
+miniasm_status miniasm_set_engine(miniasm_machine* machine, miniasm_engine engine, int optimize) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  if (engine < MINIASM_ENGINE_BASIC || engine > MINIASM_ENGINE_JIT) {
+    return fail(machine, MINIASM_ERROR_ARGUMENT, "Unknown engine");
+  }
+  return guard(machine, MINIASM_ERROR_LOAD, [&] {
+    auto const chosen = static_cast<Engine>(engine);
+    if (machine->image) {
+      machine->executable = std::make_unique<Asm::Interpreter::Executable>(machine->image->program, chosen, optimize != 0);
+    }
+    machine->engine = chosen;
+    machine->optimize = optimize != 0;
+    return MINIASM_OK;
+  });
+}
+
+/**
+ * @brief Sends what PRINT writes to a callback instead of standard output
+ * @param output The callback, null to print to standard output again
+ * @param user Passed to every call of output
+ * @throw /
+ */
+miniasm_status miniasm_set_output(miniasm_machine* machine, miniasm_output output, void* user) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  return guard(machine, MINIASM_ERROR_MEMORY, [&] {
+    if (!output) {
+      machine->machine.output = &std::cout;
+      machine->output.reset();
+      machine->callback.reset();
+      return MINIASM_OK;
+    }
+    auto callback = std::make_unique<Callback>(output, user);
+    auto stream = std::make_unique<std::ostream>(callback.get());
+    machine->machine.output = stream.get();
+    machine->output = std::move(stream);
+    machine->callback = std::move(callback);
+    return MINIASM_OK;
+  });
+}
+
+/**
+ * @brief Keeps the programs miniasm_load_file decodes in a directory, shared
+ * with other machines and processes, so that loading the same source again
+ * maps its decoded image
+ * @param directory The directory, created if needed, null to stop caching
+ * @param capacity Bytes of images it keeps at most, the least recently used go first
+ * @returns MINIASM_ERROR_IO if the directory cannot be created
+ * @throw /
+ */
+miniasm_status miniasm_set_cache(miniasm_machine* machine, const char* directory, uint64_t capacity) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  return guard(machine, MINIASM_ERROR_IO, [&] {
+    machine->cache = directory ? std::make_unique<Asm::Cache>(directory, capacity) : nullptr;
+    return MINIASM_OK;
+  });
+}
+
+/**
+ * @brief Reads how many loads found their program in the cache, and how many decoded it
+ * @param hits, misses Receive the counts, may be null
+ * @returns MINIASM_ERROR_ARGUMENT if no cache is set
+ * @throw /
+ */
+miniasm_status miniasm_cache_stats(const miniasm_machine* machine, uint64_t* hits, uint64_t* misses) {
+  if (!machine || !machine->cache) return MINIASM_ERROR_ARGUMENT;
+  auto const stats = machine->cache->stats();
+  if (hits) *hits = stats.hits;
+  if (misses) *misses = stats.misses;
+  return MINIASM_OK;
+}
+
+/**
+ * @brief Puts the machine back in the state the last load left it in
+ * @details Registers, the stack, the step count and RAM are restored, RAM
+ * only reverting the pages written since.
+ * @throw /
+ */
+miniasm_status miniasm_reset(miniasm_machine* machine) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  if (!machine->start) return fail(machine, MINIASM_ERROR_NO_PROGRAM, "No program loaded");
+  machine->start->restore(machine->machine);
+  return MINIASM_OK;
+}
+
+/**
+ * @brief Runs the loaded program until it ends or budget instructions ran
+ * @param budget Instructions to run at most, exactly whatever the engine, 0 for no limit
+ * @param executed Receives the number of instructions run, ignored if null
+ * @returns MINIASM_OK if the program ended, MINIASM_BUDGET if it stopped on
+ * the budget: running again resumes it. A run which fails leaves PC after
+ * the faulty instruction, as the CLI does.
+ * @throw /
+ */
+miniasm_status miniasm_run(miniasm_machine* machine, uint64_t budget, uint64_t* executed) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  if (!machine->executable) return fail(machine, MINIASM_ERROR_NO_PROGRAM, "No program loaded");
+  auto const before = machine->machine.steps;
+  auto const status = guard(machine, MINIASM_ERROR_FAULT, [&] {
+    if (budget == 0) {
+      machine->executable->run(machine->machine);
+      return MINIASM_OK;
+    }
+    auto const stop = machine->executable->run(machine->machine, budget);
+    return (stop == Asm::Interpreter::Stop::ended) ? MINIASM_OK : MINIASM_BUDGET;
+  });
+  if (executed) *executed = machine->machine.steps - before;
+  return status;
+}
+
+/**
+ * @brief Executes one line as the shell does, an instruction or a command
+ * @param line The line (ex: "mov a, 42", "print registers"), in any case
+ * @throw /
+ */
+miniasm_status miniasm_execute_line(miniasm_machine* machine, const char* line) {
+  if (!machine || !line) return machine ? fail(machine, MINIASM_ERROR_ARGUMENT, "Null line") : MINIASM_ERROR_ARGUMENT;
+  return guard(machine, MINIASM_ERROR_FAULT, [&] {
+    Asm::Interpreter::intepret_instruction(machine->machine, to_lower(line));
+    return MINIASM_OK;
+  });
+}
+
+/**
+ * @brief Reads a register, P as PRINT REGISTERS shows it
+ * @throw /
+ */
+miniasm_status miniasm_get_register(const miniasm_machine* machine, miniasm_register reg, unsigned* value) {
+  if (!machine || !value) return MINIASM_ERROR_ARGUMENT;
+  auto const& registers = machine->machine.registers;
+  switch (reg) {
+  case MINIASM_A: *value = registers.A; break;
+  case MINIASM_X: *value = registers.X; break;
+  case MINIASM_Y: *value = registers.Y; break;
+  case MINIASM_P: *value = registers.P.value(); break;
+  case MINIASM_PC: *value = registers.PC; break;
+  case MINIASM_S: *value = registers.S; break;
+  default: return MINIASM_ERROR_ARGUMENT;
+  }
+  return MINIASM_OK;
+}
+
+/**
+ * @brief Writes a register
+ * @param value At most 0xff, 0xffff for PC, and the stack capacity for S.
+ * P takes a value P can hold: 0 or a single flag among equal, lower and
+ * greater, others would not read back.
+ * @throw /
+ */
+miniasm_status miniasm_set_register(miniasm_machine* machine, miniasm_register reg, unsigned value) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  auto const limit = (reg == MINIASM_PC) ? 0xffffu : (reg == MINIASM_S) ? decltype(Machine::stack)::capacity : 0xffu;
+  if (value > limit) return fail(machine, MINIASM_ERROR_ARGUMENT, "Register value out of range");
+  if (reg == MINIASM_P && !Status::holds(static_cast<u8>(value))) {
+    return fail(machine, MINIASM_ERROR_ARGUMENT, "P holds 0 or a single flag among equal, lower and greater");
+  }
+  auto& registers = machine->machine.registers;
+  switch (reg) {
+  case MINIASM_A: registers.A = static_cast<u8>(value); break;
+  case MINIASM_X: registers.X = static_cast<u8>(value); break;
+  case MINIASM_Y: registers.Y = static_cast<u8>(value); break;
+  case MINIASM_P: registers.P.assign(static_cast<u8>(value)); break;
+  case MINIASM_PC: registers.PC = static_cast<u16>(value); break;
+  case MINIASM_S: registers.S = static_cast<u8>(value); break;
+  default: return fail(machine, MINIASM_ERROR_ARGUMENT, "Unknown register");
+  }
+  return MINIASM_OK;
+}
+
+/**
+ * @brief Copies size bytes of RAM from address into data
+ * @throw /
+ */
+miniasm_status miniasm_read_ram(const miniasm_machine* machine, size_t address, uint8_t* data, size_t size) {
+  if (!machine || (!data && size > 0)) return MINIASM_ERROR_ARGUMENT;
+  auto const& ram = machine->machine.RAM;
+  if (address > ram.size() || size > ram.size() - address) return MINIASM_ERROR_ARGUMENT;
+  for (size_t i = 0; i < size; i++) data[i] = ram.read(address + i);
+  return MINIASM_OK;
+}
+
+/**
+ * @brief Copies size bytes of data into RAM from address
+ * @throw /
+ */
+miniasm_status miniasm_write_ram(miniasm_machine* machine, size_t address, const uint8_t* data, size_t size) {
+  if (!machine) return MINIASM_ERROR_ARGUMENT;
+  auto& ram = machine->machine.RAM;
+  if ((!data && size > 0) || address > ram.size() || size > ram.size() - address) {
+    return fail(machine, MINIASM_ERROR_ARGUMENT, "RAM range out of bounds");
+  }
+  return guard(machine, MINIASM_ERROR_MEMORY, [&] {
+    for (size_t i = 0; i < size; i++) ram.write(address + i) = data[i];
+    return MINIASM_OK;
+  });
+}
@@ -0,0 +1,85 @@
+#ifndef __MINIASM_H__
+#define __MINIASM_H__
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint8_t, uint64_t */
+
+/*
+ * C interface of libminiasm, for embedding the interpreter in other programs.
+ *
+ * Every call returns a status instead of throwing: MINIASM_OK, MINIASM_BUDGET
+ * when a run stopped on its budget, or a negative error whose message
+ * miniasm_last_error() returns until the next failing call (calls taking a
+ * const machine only return their status). A machine may be used by one
+ * thread at a time, distinct machines run concurrently.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct miniasm_machine miniasm_machine;
+
+typedef enum miniasm_status {
+  MINIASM_OK = 0,
+  MINIASM_BUDGET = 1,               /* The run stopped on its budget, run again to resume */
+  MINIASM_ERROR_ARGUMENT = -1,      /* Null pointer, unknown register or engine, value or address out of range */
+  MINIASM_ERROR_IO = -2,            /* File which cannot be opened or mapped */
+  MINIASM_ERROR_LOAD = -3,          /* Invalid image, label defined twice, more than 65535 instructions */
+  MINIASM_ERROR_FAULT = -4,         /* Faulty instruction executed */
+  MINIASM_ERROR_STACK = -5,         /* Stack overflow or underflow */
+  MINIASM_ERROR_MEMORY = -6,        /* Allocation failure */
+  MINIASM_ERROR_NO_PROGRAM = -7     /* Run before a program was loaded */
+} miniasm_status;
+
+typedef enum miniasm_register {
+  MINIASM_A,
+  MINIASM_X,
+  MINIASM_Y,
+  MINIASM_P,
+  MINIASM_PC,
+  MINIASM_S
+} miniasm_register;
+
+typedef enum miniasm_engine {
+  MINIASM_ENGINE_BASIC,
+  MINIASM_ENGINE_SWITCH,
+  MINIASM_ENGINE_THREADED,
+  MINIASM_ENGINE_JIT
+} miniasm_engine;
+
+/* Receives what PRINT writes, size bytes which are not null-terminated */
+typedef void (*miniasm_output)(void* user, const char* data, size_t size);
+
+const char* miniasm_version(void);
+
+miniasm_machine* miniasm_create(void);
+void miniasm_destroy(miniasm_machine* machine);
+const char* miniasm_last_error(const miniasm_machine* machine);
+
+miniasm_status miniasm_load_source(miniasm_machine* machine, const char* source, size_t size);
+miniasm_status miniasm_load_file(miniasm_machine* machine, const char* path);
+miniasm_status miniasm_set_engine(miniasm_machine* machine, miniasm_engine engine, int optimize);
+miniasm_status miniasm_set_output(miniasm_machine* machine, miniasm_output output, void* user);
+miniasm_status miniasm_set_cache(miniasm_machine* machine, const char* directory, uint64_t capacity);
+miniasm_status miniasm_cache_stats(const miniasm_machine* machine, uint64_t* hits, uint64_t* misses);
+miniasm_status miniasm_reset(miniasm_machine* machine);
+
+miniasm_status miniasm_run(miniasm_machine* machine, uint64_t budget, uint64_t* executed);
+miniasm_status miniasm_execute_line(miniasm_machine* machine, const char* line);
+
+miniasm_status miniasm_get_register(const miniasm_machine* machine, miniasm_register reg, unsigned* value);
+/*
+ * P only holds what CMP leaves: 0, or one of equal (2), lower (4) and greater
+ * (8). Any other value fails with MINIASM_ERROR_ARGUMENT, as it could not be
+ * read back.
+ */
+miniasm_status miniasm_set_register(miniasm_machine* machine, miniasm_register reg, unsigned value);
+miniasm_status miniasm_read_ram(const miniasm_machine* machine, size_t address, uint8_t* data, size_t size);
+miniasm_status miniasm_write_ram(miniasm_machine* machine, size_t address, const uint8_t* data, size_t size);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* __MINIASM_H__ */
@@ -0,0 +1,259 @@
+#include "optimizer.h"
+
+#include <algorithm> // std::min
+
+/*
+ * Peephole optimizer of the lowered code.
+ *
+ * Every instruction keeps its own lowered entry, so jumps and resumed PCs
+ * land where they used to. An optimized entry stands for itself and the
+ * entries following it, which it only skips when no jump lands between
+ * them. Superinstructions are only made from instructions which cannot
+ * fail, except push / pop which falls back to the generic push.
+ *
+ * Rewrites:
+ *   cmp + conditional jump          -> cmp_j* (compare-and-branch)
+ *   mov d, s + op d, imm            -> load_* (load-and-op)
+ *   mov d, imm + op d, imm ...      -> set_* d, folded value
+ *   shl d, imm + shl d, imm ...     -> shl_run_* (same for shr)
+ *   push s + pop d                  -> push_pop (d = s)
+ *   nop + nop ...                   -> skip
+ *   cmp overwritten by a later cmp  -> nop, when only writes of registers and
+ *                                      RAM run in between
+ */
+
+namespace {
+
+using Asm::Handler;
+using Asm::Lowered;
+using Asm::Program;
+
+constexpr unsigned family_size = 6;
+constexpr std::size_t max_skip = 0xffff;
+
+inline unsigned index(Handler handler) noexcept {
+  return static_cast<unsigned>(handler);
+}
+
+inline bool in_family(Handler handler, Handler first) noexcept {
+  return index(handler) >= index(first) && index(handler) < index(first) + family_size;
+}
+
+inline Handler member(Handler first, unsigned offset) noexcept {
+  return static_cast<Handler>(index(first) + offset);
+}
+
+inline bool has_imm_src(unsigned offset) noexcept {
+  return offset % 3 == 1;
+}
+
+/**
+ * @brief Families which write their dst and have no other effect
+ */
+const Handler writers[] = {
+  Handler::mov_reg_reg, Handler::add_reg_reg, Handler::sub_reg_reg, Handler::bit_or_reg_reg,
+  Handler::bit_and_reg_reg, Handler::bit_xor_reg_reg, Handler::shl_reg_reg, Handler::shr_reg_reg
+};
+
+/**
+ * @brief Finds the family of a writer
+ * @param family Receives the first handler of the family
+ * @returns False if handler is not a writer
+ */
+bool writer_family(Handler handler, Handler& family) noexcept {
+  for (auto const first : writers) {
+    if (in_family(handler, first)) {
+      family = first;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Applies a writer with an immediate src to a known dst
+ */
+u8 fold(Handler family, u8 value, u8 imm) noexcept {
+  switch (family) {
+  case Handler::mov_reg_reg: return imm;
+  case Handler::add_reg_reg: return static_cast<u8>(value + imm);
+  case Handler::sub_reg_reg: return static_cast<u8>(value - imm);
+  case Handler::bit_or_reg_reg: return value | imm;
+  case Handler::bit_and_reg_reg: return value & imm;
+  case Handler::bit_xor_reg_reg: return value ^ imm;
+  case Handler::shl_reg_reg: return (imm < 8) ? static_cast<u8>(value << imm) : 0;
+  case Handler::shr_reg_reg: return (imm < 8) ? static_cast<u8>(value >> imm) : 0;
+  default: return value;
+  }
+}
+
+class Peephole {
+public:
+  Peephole(Program const& program, std::vector<Lowered>& code) : code_(code), leader_(code.size(), false) {
+    for (auto const& inst : program.code) {
+      if (inst.op >= Asm::Opcode::jmp && inst.op <= Asm::Opcode::jge && inst.target < code.size()) {
+        leader_[inst.target] = true;
+      }
+    }
+  }
+
+  void run(bool resumable) {
+    if (!resumable) {
+      for (std::size_t i = 0; i < code_.size(); i++) drop_dead_compare(i);
+    }
+    for (std::size_t i = 0; i < code_.size(); i++) fuse(i);
+  }
+
+private:
+  /**
+   * @brief Checks if the entry at i may be skipped by the one before it
+   */
+  bool joins(std::size_t i) const noexcept {
+    return i < code_.size() && !leader_[i];
+  }
+
+  /**
+   * @brief Checks if two entries of the same family write the same dst
+   */
+  bool same_dst(Lowered const& a, unsigned a_offset, Lowered const& b, unsigned b_offset) const noexcept {
+    return a_offset / 3 == b_offset / 3 && a.dst == b.dst;
+  }
+
+  void drop_dead_compare(std::size_t i) {
+    if (!in_family(code_[i].handler, Handler::cmp_reg_reg)) return;
+    for (auto j = i + 1; j < code_.size(); j++) {
+      auto const handler = code_[j].handler;
+      Handler family;
+      if (in_family(handler, Handler::cmp_reg_reg)) {
+        code_[i] = {Handler::nop, 0, 0, 0};
+        return;
+      }
+      if (handler != Handler::nop && !writer_family(handler, family)) return;
+    }
+  }
+
+  void fuse(std::size_t i) {
+    auto& head = code_[i];
+    auto const next = i + 1;
+    Handler family;
+    if (head.handler == Handler::nop) {
+      auto end = next;
+      while (joins(end) && end - i <= max_skip && code_[end].handler == Handler::nop) end++;
+      if (end - i > 1) head = {Handler::skip, 0, 0, static_cast<u16>(end - i - 1)};
+    } else if (in_family(head.handler, Handler::cmp_reg_reg)) {
+      if (joins(next)) fuse_compare(head, code_[next]);
+    } else if (in_family(head.handler, Handler::mov_reg_reg)) {
+      auto const offset = index(head.handler) - index(Handler::mov_reg_reg);
+      if (has_imm_src(offset)) fold_constants(i, offset);
+      else if (joins(next)) fuse_load(head, offset, code_[next]);
+    } else if (writer_family(head.handler, family) && (family == Handler::shl_reg_reg || family == Handler::shr_reg_reg)) {
+      auto const offset = index(head.handler) - index(family);
+      if (has_imm_src(offset)) merge_shifts(i);
+    } else if (head.handler >= Handler::push_reg && head.handler <= Handler::push_addr) {
+      if (joins(next)) fuse_push_pop(head, code_[next]);
+    }
+  }
+
+  void fuse_compare(Lowered& head, Lowered const& jump) {
+    Handler fused;
+    switch (jump.handler) {
+    case Handler::je: fused = Handler::cmp_je_reg_reg; break;
+    case Handler::jne: fused = Handler::cmp_jne_reg_reg; break;
+    case Handler::jl: fused = Handler::cmp_jl_reg_reg; break;
+    case Handler::jle: fused = Handler::cmp_jle_reg_reg; break;
+    case Handler::jg: fused = Handler::cmp_jg_reg_reg; break;
+    case Handler::jge: fused = Handler::cmp_jge_reg_reg; break;
+    default: return;
+    }
+    head.handler = member(fused, index(head.handler) - index(Handler::cmp_reg_reg));
+    head.target = jump.target;
+  }
+
+  void fuse_load(Lowered& head, unsigned offset, Lowered const& op) {
+    Handler family;
+    if (!writer_family(op.handler, family)) return;
+    auto const op_offset = index(op.handler) - index(family);
+    if (!has_imm_src(op_offset) || !same_dst(head, offset, op, op_offset)) return;
+    Handler fused;
+    switch (family) {
+    case Handler::add_reg_reg: fused = Handler::load_add_reg_reg; break;
+    case Handler::sub_reg_reg: fused = Handler::load_sub_reg_reg; break;
+    case Handler::bit_or_reg_reg: fused = Handler::load_or_reg_reg; break;
+    case Handler::bit_and_reg_reg: fused = Handler::load_and_reg_reg; break;
+    case Handler::bit_xor_reg_reg: fused = Handler::load_xor_reg_reg; break;
+    default: return;
+    }
+    head.handler = member(fused, offset);
+    head.target = op.src;
+  }
+
+  void fold_constants(std::size_t i, unsigned offset) {
+    auto& head = code_[i];
+    auto value = head.src;
+    auto end = i + 1;
+    Handler family;
+    while (joins(end) && end - i <= max_skip && writer_family(code_[end].handler, family)) {
+      auto const& op = code_[end];
+      auto const op_offset = index(op.handler) - index(family);
+      if (!has_imm_src(op_offset) || !same_dst(head, offset, op, op_offset)) break;
+      value = fold(family, value, op.src);
+      end++;
+    }
+    if (end - i == 1) return;
+    head.handler = (offset < 3) ? Handler::set_reg : Handler::set_addr;
+    head.src = value;
+    head.target = static_cast<u16>(end - i - 1);
+  }
+
+  void merge_shifts(std::size_t i) {
+    auto& head = code_[i];
+    unsigned count = head.src;
+    auto end = i + 1;
+    while (joins(end) && end - i <= max_skip && code_[end].handler == head.handler && code_[end].dst == head.dst) {
+      count += code_[end].src;
+      end++;
+    }
+    if (end - i == 1) return;
+    auto const left = in_family(head.handler, Handler::shl_reg_reg);
+    auto const reg = (head.handler == Handler::shl_reg_imm || head.handler == Handler::shr_reg_imm);
+    head.handler = left ? (reg ? Handler::shl_run_reg : Handler::shl_run_addr) : (reg ? Handler::shr_run_reg : Handler::shr_run_addr);
+    head.src = static_cast<u8>(std::min(count, 8u)); // Shifting by 8 or more gives 0
+    head.target = static_cast<u16>(end - i - 1);
+  }
+
+  void fuse_push_pop(Lowered& head, Lowered const& pop) {
+    if (pop.handler != Handler::pop_reg && pop.handler != Handler::pop_addr) return;
+    auto const src_offset = index(head.handler) - index(Handler::push_reg);
+    auto const dst_offset = (pop.handler == Handler::pop_addr) ? 3u : 0u;
+    head.handler = member(Handler::push_pop_reg_reg, dst_offset + src_offset);
+    head.dst = pop.dst;
+  }
+
+  std::vector<Lowered>& code_;
+  std::vector<bool> leader_; //!< Entries which jumps land on
+};
+
+} // namespace
+
+/**
+ * @brief Lowers a program for the switched and threaded engines
+ * @param program The program
+ * @param optimize Makes superinstructions and removes redundant work if true,
+ * results are the same either way
+ * @param resumable Keeps the registers exact at every entry, for runs which
+ * may stop anywhere: the optimizer then only fuses, and a superinstruction
+ * runs whole or not at all
+ * @returns One entry per instruction
+ * @throw std::bad_alloc If the lowered code cannot be allocated
+ */
+std::vector<Asm::Lowered> Asm::lower(Program const& program, bool optimize, bool resumable) {
+  std::vector<Lowered> code;
+  code.reserve(program.code.size());
+  for (auto const& inst : program.code) {
+    code.push_back({handler_of(inst), inst.dst, inst.src, inst.target});
+  }
+  if (optimize) {
+    Peephole{program, code}.run(resumable);
+  }
+  return code;
+}
@@ -0,0 +1,15 @@
+#ifndef __OPTIMIZER_H__
+#define __OPTIMIZER_H__
+
+#include <vector> // std::vector
+
+#include "dispatch.h"
+#include "program.h"
+
+namespace Asm {
+
+std::vector<Lowered> lower(Program const& program, bool optimize, bool resumable = false);
+
+} // namespace Asm
+
+#endif // __OPTIMIZER_H__
@@ -0,0 +1,129 @@
+#include "pool.h"
+
+/**
+ * @brief Creates a pool and starts its threads
+ * @param workers Number of workers, 0 for one per core
+ * @throw std::system_error If a thread cannot be started
+ */
+Asm::WorkStealingPool::WorkStealingPool(unsigned workers) {
+  if (workers == 0) workers = std::thread::hardware_concurrency();
+  if (workers == 0) workers = 1;
+  for (unsigned i = 0; i < workers; i++) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  try {
+    for (unsigned i = 1; i < workers; i++) {
+      threads_.emplace_back(&WorkStealingPool::wait_for_runs, this, i);
+    }
+  } catch (...) {
+    stop();
+    throw;
+  }
+}
+
+/**
+ * @brief Stops the threads, which must not be running tasks
+ * @throw /
+ */
+Asm::WorkStealingPool::~WorkStealingPool() {
+  stop();
+}
+
+void Asm::WorkStealingPool::stop() noexcept {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  started_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+/**
+ * @brief Runs task(0) to task(count - 1) and waits for all of them
+ * @param count Number of tasks
+ * @param task The task, which must not throw
+ * @details Each worker starts with a contiguous range of indices.
+ * @throw std::bad_alloc If the indices cannot be queued
+ */
+void Asm::WorkStealingPool::run(std::size_t count, std::function<void(std::size_t)> const& task) {
+  run(count, [&](std::size_t t, unsigned) { task(t); });
+}
+
+/**
+ * @brief Same, also giving the task the index of the worker running it
+ * @details Tasks can so reuse per-worker state, such as a machine.
+ * @throw std::bad_alloc If the indices cannot be queued
+ */
+void Asm::WorkStealingPool::run(std::size_t count, std::function<void(std::size_t, unsigned)> const& task) {
+  auto const n = queues_.size();
+  for (std::size_t i = 0; i < n; i++) {
+    auto& queue = *queues_[i];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    for (auto t = count * i / n; t < count * (i + 1) / n; t++) queue.tasks.push_back(t);
+  }
+  if (!threads_.empty()) {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      task_ = &task;
+      busy_ = static_cast<unsigned>(threads_.size());
+      runs_++;
+    }
+    started_.notify_all();
+  }
+  std::size_t t;
+  while (next(0, t)) task(t, 0);
+  std::unique_lock<std::mutex> lock{mutex_};
+  finished_.wait(lock, [this] { return busy_ == 0; });
+  task_ = nullptr;
+}
+
+/**
+ * @brief Body of the threads: runs the tasks of every run until the pool stops
+ */
+void Asm::WorkStealingPool::wait_for_runs(unsigned worker) {
+  std::size_t seen = 0;
+  for (;;) {
+    Task const* task;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      started_.wait(lock, [&] { return stopping_ || runs_ != seen; });
+      if (stopping_) return;
+      seen = runs_;
+      task = task_;
+    }
+    std::size_t t;
+    while (next(worker, t)) (*task)(t, worker);
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (--busy_ == 0) finished_.notify_one();
+  }
+}
+
+/**
+ * @brief Takes the next task of a worker, stealing one if it has none left
+ * @returns False once every deque is empty
+ * @details No task is added during a run, so empty deques stay empty.
+ */
+bool Asm::WorkStealingPool::next(unsigned worker, std::size_t& task) {
+  auto const n = queues_.size();
+  {
+    auto& own = *queues_[worker];
+    std::lock_guard<std::mutex> lock{own.mutex};
+    if (!own.tasks.empty()) {
+      task = own.tasks.back();
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (std::size_t i = 1; i < n; i++) {
+    auto& victim = *queues_[(worker + i) % n];
+    std::lock_guard<std::mutex> lock{victim.mutex};
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
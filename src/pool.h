@@ -0,0 +1,61 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <condition_variable> // std::condition_variable
+#include <cstddef>            // std::size_t
+#include <deque>              // std::deque
+#include <functional>         // std::function
+#include <memory>             // std::unique_ptr
+#include <mutex>              // std::mutex
+#include <thread>             // std::thread
+#include <vector>             // std::vector
+
+namespace Asm {
+
+/**
+ * @brief Runs indexed tasks on a fixed number of threads
+ * @details Every worker owns a deque of task indices. It takes its own tasks
+ * from the back and, once it has none left, steals from the front of the
+ * other workers' deques, so long tasks on one worker do not leave the other
+ * cores idle. The calling thread is worker 0, the threads of the others
+ * start with the pool and wait between runs, so a run starts no thread.
+ */
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(unsigned workers);
+  ~WorkStealingPool();
+  WorkStealingPool(WorkStealingPool const&) = delete;
+  WorkStealingPool& operator=(WorkStealingPool const&) = delete;
+
+  unsigned workers() const noexcept {
+    return static_cast<unsigned>(queues_.size());
+  }
+  void run(std::size_t count, std::function<void(std::size_t)> const& task);
+  void run(std::size_t count, std::function<void(std::size_t, unsigned)> const& task);
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::size_t> tasks;
+  };
+
+  using Task = std::function<void(std::size_t, unsigned)>;
+
+  bool next(unsigned worker, std::size_t& task);
+  void wait_for_runs(unsigned worker);
+  void stop() noexcept;
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_; //!< Workers 1 to n - 1
+  std::mutex mutex_;
+  std::condition_variable started_;  //!< Wakes the workers when a run starts or the pool stops
+  std::condition_variable finished_; //!< Wakes run() when the last worker is done
+  Task const* task_ = nullptr;       //!< Task of the current run
+  std::size_t runs_ = 0;             //!< Runs started so far
+  unsigned busy_ = 0;                //!< Workers still in the current run
+  bool stopping_ = false;
+};
+
+} // namespace Asm
+
+#endif // __POOL_H__
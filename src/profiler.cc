@@ -0,0 +1,180 @@
+#include "profiler.h"
+#include "interpreter.h" // execute
+
+#include <algorithm> // std::sort, std::upper_bound
+#include <chrono>    // std::chrono::steady_clock
+#include <iomanip>   // std::setw
+#include <numeric>   // std::iota
+#include <utility>   // std::pair
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+inline bool is_conditional(Asm::Opcode op) noexcept {
+  return op >= Asm::Opcode::je && op <= Asm::Opcode::jge;
+}
+
+/**
+ * @brief Checks if a conditional jump is taken, as the interpreter decides
+ * @details Where PC ends up cannot tell, a jump may target the next
+ * instruction.
+ */
+bool is_taken(Asm::Opcode op, Status const& P) noexcept {
+  switch (op) {
+  case Asm::Opcode::je: return P.equal();
+  case Asm::Opcode::jne: return !P.equal();
+  case Asm::Opcode::jl: return P.lower();
+  case Asm::Opcode::jle: return P.lower() || P.equal();
+  case Asm::Opcode::jg: return P.greater();
+  case Asm::Opcode::jge: return P.greater() || P.equal();
+  default: return false;
+  }
+}
+
+double seconds_between(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double>(to - from).count();
+}
+
+} // namespace
+
+/**
+ * @brief Prepares the counters of a program
+ * @param program The program, which must outlive the profiler
+ * @param labels Its labels, which delimit the regions
+ * @throw /
+ */
+Asm::Profiler::Profiler(Program const& program, Labels const& labels)
+  : program_(program), region_of_(program.code.size()), executions_(program.code.size()), taken_(program.code.size()) {
+  regions_.push_back("(start)");
+  region_start_.push_back(0);
+  std::vector<std::pair<unsigned, std::string>> sorted;
+  for (auto const& label : labels) {
+    sorted.push_back({label.second, label.first});
+    label_pcs_.push_back(label.second);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  std::sort(label_pcs_.begin(), label_pcs_.end());
+  for (auto const& label : sorted) {
+    if (label.first == region_start_.back() && regions_.size() > 1) {
+      regions_.back() += "/" + label.second; // Several labels on one line
+    } else {
+      regions_.push_back(label.second);
+      region_start_.push_back(static_cast<u16>(label.first));
+    }
+  }
+  unsigned region = 0;
+  for (std::size_t pc = 0; pc < region_of_.size(); pc++) {
+    while (region + 1 < region_start_.size() && region_start_[region + 1] <= pc) region++;
+    region_of_[pc] = region;
+  }
+  seconds_.resize(regions_.size());
+}
+
+/**
+ * @brief Runs the program from the machine's PC, like Interpreter::run
+ * @param machine The machine we work with
+ * @details Counters keep what was measured before an error.
+ * @throw std::runtime_error If a faulty instruction is executed
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+void Asm::Profiler::run(Machine& machine) {
+  auto const size = program_.code.size();
+  auto pc = machine.registers.PC;
+  auto current = (pc < size) ? region_of_[pc] : 0;
+  auto const start = Clock::now();
+  auto since = start;
+  auto const stop = [&] {
+    auto const now = Clock::now();
+    seconds_[current] += seconds_between(since, now);
+    total_seconds_ += seconds_between(start, now);
+  };
+  try {
+    while (pc < size) {
+      // Reading the clock only when the region changes keeps tight loops cheap
+      if (region_of_[pc] != current) {
+        auto const now = Clock::now();
+        seconds_[current] += seconds_between(since, now);
+        since = now;
+        current = region_of_[pc];
+      }
+      auto const& inst = program_.code[pc];
+      executions_[pc]++;
+      machine.steps++;
+      machine.registers.PC = static_cast<u16>(pc + 1);
+      Interpreter::execute(machine, program_, inst);
+      if (is_conditional(inst.op) && is_taken(inst.op, machine.registers.P)) taken_[pc]++; // Jumps leave P as is
+      pc = machine.registers.PC;
+    }
+  } catch (...) {
+    stop();
+    throw;
+  }
+  stop();
+}
+
+/**
+ * @brief Returns "line: source" for an instruction
+ * @details Label lines are not decoded, so the line of an instruction is its
+ * PC plus the labels defined before it.
+ */
+std::string Asm::Profiler::line_of(std::size_t pc) const {
+  auto const labels = std::upper_bound(label_pcs_.begin(), label_pcs_.end(), pc) - label_pcs_.begin();
+  auto const line = std::to_string(pc + 1 + labels);
+  if (pc >= program_.source.size() || program_.source[pc].empty()) return line;
+  return line + ": " + program_.source[pc];
+}
+
+/**
+ * @brief Writes the hot lines, the conditional jumps and the time per region
+ * @throw /
+ */
+void Asm::Profiler::report(std::ostream& out) const {
+  u64 total = 0;
+  for (auto const count : executions_) total += count;
+  out << "Instructions: " << total << "\nTime: " << total_seconds_ << " s\n";
+
+  std::vector<std::size_t> pcs(executions_.size());
+  std::iota(pcs.begin(), pcs.end(), 0);
+  std::stable_sort(pcs.begin(), pcs.end(), [this](std::size_t a, std::size_t b) { return executions_[a] > executions_[b]; });
+  out << "\nLines by executions\n";
+  for (auto const pc : pcs) {
+    if (executions_[pc] == 0) break;
+    out << std::setw(12) << executions_[pc] << "  " << line_of(pc) << "\n";
+  }
+
+  out << "\nConditional jumps (taken / not taken)\n";
+  for (std::size_t pc = 0; pc < executions_.size(); pc++) {
+    if (!is_conditional(program_.code[pc].op) || executions_[pc] == 0) continue;
+    out << std::setw(12) << taken_[pc] << std::setw(12) << executions_[pc] - taken_[pc] << "  " << line_of(pc) << "\n";
+  }
+
+  std::vector<u64> instructions(regions_.size());
+  for (std::size_t pc = 0; pc < executions_.size(); pc++) {
+    instructions[region_of_[pc]] += executions_[pc];
+  }
+  std::vector<std::size_t> regions(regions_.size());
+  std::iota(regions.begin(), regions.end(), 0);
+  std::stable_sort(regions.begin(), regions.end(), [this](std::size_t a, std::size_t b) { return seconds_[a] > seconds_[b]; });
+  out << "\nLabels by time (seconds, %, instructions)\n";
+  for (auto const region : regions) {
+    if (instructions[region] == 0) continue;
+    auto const percent = (total_seconds_ > 0) ? 100 * seconds_[region] / total_seconds_ : 0;
+    out << std::setw(12) << seconds_[region] << std::setw(8) << std::fixed << std::setprecision(1) << percent
+      << std::defaultfloat << std::setprecision(6) << std::setw(12) << instructions[region] << "  " << regions_[region] << "\n";
+  }
+}
+
+/**
+ * @brief Writes the profile as folded stacks ("label;line count") for flame graph tools
+ * @details Counts are executions, so widths are proportional to instructions.
+ * @throw /
+ */
+void Asm::Profiler::folded(std::ostream& out) const {
+  for (std::size_t pc = 0; pc < executions_.size(); pc++) {
+    if (executions_[pc] == 0) continue;
+    auto frame = line_of(pc);
+    std::replace(frame.begin(), frame.end(), ';', ',');
+    out << regions_[region_of_[pc]] << ";" << frame << " " << executions_[pc] << "\n";
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <cstddef> // std::size_t
+#include <ostream> // std::ostream
+#include <string>  // std::string
+#include <vector>  // std::vector
+
+#include "cpu.h"
+#include "program.h"
+
+namespace Asm {
+
+/**
+ * @brief Runs a program while counting where it spends its time
+ * @details Label regions play the role of functions: a region starts at a
+ * label and ends at the next one. The normal engines are not instrumented,
+ * so profiling costs nothing unless it is used.
+ */
+class Profiler {
+public:
+  Profiler(Program const& program, Labels const& labels);
+
+  void run(Machine& machine);
+  void report(std::ostream& out) const;
+  void folded(std::ostream& out) const;
+
+private:
+  std::string line_of(std::size_t pc) const;
+
+  Program const& program_;
+  std::vector<std::string> regions_; //!< Label names by region, "(start)" before the first label
+  std::vector<u16> region_start_;    //!< First PC of each region
+  std::vector<unsigned> label_pcs_;  //!< PC of every label, sorted
+  std::vector<unsigned> region_of_;  //!< Region of each PC
+  std::vector<u64> executions_;      //!< Executions of each PC
+  std::vector<u64> taken_;           //!< Taken conditional jumps at each PC
+  std::vector<double> seconds_;      //!< Time spent in each region
+  double total_seconds_ = 0;
+};
+
+} // namespace Asm
+
+#endif // __PROFILER_H__
@@ -0,0 +1,466 @@
+#include "program.h"
+#include "pool.h"     // WorkStealingPool
+#include "rom.h"      // Rom::max_instructions
+#include "strmanip.h" // to_lower, to_upper, hash_bytes
+#include "syntax.h"   // parse_instruction, parse_command, parse_label
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+
+#include <algorithm>  // std::sort
+#include <cctype>     // std::isspace
+#include <cstring>    // std::memchr
+#include <exception>  // std::exception_ptr, std::current_exception, std::rethrow_exception
+#include <fstream>    // std::ifstream
+#include <istream>    // std::istream
+#include <stdexcept>  // std::runtime_error
+#include <thread>     // std::thread
+#include <utility>    // std::move
+
+namespace {
+
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+using Asm::Program;
+
+/**
+ * @brief An operand being decoded
+ */
+struct Operand {
+  OperandKind kind;
+  u8 value;
+  std::string fault; //!< Message thrown when kind is bad
+};
+
+using Asm::Syntax::Token;
+
+inline bool is_space(std::string const& str) noexcept {
+  for (auto c : str) {
+    if (!isspace(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool is_comment(std::string const& str) noexcept {
+  unsigned i{};
+  for (; i < str.size() && isspace(str[i]); i++);
+  return i < str.size() && str[i] == ';';
+}
+
+/**
+ * @brief Decodes a register name
+ * @details S, P and PC are not accessible from instructions
+ */
+Operand register_operand(Token const& name) {
+  switch (name.size == 1 ? name.begin[0] : '\0') {
+  case 'a': return {OperandKind::reg, 0, ""};
+  case 'x': return {OperandKind::reg, 1, ""};
+  case 'y': return {OperandKind::reg, 2, ""};
+  default: return {OperandKind::bad, 0, "Cannot access to register '" + to_upper(name.str()) + "'\n"};
+  }
+}
+
+/**
+ * @brief Decodes an operand which is read
+ */
+Operand read_operand(Token const& val) {
+  using namespace Asm::Syntax;
+  if (is_register_name(val)) return register_operand(val);
+  if (is_out_of_range(val)) return {OperandKind::bad, 0, "stoi"};
+  u8 value{};
+  if (parse_address(val, value)) return {OperandKind::addr, value, ""};
+  if (parse_number(val, value)) return {OperandKind::imm, value, ""};
+  return {OperandKind::bad, 0, "Invalid token '" + val.str() + "'"};
+}
+
+/**
+ * @brief Decodes an operand which is written
+ */
+Operand write_operand(Token const& param) {
+  using namespace Asm::Syntax;
+  if (is_register_name(param)) return register_operand(param);
+  if (is_out_of_range(param)) return {OperandKind::bad, 0, "stoi"};
+  u8 value{};
+  if (parse_address(param, value)) return {OperandKind::addr, value, ""};
+  return {OperandKind::bad, 0, "Invalid value " + param.str()};
+}
+
+u16 add_fault(Program& program, std::string const& message) {
+  program.faults.push_back(message);
+  return static_cast<u16>(program.faults.size() - 1);
+}
+
+Instruction make_fault(Program& program, std::string const& message) {
+  Instruction inst{};
+  inst.op = Opcode::fault;
+  inst.target = add_fault(program, message);
+  return inst;
+}
+
+/**
+ * @brief Stores both operands in inst
+ * @param first The operand evaluated first, whose error wins if both are bad
+ */
+void set_operands(Program& program, Instruction& inst, Operand const& dst, Operand const& src, Operand const& first) {
+  inst.dst_kind = dst.kind;
+  inst.dst = dst.value;
+  inst.src_kind = src.kind;
+  inst.src = src.value;
+  if (first.kind == OperandKind::bad) inst.target = add_fault(program, first.fault);
+  else if (dst.kind == OperandKind::bad) inst.target = add_fault(program, dst.fault);
+  else if (src.kind == OperandKind::bad) inst.target = add_fault(program, src.fault);
+}
+
+u16 jump_target(Token const& param, Labels const& labels) {
+  u8 idx{};
+  if (Asm::Syntax::parse_number(param, idx)) return idx;
+  auto const it = labels.find(param.str()); // Lines are lowered before decoding
+  return (it != labels.end()) ? static_cast<u16>(it->second) : 0;
+}
+
+Instruction decode_instruction(Program& program, std::string const& line, Labels const& labels) {
+  using namespace Asm::Syntax;
+  auto const instruction = line.substr(0, line.find(';'));
+  Parsed parsed;
+  if (!parse_instruction(instruction, parsed)) {
+    return make_fault(program, "Invalid instruction '" + instruction + "'\n");
+  }
+  Instruction inst{};
+  inst.op = parsed.op;
+  auto const& param1 = parsed.param1;
+  auto const& param2 = parsed.param2;
+  switch (inst.op) {
+  case Opcode::mov: {
+    u8 addr{};
+    if (!is_register_name(param1) && !parse_address(param1, addr) && !is_out_of_range(param1)) {
+      return make_fault(program, "Cannot execute MOV\n");
+    }
+    auto const src = read_operand(param2);
+    set_operands(program, inst, write_operand(param1), src, src);
+    break;
+  }
+  case Opcode::cmp: {
+    auto const dst = read_operand(param1);
+    set_operands(program, inst, dst, read_operand(param2), dst);
+    break;
+  }
+  case Opcode::push: {
+    auto const src = read_operand(param1);
+    set_operands(program, inst, {}, src, src);
+    break;
+  }
+  case Opcode::pop: {
+    auto const dst = write_operand(param1);
+    set_operands(program, inst, dst, {}, dst);
+    break;
+  }
+  case Opcode::jmp: case Opcode::je: case Opcode::jne: case Opcode::jl:
+  case Opcode::jle: case Opcode::jg: case Opcode::jge:
+    if (is_out_of_range(param1)) return make_fault(program, "stoi");
+    inst.target = jump_target(param1, labels);
+    break;
+  default: {
+    auto const src = read_operand(param2);
+    set_operands(program, inst, write_operand(param1), src, src);
+    break;
+  }
+  }
+  return inst;
+}
+
+Instruction decode_line(Program& program, std::string const& line, Labels const& labels) {
+  Asm::Syntax::Parsed parsed;
+  Instruction inst{};
+  if (is_space(line) || is_comment(line)) {
+    inst.op = Opcode::nop;
+  } else if (Asm::Syntax::parse_command(line, parsed)) {
+    inst.op = parsed.op;
+    if (parsed.params == 1) {
+      auto const src = read_operand(parsed.param1);
+      set_operands(program, inst, {}, src, src);
+    }
+  } else {
+    inst = decode_instruction(program, line, labels);
+  }
+  return inst;
+}
+
+/**
+ * @brief Whether target holds the index of a fault message
+ */
+bool has_fault(Instruction const& inst) noexcept {
+  return inst.op == Opcode::fault || inst.dst_kind == OperandKind::bad || inst.src_kind == OperandKind::bad;
+}
+
+/**
+ * @brief A label found in a chunk
+ */
+struct Label {
+  std::string name; //!< Lowered
+  unsigned line;    //!< Index of the next code line in the chunk
+  u64 hash;
+};
+
+/**
+ * @brief Whole lines of a source, read by one task of parse_program
+ */
+struct Chunk {
+  const char* begin;
+  const char* end;
+  std::vector<std::string> lines; //!< Lowered code lines, comments cut
+  std::vector<Label> labels;
+  Program program;                //!< The lines decoded, faults numbered from 0
+  std::exception_ptr error;
+};
+
+/**
+ * @brief Sorts the lines of a chunk into labels and code lines, as
+ * read_program does with the lines it gets
+ */
+void scan(Chunk& chunk) {
+  chunk.lines.reserve(static_cast<std::size_t>(chunk.end - chunk.begin) / 16);
+  for (auto line = chunk.begin; line < chunk.end;) {
+    auto const newline = static_cast<const char*>(std::memchr(line, '\n', static_cast<std::size_t>(chunk.end - line)));
+    auto const end = newline ? newline : chunk.end;
+    auto const size = static_cast<std::size_t>(end - line);
+    Asm::Syntax::Token name;
+    if (Asm::Syntax::parse_label(line, size, name)) {
+      auto lowered = to_lower(name.str());
+      auto const digest = hash_bytes(lowered.data(), lowered.size());
+      chunk.labels.push_back({std::move(lowered), static_cast<unsigned>(chunk.lines.size()), digest});
+    } else {
+      auto const comment = static_cast<const char*>(std::memchr(line, ';', size));
+      chunk.lines.emplace_back(line, comment ? comment : end);
+      for (auto& c : chunk.lines.back()) c = static_cast<char>(std::tolower(c)); // As to_lower, in place
+    }
+    line = end + 1;
+  }
+}
+
+void decode(Chunk& chunk, Labels const& labels) {
+  chunk.program.code.reserve(chunk.lines.size());
+  for (auto const& line : chunk.lines) {
+    chunk.program.code.push_back(decode_line(chunk.program, line, labels));
+  }
+}
+
+/**
+ * @brief Registers the labels of the chunks, in source order
+ * @param first Index of the first code line of each chunk
+ * @details Names go through an open-addressing table of hashes first, so
+ * finding a duplicate costs a probe, then into labels sorted, each insertion
+ * hinted at the end.
+ * @throw std::runtime_error On the first name defined twice, as read_program
+ */
+void merge_labels(std::vector<Chunk>& chunks, std::vector<unsigned> const& first, Labels& labels) {
+  std::vector<std::pair<Label*, unsigned>> all; // Label, index of its line in the program
+  for (std::size_t c = 0; c < chunks.size(); c++) {
+    for (auto& label : chunks[c].labels) all.push_back({&label, first[c] + label.line});
+  }
+  std::size_t capacity = 16;
+  while (capacity < 2 * all.size()) capacity *= 2;
+  std::vector<u32> table(capacity, 0); // Index in all + 1, 0 if empty
+  for (std::size_t i = 0; i < all.size(); i++) {
+    auto const& label = *all[i].first;
+    auto slot = label.hash & (capacity - 1);
+    for (; table[slot] != 0; slot = (slot + 1) & (capacity - 1)) {
+      auto const& other = *all[table[slot] - 1].first;
+      if (other.hash == label.hash && other.name == label.name) {
+        throw std::runtime_error{"Multiple definitions of token " + label.name};
+      }
+    }
+    if (!labels.empty() && labels.count(label.name) != 0) {
+      throw std::runtime_error{"Multiple definitions of token " + label.name};
+    }
+    table[slot] = static_cast<u32>(i + 1);
+  }
+  std::sort(all.begin(), all.end(), [](std::pair<Label*, unsigned> const& lhs, std::pair<Label*, unsigned> const& rhs) {
+    return lhs.first->name < rhs.first->name;
+  });
+  for (auto& label : all) {
+    labels.emplace_hint(labels.end(), std::move(label.first->name), label.second);
+  }
+}
+
+/**
+ * @brief Refuses programs with more instructions than PC can reach
+ * @throw std::runtime_error If there are too many
+ */
+void check_size(std::size_t instructions) {
+  if (instructions > Asm::Rom::max_instructions) {
+    throw std::runtime_error{"Too many instructions: " + std::to_string(instructions) + ", a program holds "
+      + std::to_string(Asm::Rom::max_instructions) + " at most"};
+  }
+}
+
+} // namespace
+
+/**
+ * @brief Decodes a lowered line and appends it to program
+ * @param program The program we append to
+ * @param line The line (instruction, command, comment or blank line)
+ * @param labels The labels of the program, which must all be registered
+ * before the lines which use them. Invalid lines are decoded as instructions
+ * raising the error the interpreter would have raised.
+ * @throw std::bad_alloc if the program cannot grow
+ */
+void Asm::append_line(Program& program, std::string const& line, Labels const& labels) {
+  program.code.push_back(decode_line(program, line, labels));
+  program.source.push_back(line);
+}
+
+/**
+ * @brief Reads and decodes an ASM source
+ * @param input The source
+ * @param labels Receives the labels defined by the source
+ * @returns The decoded program
+ * @throw std::runtime_error If a label is defined twice or there are more
+ * instructions than PC can reach
+ */
+Asm::Program Asm::read_program(std::istream& input, Labels& labels) {
+  std::string line;
+  std::vector<std::string> lines;
+  // Labels must all be known before decoding because of forward JMP instructions
+  unsigned i{};
+  while (std::getline(input, line)) {
+    Asm::Syntax::Token name;
+    if (Asm::Syntax::parse_label(line.data(), line.size(), name)) {
+      auto token = to_lower(name.str());
+      if (!labels.insert({token, i}).second) {
+        throw std::runtime_error{"Multiple definitions of token " + token};
+      }
+      continue;
+    }
+    lines.push_back(to_lower(line.substr(0, line.find(';'))));
+    i++;
+  }
+  check_size(lines.size());
+  Program program;
+  program.code.reserve(lines.size());
+  program.source.reserve(lines.size());
+  for (auto const& code_line : lines) {
+    append_line(program, code_line, labels);
+  }
+  return program;
+}
+
+/**
+ * @brief Reads and decodes an ASM file
+ * @param filename Path of the file
+ * @param labels Receives the labels defined by the file
+ * @param jobs Threads of parse_program, 0 for one per core
+ * @returns The decoded program
+ * @details Regular files are mapped and go through parse_program, anything
+ * else (a pipe, a directory) through read_program.
+ * @throw std::runtime_error If the file cannot be opened, a label is defined
+ * twice or there are more instructions than PC can reach
+ */
+Asm::Program Asm::load_program(std::string const& filename, Labels& labels, unsigned jobs) {
+  auto const fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error{"Cannot open file " + filename};
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(fd);
+    std::ifstream file{filename};
+    if (!file) {
+      throw std::runtime_error{"Cannot open file " + filename};
+    }
+    return read_program(file, labels);
+  }
+  auto const size = static_cast<std::size_t>(info.st_size);
+  auto const mem = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error{"Cannot map file " + filename};
+  }
+  try {
+    auto program = parse_program(static_cast<const char*>(mem), size, labels, jobs);
+    if (mem) munmap(mem, size);
+    return program;
+  } catch (...) {
+    if (mem) munmap(mem, size);
+    throw;
+  }
+}
+
+/**
+ * @brief Decodes an ASM source held in memory, on several threads
+ * @param data The source, size bytes
+ * @param labels Receives the labels defined by the source
+ * @param jobs Threads at most, 0 for one per core. Sources are cut in chunks
+ * of at least 64 KiB, so small ones are decoded on the calling thread.
+ * @returns The program read_program would decode, with the same labels and
+ * faults
+ * @details Chunks of whole lines are sorted into labels and code lines in
+ * parallel, then a merge numbers the code lines and registers the labels.
+ * Once every label is known, the chunks are decoded in parallel and
+ * concatenated, shifting the fault indices of the later ones.
+ * @throw std::runtime_error If a label is defined twice or there are more
+ * instructions than PC can reach
+ * @throw std::system_error If a thread cannot be started
+ */
+Asm::Program Asm::parse_program(const char* data, std::size_t size, Labels& labels, unsigned jobs) {
+  constexpr std::size_t min_chunk = 64 << 10;
+  if (jobs == 0) jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  auto const count = std::max<std::size_t>(std::min<std::size_t>(size / min_chunk, 4 * jobs), 1);
+  std::vector<Chunk> chunks(count);
+  auto const end = data + size;
+  auto begin = data;
+  for (std::size_t c = 0; c < count; c++) {
+    auto cut = (c + 1 == count) ? end : data + size * (c + 1) / count;
+    if (cut < begin) cut = begin;
+    if (cut != end) {
+      auto const newline = static_cast<const char*>(std::memchr(cut, '\n', static_cast<std::size_t>(end - cut)));
+      cut = newline ? newline + 1 : end;
+    }
+    chunks[c].begin = begin;
+    chunks[c].end = cut;
+    begin = cut;
+  }
+
+  WorkStealingPool pool{static_cast<unsigned>(std::min<std::size_t>(jobs, count))};
+  auto const run = [&](auto const& task) {
+    pool.run(count, [&](std::size_t c) {
+      try {
+        task(chunks[c]);
+      } catch (...) {
+        chunks[c].error = std::current_exception();
+      }
+    });
+    for (auto const& chunk : chunks) {
+      if (chunk.error) std::rethrow_exception(chunk.error);
+    }
+  };
+  run(scan);
+  std::vector<unsigned> first(count);
+  std::size_t lines = 0;
+  for (std::size_t c = 0; c < count; c++) {
+    first[c] = static_cast<unsigned>(lines);
+    lines += chunks[c].lines.size();
+  }
+  check_size(lines);
+  merge_labels(chunks, first, labels);
+  run([&](Chunk& chunk) { decode(chunk, labels); });
+
+  Program program;
+  program.code.reserve(lines);
+  program.source.reserve(lines);
+  for (auto& chunk : chunks) {
+    auto const offset = static_cast<u16>(program.faults.size());
+    for (auto inst : chunk.program.code) {
+      if (has_fault(inst)) inst.target = static_cast<u16>(inst.target + offset);
+      program.code.push_back(inst);
+    }
+    for (auto& line : chunk.lines) program.source.push_back(std::move(line));
+    for (auto& fault : chunk.program.faults) program.faults.push_back(std::move(fault));
+    chunk = Chunk{};
+  }
+  return program;
+}
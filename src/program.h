@@ -0,0 +1,107 @@
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+
+#include <cstddef> // std::size_t
+#include <istream> // std::istream
+#include <memory>  // std::shared_ptr
+#include <string>  // std::string
+#include <utility> // std::move
+#include <vector>  // std::vector
+
+#include "cpu.h"
+
+namespace Asm {
+
+/**
+ * @enum Opcode
+ * @brief Operation of a decoded instruction
+ */
+enum class Opcode : u8 {
+  nop,             //!< Blank or comment line
+  mov, add, sub, cmp, or_, and_, xor_,
+  push, pop,
+  jmp, je, jne, jl, jle, jg, jge,
+  shl, shr,
+  print,           //!< print (a|x|y|p|s|pc|*addr)
+  print_registers, //!< print registers
+  fault            //!< Invalid line, throws faults[target] when executed
+};
+
+/**
+ * @enum OperandKind
+ * @brief What an operand designates
+ */
+enum class OperandKind : u8 {
+  none, //!< No operand
+  reg,  //!< Register A, X or Y (value is 0, 1 or 2)
+  imm,  //!< Immediate value
+  addr, //!< RAM address
+  bad   //!< Operand which throws faults[target] when accessed
+};
+
+/**
+ * @brief A fixed-size decoded instruction
+ * @details Operands are stored the way the interpreter evaluates them: the
+ * written (or first compared) operand in dst, the read one in src. Jumps keep
+ * their resolved target in target, faulty instructions the index of their
+ * error message.
+ */
+struct Instruction {
+  Opcode op;
+  OperandKind dst_kind;
+  OperandKind src_kind;
+  u8 dst;
+  u8 src;
+  u16 target;
+};
+
+static_assert(sizeof(Instruction) == 8, "Instruction must stay compact");
+
+/**
+ * @brief Decoded instructions, either owned or read in place from a ROM image
+ * @details Mapped instructions are kept alive by the image they point into,
+ * they cannot be appended to.
+ */
+class Code {
+public:
+  Code() = default;
+  Code(std::shared_ptr<const void> image, const Instruction* data, std::size_t size) noexcept
+    : image_(std::move(image)), mapped_(data), mapped_size_(size) {}
+
+  const Instruction* data() const noexcept { return image_ ? mapped_ : owned_.data(); }
+  std::size_t size() const noexcept { return image_ ? mapped_size_ : owned_.size(); }
+  bool empty() const noexcept { return size() == 0; }
+  const Instruction* begin() const noexcept { return data(); }
+  const Instruction* end() const noexcept { return data() + size(); }
+  Instruction const& operator[](std::size_t i) const noexcept { return data()[i]; }
+  Instruction const& front() const noexcept { return data()[0]; }
+
+  void reserve(std::size_t size) { owned_.reserve(size); }
+  void push_back(Instruction const& inst) { owned_.push_back(inst); }
+
+private:
+  std::vector<Instruction> owned_;
+  std::shared_ptr<const void> image_; //!< Null unless mapped
+  const Instruction* mapped_ = nullptr;
+  std::size_t mapped_size_ = 0;
+};
+
+/**
+ * @brief A program decoded once at load time
+ * @details code[i] is the decoded form of source[i], so a PC indexes both.
+ * Programs read from a ROM image have no source.
+ */
+struct Program {
+  Code code;                       //!< @brief Decoded instructions
+  std::vector<std::string> source; //!< @brief Lowered source lines
+  std::vector<std::string> faults; //!< @brief Error messages raised at runtime
+};
+
+void append_line(Program& program, std::string const& line, Labels const& labels);
+Program read_program(std::istream& input, Labels& labels);
+Program parse_program(const char* data, std::size_t size, Labels& labels, unsigned jobs = 0);
+Program load_program(std::string const& filename, Labels& labels, unsigned jobs = 0);
+
+} // namespace Asm
+
+#endif // __PROGRAM_H__
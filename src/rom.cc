@@ -0,0 +1,325 @@
+#include "rom.h"
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+
+#include <cstring>    // std::memcpy, std::memcmp
+#include <fstream>    // std::ifstream, std::ofstream
+#include <memory>     // std::make_shared
+#include <stdexcept>  // std::runtime_error
+#include <string>     // std::to_string
+
+/*
+ * ROM image format, version 2. Numbers are little-endian, the image is only
+ * meant for the host which assembled it.
+ *
+ * Header (48 bytes):
+ *   char magic[4] = "MASM", u16 version, u16 header size,
+ *   u32 code offset, u32 code count,
+ *   u32 faults offset, u32 faults count,
+ *   u32 labels offset, u32 labels count,
+ *   u32 ram offset, u32 ram size,
+ *   u32 state offset, u32 state size (0 unless the image is a warm start)
+ * Sections:
+ *   code   : Instruction records exactly as in memory, 8-byte aligned
+ *   faults : for each message, u32 size then its characters
+ *   labels : for each label, u32 address, u32 size then its characters
+ *   state  : registers, steps and stack of the machine which saved the image
+ *   ram    : bytes copied to RAM from address 0 before running, aligned on
+ *            a RAM page
+ *
+ * The code section is executed in place and RAM pages are read in place
+ * until they are written: mapping the image is the only cost of loading it,
+ * besides reading the (usually few) messages and labels.
+ */
+
+namespace {
+
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+
+constexpr char signature[4] = {'M', 'A', 'S', 'M'};
+constexpr std::size_t ram_capacity = Memory::capacity;
+
+struct Header {
+  char magic[4];
+  u16 version;
+  u16 header_size;
+  u32 code_offset;
+  u32 code_count;
+  u32 faults_offset;
+  u32 faults_count;
+  u32 labels_offset;
+  u32 labels_count;
+  u32 ram_offset;
+  u32 ram_size;
+  u32 state_offset;
+  u32 state_size;
+};
+
+static_assert(sizeof(Header) == 48, "The ROM header must not be padded");
+
+/**
+ * @brief Machine state of a warm-start image
+ */
+struct State {
+  u8 A, X, Y, P, S;
+  u8 reserved;
+  u16 PC;
+  u64 steps;
+  u8 stack[decltype(Machine::stack)::capacity];
+  u8 padding;
+};
+
+static_assert(sizeof(State) == 272, "The ROM machine state must not be padded");
+
+void put_u32(std::vector<u8>& out, u32 value) {
+  u8 bytes[4];
+  std::memcpy(bytes, &value, 4);
+  out.insert(out.end(), bytes, bytes + 4);
+}
+
+void put_string(std::vector<u8>& out, std::string const& str) {
+  put_u32(out, static_cast<u32>(str.size()));
+  out.insert(out.end(), str.begin(), str.end());
+}
+
+/**
+ * @brief Reads the sections of a mapped image, checking they stay in it
+ */
+class Reader {
+public:
+  Reader(std::string const& filename, const u8* data, std::size_t size) noexcept
+    : filename_(filename), data_(data), size_(size) {}
+
+  [[noreturn]] void fail(std::string const& why) const {
+    throw std::runtime_error{"Invalid ROM image " + filename_ + ": " + why};
+  }
+
+  const u8* at(u32 offset, std::size_t bytes) const {
+    if (offset > size_ || bytes > size_ - offset) fail("truncated");
+    return data_ + offset;
+  }
+
+  u32 u32_at(u32& offset) const {
+    u32 value;
+    std::memcpy(&value, at(offset, 4), 4);
+    offset += 4;
+    return value;
+  }
+
+  std::string string_at(u32& offset) const {
+    auto const size = u32_at(offset);
+    auto const begin = reinterpret_cast<const char*>(at(offset, size));
+    offset += size;
+    return {begin, size};
+  }
+
+private:
+  std::string const& filename_;
+  const u8* data_;
+  std::size_t size_;
+};
+
+inline bool valid_operand(OperandKind kind, u8 value) noexcept {
+  return kind <= OperandKind::bad && (kind != OperandKind::reg || value <= 2);
+}
+
+/**
+ * @brief Checks an instruction cannot make the engines read out of bounds
+ */
+bool valid(Instruction const& inst, std::size_t faults) noexcept {
+  if (inst.op > Opcode::fault) return false;
+  if (!valid_operand(inst.dst_kind, inst.dst) || !valid_operand(inst.src_kind, inst.src)) return false;
+  auto const raises = inst.op == Opcode::fault || inst.dst_kind == OperandKind::bad || inst.src_kind == OperandKind::bad;
+  return !raises || inst.target < faults;
+}
+
+/**
+ * @brief Writes an image, with a machine state if state is not null
+ * @throw std::runtime_error If the image cannot be written
+ */
+void write_image(std::string const& filename, Asm::Program const& program, Labels const& labels, std::vector<u8> const& ram, const State* state) {
+  Header header{};
+  std::memcpy(header.magic, signature, sizeof(signature));
+  header.version = Asm::Rom::version;
+  header.header_size = sizeof(Header);
+  header.code_offset = sizeof(Header);
+  header.code_count = static_cast<u32>(program.code.size());
+
+  std::vector<u8> body;
+  auto const code = reinterpret_cast<const u8*>(program.code.data());
+  body.insert(body.end(), code, code + program.code.size() * sizeof(Instruction));
+  header.faults_offset = static_cast<u32>(sizeof(Header) + body.size());
+  header.faults_count = static_cast<u32>(program.faults.size());
+  for (auto const& fault : program.faults) put_string(body, fault);
+  header.labels_offset = static_cast<u32>(sizeof(Header) + body.size());
+  header.labels_count = static_cast<u32>(labels.size());
+  for (auto const& label : labels) {
+    put_u32(body, label.second);
+    put_string(body, label.first);
+  }
+  if (state) {
+    body.resize((body.size() + 7) / 8 * 8, 0); // Aligns steps
+    header.state_offset = static_cast<u32>(sizeof(Header) + body.size());
+    header.state_size = sizeof(State);
+    auto const bytes = reinterpret_cast<const u8*>(state);
+    body.insert(body.end(), bytes, bytes + sizeof(State));
+  }
+  auto const page = Memory::page_size;
+  body.resize((sizeof(Header) + body.size() + page - 1) / page * page - sizeof(Header), 0);
+  header.ram_offset = static_cast<u32>(sizeof(Header) + body.size());
+  header.ram_size = static_cast<u32>(ram.size());
+  body.insert(body.end(), ram.begin(), ram.end());
+
+  std::ofstream file{filename, std::ios::binary | std::ios::trunc};
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(body.data()), static_cast<std::streamsize>(body.size()));
+  if (!file) {
+    throw std::runtime_error{"Cannot write file " + filename};
+  }
+}
+
+} // namespace
+
+/**
+ * @brief Checks if a file is a ROM image
+ * @throw /
+ */
+bool Asm::Rom::is_image(std::string const& filename) {
+  std::ifstream file{filename, std::ios::binary};
+  char start[sizeof(signature)];
+  return file.read(start, sizeof(start)) && std::memcmp(start, signature, sizeof(signature)) == 0;
+}
+
+/**
+ * @brief Writes a decoded program to a ROM image
+ * @param filename Path of the image
+ * @param program The program
+ * @param labels Its labels, kept for the shell
+ * @param ram Initial RAM contents, may be empty
+ * @throw std::runtime_error If the image cannot be written or ram is bigger than RAM
+ */
+void Asm::Rom::assemble(std::string const& filename, Program const& program, Labels const& labels, std::vector<u8> const& ram) {
+  if (ram.size() > ram_capacity) {
+    throw std::runtime_error{"Initial RAM contents are bigger than RAM"};
+  }
+  write_image(filename, program, labels, ram, nullptr);
+}
+
+/**
+ * @brief Writes a warm-start image, which resumes where state was captured
+ * @param filename Path of the image
+ * @param program The program the state was captured in
+ * @param labels Its labels
+ * @param state The machine state, RAM included
+ * @details Trailing RAM pages which only hold zeros are not written.
+ * @throw std::runtime_error If the image cannot be written
+ */
+void Asm::Rom::save(std::string const& filename, Program const& program, Labels const& labels, Snapshot const& state) {
+  auto const& memory = state.ram();
+  std::size_t used = 0;
+  for (std::size_t addr = 0; addr < memory.size(); addr++) {
+    if (memory.read(addr) != 0) used = addr + 1;
+  }
+  std::vector<u8> ram(used);
+  for (std::size_t addr = 0; addr < used; addr++) ram[addr] = memory.read(addr);
+
+  auto const& registers = state.registers();
+  State saved{};
+  saved.A = registers.A;
+  saved.X = registers.X;
+  saved.Y = registers.Y;
+  saved.P = registers.P.value();
+  saved.S = registers.S;
+  saved.PC = registers.PC;
+  saved.steps = state.steps();
+  std::memcpy(saved.stack, state.stack().data(), sizeof(saved.stack));
+  write_image(filename, program, labels, ram, &saved);
+}
+
+/**
+ * @brief Maps a ROM image in memory
+ * @param filename Path of the image
+ * @returns The image, whose instructions are read in place
+ * @throw std::runtime_error If the file cannot be mapped or is not a valid image
+ */
+Asm::Rom::Image Asm::Rom::map(std::string const& filename) {
+  auto const fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error{"Cannot open file " + filename};
+  }
+  struct stat info;
+  auto const size = (fstat(fd, &info) == 0) ? static_cast<std::size_t>(info.st_size) : 0;
+  auto const mem = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error{"Cannot map file " + filename};
+  }
+  Image image;
+  image.mapping = std::shared_ptr<const void>{mem, [size](const void* p) { munmap(const_cast<void*>(p), size); }};
+
+  Reader const reader{filename, static_cast<const u8*>(mem), size};
+  Header header;
+  std::memcpy(&header, reader.at(0, sizeof(Header)), sizeof(Header));
+  if (std::memcmp(header.magic, signature, sizeof(signature)) != 0) reader.fail("bad magic number");
+  if (header.version != version) reader.fail("version " + std::to_string(header.version) + " is not supported");
+  if (header.header_size != sizeof(Header)) reader.fail("bad header size");
+  if (header.code_offset % sizeof(Instruction) != 0) reader.fail("misaligned code");
+  if (header.code_count > max_instructions) reader.fail("too many instructions");
+
+  auto offset = header.faults_offset;
+  for (u32 i = 0; i < header.faults_count; i++) {
+    image.program.faults.push_back(reader.string_at(offset));
+  }
+  offset = header.labels_offset;
+  for (u32 i = 0; i < header.labels_count; i++) {
+    auto const address = reader.u32_at(offset);
+    image.labels.insert({reader.string_at(offset), address});
+  }
+  if (header.ram_size > ram_capacity) reader.fail("initial RAM contents are bigger than RAM");
+  auto const ram = std::make_shared<Memory>();
+  ram->map(image.mapping, reader.at(header.ram_offset, header.ram_size), header.ram_size);
+  image.ram = ram;
+
+  if (header.state_size != 0) {
+    if (header.state_size != sizeof(State)) reader.fail("bad machine state size");
+    State state;
+    std::memcpy(&state, reader.at(header.state_offset, sizeof(State)), sizeof(State));
+    if (state.PC > header.code_count) reader.fail("PC out of the program");
+    Registers registers;
+    registers.A = state.A;
+    registers.X = state.X;
+    registers.Y = state.Y;
+    registers.P.assign(state.P);
+    registers.PC = state.PC;
+    registers.S = state.S;
+    Stack<decltype(Machine::stack)::capacity> stack;
+    std::memcpy(stack.data(), state.stack, sizeof(state.stack));
+    image.state = std::make_shared<const Snapshot>(registers, stack, state.steps, ram);
+  }
+
+  auto const code = reinterpret_cast<const Instruction*>(
+    reader.at(header.code_offset, std::size_t{header.code_count} * sizeof(Instruction)));
+  for (u32 i = 0; i < header.code_count; i++) {
+    if (!valid(code[i], image.program.faults.size())) reader.fail("bad instruction " + std::to_string(i));
+  }
+  image.program.code = Code{image.mapping, code, header.code_count};
+  return image;
+}
+
+/**
+ * @brief Prepares a machine to run an image: copies its labels and shares its
+ * initial RAM, which pages copy when they are first written
+ * @details A warm-start image also restores the registers, stack and steps it
+ * was saved with.
+ * @throw std::bad_alloc If the labels cannot be allocated
+ */
+void Asm::Rom::install(Machine& machine, Image const& image) {
+  machine.jmp_tokens = image.labels;
+  if (image.state) image.state->restore(machine);
+  else machine.RAM.reset(image.ram);
+}
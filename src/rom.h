@@ -0,0 +1,51 @@
+#ifndef __ROM_H__
+#define __ROM_H__
+
+#include <cstddef> // std::size_t
+#include <memory>  // std::shared_ptr
+#include <string>  // std::string
+#include <vector>  // std::vector
+
+#include "cpu.h"
+#include "program.h"
+#include "snapshot.h"
+
+namespace Asm {
+namespace Rom {
+
+/**
+ * @brief Version of the image format, to bump whenever Instruction, Opcode or
+ * OperandKind change
+ */
+constexpr u16 version = 2;
+
+/**
+ * @brief Instructions an image, or any program, holds at most: as many as PC
+ * can reach
+ */
+constexpr std::size_t max_instructions = 0xffff;
+
+/**
+ * @brief A ROM image mapped in memory
+ * @details program.code and ram point into the mapping, which lives as long as
+ * the image, a copy of program or a machine reading ram. Warm-start images
+ * also hold the state of the machine which saved them, ram included.
+ */
+struct Image {
+  Program program;                       //!< @brief Decoded instructions and error messages
+  Labels labels;                         //!< @brief Labels of the assembled file
+  std::shared_ptr<const Memory> ram;     //!< @brief Initial RAM contents, null for zeros
+  std::shared_ptr<const Snapshot> state; //!< @brief Machine state of a warm-start image, null otherwise
+  std::shared_ptr<const void> mapping;   //!< @brief Unmaps the file when released
+};
+
+bool is_image(std::string const& filename);
+void assemble(std::string const& filename, Program const& program, Labels const& labels, std::vector<u8> const& ram);
+void save(std::string const& filename, Program const& program, Labels const& labels, Snapshot const& state);
+Image map(std::string const& filename);
+void install(Machine& machine, Image const& image);
+
+} // namespace Asm::Rom
+} // namespace Asm
+
+#endif // __ROM_H__
@@ -0,0 +1,293 @@
+#include "scheduler.h"
+
+#include <algorithm> // std::copy, std::fill, std::find_if, std::max, std::min
+#include <chrono>    // std::chrono::steady_clock
+#include <cmath>     // std::ldexp
+#include <utility>   // std::move
+
+/*
+ * Cooperative scheduler of green VMs.
+ *
+ * A round collects the ready VMs, then the pool runs one slice of each. VMs
+ * only change state in their own slice, and the host only calls the
+ * scheduler between rounds, so nothing but the shared output is locked. A
+ * slice loads the VM into the machine of its worker: registers, stack and
+ * the pages it wrote, over the memory it started from. Afterwards, the pages
+ * the machine committed are the VM's pages, copied back.
+ */
+
+namespace {
+
+u64 now() noexcept {
+  auto const time = std::chrono::steady_clock::now().time_since_epoch();
+  return static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+}
+
+/**
+ * @brief Returns the latency bucket of a duration: 4 per power of two
+ */
+unsigned bucket_of(u64 ns) noexcept {
+  if (ns < 4) return static_cast<unsigned>(ns);
+  unsigned log = 63;
+  while (!(ns >> log)) log--;
+  return 4 * (log - 1) + static_cast<unsigned>((ns >> (log - 2)) & 3);
+}
+
+/**
+ * @brief Returns the upper bound of a latency bucket, in seconds
+ */
+double bucket_end(unsigned bucket) noexcept {
+  if (bucket < 4) return (bucket + 1) * 1e-9;
+  auto const log = bucket / 4 + 1;
+  return std::ldexp(4.0 + bucket % 4 + 1, static_cast<int>(log) - 2) * 1e-9;
+}
+
+} // namespace
+
+/**
+ * @brief Creates a scheduler without VMs
+ * @param threads Worker threads, 0 for one per core
+ * @param slice Instructions a VM runs at most per round
+ * @param output Where PRINT writes, a whole slice at once
+ * @details The worker threads start here and wait between rounds.
+ * @throw std::bad_alloc If the workers cannot be allocated
+ * @throw std::system_error If a thread cannot be started
+ */
+Asm::Scheduler::Scheduler(unsigned threads, u64 slice, std::ostream& output)
+  : pool_(threads), slice_(slice ? slice : 1), output_(output) {
+  for (unsigned i = 0; i < pool_.workers(); i++) {
+    auto worker = std::make_unique<Worker>();
+    worker->machine = std::make_unique<Machine>();
+    worker->machine->output = &worker->output;
+    workers_.push_back(std::move(worker));
+  }
+}
+
+/**
+ * @brief Adds a ready VM at the start of a program
+ * @param executable The program, which must outlive the scheduler. Its traps
+ * are where its VMs block.
+ * @param ram The memory it starts from, shared with other VMs, null for zeros
+ * @returns The index of the VM
+ * @throw std::bad_alloc If the VM cannot be allocated
+ */
+std::size_t Asm::Scheduler::spawn(Interpreter::Executable const& executable, std::shared_ptr<const Memory> ram) {
+  vms_.emplace_back();
+  auto& vm = vms_.back();
+  vm.executable = &executable;
+  vm.ram = std::move(ram);
+  vm.ready_since = now();
+  return vms_.size() - 1;
+}
+
+/**
+ * @brief Adds a ready VM where a snapshot was taken, a warm-start image for instance
+ * @throw std::bad_alloc If the VM cannot be allocated
+ */
+std::size_t Asm::Scheduler::spawn(Interpreter::Executable const& executable, Snapshot const& start) {
+  auto const index = spawn(executable, start.shared_ram());
+  auto& vm = vms_[index];
+  vm.registers = start.registers();
+  vm.stack = start.stack();
+  vm.steps = start.steps();
+  return index;
+}
+
+/**
+ * @brief Gives every ready VM one slice per round
+ * @param rounds Rounds to run at most, fewer once no VM is ready
+ * @throw std::bad_alloc If the round cannot be allocated
+ */
+void Asm::Scheduler::run(u64 rounds) {
+  for (u64 round = 0; round < rounds; round++) {
+    ready_.clear();
+    for (std::size_t i = 0; i < vms_.size(); i++) {
+      if (vms_[i].state == State::ready) ready_.push_back(i);
+    }
+    if (ready_.empty()) return;
+    pool_.run(ready_.size(), [this](std::size_t task, unsigned worker) {
+      slice(vms_[ready_[task]], *workers_[worker]);
+    });
+    rounds_++;
+  }
+}
+
+void Asm::Scheduler::slice(Vm& vm, Worker& worker) noexcept {
+  auto& machine = *worker.machine;
+  auto const start = now();
+  auto const waited = start - vm.ready_since;
+  try {
+    machine.registers = vm.registers;
+    machine.stack = vm.stack;
+    machine.steps = vm.steps;
+    machine.RAM.reset(vm.ram);
+    for (auto const& page : vm.pages) {
+      std::copy(page.bytes.get(), page.bytes.get() + Memory::page_size, machine.RAM.page(page.index));
+    }
+    try {
+      switch (vm.executable->run(machine, slice_)) {
+      case Interpreter::Stop::ended: vm.state = State::ended; break;
+      case Interpreter::Stop::budget: vm.state = State::ready; break;
+      case Interpreter::Stop::trap: vm.state = State::blocked; break;
+      }
+    } catch (std::exception const& e) {
+      vm.state = State::failed;
+      vm.error = std::make_unique<std::string>(e.what());
+    }
+    Memory const& ram = machine.RAM;
+    for (std::size_t i = 0; i < Memory::pages; i++) {
+      if (!ram.committed(i)) continue;
+      std::copy(ram.page(i), ram.page(i) + Memory::page_size, page_of(vm, i).bytes.get());
+    }
+  } catch (...) {
+    vm.state = State::failed;
+    vm.error.reset();
+  }
+  vm.registers = machine.registers;
+  vm.stack = machine.stack;
+  worker.instructions += machine.steps - vm.steps;
+  vm.executed += machine.steps - vm.steps;
+  vm.steps = machine.steps;
+  vm.slices++;
+  vm.waited += waited;
+  vm.waited_max = std::max(vm.waited_max, waited);
+  worker.slices++;
+  worker.latency[std::min(bucket_of(waited), buckets - 1)]++;
+  worker.latency_max = std::max(worker.latency_max, waited);
+  if (worker.output.tellp() > 0) {
+    try {
+      std::lock_guard<std::mutex> lock{output_mutex_};
+      output_ << worker.output.str();
+    } catch (...) {
+    }
+    worker.output.str({});
+  }
+  vm.ready_since = now();
+}
+
+/**
+ * @brief Returns the copy of a page a VM wrote, making it from the memory it
+ * started from if needed
+ */
+Asm::Scheduler::Page& Asm::Scheduler::page_of(Vm& vm, std::size_t index) {
+  auto const found = std::find_if(vm.pages.begin(), vm.pages.end(), [index](Page const& page) { return page.index == index; });
+  if (found != vm.pages.end()) return *found;
+  auto bytes = std::make_unique<u8[]>(Memory::page_size);
+  if (vm.ram) std::copy(vm.ram->page(index), vm.ram->page(index) + Memory::page_size, bytes.get());
+  vm.pages.push_back({static_cast<u16>(index), std::move(bytes)});
+  return vm.pages.back();
+}
+
+/**
+ * @brief Makes a blocked VM ready, its next slice starts with the
+ * instruction it stopped at
+ * @throw /
+ */
+void Asm::Scheduler::wake(std::size_t vm) {
+  if (vms_[vm].state != State::blocked) return;
+  vms_[vm].state = State::ready;
+  vms_[vm].ready_since = now();
+}
+
+/**
+ * @brief Writes a byte of the RAM of a VM, a mailbox for instance, and wakes it
+ * @throw std::bad_alloc If the page cannot be allocated
+ */
+void Asm::Scheduler::post(std::size_t vm, std::size_t address, u8 value) {
+  page_of(vms_[vm], address / Memory::page_size).bytes[address % Memory::page_size] = value;
+  wake(vm);
+}
+
+/**
+ * @brief Returns why a VM failed, empty if it did not or if that could not be kept
+ * @throw std::bad_alloc If the message cannot be copied
+ */
+std::string Asm::Scheduler::error(std::size_t vm) const {
+  return vms_[vm].error ? *vms_[vm].error : std::string{};
+}
+
+/**
+ * @brief Reads a byte of the RAM of a VM
+ * @throw /
+ */
+u8 Asm::Scheduler::read(std::size_t vm, std::size_t address) const noexcept {
+  auto const& state = vms_[vm];
+  auto const index = address / Memory::page_size;
+  for (auto const& page : state.pages) {
+    if (page.index == index) return page.bytes[address % Memory::page_size];
+  }
+  return state.ram ? state.ram->read(address) : 0;
+}
+
+/**
+ * @brief Returns what a VM got so far
+ * @throw /
+ */
+Asm::Scheduler::Usage Asm::Scheduler::usage(std::size_t vm) const noexcept {
+  auto const& state = vms_[vm];
+  Usage usage;
+  usage.instructions = state.executed;
+  usage.slices = state.slices;
+  usage.latency_mean = state.slices ? state.waited * 1e-9 / state.slices : 0;
+  usage.latency_max = state.waited_max * 1e-9;
+  return usage;
+}
+
+/**
+ * @brief Sums up the rounds run so far
+ * @throw /
+ */
+Asm::Scheduler::Stats Asm::Scheduler::stats() const noexcept {
+  Stats stats;
+  stats.rounds = rounds_;
+  std::array<u64, buckets> latency{};
+  u64 latency_max = 0;
+  for (auto const& worker : workers_) {
+    stats.slices += worker->slices;
+    stats.instructions += worker->instructions;
+    latency_max = std::max(latency_max, worker->latency_max);
+    for (unsigned i = 0; i < buckets; i++) latency[i] += worker->latency[i];
+  }
+  stats.latency_max = latency_max * 1e-9;
+  auto const percentile = [&](double rank) { // Spreads the slices of a bucket evenly over it
+    double seen = 0;
+    for (unsigned i = 0; i < buckets; i++) {
+      if (latency[i] == 0 || seen + latency[i] < rank) {
+        seen += latency[i];
+        continue;
+      }
+      auto const start = i ? bucket_end(i - 1) : 0.0;
+      auto const value = start + (bucket_end(i) - start) * (rank - seen) / latency[i];
+      return std::min(value, stats.latency_max);
+    }
+    return stats.latency_max;
+  };
+  if (stats.slices > 0) {
+    stats.latency_p50 = percentile(stats.slices * 0.5);
+    stats.latency_p99 = percentile(stats.slices * 0.99);
+  }
+  double sum = 0;
+  double squares = 0;
+  std::size_t alive = 0;
+  for (auto const& vm : vms_) {
+    if (vm.state != State::ready && vm.state != State::blocked) continue;
+    sum += static_cast<double>(vm.executed);
+    squares += static_cast<double>(vm.executed) * static_cast<double>(vm.executed);
+    alive++;
+  }
+  if (squares > 0) stats.fairness = sum * sum / (alive * squares);
+  return stats;
+}
+
+/**
+ * @brief Returns the bytes the VMs hold, pages and error messages included
+ * @throw /
+ */
+std::size_t Asm::Scheduler::footprint() const noexcept {
+  auto bytes = vms_.capacity() * sizeof(Vm);
+  for (auto const& vm : vms_) {
+    bytes += vm.pages.capacity() * (sizeof(Page) + Memory::page_size);
+    if (vm.error) bytes += sizeof(std::string) + vm.error->capacity();
+  }
+  return bytes;
+}
@@ -0,0 +1,138 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <array>   // std::array
+#include <cstddef> // std::size_t
+#include <memory>  // std::shared_ptr, std::unique_ptr
+#include <mutex>   // std::mutex
+#include <ostream> // std::ostream
+#include <sstream> // std::ostringstream
+#include <string>  // std::string
+#include <vector>  // std::vector
+
+#include "cpu.h"
+#include "interpreter.h"
+#include "pool.h"
+#include "snapshot.h"
+
+namespace Asm {
+
+/**
+ * @brief Runs many resumable machines, green VMs, in time slices over a few threads
+ * @details Every round gives one slice to each ready VM: slice instructions
+ * at most, fewer if it reaches a trap of its executable, which blocks it
+ * until wake() or post(). Each worker thread keeps one machine and loads a VM
+ * into it for its slice, so a parked VM only holds its registers, stack,
+ * step count and the RAM pages it wrote: a few hundred bytes, plus a page
+ * per page written.
+ */
+class Scheduler {
+public:
+  /**
+   * @enum State
+   * @brief What a VM waits for
+   */
+  enum class State : u8 {
+    ready,   //!< Its next slice
+    blocked, //!< wake() or post(), it stopped on a trap
+    ended,   //!< Nothing, PC left its program
+    failed   //!< Nothing, it raised error()
+  };
+
+  /**
+   * @brief What the VMs got since the scheduler was created
+   * @details Latency is the time a ready VM waits for its slice, from the
+   * end of its previous slice or from the moment it was spawned or woken.
+   */
+  struct Stats {
+    u64 rounds = 0;
+    u64 slices = 0;
+    u64 instructions = 0;
+    double fairness = 1;    //!< Jain's index of the instructions of the VMs not ended, 1 when all got as many
+    double latency_p50 = 0; //!< Seconds, interpolated within a bucket, at most latency_max
+    double latency_p99 = 0; //!< Seconds, interpolated within a bucket, at most latency_max
+    double latency_max = 0; //!< Seconds
+  };
+
+  /**
+   * @brief What one VM got
+   */
+  struct Usage {
+    u64 instructions = 0;
+    u64 slices = 0;
+    double latency_mean = 0; //!< Seconds
+    double latency_max = 0;  //!< Seconds
+  };
+
+  Scheduler(unsigned threads, u64 slice, std::ostream& output);
+
+  std::size_t spawn(Interpreter::Executable const& executable, std::shared_ptr<const Memory> ram = nullptr);
+  std::size_t spawn(Interpreter::Executable const& executable, Snapshot const& start);
+  void run(u64 rounds);
+  void wake(std::size_t vm);
+  void post(std::size_t vm, std::size_t address, u8 value);
+
+  std::size_t size() const noexcept { return vms_.size(); }
+  State state(std::size_t vm) const noexcept { return vms_[vm].state; }
+  Registers const& registers(std::size_t vm) const noexcept { return vms_[vm].registers; }
+  std::string error(std::size_t vm) const;
+  u8 read(std::size_t vm, std::size_t address) const noexcept;
+  Usage usage(std::size_t vm) const noexcept;
+  Stats stats() const noexcept;
+  std::size_t footprint() const noexcept;
+
+private:
+  static constexpr unsigned buckets = 256; //!< Of the latency histograms, 4 per power of two nanoseconds
+
+  struct Page {
+    u16 index;
+    std::unique_ptr<u8[]> bytes;
+  };
+
+  /**
+   * @brief A parked VM
+   */
+  struct Vm {
+    Interpreter::Executable const* executable = nullptr;
+    std::shared_ptr<const Memory> ram;  //!< Memory it started from, null for zeros
+    std::vector<Page> pages;            //!< Pages it wrote
+    std::unique_ptr<std::string> error; //!< Null unless it failed
+    u64 steps = 0;
+    u64 executed = 0;                   //!< Instructions run by the scheduler
+    u64 slices = 0;
+    u64 ready_since = 0;                //!< Nanoseconds, when it last became ready
+    u64 waited = 0;                     //!< Nanoseconds spent ready, in total
+    u64 waited_max = 0;
+    Registers registers;
+    State state = State::ready;
+    Stack<0xff> stack;
+  };
+
+  /**
+   * @brief The machine and counters of a worker thread
+   */
+  struct Worker {
+    std::unique_ptr<Machine> machine;
+    std::ostringstream output;
+    std::array<u64, buckets> latency{}; //!< Slices per latency bucket
+    u64 slices = 0;
+    u64 instructions = 0;
+    u64 latency_max = 0;
+  };
+
+  void slice(Vm& vm, Worker& worker) noexcept;
+  Page& page_of(Vm& vm, std::size_t index);
+
+  WorkStealingPool pool_;
+  u64 slice_;
+  std::ostream& output_;
+  std::mutex output_mutex_;
+  std::vector<Vm> vms_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::size_t> ready_; //!< VMs of the current round
+  u64 rounds_ = 0;
+};
+
+} // namespace Asm
+
+#endif // __SCHEDULER_H__
@@ -0,0 +1,595 @@
+#include "server.h"
+
+#include <sys/socket.h> // socket, bind, listen, accept, connect, recv, send, shutdown
+#include <sys/stat.h>   // stat
+#include <sys/un.h>     // sockaddr_un
+#include <unistd.h>     // close, unlink
+
+#include <algorithm>    // std::min, std::min_element
+#include <cerrno>       // errno
+#include <cstring>      // std::memcpy
+#include <new>          // std::bad_alloc
+#include <sstream>      // std::istringstream, std::ostringstream
+#include <stdexcept>    // std::runtime_error
+#include <system_error> // std::system_error
+#include <utility>      // std::move
+
+#include "errors.h"   // OutOfRangeException
+#include "strmanip.h" // hash_bytes
+
+/*
+ * Protocol of the server. Every message is a frame: u32 size of the body,
+ * then the body. Numbers are little-endian, client and server run on the
+ * same host. Registers take 8 bytes: u8 A, X, Y, P, S, 0, then u16 PC.
+ *
+ * Request body:
+ *   u64 budget, registers,
+ *   u32 source size, source,
+ *   u32 writes count, for each: u32 address, u32 size, bytes,
+ *   u32 reads count, for each: u32 address, u32 size
+ * Response body:
+ *   i8 status (miniasm_status), u8 cached, u16 0, u64 executed, registers,
+ *   u32 output size, output, u32 error size, error,
+ *   u32 RAM size, the bytes of the reads one after the other
+ *
+ * A connection sends requests and reads their responses in order. A frame
+ * the server cannot read, P included if it is not 0 or a single flag among
+ * equal, lower and greater, gets a MINIASM_ERROR_ARGUMENT response, a frame
+ * bigger than max_frame closes the connection. A request runs the server's
+ * budget at most, a budget of 0 asks for all of it.
+ */
+
+namespace {
+
+using Asm::Serve::Request;
+using Asm::Serve::Response;
+
+constexpr std::size_t max_frame = 64 << 20;
+
+template <typename T>
+void put(std::vector<u8>& out, T value) {
+  u8 bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void put_bytes(std::vector<u8>& out, const void* data, std::size_t size) {
+  put(out, static_cast<u32>(size));
+  auto const begin = static_cast<const u8*>(data);
+  out.insert(out.end(), begin, begin + size);
+}
+
+void put_registers(std::vector<u8>& out, Registers const& registers) {
+  u8 const bytes[6] = {registers.A, registers.X, registers.Y, registers.P.value(), registers.S, 0};
+  out.insert(out.end(), bytes, bytes + 6);
+  put(out, registers.PC);
+}
+
+/**
+ * @brief Starts a frame, finish() writes its size once the body is in
+ */
+void start(std::vector<u8>& frame) {
+  frame.clear();
+  put(frame, u32{0});
+}
+
+void finish(std::vector<u8>& frame) {
+  auto const size = static_cast<u32>(frame.size() - 4);
+  std::memcpy(frame.data(), &size, 4);
+}
+
+/**
+ * @brief Reads the body of a frame, checking it stays in it
+ */
+class Reader {
+public:
+  explicit Reader(std::vector<u8> const& body) noexcept : body_(body) {}
+
+  const u8* take(std::size_t bytes) {
+    if (bytes > body_.size() - offset_) throw std::runtime_error{"Invalid frame: truncated"};
+    auto const data = body_.data() + offset_;
+    offset_ += bytes;
+    return data;
+  }
+
+  template <typename T>
+  T get() {
+    T value;
+    std::memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  std::string string() {
+    auto const size = get<u32>();
+    auto const data = reinterpret_cast<const char*>(take(size));
+    return {data, size};
+  }
+
+  std::vector<u8> bytes() {
+    auto const size = get<u32>();
+    auto const data = take(size);
+    return {data, data + size};
+  }
+
+  Registers registers() {
+    auto const bytes = take(6);
+    Registers registers;
+    registers.A = bytes[0];
+    registers.X = bytes[1];
+    registers.Y = bytes[2];
+    if (!Status::holds(bytes[3])) {
+      throw std::runtime_error{"Invalid frame: P holds 0 or a single flag among equal, lower and greater"};
+    }
+    registers.P.assign(bytes[3]);
+    registers.S = bytes[4];
+    registers.PC = get<u16>();
+    return registers;
+  }
+
+  /**
+   * @brief Reads a count of records of at least record bytes each, so that
+   * a forged count cannot reserve more than the frame holds
+   */
+  std::size_t count(std::size_t record) {
+    auto const count = get<u32>();
+    if (count > (body_.size() - offset_) / record) throw std::runtime_error{"Invalid frame: truncated"};
+    return count;
+  }
+
+  void end() const {
+    if (offset_ != body_.size()) throw std::runtime_error{"Invalid frame: trailing bytes"};
+  }
+
+private:
+  std::vector<u8> const& body_;
+  std::size_t offset_ = 0;
+};
+
+[[noreturn]] void fail(std::string const& what) {
+  throw std::system_error{errno, std::generic_category(), what};
+}
+
+/**
+ * @brief Reads exactly size bytes
+ * @returns False if the peer closed the connection before the first byte
+ */
+bool receive(int fd, void* data, std::size_t size) {
+  auto bytes = static_cast<char*>(data);
+  std::size_t done = 0;
+  while (done < size) {
+    auto const n = recv(fd, bytes + done, size - done, 0);
+    if (n == 0) {
+      if (done == 0) return false;
+      throw std::runtime_error{"Connection closed in the middle of a frame"};
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fail("Cannot read from the socket");
+    }
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+/**
+ * @brief Reads the body of the next frame
+ * @returns False if the peer closed the connection between two frames
+ */
+bool receive(int fd, std::vector<u8>& body) {
+  u32 size;
+  if (!receive(fd, &size, 4)) return false;
+  if (size > max_frame) throw std::runtime_error{"Frame too big"};
+  body.resize(size);
+  if (size > 0 && !receive(fd, body.data(), size)) throw std::runtime_error{"Connection closed in the middle of a frame"};
+  return true;
+}
+
+void send_all(int fd, std::vector<u8> const& frame) {
+  std::size_t done = 0;
+  while (done < frame.size()) {
+    auto const n = send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fail("Cannot write to the socket");
+    }
+    done += static_cast<std::size_t>(n);
+  }
+}
+
+sockaddr_un address_of(std::string const& path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error{"Invalid socket path " + path};
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+} // namespace
+
+/**
+ * @brief Writes a request frame, its size included
+ * @param frame Receives the frame, its capacity is reused
+ * @throw std::bad_alloc If the frame cannot grow
+ */
+void Asm::Serve::encode(Request const& request, std::vector<u8>& frame) {
+  start(frame);
+  put(frame, request.budget);
+  put_registers(frame, request.registers);
+  put_bytes(frame, request.source.data(), request.source.size());
+  put(frame, static_cast<u32>(request.writes.size()));
+  for (auto const& write : request.writes) {
+    put(frame, write.address);
+    put_bytes(frame, write.bytes.data(), write.bytes.size());
+  }
+  put(frame, static_cast<u32>(request.reads.size()));
+  for (auto const& read : request.reads) {
+    put(frame, read.address);
+    put(frame, read.size);
+  }
+  finish(frame);
+}
+
+/**
+ * @brief Writes a response frame, its size included
+ * @throw std::bad_alloc If the frame cannot grow
+ */
+void Asm::Serve::encode(Response const& response, std::vector<u8>& frame) {
+  start(frame);
+  put(frame, static_cast<int8_t>(response.status));
+  put(frame, static_cast<u8>(response.cached));
+  put(frame, u16{0});
+  put(frame, response.executed);
+  put_registers(frame, response.registers);
+  put_bytes(frame, response.output.data(), response.output.size());
+  put_bytes(frame, response.error.data(), response.error.size());
+  put_bytes(frame, response.ram.data(), response.ram.size());
+  finish(frame);
+}
+
+/**
+ * @brief Reads the body of a request frame
+ * @throw std::runtime_error If the body is truncated or too long
+ */
+Request Asm::Serve::decode_request(std::vector<u8> const& body) {
+  Reader reader{body};
+  Request request;
+  request.budget = reader.get<u64>();
+  request.registers = reader.registers();
+  request.source = reader.string();
+  request.writes.resize(reader.count(8));
+  for (auto& write : request.writes) {
+    write.address = reader.get<u32>();
+    write.bytes = reader.bytes();
+  }
+  request.reads.resize(reader.count(8));
+  for (auto& read : request.reads) {
+    read.address = reader.get<u32>();
+    read.size = reader.get<u32>();
+  }
+  reader.end();
+  return request;
+}
+
+/**
+ * @brief Reads the body of a response frame
+ * @throw std::runtime_error If the body is truncated or too long
+ */
+Response Asm::Serve::decode_response(std::vector<u8> const& body) {
+  Reader reader{body};
+  Response response;
+  response.status = static_cast<miniasm_status>(reader.get<int8_t>());
+  response.cached = reader.get<u8>() != 0;
+  reader.get<u16>();
+  response.executed = reader.get<u64>();
+  response.registers = reader.registers();
+  response.output = reader.string();
+  response.error = reader.string();
+  response.ram = reader.bytes();
+  reader.end();
+  return response;
+}
+
+Asm::Serve::Server::Entry::Entry(std::string const& text, Interpreter::Engine engine, bool optimize)
+  : source(text), program([&] {
+      std::istringstream input{text};
+      return read_program(input, labels);
+    }()), executable(program, engine, optimize) {}
+
+/**
+ * @brief Listens on a Unix socket, replacing a stale socket file
+ * @param machines Machines created up front, 0 for one per core. More are
+ * created when more requests run at once.
+ * @param budget Instructions a request runs at most, whatever it asks for,
+ * so that no loop holds a connection forever. 0 for default_budget.
+ * @throw std::runtime_error If the path is too long or is not a socket
+ * @throw std::system_error If the socket cannot be bound
+ */
+Asm::Serve::Server::Server(std::string const& path, Interpreter::Engine engine, bool optimize, unsigned machines,
+  u64 budget)
+  : path_(path), engine_(engine), optimize_(optimize), budget_(budget > 0 ? budget : default_budget) {
+  auto const address = address_of(path);
+  struct stat status;
+  if (stat(path.c_str(), &status) == 0) {
+    if (!S_ISSOCK(status.st_mode)) throw std::runtime_error{"Not a socket: " + path};
+    unlink(path.c_str());
+  }
+  listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener_ < 0) fail("Cannot create a socket");
+  if (bind(listener_, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0 || listen(listener_, 128) != 0) {
+    auto const error = errno;
+    close(listener_);
+    errno = error;
+    fail("Cannot listen on " + path);
+  }
+  if (machines == 0) machines = std::thread::hardware_concurrency();
+  for (unsigned i = 0; i < std::max(machines, 1u); i++) {
+    machines_.push_back(std::make_unique<Machine>());
+  }
+}
+
+Asm::Serve::Server::~Server() {
+  close(listener_);
+  unlink(path_.c_str());
+}
+
+/**
+ * @brief Accepts connections until stop(), then closes them and waits for
+ * their threads
+ * @details A request running when the server stops completes first, which
+ * takes the server's budget at most.
+ * @throw std::system_error If accepting or starting a thread fails
+ */
+void Asm::Serve::Server::serve() {
+  auto const hang_up = [this] {
+    for (auto& connection : connections_) shutdown(connection->fd, SHUT_RDWR);
+    for (auto& connection : connections_) {
+      connection->thread.join();
+      close(connection->fd);
+    }
+    connections_.clear();
+  };
+  try {
+    while (!stopping_) {
+      auto const fd = accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (stopping_) break;
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        fail("Cannot accept a connection");
+      }
+      for (auto it = connections_.begin(); it != connections_.end();) {
+        if (!(*it)->done) {
+          ++it;
+          continue;
+        }
+        (*it)->thread.join();
+        close((*it)->fd);
+        it = connections_.erase(it);
+      }
+      auto connection = std::make_unique<Connection>();
+      connection->fd = fd;
+      auto& added = *connection;
+      try {
+        connections_.push_back(std::move(connection));
+        added.thread = std::thread{[this, &added] { talk(added); }};
+      } catch (...) {
+        close(fd);
+        if (!connections_.empty() && connections_.back().get() == &added) connections_.pop_back();
+        throw;
+      }
+    }
+  } catch (...) {
+    hang_up();
+    throw;
+  }
+  hang_up();
+}
+
+/**
+ * @brief Makes serve() return, from any thread or from a signal handler
+ * @throw /
+ */
+void Asm::Serve::Server::stop() noexcept {
+  stopping_ = true;
+  shutdown(listener_, SHUT_RDWR);
+}
+
+/**
+ * @brief Returns the requests served so far
+ * @throw /
+ */
+Asm::Serve::Server::Stats Asm::Serve::Server::stats() const noexcept {
+  Stats stats;
+  stats.requests = requests_;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  return stats;
+}
+
+/**
+ * @brief Answers the requests of a connection until it closes
+ */
+void Asm::Serve::Server::talk(Connection& connection) {
+  try {
+    std::vector<u8> frame;
+    while (receive(connection.fd, frame)) {
+      Response response;
+      try {
+        response = run(decode_request(frame));
+      } catch (std::bad_alloc const&) {
+        response.status = MINIASM_ERROR_MEMORY;
+        response.error = "Out of memory";
+      } catch (std::exception const& e) {
+        response.status = MINIASM_ERROR_ARGUMENT;
+        response.error = e.what();
+      }
+      encode(response, frame);
+      send_all(connection.fd, frame);
+    }
+  } catch (...) {
+    // The connection is lost, or its frame is too big
+  }
+  shutdown(connection.fd, SHUT_RDWR); // serve() closes it
+  connection.done = true;
+}
+
+/**
+ * @brief Runs a request on a machine of the pool
+ * @throw std::runtime_error If a RAM range is out of the memory
+ * @throw std::bad_alloc If the program or the machine cannot be allocated
+ */
+Asm::Serve::Response Asm::Serve::Server::run(Request const& request) {
+  requests_++;
+  for (auto const& write : request.writes) {
+    if (write.address > Memory::capacity || write.bytes.size() > Memory::capacity - write.address) {
+      throw std::runtime_error{"RAM write out of range"};
+    }
+  }
+  for (auto const& read : request.reads) {
+    if (read.address > Memory::capacity || read.size > Memory::capacity - read.address) {
+      throw std::runtime_error{"RAM read out of range"};
+    }
+  }
+  Response response;
+  std::shared_ptr<const Entry> entry;
+  try {
+    entry = lookup(request.source, response.cached);
+  } catch (std::bad_alloc const&) {
+    throw;
+  } catch (std::exception const& e) {
+    response.status = MINIASM_ERROR_LOAD;
+    response.error = e.what();
+    return response;
+  }
+
+  auto machine = acquire();
+  std::ostringstream output;
+  machine->registers = request.registers;
+  machine->stack = Stack<0xff>{};
+  machine->steps = 0;
+  machine->output = &output;
+  try {
+    for (auto const& write : request.writes) {
+      for (std::size_t i = 0; i < write.bytes.size(); i++) machine->RAM.write(write.address + i) = write.bytes[i];
+    }
+    auto const budget = (request.budget == 0) ? budget_ : std::min(request.budget, budget_);
+    if (entry->executable.run(*machine, budget) != Interpreter::Stop::ended) {
+      response.status = MINIASM_BUDGET;
+    }
+  } catch (Errors::OutOfRangeException const& e) {
+    response.status = MINIASM_ERROR_STACK;
+    response.error = e.what();
+  } catch (std::bad_alloc const&) {
+    response.status = MINIASM_ERROR_MEMORY;
+    response.error = "Out of memory";
+  } catch (std::exception const& e) {
+    response.status = MINIASM_ERROR_FAULT;
+    response.error = e.what();
+  }
+  machine->output = &std::cout;
+  response.executed = machine->steps;
+  response.registers = machine->registers;
+  try {
+    response.output = output.str();
+    for (auto const& read : request.reads) {
+      for (u32 i = 0; i < read.size; i++) response.ram.push_back(machine->RAM.read(read.address + i));
+    }
+  } catch (...) {
+    release(std::move(machine));
+    throw;
+  }
+  release(std::move(machine));
+  return response;
+}
+
+/**
+ * @brief Returns the prepared program of a source, decoding it on a miss
+ * @param cached Set if it was in the cache
+ * @throw std::runtime_error If a label is defined twice
+ * @throw std::bad_alloc If the program cannot be allocated
+ */
+std::shared_ptr<const Asm::Serve::Server::Entry> Asm::Serve::Server::lookup(std::string const& source, bool& cached) {
+  auto const key = hash_bytes(source.data(), source.size());
+  {
+    std::lock_guard<std::mutex> lock{cache_mutex_};
+    auto const found = cache_.find(key);
+    if (found != cache_.end() && found->second->source == source) {
+      found->second->used = ++clock_;
+      cached = true;
+      hits_++;
+      return found->second;
+    }
+  }
+  // Decoding runs unlocked, so a big program does not hold up the others
+  auto entry = std::make_shared<Entry>(source, engine_, optimize_);
+  misses_++;
+  std::lock_guard<std::mutex> lock{cache_mutex_};
+  if (cache_.size() >= cache_capacity && cache_.find(key) == cache_.end()) {
+    using Item = decltype(cache_)::value_type;
+    cache_.erase(std::min_element(cache_.begin(), cache_.end(), [](Item const& lhs, Item const& rhs) {
+      return lhs.second->used < rhs.second->used;
+    }));
+  }
+  entry->used = ++clock_;
+  cache_[key] = entry;
+  return entry;
+}
+
+std::unique_ptr<Machine> Asm::Serve::Server::acquire() {
+  {
+    std::lock_guard<std::mutex> lock{machines_mutex_};
+    if (!machines_.empty()) {
+      auto machine = std::move(machines_.back());
+      machines_.pop_back();
+      return machine;
+    }
+  }
+  return std::make_unique<Machine>();
+}
+
+/**
+ * @brief Gives a machine back to the pool, its RAM cleared for the next request
+ */
+void Asm::Serve::Server::release(std::unique_ptr<Machine> machine) {
+  machine->RAM.clear();
+  std::lock_guard<std::mutex> lock{machines_mutex_};
+  try {
+    machines_.push_back(std::move(machine));
+  } catch (...) {
+    // Dropped, the next acquire() creates another one
+  }
+}
+
+/**
+ * @brief Connects to a server
+ * @throw std::runtime_error If the path is too long
+ * @throw std::system_error If nothing listens on it
+ */
+Asm::Serve::Client::Client(std::string const& path) {
+  auto const address = address_of(path);
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) fail("Cannot create a socket");
+  if (connect(fd_, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0) {
+    auto const error = errno;
+    close(fd_);
+    errno = error;
+    fail("Cannot connect to " + path);
+  }
+}
+
+Asm::Serve::Client::~Client() {
+  close(fd_);
+}
+
+/**
+ * @brief Sends a request and waits for its response
+ * @throw std::system_error If the connection fails
+ * @throw std::runtime_error If the server closes it or answers an invalid frame
+ */
+Asm::Serve::Response Asm::Serve::Client::run(Request const& request) {
+  encode(request, frame_);
+  send_all(fd_, frame_);
+  if (!receive(fd_, frame_)) throw std::runtime_error{"The server closed the connection"};
+  return decode_response(frame_);
+}
@@ -0,0 +1,167 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <atomic>        // std::atomic
+#include <cstddef>       // std::size_t
+#include <list>          // std::list
+#include <memory>        // std::shared_ptr, std::unique_ptr
+#include <mutex>         // std::mutex
+#include <string>        // std::string
+#include <thread>        // std::thread
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+
+#include "cpu.h"
+#include "interpreter.h"
+#include "miniasm.h"
+#include "program.h"
+
+namespace Asm {
+namespace Serve {
+
+/**
+ * @brief RAM bytes written before a run
+ */
+struct Write {
+  u32 address;
+  std::vector<u8> bytes;
+};
+
+/**
+ * @brief RAM bytes sent back after a run
+ */
+struct Range {
+  u32 address;
+  u32 size;
+};
+
+/**
+ * @brief A program to run on a fresh machine
+ */
+struct Request {
+  std::string source;        //!< ASM source, decoded once per distinct content
+  Registers registers;       //!< Initial registers, PC included
+  u64 budget = 0;            //!< Instructions at most, 0 for the server's budget
+  std::vector<Write> writes; //!< Initial RAM contents, zeros elsewhere
+  std::vector<Range> reads;  //!< RAM sent back in the response
+};
+
+/**
+ * @brief What running a request gave
+ */
+struct Response {
+  miniasm_status status = MINIASM_OK; //!< MINIASM_BUDGET if the budget ran out, an error if it failed
+  bool cached = false;                //!< The program was already decoded
+  u64 executed = 0;                   //!< Instructions executed
+  Registers registers;                //!< Final registers
+  std::string output;                 //!< What the program printed
+  std::string error;                  //!< Empty unless status is an error
+  std::vector<u8> ram;                //!< Bytes of the reads, one after the other
+};
+
+void encode(Request const& request, std::vector<u8>& frame);
+void encode(Response const& response, std::vector<u8>& frame);
+Request decode_request(std::vector<u8> const& frame);
+Response decode_response(std::vector<u8> const& frame);
+
+/**
+ * @brief Daemon running requests sent over a Unix socket
+ * @details Every connection gets a thread and may send any number of
+ * requests, answered in order. A request borrows a machine from a pool
+ * created with the server, and the program it sends is only decoded and
+ * prepared the first time: later requests with the same source find it in a
+ * cache keyed by a hash of the content. Requests run a budget of
+ * instructions at most, so a looping program cannot hold its connection,
+ * nor the server's shutdown, forever.
+ */
+class Server {
+public:
+  /**
+   * @brief Requests served since the server was created
+   */
+  struct Stats {
+    u64 requests = 0;
+    u64 hits = 0;   //!< Programs found in the cache
+    u64 misses = 0; //!< Programs decoded
+  };
+
+  static constexpr u64 default_budget = u64{1} << 32; //!< Instructions a request runs at most, unless told otherwise
+
+  Server(std::string const& path, Interpreter::Engine engine, bool optimize, unsigned machines, u64 budget = 0);
+  ~Server();
+  Server(Server const&) = delete;
+  Server& operator=(Server const&) = delete;
+
+  void serve();
+  void stop() noexcept;
+  Stats stats() const noexcept;
+
+private:
+  static constexpr std::size_t cache_capacity = 1024; //!< Programs kept, the least recently used go first
+
+  /**
+   * @brief A decoded program, prepared for the engine of the server
+   */
+  struct Entry {
+    Entry(std::string const& text, Interpreter::Engine engine, bool optimize);
+
+    std::string source;
+    Labels labels;
+    Program program;
+    Interpreter::Executable executable; //!< Refers to program
+    u64 used = 0;                       //!< Last lookup, for eviction
+  };
+
+  struct Connection {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done{false};
+  };
+
+  void talk(Connection& connection);
+  Response run(Request const& request);
+  std::shared_ptr<const Entry> lookup(std::string const& source, bool& cached);
+  std::unique_ptr<Machine> acquire();
+  void release(std::unique_ptr<Machine> machine);
+
+  std::string path_;
+  Interpreter::Engine engine_;
+  bool optimize_;
+  u64 budget_; //!< Instructions a request runs at most
+  int listener_ = -1;
+  std::atomic<bool> stopping_{false};
+  std::list<std::unique_ptr<Connection>> connections_; //!< Only used by serve()
+
+  std::mutex machines_mutex_;
+  std::vector<std::unique_ptr<Machine>> machines_; //!< Idle machines
+
+  std::mutex cache_mutex_;
+  std::unordered_map<u64, std::shared_ptr<Entry>> cache_;
+  u64 clock_ = 0; //!< Lookups so far
+
+  std::atomic<u64> requests_{0};
+  std::atomic<u64> hits_{0};
+  std::atomic<u64> misses_{0};
+};
+
+/**
+ * @brief Connection to a server
+ */
+class Client {
+public:
+  explicit Client(std::string const& path);
+  ~Client();
+  Client(Client const&) = delete;
+  Client& operator=(Client const&) = delete;
+
+  Response run(Request const& request);
+
+private:
+  int fd_;
+  std::vector<u8> frame_; //!< Reused by every request
+};
+
+} // namespace Asm::Serve
+} // namespace Asm
+
+#endif // __SERVER_H__
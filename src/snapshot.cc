@@ -0,0 +1,60 @@
+#include "snapshot.h"
+#include "interpreter.h" // execute
+
+#include <memory>    // std::make_shared
+#include <stdexcept> // std::runtime_error
+#include <utility>   // std::move
+
+/**
+ * @brief Captures the state of a machine
+ * @details Only the RAM pages the machine wrote are copied, the others are
+ * shared with the memory it started from.
+ * @throw std::bad_alloc If the pages cannot be allocated
+ */
+Asm::Snapshot::Snapshot(Machine const& machine)
+  : registers_(machine.registers), stack_(machine.stack), steps_(machine.steps),
+    ram_(std::make_shared<const Memory>(machine.RAM)) {}
+
+/**
+ * @brief Builds a snapshot from saved state, a warm-start image for instance
+ * @param ram The frozen RAM, shared with the machines restored from the snapshot
+ * @throw /
+ */
+Asm::Snapshot::Snapshot(Registers const& registers, Stack<0xff> const& stack, u64 steps, std::shared_ptr<const Memory> ram) noexcept
+  : registers_(registers), stack_(stack), steps_(steps), ram_(std::move(ram)) {}
+
+/**
+ * @brief Puts a machine back in the state of the snapshot
+ * @details A machine already restored from this snapshot only reverts the
+ * RAM pages it wrote since, so restoring costs what the run dirtied rather
+ * than the size of RAM.
+ * @throw /
+ */
+void Asm::Snapshot::restore(Machine& machine) const noexcept {
+  machine.registers = registers_;
+  machine.stack = stack_;
+  machine.steps = steps_;
+  machine.RAM.reset(ram_);
+}
+
+/**
+ * @brief Runs a program until it reaches a PC, then captures the machine
+ * @param machine The machine, left at pc
+ * @param program The program
+ * @param pc Where to stop, the PC of a label for instance
+ * @details The instructions run one by one with the basic engine, so the
+ * program stops exactly at pc however the other engines would fuse it.
+ * @returns The snapshot
+ * @throw std::runtime_error If the program fails or ends before reaching pc
+ */
+Asm::Snapshot Asm::run_to(Machine& machine, Program const& program, u16 pc) {
+  auto const size = program.code.size();
+  while (machine.registers.PC < size && machine.registers.PC != pc) {
+    machine.steps++;
+    Interpreter::execute(machine, program, program.code[machine.registers.PC++]);
+  }
+  if (machine.registers.PC != pc) {
+    throw std::runtime_error{"The program ended before reaching the snapshot"};
+  }
+  return Snapshot{machine};
+}
@@ -0,0 +1,42 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <memory> // std::shared_ptr
+
+#include "cpu.h"
+#include "program.h"
+
+namespace Asm {
+
+/**
+ * @brief The state of a machine at one point of a program
+ * @details Registers (PC included), the stack, the step count and RAM are
+ * kept. RAM is frozen and shared: machines restored from a snapshot read its
+ * pages in place and copy one only when they write to it. Labels, VRAM and
+ * the output are left as they are.
+ */
+class Snapshot {
+public:
+  explicit Snapshot(Machine const& machine);
+  Snapshot(Registers const& registers, Stack<0xff> const& stack, u64 steps, std::shared_ptr<const Memory> ram) noexcept;
+
+  void restore(Machine& machine) const noexcept;
+  u16 pc() const noexcept { return registers_.PC; }
+  Registers const& registers() const noexcept { return registers_; }
+  Stack<0xff> const& stack() const noexcept { return stack_; }
+  u64 steps() const noexcept { return steps_; }
+  Memory const& ram() const noexcept { return *ram_; }
+  std::shared_ptr<const Memory> const& shared_ram() const noexcept { return ram_; }
+
+private:
+  Registers registers_;
+  Stack<0xff> stack_;
+  u64 steps_;
+  std::shared_ptr<const Memory> ram_;
+};
+
+Snapshot run_to(Machine& machine, Program const& program, u16 pc);
+
+} // namespace Asm
+
+#endif // __SNAPSHOT_H__
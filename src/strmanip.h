@@ -2,6 +2,8 @@
 #define __STRMANIP_H__
 
 #include <cctype>  // std::tolower, std::toupper
+#include <cstddef> // std::size_t
+#include <cstdint> // uint64_t
 #include <string>  // std::string
 
 /**
@@ -32,4 +34,17 @@ inline std::string to_upper(std::string const& str) {
   return cpy;
 }
 
+/**
+  * @brief Hashes bytes with 64-bit FNV-1a
+  * @param seed Hash of the bytes before, to hash several parts as one
+  * @returns The hash
+  * @throw /
+  */
+inline uint64_t hash_bytes(const char* data, std::size_t size, uint64_t seed = 0xcbf29ce484222325) noexcept {
+  for (std::size_t i = 0; i < size; i++) {
+    seed = (seed ^ static_cast<unsigned char>(data[i])) * 0x100000001b3;
+  }
+  return seed;
+}
+
 #endif // __STRMANIP_H__
@@ -1,79 +1,383 @@
 #ifndef __SYNTAX_H__
 #define __SYNTAX_H__
 
-#include <regex> // std::regex
+#include <cstddef> // std::size_t
+#include <string>  // std::string
+
+#include "program.h"
+
+/*
+ * Grammar (case insensitive, blank = ' ' or '\t'):
+ *   instruction := blank* op2 blank+ dst blank* ',' blank* src blank*
+ *                | blank* "push" blank+ push_operand blank*
+ *                | blank* "pop" (blank+ dst)? blank*
+ *                | blank* jump blank+ [_a-z0-9]+ blank*
+ *   op2  := mov | add | sub | cmp | or | and | xor | shl | shr
+ *   jump := jmp | je | jne | jl | jle | jg | jge
+ *   dst  := [a|xyspc] | address
+ *   src  := [a|xyspc] | number | address
+ *   push_operand := [a|xyps] | number | address | "'" [a-z0-9] "'"
+ *   number  := [0-9]+ | 0x[0-9a-f]+ | 0b[01]+
+ *   address := '*' number
+ *   label   := blank* [_a-z0-9]+ blank* ':'
+ *
+ * Operands never contain blanks or commas, so each one is the longest run of
+ * other characters and is then checked as a whole, in a single pass. The
+ * parser is constexpr, so embedded.h checks programs while compiling.
+ */
 
 namespace Asm {
 namespace Syntax {
 
-// TODO - Refactoring
-const std::string regex_with_2_params = "[ \t]+([a|x|y|s|p|pc]|\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+)[ \t]*,[ \t]*([a|x|y|s|p|pc]|0b[0-1]+|0x[0-9a-f]+|[0-9]+|\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+)[ \t]*";
-std::regex const regex_mov{"[ \t]*mov" + regex_with_2_params};
-std::regex const regex_add{"[ \t]*add" + regex_with_2_params};
-std::regex const regex_sub{"[ \t]*sub" + regex_with_2_params};
-std::regex const regex_cmp{"[ \t]*cmp" + regex_with_2_params};
-std::regex const regex_or {"[ \t]*or"  + regex_with_2_params};
-std::regex const regex_and{"[ \t]*and" + regex_with_2_params};
-std::regex const regex_xor{"[ \t]*xor" + regex_with_2_params};
-std::regex const regex_push{"[ \t]*push[ \t]+([a|x|y|p|s]|0b[0-1]+|0x[0-9a-f]+|[0-9]+|\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+|'[a-zA-Z0-9]')[ \t]*"};
-std::regex const regex_pop{"[ \t]*pop([ \t]+([a|x|y|s|p|pc]|\\*[0-9]+|\\*0x[0-9a-f]+|\\*0b[0-1]+))?[ \t]*"};
-
-const std::string jmp_label = "[ \t]+[_a-zA-Z]*[_a-zA-Z0-9]+[ \t]*";
-std::regex const regex_jmp{"[ \t]*(jmp)" + jmp_label};
-std::regex const regex_je{"[ \t]*(je)"   + jmp_label};
-std::regex const regex_jne{"[ \t]*(jne)" + jmp_label};
-std::regex const regex_jl{"[ \t]*(jl)"   + jmp_label};
-std::regex const regex_jle{"[ \t]*(jle)" + jmp_label};
-std::regex const regex_jg{"[ \t]*(jg)"   + jmp_label};
-std::regex const regex_jge{"[ \t]*(jge)" + jmp_label};
-
-std::regex const regex_shl{"[ \t]*shl" + regex_with_2_params};
-std::regex const regex_shr{"[ \t]*shr" + regex_with_2_params};
-// Fin TODO
-
-const std::vector<std::regex> regexes = {
-	regex_mov,
-	regex_add,
-	regex_sub,
-	regex_cmp,
-	regex_or,
-	regex_and,
-	regex_xor,
-	regex_push,
-	regex_pop,
-	regex_jmp,
-	regex_je,
-	regex_jne,
-	regex_jl,
-	regex_jle,
-	regex_jg,
-	regex_jge,
-	regex_shl,
-	regex_shr
+/**
+ * @brief A slice of the parsed line (no copy, no allocation)
+ */
+struct Token {
+  const char* begin;
+  std::size_t size;
+
+  std::string str() const { return {begin, size}; }
 };
 
-const std::vector<std::string> instructions = {
-  "mov A, 0xff",
-  "mov X, 0xff",
-  "cmp A, 0xff",
-  "jne Y",
-  "jle Y",
-  "jl Y",
-  "jge A",
-  "je 0b1101",
-  "mov *0xff, a",
-  "mov A, *0x01",
-  "mov X, 0x00",
-  "push 42",
-  "pop"
+/**
+ * @brief An instruction or a command split into its parts
+ */
+struct Parsed {
+  Opcode op;       //!< @brief Operation
+  unsigned params; //!< @brief Number of parameters found
+  Token param1;    //!< @brief First parameter (empty if none)
+  Token param2;    //!< @brief Second parameter (empty if none)
 };
 
+bool parse_instruction(std::string const& line, Parsed& parsed) noexcept;
+bool parse_command(std::string const& line, Parsed& parsed) noexcept;
 bool is_inst(std::string const& line) noexcept;
-bool has_1_parameter(std::string const& line);
-bool has_2_parameters(std::string const& line);
-std::string extract_op(std::string const& line);
-std::string extract_param1(std::string const& line);
-std::string extract_param2(std::string const& line);
+
+/**
+ * @brief Building blocks of the grammar, usable in constant expressions
+ */
+namespace Grammar {
+
+enum CharClass : u8 {
+  blank   = 0x01, //!< ' ' or '\t'
+  digit   = 0x02, //!< [0-9]
+  hex     = 0x04, //!< [0-9a-f]
+  bin     = 0x08, //!< [01]
+  word    = 0x10, //!< [_a-z0-9]
+  alpha   = 0x20, //!< [a-z]
+  reg_dst = 0x40, //!< [a|xyspc]
+  reg_src = 0x80  //!< [a|xyps]
+};
+
+struct CharTable {
+  u8 classes[256];
+  char lower[256];
+};
+
+constexpr CharTable make_char_table() {
+  CharTable table{};
+  for (unsigned c = 0; c < 256; c++) {
+    auto const l = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    table.lower[c] = static_cast<char>(l);
+    u8 classes{};
+    if (l == ' ' || l == '\t') classes |= blank;
+    if (l >= '0' && l <= '9') classes |= digit | hex | word;
+    if (l == '0' || l == '1') classes |= bin;
+    if (l >= 'a' && l <= 'z') classes |= alpha | word;
+    if (l >= 'a' && l <= 'f') classes |= hex;
+    if (l == '_') classes |= word;
+    if (l == 'a' || l == '|' || l == 'x' || l == 'y' || l == 's' || l == 'p') classes |= reg_dst | reg_src;
+    if (l == 'c') classes |= reg_dst;
+    table.classes[c] = classes;
+  }
+  return table;
+}
+
+constexpr CharTable char_table = make_char_table();
+
+constexpr bool is(char c, u8 classes) noexcept {
+  return (char_table.classes[static_cast<unsigned char>(c)] & classes) != 0;
+}
+
+constexpr char lower_char(char c) noexcept {
+  return char_table.lower[static_cast<unsigned char>(c)];
+}
+
+enum class Form : u8 { two_params, push, pop, jump };
+
+struct Mnemonic {
+  const char* name;
+  std::size_t size;
+  Opcode op;
+  Form form;
+};
+
+constexpr Mnemonic mnemonics[] = {
+  {"mov", 3, Opcode::mov, Form::two_params},
+  {"add", 3, Opcode::add, Form::two_params},
+  {"sub", 3, Opcode::sub, Form::two_params},
+  {"cmp", 3, Opcode::cmp, Form::two_params},
+  {"or", 2, Opcode::or_, Form::two_params},
+  {"and", 3, Opcode::and_, Form::two_params},
+  {"xor", 3, Opcode::xor_, Form::two_params},
+  {"shl", 3, Opcode::shl, Form::two_params},
+  {"shr", 3, Opcode::shr, Form::two_params},
+  {"push", 4, Opcode::push, Form::push},
+  {"pop", 3, Opcode::pop, Form::pop},
+  {"jmp", 3, Opcode::jmp, Form::jump},
+  {"je", 2, Opcode::je, Form::jump},
+  {"jne", 3, Opcode::jne, Form::jump},
+  {"jl", 2, Opcode::jl, Form::jump},
+  {"jle", 3, Opcode::jle, Form::jump},
+  {"jg", 2, Opcode::jg, Form::jump},
+  {"jge", 3, Opcode::jge, Form::jump}
+};
+
+/**
+ * @brief Case insensitive comparison of a token with a lower string
+ */
+constexpr bool equals(Token const& token, const char* str, std::size_t size) noexcept {
+  if (token.size != size) return false;
+  for (std::size_t i = 0; i < size; i++) {
+    if (lower_char(token.begin[i]) != str[i]) return false;
+  }
+  return true;
+}
+
+constexpr Mnemonic const* find_mnemonic(Token const& token) noexcept {
+  for (auto const& mnemonic : mnemonics) {
+    if (equals(token, mnemonic.name, mnemonic.size)) return &mnemonic;
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Checks that every character of [begin, end) belongs to classes
+ */
+constexpr bool all_of(const char* begin, const char* end, u8 classes) noexcept {
+  if (begin == end) return false;
+  for (; begin != end; begin++) {
+    if (!is(*begin, classes)) return false;
+  }
+  return true;
+}
+
+constexpr bool is_number(Token const& token) noexcept {
+  auto const begin = token.begin;
+  auto const end = token.begin + token.size;
+  if (token.size > 2 && begin[0] == '0' && lower_char(begin[1]) == 'x') return all_of(begin + 2, end, hex);
+  if (token.size > 2 && begin[0] == '0' && lower_char(begin[1]) == 'b') return all_of(begin + 2, end, bin);
+  return all_of(begin, end, digit);
+}
+
+constexpr bool is_address(Token const& token) noexcept {
+  return token.size > 1 && token.begin[0] == '*' && is_number({token.begin + 1, token.size - 1});
+}
+
+constexpr bool is_dst(Token const& token) noexcept {
+  return (token.size == 1 && is(token.begin[0], reg_dst)) || is_address(token);
+}
+
+constexpr bool is_src(Token const& token) noexcept {
+  return is_dst(token) || is_number(token);
+}
+
+constexpr bool is_push_operand(Token const& token) noexcept {
+  if (token.size == 1 && is(token.begin[0], reg_src)) return true;
+  if (token.size == 3 && token.begin[0] == '\'' && token.begin[2] == '\'') {
+    return is(token.begin[1], digit | alpha);
+  }
+  return is_number(token) || is_address(token);
+}
+
+/**
+ * @brief Cursor over the line being parsed
+ */
+struct Scanner {
+  const char* pos;
+  const char* end;
+
+  constexpr bool done() const noexcept { return pos == end; }
+
+  /**
+   * @returns The number of blanks skipped
+   */
+  constexpr std::size_t skip_blanks() noexcept {
+    auto const begin = pos;
+    for (; pos != end && is(*pos, blank); pos++);
+    return static_cast<std::size_t>(pos - begin);
+  }
+
+  constexpr Token take_while(u8 classes) noexcept {
+    auto const begin = pos;
+    for (; pos != end && is(*pos, classes); pos++);
+    return {begin, static_cast<std::size_t>(pos - begin)};
+  }
+
+  constexpr Token take_operand() noexcept {
+    auto const begin = pos;
+    for (; pos != end && !is(*pos, blank) && *pos != ','; pos++);
+    return {begin, static_cast<std::size_t>(pos - begin)};
+  }
+
+  /**
+   * @brief Checks that only blanks are left
+   */
+  constexpr bool finish() noexcept {
+    skip_blanks();
+    return done();
+  }
+};
+
+} // namespace Asm::Syntax::Grammar
+
+/**
+ * @brief Checks if token is the name of a register (a, x, y, p, s or pc)
+ * @throw /
+ */
+constexpr bool is_register_name(Token const& token) noexcept {
+  if (token.size == 2) return Grammar::equals(token, "pc", 2);
+  return token.size == 1 && Grammar::is(token.begin[0], Grammar::reg_src) && token.begin[0] != '|';
+}
+
+/**
+ * @brief Checks if token is a decimal number, or the address of one, past
+ * the range of int, which std::stoi rejected with "stoi"
+ * @throw /
+ */
+constexpr bool is_out_of_range(Token const& token) noexcept {
+  auto const number = Grammar::is_address(token) ? Token{token.begin + 1, token.size - 1} : token;
+  if (!Grammar::is_number(number) || (number.size > 2 && !Grammar::is(number.begin[1], Grammar::digit))) return false;
+  unsigned long long n{};
+  for (std::size_t i = 0; i < number.size && n <= 0x7fffffffu; i++) n = n * 10 + (number.begin[i] - '0');
+  return n > 0x7fffffffu;
+}
+
+/**
+ * @brief Parses a decimal, hexadecimal (0x) or binary (0b) number
+ * @param token The token we parse
+ * @param value Receives the number truncated to 8 bits
+ * @returns True if token is a number, false otherwise (decimal numbers out of
+ * range included)
+ * @details Decimal and hexadecimal numbers keep their low byte (hexadecimal
+ * saturates past 32 bits like stream extraction does) and binary numbers keep
+ * their 8 leading digits like std::bitset<8> does.
+ * @throw /
+ */
+constexpr bool parse_number(Token const& token, u8& value) noexcept {
+  if (!Grammar::is_number(token) || is_out_of_range(token)) return false;
+  auto const str = token.begin;
+  if (token.size > 2 && Grammar::lower_char(str[1]) == 'x') {
+    unsigned long long n{};
+    for (std::size_t i = 2; i < token.size && n <= 0xffffffffu; i++) {
+      auto const c = Grammar::lower_char(str[i]);
+      n = n * 16 + (Grammar::is(c, Grammar::digit) ? c - '0' : c - 'a' + 10);
+    }
+    value = static_cast<u8>(n > 0xffffffffu ? 0xff : n);
+  } else if (token.size > 2 && Grammar::lower_char(str[1]) == 'b') {
+    unsigned n{};
+    for (std::size_t i = 2; i < token.size && i < 10; i++) n = n * 2 + (str[i] - '0');
+    value = static_cast<u8>(n);
+  } else {
+    unsigned n{};
+    for (std::size_t i = 0; i < token.size; i++) n = n * 10 + (str[i] - '0');
+    value = static_cast<u8>(n);
+  }
+  return true;
+}
+
+/**
+ * @brief Parses an address (ex: "*0x10")
+ * @param token The token we parse
+ * @param value Receives the address
+ * @returns True if token is an address, false otherwise
+ * @throw /
+ */
+constexpr bool parse_address(Token const& token, u8& value) noexcept {
+  return Grammar::is_address(token) && parse_number({token.begin + 1, token.size - 1}, value);
+}
+
+/**
+ * @brief Parses an ASM instruction in a single pass, without allocation
+ * @param line The line we work with (without comment)
+ * @param size Size of the line
+ * @param parsed Receives the operation and the parameters, which point into line
+ * @returns True if line is a correct ASM instruction, false otherwise
+ * @throw /
+ */
+constexpr bool parse_instruction(const char* line, std::size_t size, Parsed& parsed) noexcept {
+  Grammar::Scanner scanner{line, line + size};
+  parsed = Parsed{};
+  scanner.skip_blanks();
+  auto const mnemonic = Grammar::find_mnemonic(scanner.take_while(Grammar::alpha));
+  if (!mnemonic) return false;
+  parsed.op = mnemonic->op;
+  auto const blanks = scanner.skip_blanks();
+  if (mnemonic->form == Grammar::Form::pop && scanner.done()) return true;
+  if (blanks == 0 || scanner.done()) return false;
+  parsed.param1 = scanner.take_operand();
+  parsed.params = 1;
+  switch (mnemonic->form) {
+  case Grammar::Form::two_params:
+    if (!Grammar::is_dst(parsed.param1)) return false;
+    scanner.skip_blanks();
+    if (scanner.done() || *scanner.pos != ',') return false;
+    scanner.pos++;
+    scanner.skip_blanks();
+    parsed.param2 = scanner.take_operand();
+    parsed.params = 2;
+    return Grammar::is_src(parsed.param2) && scanner.finish();
+  case Grammar::Form::push:
+    return Grammar::is_push_operand(parsed.param1) && scanner.finish();
+  case Grammar::Form::pop:
+    return Grammar::is_dst(parsed.param1) && scanner.finish();
+  case Grammar::Form::jump:
+    return Grammar::all_of(parsed.param1.begin, parsed.param1.begin + parsed.param1.size, Grammar::word)
+      && scanner.finish();
+  }
+  return false;
+}
+
+/**
+ * @brief Parses a label definition (ex: "loop:")
+ * @param line The line we work with
+ * @param size Size of the line
+ * @param name Receives the name of the label
+ * @returns True if line is a label definition, false otherwise
+ * @throw /
+ */
+constexpr bool parse_label(const char* line, std::size_t size, Token& name) noexcept {
+  Grammar::Scanner scanner{line, line + size};
+  scanner.skip_blanks();
+  name = scanner.take_while(Grammar::word);
+  if (name.size == 0) return false;
+  scanner.skip_blanks();
+  return !scanner.done() && *scanner.pos++ == ':' && scanner.done();
+}
+
+/**
+ * @brief Parses a shell command: print registers, print (a|x|y|p|s|pc) or print *address
+ * @param line The line we work with
+ * @param size Size of the line
+ * @param parsed Receives Opcode::print_registers, or Opcode::print and its parameter
+ * @returns True if line is a command, false otherwise
+ * @throw /
+ */
+constexpr bool parse_command(const char* line, std::size_t size, Parsed& parsed) noexcept {
+  parsed = Parsed{};
+  Token const all{line, size};
+  if (Grammar::equals(all, "print registers", 15)) {
+    parsed.op = Opcode::print_registers;
+    return true;
+  }
+  if (size < 7 || !Grammar::equals({line, 6}, "print ", 6)) return false;
+  Token const param{line + 6, size - 6};
+  if (!is_register_name(param) && !Grammar::is_address(param)) return false;
+  parsed.op = Opcode::print;
+  parsed.params = 1;
+  parsed.param1 = param;
+  return true;
+}
 
 } // namespace Asm::Syntax
 } // namespace Asm
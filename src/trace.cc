@@ -0,0 +1,792 @@
+#include "trace.h"
+#include "strmanip.h" // hash_bytes
+
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // write, close
+
+#include <algorithm>          // std::all_of, std::fill, std::min, std::upper_bound
+#include <cerrno>             // errno, EINTR
+#include <condition_variable> // std::condition_variable
+#include <cstring>            // std::memcpy, std::memcmp
+#include <exception>          // std::exception
+#include <mutex>              // std::mutex, std::unique_lock
+#include <ostream>            // std::ostream
+#include <stdexcept>          // std::runtime_error
+#include <thread>             // std::thread
+#include <utility>            // std::swap
+
+/*
+ * Trace format, version 2. Numbers are little-endian, varints hold 7 bits
+ * per byte, lowest first, and signed ones are zigzag encoded.
+ *
+ * Header (32 bytes):
+ *   char magic[8] = "MASMTRC\n", u16 version, u16 header size,
+ *   u32 instructions of the program, u64 fingerprint of the program,
+ *   u64 flags: 0x01 if blocks list what they changed
+ * Records, told apart by their first byte:
+ *   block (0x01 to 0x7f), if blocks do not list what they changed: the
+ *     length of the block, whose jump target is the one of its last
+ *     instruction
+ *   long block (0x85), if blocks do not list what they changed: varint
+ *     length, for blocks of 128 instructions or more
+ *   block (0x00 to 0x7f), if blocks list what they changed: the flags byte,
+ *     then varint length and varint jump target minus the PC after the
+ *     block, unless flag 0x40 tells they are those of the last block which
+ *     started at the same PC since the checkpoint. Then A X Y P S for flags
+ *     0x01 to 0x10 (the registers the block changed), and for flag 0x20
+ *     u8 count - 1 then (u8 address, u8 value) for each RAM byte it wrote
+ *   checkpoint (0x80): u8 1 if the run went on from the block before, so
+ *     the machine is in this state already, else 0, u64 steps, u8 A X Y P S,
+ *     u16 PC, the S bytes of the stack, u16 count then (u8 index, 256 bytes)
+ *     for each RAM page which holds something else than zeros
+ *   input (0x81): varint size then the shell line
+ *   error (0x82): varint size then the message the run failed with
+ *   end (0x83): the last block of a run, which did not jump: the flags byte,
+ *     then varint length and what changed as in a block. If blocks do not
+ *     list what they changed, the flags are 0x1f and A X Y P S follow
+ *   repeats (0x84): varint count of blocks, each of them the last block
+ *     which started at its PC since the checkpoint
+ * Index:
+ *   (u64 steps, u64 offset) for each checkpoint, by steps
+ * Trailer (24 bytes):
+ *   u64 index offset, u64 checkpoints, u64 instructions
+ *
+ * A run starts with a checkpoint, then its blocks: the PC of a block is the
+ * target of the one before. Registers and RAM bytes a block does not list
+ * kept their value, or are left to the replay if blocks do not list what
+ * they changed, as the stack always is.
+ */
+
+namespace {
+
+using Asm::Opcode;
+using Asm::OperandKind;
+using Asm::Program;
+
+constexpr char signature[8] = {'M', 'A', 'S', 'M', 'T', 'R', 'C', '\n'};
+constexpr u16 version = 2;
+constexpr std::size_t chunk_size = std::size_t{1} << 20; //!< Bytes handed to the writer at once
+constexpr std::size_t block_room = 1024;                 //!< Largest block record, rounded up
+
+constexpr u8 repeat_flag = 0x40;
+constexpr u8 ram_flag = 0x20;
+constexpr u8 checkpoint_tag = 0x80;
+constexpr u8 input_tag = 0x81;
+constexpr u8 error_tag = 0x82;
+constexpr u8 end_tag = 0x83;
+constexpr u8 repeats_tag = 0x84;
+constexpr u8 long_block_tag = 0x85;
+constexpr u64 changes_flag = 0x01;
+
+struct Header {
+  char magic[8];
+  u16 version;
+  u16 header_size;
+  u32 code_count;
+  u64 fingerprint;
+  u64 flags;
+};
+
+static_assert(sizeof(Header) == 32, "The trace header must not be padded");
+
+struct Trailer {
+  u64 index_offset;
+  u64 checkpoints;
+  u64 instructions;
+};
+
+/**
+ * @brief Hashes the decoded instructions and fault messages of a program
+ */
+u64 fingerprint(Program const& program) noexcept {
+  auto hash = hash_bytes(nullptr, 0);
+  for (auto const& inst : program.code) {
+    u8 const fields[] = {static_cast<u8>(inst.op), static_cast<u8>(inst.dst_kind), static_cast<u8>(inst.src_kind),
+      inst.dst, inst.src, static_cast<u8>(inst.target), static_cast<u8>(inst.target >> 8)};
+    hash = hash_bytes(reinterpret_cast<const char*>(fields), sizeof(fields), hash);
+  }
+  for (auto const& fault : program.faults) hash = hash_bytes(fault.data(), fault.size() + 1, hash);
+  return hash;
+}
+
+/**
+ * @brief Checks if an instruction writes the RAM byte at dst when it runs
+ */
+bool writes_ram(Asm::Instruction const& inst) noexcept {
+  if (inst.dst_kind != OperandKind::addr) return false;
+  switch (inst.op) {
+  case Opcode::mov: case Opcode::add: case Opcode::sub: case Opcode::or_: case Opcode::and_:
+  case Opcode::xor_: case Opcode::shl: case Opcode::shr: case Opcode::pop:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void append_varint(std::vector<u8>& out, u64 value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<u8>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<u8>(value));
+}
+
+/**
+ * @brief Reads the records of a mapped trace, checking they stay in it
+ */
+class Cursor {
+public:
+  Cursor(std::string const& filename, const u8* data, std::size_t end, std::size_t offset) noexcept
+    : filename_(filename), data_(data), end_(end), offset_(offset) {}
+
+  [[noreturn]] void fail(std::string const& why) const {
+    throw std::runtime_error{"Invalid trace " + filename_ + ": " + why};
+  }
+
+  bool done() const noexcept { return offset_ >= end_; }
+  std::size_t offset() const noexcept { return offset_; }
+
+  const u8* bytes(std::size_t size) {
+    if (size > end_ - offset_) fail("truncated");
+    auto const at = data_ + offset_;
+    offset_ += size;
+    return at;
+  }
+
+  u8 byte() { return *bytes(1); }
+
+  template <typename T>
+  T number() {
+    T value;
+    std::memcpy(&value, bytes(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  u64 varint() {
+    u64 value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      auto const b = byte();
+      value |= u64{b & 0x7fu} << shift;
+      if (b < 0x80) return value;
+    }
+    fail("bad number");
+  }
+
+  std::string string() {
+    auto const size = varint();
+    if (size > end_ - offset_) fail("truncated");
+    return {reinterpret_cast<const char*>(bytes(size)), static_cast<std::size_t>(size)};
+  }
+
+private:
+  std::string const& filename_;
+  const u8* data_;
+  std::size_t end_;
+  std::size_t offset_;
+};
+
+/**
+ * @brief Discards what is written, for the PRINTs a seek runs over
+ */
+std::ostream& discarded() {
+  static std::ostream stream{nullptr};
+  return stream;
+}
+
+} // namespace
+
+/**
+ * @brief Thread writing the buffers a recorder fills, one at a time
+ */
+class Asm::Trace::Recorder::Writer {
+public:
+  explicit Writer(std::string const& filename) : filename_(filename) {
+    fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error{"Cannot create file " + filename};
+    }
+    thread_ = std::thread{[this] { loop(); }};
+  }
+
+  ~Writer() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      stopping_ = true;
+    }
+    changed_.notify_all();
+    thread_.join();
+    ::close(fd_);
+  }
+
+  /**
+   * @brief Hands a buffer over, and gets back an empty one
+   * @throw std::runtime_error If a previous write failed
+   */
+  void write(std::vector<u8>& chunk) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    changed_.wait(lock, [this] { return pending_.empty() || failed_; });
+    if (failed_) {
+      throw std::runtime_error{"Cannot write file " + filename_};
+    }
+    std::swap(pending_, chunk);
+    changed_.notify_all();
+  }
+
+  /**
+   * @brief Waits until every buffer handed over is written
+   * @throw std::runtime_error If a write failed
+   */
+  void flush() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    changed_.wait(lock, [this] { return (pending_.empty() && !writing_) || failed_; });
+    if (failed_) {
+      throw std::runtime_error{"Cannot write file " + filename_};
+    }
+  }
+
+private:
+  void loop() {
+    std::vector<u8> chunk;
+    std::unique_lock<std::mutex> lock{mutex_};
+    while (true) {
+      changed_.wait(lock, [this] { return !pending_.empty() || stopping_; });
+      if (pending_.empty()) return;
+      std::swap(pending_, chunk);
+      writing_ = true;
+      changed_.notify_all();
+      lock.unlock();
+      auto const ok = write_all(chunk.data(), chunk.size());
+      chunk.clear();
+      lock.lock();
+      writing_ = false;
+      failed_ = failed_ || !ok;
+      changed_.notify_all();
+    }
+  }
+
+  bool write_all(const u8* data, std::size_t size) noexcept {
+    while (size > 0) {
+      auto const written = ::write(fd_, data, size);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return false;
+      data += written;
+      size -= static_cast<std::size_t>(written);
+    }
+    return true;
+  }
+
+  std::string filename_;
+  int fd_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::vector<u8> pending_; //!< Next buffer to write, empty if none
+  bool writing_ = false;
+  bool failed_ = false;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+/**
+ * @brief Creates a trace file
+ * @param program The program, which must outlive the recorder
+ * @param filename Path of the trace, replaced if it exists
+ * @param engine The dispatch engine of the runs, the basic one calls back
+ * after every instruction
+ * @param interval Instructions between two checkpoints, at least
+ * @param changes Lists what every block changed, for replays to check each
+ * of them rather than only the checkpoints
+ * @throw std::runtime_error If the file cannot be created
+ */
+Asm::Trace::Recorder::Recorder(Program const& program, std::string const& filename,
+  Interpreter::Engine engine, bool optimize, u64 interval, bool changes)
+  : program_(program), executable_(program, engine, optimize), interval_(interval > 0 ? interval : 1), changes_(changes),
+    next_write_(program.code.size() + 1), shapes_(program.code.size() + 1), writer_(std::make_unique<Writer>(filename)), buffer_(chunk_size + block_room) {
+  auto const size = program.code.size();
+  next_write_[size] = static_cast<unsigned>(size);
+  for (auto pc = size; pc-- > 0;) {
+    next_write_[pc] = writes_ram(program.code[pc]) ? static_cast<unsigned>(pc) : next_write_[pc + 1];
+  }
+  out_ = buffer_.data();
+  limit_ = buffer_.data() + chunk_size;
+  Header header{};
+  std::memcpy(header.magic, signature, sizeof(signature));
+  header.version = version;
+  header.header_size = sizeof(Header);
+  header.code_count = static_cast<u32>(size);
+  header.fingerprint = fingerprint(program);
+  header.flags = changes ? changes_flag : 0;
+  put(&header, sizeof(header));
+}
+
+/**
+ * @brief Closes the trace, a trace which could not be written is left as it is
+ * @throw /
+ */
+Asm::Trace::Recorder::~Recorder() {
+  try {
+    close();
+  } catch (std::exception const&) {
+    // The trace stays truncated, replayers reject it
+  }
+}
+
+/**
+ * @brief Runs the program from the machine's PC, like Interpreter::run, and
+ * records it
+ * @param machine The machine we work with
+ * @details A run which fails is recorded with its error, then the error is
+ * thrown again.
+ * @throw std::runtime_error If a faulty instruction is executed or the trace
+ * cannot be written
+ * @throw Asm::Errors::OutOfRangeException On stack overflow or underflow
+ */
+void Asm::Trace::Recorder::run(Machine& machine) {
+  begin(machine);
+  checkpoint(machine.registers.PC, machine.steps, false);
+  try {
+    executable_.run(machine, *this);
+  } catch (std::exception const& e) {
+    finish(start_ + static_cast<unsigned>(machine.steps - start_steps_), machine.steps);
+    std::string const message{e.what()};
+    std::vector<u8> record{error_tag};
+    append_varint(record, message.size());
+    record.insert(record.end(), message.begin(), message.end());
+    put(record.data(), record.size());
+    throw;
+  }
+  finish(machine.registers.PC, machine.steps);
+}
+
+/**
+ * @brief Executes a shell line and records it
+ * @param line The line, lowered as the shell does
+ * @throw std::runtime_error If inst is not a correct ASM instruction or the
+ * trace cannot be written
+ */
+void Asm::Trace::Recorder::input(Machine& machine, std::string const& line) {
+  if (!writer_) {
+    throw std::runtime_error{"The trace is closed"};
+  }
+  if (stats_.checkpoints == 0) {
+    begin(machine);
+    checkpoint(machine.registers.PC, machine.steps, false);
+  }
+  std::vector<u8> record{input_tag};
+  append_varint(record, line.size());
+  record.insert(record.end(), line.begin(), line.end());
+  put(record.data(), record.size());
+  stats_.inputs++;
+  Interpreter::intepret_instruction(machine, line);
+}
+
+/**
+ * @brief Writes the index and waits for the whole trace to be written
+ * @details Nothing can be recorded after, closing again does nothing.
+ * @throw std::runtime_error If the trace cannot be written
+ */
+void Asm::Trace::Recorder::close() {
+  if (!writer_) return;
+  Trailer trailer{offset(), index_.size() / 2, stats_.instructions};
+  put(index_.data(), index_.size() * sizeof(u64));
+  put(&trailer, sizeof(trailer));
+  stats_.bytes = offset();
+  auto const writer = std::move(writer_);
+  buffer_.resize(static_cast<std::size_t>(out_ - buffer_.data()));
+  writer->write(buffer_);
+  writer->flush();
+}
+
+/**
+ * @brief Returns what was recorded so far
+ * @throw /
+ */
+Asm::Trace::Recorder::Stats Asm::Trace::Recorder::stats() const noexcept {
+  auto stats = stats_;
+  if (writer_) stats.bytes = offset();
+  return stats;
+}
+
+void Asm::Trace::Recorder::begin(Machine& machine) {
+  if (!writer_) {
+    throw std::runtime_error{"The trace is closed"};
+  }
+  machine_ = &machine;
+  ram_ = machine.RAM.page(0); // Commits it, as the engines do
+  start_ = machine.registers.PC;
+  start_steps_ = machine.steps;
+  run_steps_ = machine.steps;
+}
+
+/**
+ * @brief Records the block a run ended in
+ */
+void Asm::Trace::Recorder::finish(unsigned end, u64 steps) {
+  stats_.instructions += steps - run_steps_;
+  if (steps > start_steps_) block(true, end, end, steps);
+}
+
+/**
+ * @brief Writes the count of the blocks which repeated a shape
+ */
+void Asm::Trace::Recorder::put_repeats() {
+  if (out_ > limit_) spill();
+  *out_ = repeats_tag;
+  out_ = put_varint(out_ + 1, repeats_);
+  stats_.blocks += repeats_;
+  repeats_ = 0;
+}
+
+/**
+ * @brief Records the whole machine, which starts a new block at pc
+ * @param resumed True if the run goes on from there, false if it starts
+ */
+void Asm::Trace::Recorder::checkpoint(unsigned pc, u64 steps, bool resumed) {
+  if (repeats_ > 0) put_repeats();
+  auto const& machine = *machine_;
+  index_.push_back(steps);
+  index_.push_back(offset());
+  auto const& registers = machine.registers;
+  registers_ = {{registers.A, registers.X, registers.Y, registers.P.value(), registers.S}};
+  std::vector<u8> record{checkpoint_tag, static_cast<u8>(resumed)};
+  record.resize(2 + sizeof(u64));
+  std::memcpy(&record[2], &steps, sizeof(u64));
+  record.insert(record.end(), registers_.begin(), registers_.end());
+  record.push_back(static_cast<u8>(pc));
+  record.push_back(static_cast<u8>(pc >> 8));
+  record.insert(record.end(), machine.stack.data(), machine.stack.data() + registers.S);
+  auto const count = record.size();
+  record.resize(count + 2);
+  u16 pages = 0;
+  for (std::size_t i = 0; i < Memory::pages; i++) {
+    auto const page = machine.RAM.page(i);
+    if (std::all_of(page, page + Memory::page_size, [](u8 b) { return b == 0; })) continue;
+    record.push_back(static_cast<u8>(i));
+    record.insert(record.end(), page, page + Memory::page_size);
+    pages++;
+  }
+  std::memcpy(&record[count], &pages, sizeof(pages));
+  put(record.data(), record.size());
+  std::fill(shapes_.begin(), shapes_.end(), 0); // Replays may start here
+  next_checkpoint_ = steps + interval_;
+  stats_.checkpoints++;
+}
+
+/**
+ * @brief Appends bytes of any size to the records
+ */
+void Asm::Trace::Recorder::put(const void* data, std::size_t size) {
+  if (repeats_ > 0) put_repeats();
+  auto bytes = static_cast<const u8*>(data);
+  while (size > 0) {
+    if (out_ > limit_) spill();
+    auto const room = std::min(size, static_cast<std::size_t>(buffer_.data() + buffer_.size() - out_));
+    std::memcpy(out_, bytes, room);
+    out_ += room;
+    bytes += room;
+    size -= room;
+  }
+}
+
+/**
+ * @brief Hands the records to the writer
+ */
+void Asm::Trace::Recorder::spill() {
+  auto const used = static_cast<std::size_t>(out_ - buffer_.data());
+  buffer_.resize(used);
+  writer_->write(buffer_);
+  buffer_.resize(chunk_size + block_room);
+  spilled_ += used;
+  out_ = buffer_.data();
+  limit_ = buffer_.data() + chunk_size;
+}
+
+u64 Asm::Trace::Recorder::offset() const noexcept {
+  return spilled_ + static_cast<u64>(out_ - buffer_.data());
+}
+
+/**
+ * @brief Maps a trace
+ * @param program The program which was recorded, which must outlive the replayer
+ * @param engine The dispatch engine of the replay
+ * @throw std::runtime_error If the file cannot be mapped, is not a valid
+ * trace or was recorded from another program
+ */
+Asm::Trace::Replayer::Replayer(std::string const& filename, Program const& program,
+  Interpreter::Engine engine, bool optimize)
+  : filename_(filename), program_(program), executable_(program, engine, optimize) {
+  auto const fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error{"Cannot open file " + filename};
+  }
+  struct stat info;
+  auto const size = (fstat(fd, &info) == 0) ? static_cast<std::size_t>(info.st_size) : 0;
+  auto const mem = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error{"Cannot map file " + filename};
+  }
+  mapping_ = std::shared_ptr<const void>{mem, [size](const void* p) { munmap(const_cast<void*>(p), size); }};
+  data_ = static_cast<const u8*>(mem);
+
+  Cursor cursor{filename_, data_, size, 0};
+  auto const header = cursor.number<Header>();
+  if (std::memcmp(header.magic, signature, sizeof(signature)) != 0) cursor.fail("bad magic number");
+  if (header.version != version) cursor.fail("version " + std::to_string(header.version) + " is not supported");
+  if (header.header_size != sizeof(Header)) cursor.fail("bad header size");
+  if (header.code_count != program.code.size() || header.fingerprint != fingerprint(program)) {
+    throw std::runtime_error{"Trace " + filename + " was recorded from another program"};
+  }
+  if ((header.flags & ~changes_flag) != 0) cursor.fail("unknown flags");
+  changes_ = (header.flags & changes_flag) != 0;
+  if (size < sizeof(Header) + sizeof(Trailer)) cursor.fail("no index");
+  Cursor end{filename_, data_, size, size - sizeof(Trailer)};
+  auto const trailer = end.number<Trailer>();
+  if (trailer.index_offset < sizeof(Header) || trailer.index_offset > size - sizeof(Trailer)
+    || trailer.checkpoints != (size - sizeof(Trailer) - trailer.index_offset) / sizeof(Checkpoint)
+    || (size - sizeof(Trailer) - trailer.index_offset) % sizeof(Checkpoint) != 0) {
+    cursor.fail("bad index");
+  }
+  records_end_ = trailer.index_offset;
+  instructions_ = trailer.instructions;
+  Cursor index{filename_, data_, size - sizeof(Trailer), records_end_};
+  for (u64 i = 0; i < trailer.checkpoints; i++) {
+    auto const checkpoint = index.number<Checkpoint>();
+    if (checkpoint.offset < sizeof(Header) || checkpoint.offset >= records_end_ || data_[checkpoint.offset] != checkpoint_tag
+      || (!checkpoints_.empty() && checkpoint.steps < checkpoints_.back().steps)) {
+      cursor.fail("bad checkpoint");
+    }
+    checkpoints_.push_back(checkpoint);
+  }
+  if (checkpoints_.empty() || checkpoints_.front().offset != sizeof(Header)) cursor.fail("no checkpoint at the start");
+}
+
+/**
+ * @brief Replays the whole trace
+ * @param machine The machine we work with, whose labels are the program's
+ * @returns The instructions run
+ * @details A run which failed fails again, and the replay stops there as
+ * the recording did.
+ * @throw std::runtime_error If the machine does not go through the recorded
+ * states, or the trace is invalid, or with the error of a run which failed
+ */
+u64 Asm::Trace::Replayer::replay(Machine& machine) {
+  return play(machine, checkpoints_.front().offset, ~u64{0}, true);
+}
+
+/**
+ * @brief Puts the machine in the state it was in once steps instructions ran
+ * @param machine The machine we work with, whose labels are the program's
+ * @param steps Instructions run, counted as machine.steps counts them. The
+ * shell lines typed once they ran are executed too, the replay stops before
+ * the next instruction. Past the end of the trace, the machine is left as
+ * the trace ends.
+ * @details The replay starts from the last checkpoint before, what PRINT
+ * writes is discarded. A run which failed leaves the machine on the faulty
+ * instruction, as it did when recorded.
+ * @throw std::runtime_error If the machine does not go through the recorded
+ * states, or the trace is invalid
+ */
+void Asm::Trace::Replayer::seek(Machine& machine, u64 steps) {
+  auto const after = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), steps,
+    [](u64 value, Checkpoint const& checkpoint) { return value < checkpoint.steps; });
+  auto const from = (after == checkpoints_.begin()) ? checkpoints_.front() : *(after - 1);
+  auto const output = machine.output;
+  machine.output = &discarded();
+  try {
+    play(machine, from.offset, steps, false);
+  } catch (...) {
+    machine.output = output;
+    throw;
+  }
+  machine.output = output;
+}
+
+/**
+ * @brief Replays records from an offset, until the machine's steps reach until
+ * @param rethrow Throws the error of a run which failed, once checked,
+ * rather than going on with the next records
+ * @returns The instructions run
+ */
+u64 Asm::Trace::Replayer::play(Machine& machine, u64 from, u64 until, bool rethrow) {
+  Cursor cursor{filename_, data_, records_end_, static_cast<std::size_t>(from)};
+  auto const size = program_.code.size();
+  u8 expected[5] = {};
+  std::vector<u64> shapes(size + 1); // Lengths and targets, as the recorder keeps them
+  std::vector<const u8*> pages(Memory::pages);
+  u64 ran = 0;
+
+  // Runs the block at the machine's PC, false once until is reached
+  auto const run_block = [&](u64 length, long long target, bool last, std::string& error) {
+    auto const start = machine.registers.PC;
+    auto const steps = machine.steps;
+    if (steps >= until) return false;
+    auto const budget = std::min(length, until - steps);
+    try {
+      executable_.run(machine, budget);
+    } catch (std::exception const& e) {
+      error = e.what();
+    }
+    ran += machine.steps - steps;
+    if (budget < length) return false;
+    if (machine.steps - steps != length) diverged(machine, "the block at PC " + std::to_string(start) + " ended early");
+    auto const end = start + length;
+    if (!last) {
+      if (machine.registers.PC != target) diverged(machine, "the jump at PC " + std::to_string(end - 1) + " went elsewhere");
+    } else if (error.empty() && machine.registers.PC != end) {
+      diverged(machine, "the run did not end at PC " + std::to_string(end));
+    }
+    return true;
+  };
+  // Checks the block failed as the next record tells, if it does
+  auto const check_error = [&](std::string const& error) {
+    auto const failed = !cursor.done() && data_[cursor.offset()] == error_tag;
+    if (failed) {
+      Cursor message{cursor};
+      message.byte();
+      if (message.string() != error) diverged(machine, "the run did not fail the same way");
+      if (rethrow) throw std::runtime_error{error};
+    } else if (!error.empty()) {
+      diverged(machine, "the run failed: " + error);
+    }
+  };
+
+  while (!cursor.done()) {
+    auto const first = cursor.offset() == from;
+    auto const tag = cursor.byte();
+    if (tag == checkpoint_tag) {
+      auto const resumed = cursor.byte();
+      auto const steps = cursor.number<u64>();
+      if (steps > until && !first) break;
+      auto const registers = cursor.bytes(5);
+      auto const pc = cursor.number<u16>();
+      if (resumed > 1 || pc > size || registers[4] > decltype(Machine::stack)::capacity) cursor.fail("bad checkpoint");
+      auto const stack = cursor.bytes(registers[4]);
+      std::fill(pages.begin(), pages.end(), nullptr);
+      auto const count = cursor.number<u16>();
+      for (u16 i = 0; i < count; i++) {
+        auto const index = cursor.byte();
+        if (index >= Memory::pages) cursor.fail("bad checkpoint");
+        pages[index] = cursor.bytes(Memory::page_size);
+      }
+      if (resumed && !first) check(machine, registers, pc, steps, stack, pages);
+      std::memcpy(expected, registers, 5);
+      machine.registers.A = registers[0];
+      machine.registers.X = registers[1];
+      machine.registers.Y = registers[2];
+      machine.registers.P.assign(registers[3]);
+      machine.registers.S = registers[4];
+      machine.registers.PC = pc;
+      machine.steps = steps;
+      std::memcpy(machine.stack.data(), stack, registers[4]);
+      machine.RAM.clear();
+      for (std::size_t i = 0; i < Memory::pages; i++) {
+        if (pages[i]) std::memcpy(machine.RAM.page(i), pages[i], Memory::page_size);
+      }
+      std::fill(shapes.begin(), shapes.end(), 0);
+    } else if (tag == input_tag) {
+      auto const line = cursor.string();
+      try {
+        Interpreter::intepret_instruction(machine, line);
+      } catch (std::exception const& e) {
+        *machine.output << std::string{"Error: "} + e.what();
+      }
+      expected[0] = machine.registers.A;
+      expected[1] = machine.registers.X;
+      expected[2] = machine.registers.Y;
+      expected[3] = machine.registers.P.value();
+      expected[4] = machine.registers.S;
+    } else if (tag == error_tag) {
+      cursor.string(); // Thrown by the block before, which checked it
+    } else if (tag == repeats_tag) {
+      if (changes_) cursor.fail("bad record");
+      auto const count = cursor.varint();
+      for (u64 i = 0; i < count; i++) {
+        auto const start = machine.registers.PC;
+        if (start > size || shapes[start] == 0) cursor.fail("bad block");
+        std::string error;
+        if (!run_block(shapes[start] >> 16, static_cast<long long>(shapes[start] & 0xffff), false, error)) return ran;
+        if (i + 1 == count) check_error(error);
+        else if (!error.empty()) diverged(machine, "the run failed: " + error);
+      }
+    } else if (!changes_ && (tag < checkpoint_tag || tag == long_block_tag)) {
+      auto const length = (tag == long_block_tag) ? cursor.varint() : tag;
+      auto const start = machine.registers.PC;
+      if (length == 0 || start > size || length > size - start) cursor.fail("bad block");
+      auto const& jump = program_.code[start + length - 1];
+      if (jump.op < Opcode::jmp || jump.op > Opcode::jge || jump.target > size) cursor.fail("bad block");
+      shapes[start] = length << 16 | jump.target;
+      std::string error;
+      if (!run_block(length, jump.target, false, error)) break;
+      check_error(error);
+    } else if (tag < checkpoint_tag || tag == end_tag) {
+      auto const last = tag == end_tag;
+      auto const flags = last ? cursor.byte() : tag;
+      if ((last && (flags & repeat_flag)) || (!changes_ && (!last || flags != 0x1f))) cursor.fail("bad record");
+      auto const start = machine.registers.PC;
+      if (start > size) cursor.fail("bad block");
+      u64 length = 0;
+      long long target = 0;
+      if (flags & repeat_flag) {
+        auto const shape = shapes[start];
+        if (shape == 0) cursor.fail("bad block");
+        length = shape >> 16;
+        target = static_cast<long long>(shape & 0xffff);
+      } else {
+        length = cursor.varint();
+        if (length == 0 || length >> 48 != 0) cursor.fail("bad block");
+        if (!last) {
+          auto const zigzag = cursor.varint();
+          auto const delta = static_cast<long long>(zigzag >> 1) ^ -static_cast<long long>(zigzag & 1);
+          target = static_cast<long long>(start + length) + delta;
+          if (target < 0 || target > static_cast<long long>(size)) cursor.fail("bad block");
+          shapes[start] = length << 16 | static_cast<u64>(target);
+        }
+      }
+      std::string error;
+      if (!run_block(length, target, last, error)) break;
+      for (unsigned i = 0; i < 5; i++) {
+        if (flags & (1u << i)) expected[i] = cursor.byte();
+      }
+      auto const& registers = machine.registers;
+      u8 const now[] = {registers.A, registers.X, registers.Y, registers.P.value(), registers.S};
+      if ((changes_ || last) && std::memcmp(now, expected, sizeof(now)) != 0) diverged(machine, "the registers differ");
+      if (flags & ram_flag) {
+        auto const count = cursor.byte() + 1u;
+        auto const writes = cursor.bytes(2 * count);
+        for (unsigned i = 0; i < count; i++) {
+          if (machine.RAM.read(writes[2 * i]) != writes[2 * i + 1]) diverged(machine, "RAM differs");
+        }
+      }
+      check_error(error);
+    } else {
+      cursor.fail("bad record");
+    }
+  }
+  return ran;
+}
+
+/**
+ * @brief Checks the machine reached a checkpoint the run went on from
+ * @param pages The RAM pages of the checkpoint, null for zeros
+ */
+void Asm::Trace::Replayer::check(Machine const& machine, const u8* registers, unsigned pc, u64 steps, const u8* stack,
+  std::vector<const u8*> const& pages) const {
+  auto const& now = machine.registers;
+  u8 const values[] = {now.A, now.X, now.Y, now.P.value(), now.S};
+  if (std::memcmp(values, registers, sizeof(values)) != 0 || now.PC != pc || machine.steps != steps) {
+    diverged(machine, "the registers differ from the checkpoint");
+  }
+  if (std::memcmp(machine.stack.data(), stack, now.S) != 0) diverged(machine, "the stack differs from the checkpoint");
+  for (std::size_t i = 0; i < Memory::pages; i++) {
+    auto const page = machine.RAM.page(i);
+    auto const same = pages[i] ? std::memcmp(page, pages[i], Memory::page_size) == 0
+      : std::all_of(page, page + Memory::page_size, [](u8 b) { return b == 0; });
+    if (!same) diverged(machine, "RAM differs from the checkpoint");
+  }
+}
+
+[[noreturn]] void Asm::Trace::Replayer::diverged(Machine const& machine, std::string const& why) const {
+  throw std::runtime_error{"Replay of " + filename_ + " diverged after " + std::to_string(machine.steps) + " instructions: " + why};
+}
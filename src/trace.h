@@ -0,0 +1,279 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <array>   // std::array
+#include <cstddef> // std::size_t
+#include <memory>  // std::shared_ptr, std::unique_ptr
+#include <string>  // std::string
+#include <vector>  // std::vector
+
+#include "cpu.h"
+#include "interpreter.h"
+#include "program.h"
+
+namespace Asm {
+namespace Trace {
+
+/**
+ * @brief Records runs of a program, and the shell lines typed between them,
+ * in a binary trace file
+ * @details Runs go through the switched or threaded engine, which only
+ * calls back on taken jumps: a trace holds runs of consecutive instructions
+ * (basic blocks as executed), by their length and the target of their jump.
+ * The program is deterministic, so the shapes and the shell lines are enough
+ * to replay it. A block shaped as the last one from its PC only bumps a
+ * count, written once another record comes. A checkpoint of the whole
+ * machine starts every run and is repeated every interval instructions, so
+ * a replayer can seek without running the trace from its start, and check
+ * it reached the same state. With changes, blocks also list the registers
+ * they changed and the final value of the RAM bytes they wrote, which a
+ * replay checks block by block, but recording them costs more. Records
+ * are buffered and a thread writes full buffers, the run only waits for it
+ * when the disk falls behind.
+ */
+class Recorder {
+public:
+  static constexpr u64 default_interval = u64{1} << 20;
+
+  /**
+   * @brief What was recorded so far
+   */
+  struct Stats {
+    u64 instructions = 0;
+    u64 blocks = 0;
+    u64 inputs = 0;      //!< Shell lines
+    u64 checkpoints = 0;
+    u64 bytes = 0;       //!< Size of the trace, index included once closed
+  };
+
+  Recorder(Program const& program, std::string const& filename,
+    Interpreter::Engine engine = Interpreter::Engine::threaded, bool optimize = true, u64 interval = default_interval,
+    bool changes = false);
+  ~Recorder();
+  Recorder(Recorder const&) = delete;
+  Recorder& operator=(Recorder const&) = delete;
+
+  void run(Machine& machine);
+  void input(Machine& machine, std::string const& line);
+  void close();
+  Stats stats() const noexcept;
+
+  void jump(unsigned end, unsigned target, u64 steps);
+
+private:
+  class Writer;
+
+  void begin(Machine& machine);
+  void finish(unsigned end, u64 steps);
+  static u8* put_varint(u8* out, u64 value) noexcept;
+  void block(bool last, unsigned end, unsigned target, u64 steps);
+  void put_repeats();
+  void checkpoint(unsigned pc, u64 steps, bool resumed);
+  void put(const void* data, std::size_t size);
+  void spill();
+  u64 offset() const noexcept;
+
+  Program const& program_;
+  Interpreter::Executable executable_;
+  u64 interval_;
+  bool changes_;                     //!< Blocks list what they changed
+  std::vector<unsigned> next_write_; //!< First PC from each one whose instruction writes RAM
+  std::vector<u64> shapes_;          //!< Length and target of the last block from each PC, since the last checkpoint
+  std::unique_ptr<Writer> writer_;   //!< Null once closed
+
+  std::vector<u8> buffer_;  //!< Records not handed to the writer yet
+  u8* out_ = nullptr;       //!< End of the records in buffer_
+  u8* limit_ = nullptr;     //!< Spill once out_ passes it, a block record always fits after
+  u64 spilled_ = 0;         //!< Bytes handed to the writer
+  std::vector<u64> index_;  //!< Steps and offset of every checkpoint
+
+  Machine* machine_ = nullptr;
+  const u8* ram_ = nullptr;       //!< Page 0 of the machine's RAM
+  unsigned start_ = 0;            //!< PC of the block being run
+  u64 start_steps_ = 0;           //!< Steps when it started
+  u64 run_steps_ = 0;             //!< Steps when the run started
+  u64 repeats_ = 0;               //!< Blocks shaped as the last one from their PC, not written yet
+  u64 next_checkpoint_ = 0;
+  std::array<u8, 5> registers_{}; //!< A, X, Y, P and S as last recorded
+  std::array<u32, 0x100> seen_{}; //!< Block which last recorded each address
+  u32 stamp_ = 0;                 //!< Blocks recorded, modulo 2^32
+  Stats stats_;
+};
+
+/**
+ * @brief Runs a trace again, checking the machine goes through the
+ * recorded states
+ * @details The program must be the one recorded. Blocks are run with the
+ * budgeted engines, so PRINT writes again what it wrote, and the shell lines
+ * are executed again.
+ */
+class Replayer {
+public:
+  Replayer(std::string const& filename, Program const& program,
+    Interpreter::Engine engine = Interpreter::Engine::threaded, bool optimize = true);
+
+  u64 replay(Machine& machine);
+  void seek(Machine& machine, u64 steps);
+  u64 instructions() const noexcept { return instructions_; }
+
+private:
+  struct Checkpoint {
+    u64 steps;
+    u64 offset;
+  };
+
+  u64 play(Machine& machine, u64 from, u64 until, bool rethrow);
+  void check(Machine const& machine, const u8* registers, unsigned pc, u64 steps, const u8* stack,
+    std::vector<const u8*> const& pages) const;
+  [[noreturn]] void diverged(Machine const& machine, std::string const& why) const;
+
+  std::string filename_;
+  Program const& program_;
+  Interpreter::Executable executable_;
+  std::shared_ptr<const void> mapping_;
+  const u8* data_ = nullptr;
+  std::size_t records_end_ = 0;        //!< Offset of the index
+  bool changes_ = false;               //!< Blocks list what they changed
+  std::vector<Checkpoint> checkpoints_;
+  u64 instructions_ = 0;
+};
+
+/**
+ * @brief Encodes the end of a block: its length and the jump which ended
+ * it, then what changed if recording changes
+ * @param end PC after its last instruction
+ * @param target PC the jump went to
+ * @param steps Steps of the machine once the jump ran
+ * @details Called by the engines on every taken jump. Most blocks repeat
+ * the last one from their PC, which costs a compare and a count. Otherwise,
+ * unless recording changes, the length is enough: the target is the one of
+ * the jump the block ends with.
+ * @throw std::runtime_error If the writer failed
+ */
+inline void Recorder::jump(unsigned end, unsigned target, u64 steps) {
+  auto const length = steps - start_steps_;
+  auto& known = shapes_[start_];
+  if (changes_) {
+    block(false, end, target, steps);
+  } else if ((length << 16 | target) == known) {
+    repeats_++;
+  } else {
+    known = length << 16 | target;
+    if (repeats_ > 0) put_repeats();
+    if (out_ > limit_) spill();
+    if (length < 0x80) {
+      *out_++ = static_cast<u8>(length);
+    } else {
+      *out_ = 0x85; // Long block record
+      out_ = put_varint(out_ + 1, length);
+    }
+    stats_.blocks++;
+  }
+  start_ = target;
+  start_steps_ = steps;
+  if (steps >= next_checkpoint_) checkpoint(target, steps, true);
+}
+
+/**
+ * @brief Appends a varint to the records
+ */
+inline u8* Recorder::put_varint(u8* out, u64 value) noexcept {
+  while (value >= 0x80) {
+    *out++ = static_cast<u8>(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = static_cast<u8>(value);
+  return out;
+}
+
+/**
+ * @brief Encodes a block ending at end, jumping to target unless it is the
+ * last of its run, with what it changed
+ * @details Without changes, only the last block of a run comes here, and
+ * lists all the registers but no RAM. Works on locals: the records are
+ * bytes, which the compiler would otherwise assume overwrite the members
+ * after every store. The registers are read one by one, as the engine just
+ * stored them: a wider load would wait for those stores to complete.
+ */
+inline void Recorder::block(bool last, unsigned end, unsigned target, u64 steps) {
+  if (repeats_ > 0) put_repeats();
+  if (out_ > limit_) spill();
+  auto out = out_;
+  if (last) *out++ = 0x83; // End record
+  auto const header = out++;
+  u8 flags = 0;
+  auto const length = steps - start_steps_;
+  stats_.blocks++;
+  if (last) {
+    out = put_varint(out, length);
+  } else {
+    auto const shape = length << 16 | target;
+    auto& known = shapes_[start_];
+    if (shape == known) {
+      flags = 0x40;
+    } else {
+      known = shape;
+      auto const delta = static_cast<int>(target) - static_cast<int>(end);
+      out = put_varint(put_varint(out, length), (static_cast<u32>(delta) << 1) ^ static_cast<u32>(delta >> 31));
+    }
+  }
+  if (!changes_) {
+    auto const& registers = machine_->registers;
+    out[0] = registers.A;
+    out[1] = registers.X;
+    out[2] = registers.Y;
+    out[3] = registers.P.value();
+    out[4] = registers.S;
+    *header = 0x1f;
+    out_ = out + 5;
+    return;
+  }
+
+  auto const& registers = machine_->registers;
+  auto const changed = [&](unsigned i, u8 value) { // Without branches, which change is not predictable
+    auto const differs = value != registers_[i];
+    flags |= static_cast<u8>(differs << i);
+    registers_[i] = value;
+    *out = value;
+    out += differs;
+  };
+  changed(0, registers.A);
+  changed(1, registers.X);
+  changed(2, registers.Y);
+  changed(3, registers.P.value());
+  changed(4, registers.S);
+
+  auto const next_write = next_write_.data();
+  auto pc = next_write[start_];
+  if (pc < end) {
+    flags |= 0x20;
+    auto stamp = stamp_ + 1;
+    if (stamp == 0) {
+      seen_.fill(0);
+      stamp = 1;
+    }
+    stamp_ = stamp;
+    auto const code = program_.code.data();
+    auto const ram = ram_;
+    auto const seen = seen_.data();
+    auto const count = out++;
+    unsigned written = 0;
+    for (; pc < end; pc = next_write[pc + 1]) {
+      auto const address = code[pc].dst;
+      if (seen[address] == stamp) continue;
+      seen[address] = stamp;
+      out[0] = address;
+      out[1] = ram[address];
+      out += 2;
+      written++;
+    }
+    *count = static_cast<u8>(written - 1);
+  }
+  *header = flags;
+  out_ = out;
+}
+
+} // namespace Asm::Trace
+} // namespace Asm
+
+#endif // __TRACE_H__
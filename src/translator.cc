@@ -0,0 +1,204 @@
+#include "translator.h"
+
+#include <cstddef> // std::size_t
+#include <cstdio>  // std::snprintf
+
+/*
+ * Ahead-of-time translator to C++.
+ *
+ * Every instruction becomes a few statements behind its own label, jumps
+ * become gotos and the function starts with a switch on the PC, so a machine
+ * resumes where it stopped. A, X, Y, P and the step count live in locals,
+ * stored back before anything which may throw or print them: a translated
+ * program ends in the state the interpreter would leave, errors included.
+ */
+
+namespace {
+
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+using Asm::Program;
+
+inline bool is_value(OperandKind kind) noexcept {
+  return kind == OperandKind::reg || kind == OperandKind::imm || kind == OperandKind::addr;
+}
+
+inline bool is_place(OperandKind kind) noexcept {
+  return kind == OperandKind::reg || kind == OperandKind::addr;
+}
+
+/**
+ * @brief Writes str as a C++ string literal
+ */
+std::string literal(std::string const& str) {
+  std::string out{"\""};
+  for (auto const c : str) {
+    auto const byte = static_cast<unsigned char>(c);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else if (byte < 0x20 || byte >= 0x7f) {
+      char escaped[5];
+      std::snprintf(escaped, sizeof(escaped), "\\%03o", byte);
+      out += escaped;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+class Translator {
+public:
+  Translator(std::ostream& out, Program const& program) : out_(out), program_(program) {}
+
+  void run() {
+    auto const size = program_.code.size();
+    for (auto const& inst : program_.code) {
+      uses_ram_ = uses_ram_ || inst.dst_kind == OperandKind::addr || inst.src_kind == OperandKind::addr;
+    }
+    out_ << "void run(Machine& machine) {\n"
+      << "  u8 A = machine.registers.A;\n"
+      << "  u8 X = machine.registers.X;\n"
+      << "  u8 Y = machine.registers.Y;\n"
+      << "  Status P = machine.registers.P;\n"
+      << "  u64 steps = machine.steps;\n";
+    if (uses_ram_) out_ << "  auto const ram = machine.RAM.page(0);\n";
+    out_ << "  switch (machine.registers.PC) {\n";
+    for (std::size_t pc = 0; pc < size; pc++) out_ << "  case " << pc << ": goto L" << pc << ";\n";
+    out_ << "  default: goto done;\n  }\n";
+    for (std::size_t pc = 0; pc < size; pc++) instruction(pc);
+    out_ << "  machine.registers.PC = " << size << ";\n"
+      << "done:\n"
+      << "  MINIASM_AOT_STORE()\n"
+      << "}\n";
+  }
+
+private:
+  std::string value(OperandKind kind, u8 value) const {
+    static const char* const registers[] = {"A", "X", "Y"};
+    if (kind == OperandKind::reg) return registers[value];
+    if (kind == OperandKind::addr) return "ram[" + std::to_string(value) + "]";
+    return std::to_string(value);
+  }
+
+  std::string dst(Instruction const& inst) const { return value(inst.dst_kind, inst.dst); }
+  std::string src(Instruction const& inst) const { return value(inst.src_kind, inst.src); }
+
+  void sync(std::size_t pc) {
+    out_ << "  MINIASM_AOT_SYNC(" << pc + 1 << ")\n";
+  }
+
+  void raise(std::size_t pc, Instruction const& inst) {
+    sync(pc);
+    auto const& faults = program_.faults;
+    auto const message = (inst.target < faults.size()) ? faults[inst.target] : std::string{};
+    out_ << "  throw std::runtime_error{" << literal(message) << "};\n";
+  }
+
+  void jump(Instruction const& inst, std::string const& cond) {
+    auto const size = program_.code.size();
+    out_ << "  " << (cond.empty() ? "" : "if (" + cond + ") ");
+    if (inst.target < size) out_ << "goto L" << inst.target << ";\n";
+    else out_ << "{ machine.registers.PC = " << inst.target << "; goto done; }\n";
+  }
+
+  /**
+   * @brief Writes an instruction which reads src and writes dst
+   */
+  void write(std::size_t pc, Instruction const& inst, std::string const& statement) {
+    if (!is_value(inst.src_kind) || !is_place(inst.dst_kind)) return raise(pc, inst);
+    out_ << "  " << statement << "\n";
+  }
+
+  void instruction(std::size_t pc) {
+    auto const& inst = program_.code[pc];
+    out_ << "L" << pc << ":";
+    if (pc < program_.source.size() && program_.source[pc].find('\\') == std::string::npos) {
+      out_ << " // " << program_.source[pc];
+    }
+    out_ << "\n  steps++;\n";
+    auto const d = dst(inst);
+    auto const s = src(inst);
+    switch (inst.op) {
+    case Opcode::nop: break;
+    case Opcode::mov: write(pc, inst, d + " = " + s + ";"); break;
+    case Opcode::add: write(pc, inst, d + " += " + s + ";"); break;
+    case Opcode::sub: write(pc, inst, d + " -= " + s + ";"); break;
+    case Opcode::or_: write(pc, inst, d + " |= " + s + ";"); break;
+    case Opcode::and_: write(pc, inst, d + " &= " + s + ";"); break;
+    case Opcode::xor_: write(pc, inst, d + " ^= " + s + ";"); break;
+    case Opcode::shl:
+      write(pc, inst, d + " = (" + s + " < 8) ? static_cast<u8>(" + d + " << " + s + ") : 0;");
+      break;
+    case Opcode::shr:
+      write(pc, inst, d + " = (" + s + " < 8) ? static_cast<u8>(" + d + " >> " + s + ") : 0;");
+      break;
+    case Opcode::cmp:
+      if (!is_value(inst.dst_kind) || !is_value(inst.src_kind)) return raise(pc, inst);
+      out_ << "  P.compare(" << d << ", " << s << ");\n";
+      break;
+    case Opcode::push:
+      if (!is_value(inst.src_kind)) return raise(pc, inst);
+      sync(pc);
+      out_ << "  machine.push(" << s << ");\n";
+      break;
+    case Opcode::pop:
+      sync(pc);
+      if (!is_place(inst.dst_kind)) {
+        out_ << "  machine.pop();\n";
+        return raise(pc, inst);
+      }
+      out_ << "  " << d << " = machine.pop();\n";
+      break;
+    case Opcode::jmp: jump(inst, ""); break;
+    case Opcode::je: jump(inst, "P.equal()"); break;
+    case Opcode::jne: jump(inst, "!P.equal()"); break;
+    case Opcode::jl: jump(inst, "P.lower()"); break;
+    case Opcode::jle: jump(inst, "P.lower() || P.equal()"); break;
+    case Opcode::jg: jump(inst, "P.greater()"); break;
+    case Opcode::jge: jump(inst, "P.greater() || P.equal()"); break;
+    case Opcode::print:
+      if (!is_value(inst.src_kind)) return raise(pc, inst);
+      out_ << "  *machine.output << static_cast<unsigned>(" << s << ") << \"\\n\";\n";
+      break;
+    case Opcode::print_registers:
+      sync(pc);
+      out_ << "  print_registers(*machine.output, machine.registers);\n";
+      break;
+    case Opcode::fault: return raise(pc, inst);
+    }
+  }
+
+  std::ostream& out_;
+  Program const& program_;
+  bool uses_ram_ = false;
+};
+
+} // namespace
+
+/**
+ * @brief Translates a program to a C++ translation unit with a main function
+ * @param out Receives the translation unit
+ * @param program The program
+ * @param name The file it comes from, reported by the --state option
+ * @details The unit links against the runtime of aot.h, for instance with
+ * "make aot PROGRAM=prog.cc". It prints, fails and leaves the machine exactly
+ * like the interpreter.
+ * @throw /
+ */
+void Asm::emit_cpp(std::ostream& out, Program const& program, std::string const& name) {
+  out << "// Translated by mini-asm --emit-cpp from " << name << ", build with:\n"
+    << "//   make aot PROGRAM=<this file>\n"
+    << "#include \"aot.h\"\n\n"
+    << "#include <stdexcept> // std::runtime_error\n\n"
+    << "namespace {\n\n";
+  Translator{out, program}.run();
+  out << "\n} // namespace\n\n"
+    << "int main(int argc, char** argv) {\n"
+    << "  return Asm::Aot::main(argc, argv, run, " << literal(name) << ");\n"
+    << "}\n";
+}
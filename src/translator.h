@@ -0,0 +1,15 @@
+#ifndef __TRANSLATOR_H__
+#define __TRANSLATOR_H__
+
+#include <ostream> // std::ostream
+#include <string>  // std::string
+
+#include "program.h"
+
+namespace Asm {
+
+void emit_cpp(std::ostream& out, Program const& program, std::string const& name);
+
+} // namespace Asm
+
+#endif // __TRANSLATOR_H__
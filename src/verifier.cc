@@ -0,0 +1,154 @@
+#include "verifier.h"
+#include "syntax.h" // parse_instruction, parse_number, is_out_of_range
+
+#include <algorithm> // std::sort, std::upper_bound
+#include <cstddef>   // std::size_t
+
+/*
+ * Static verifier, run once per program.
+ *
+ * Stack depths are followed along every path from PC 0 with an empty stack.
+ * A PC reached with two different depths cannot be proven (a loop pushing
+ * more than it pops, for instance), which makes the program unsafe but is
+ * not an error: it still runs with the checks.
+ */
+
+namespace {
+
+using Asm::Instruction;
+using Asm::Opcode;
+using Asm::OperandKind;
+using Asm::Program;
+
+constexpr int stack_capacity = decltype(Machine::stack)::capacity;
+
+inline bool is_jump(Opcode op) noexcept {
+  return op >= Opcode::jmp && op <= Opcode::jge;
+}
+
+inline bool is_faulty(Instruction const& inst) noexcept {
+  return inst.op == Opcode::fault || inst.dst_kind == OperandKind::bad || inst.src_kind == OperandKind::bad;
+}
+
+class Verifier {
+public:
+  Verifier(Program const& program, Labels const* labels, Asm::Verification& result)
+    : program_(program), labels_(labels), result_(result) {
+    if (labels_) {
+      for (auto const& label : *labels_) label_pcs_.push_back(label.second);
+      std::sort(label_pcs_.begin(), label_pcs_.end());
+    }
+  }
+
+  void run() {
+    auto const size = program_.code.size();
+    result_.depth.assign(size, -1);
+    result_.safe = true;
+    check_labels();
+    std::vector<std::size_t> pending;
+    if (size > 0) {
+      result_.depth[0] = 0;
+      pending.push_back(0);
+    }
+    while (!pending.empty()) {
+      auto const pc = pending.back();
+      pending.pop_back();
+      step(pc, pending);
+    }
+    for (std::size_t pc = 0; pc < size; pc++) {
+      if (result_.depth[pc] == -1 && is_faulty(program_.code[pc])) problem(pc, fault_of(pc) + " (unreachable)");
+    }
+  }
+
+private:
+  /**
+   * @brief Returns the source line of a PC, or its index without labels
+   */
+  std::string where(std::size_t pc) const {
+    if (!labels_) return "instruction " + std::to_string(pc);
+    auto const labels = std::upper_bound(label_pcs_.begin(), label_pcs_.end(), pc) - label_pcs_.begin();
+    return "line " + std::to_string(pc + 1 + labels);
+  }
+
+  std::string fault_of(std::size_t pc) const {
+    auto message = program_.faults[program_.code[pc].target];
+    if (!message.empty() && message.back() == '\n') message.pop_back();
+    return message;
+  }
+
+  void problem(std::size_t pc, std::string const& message) {
+    result_.problems.push_back(where(pc) + ": " + message);
+  }
+
+  void unsafe(std::size_t pc, std::string const& message) {
+    problem(pc, message);
+    result_.safe = false;
+  }
+
+  /**
+   * @brief Reports jumps to unknown labels, which silently go to 0
+   */
+  void check_labels() {
+    if (!labels_) return;
+    for (std::size_t pc = 0; pc < program_.source.size(); pc++) {
+      Asm::Syntax::Parsed parsed;
+      u8 value{};
+      if (!Asm::Syntax::parse_instruction(program_.source[pc], parsed) || !is_jump(parsed.op)) continue;
+      if (Asm::Syntax::parse_number(parsed.param1, value) || Asm::Syntax::is_out_of_range(parsed.param1)) continue;
+      if (labels_->find(parsed.param1.str()) == labels_->end()) {
+        problem(pc, "unknown label '" + parsed.param1.str() + "', jumps to 0");
+      }
+    }
+  }
+
+  void step(std::size_t pc, std::vector<std::size_t>& pending) {
+    auto const& inst = program_.code[pc];
+    auto depth = result_.depth[pc];
+    if (is_faulty(inst)) return unsafe(pc, fault_of(pc));
+    if (inst.op == Opcode::push) {
+      if (depth >= stack_capacity) return unsafe(pc, "stack overflow");
+      depth++;
+    } else if (inst.op == Opcode::pop) {
+      if (depth == 0) return unsafe(pc, "stack underflow");
+      depth--;
+    }
+    if (is_jump(inst.op)) {
+      follow(pc, inst.target, depth, pending);
+      if (inst.op == Opcode::jmp) return;
+    }
+    follow(pc, pc + 1, depth, pending);
+  }
+
+  void follow(std::size_t from, std::size_t to, int depth, std::vector<std::size_t>& pending) {
+    auto const size = program_.code.size();
+    if (to > size) return unsafe(from, "jumps past the end of the program");
+    if (to == size) return;
+    auto& known = result_.depth[to];
+    if (known == -1) {
+      known = depth;
+      pending.push_back(to);
+    } else if (known != depth) {
+      unsafe(to, "stack depth is " + std::to_string(known) + " or " + std::to_string(depth));
+    }
+  }
+
+  Program const& program_;
+  Labels const* labels_;
+  Asm::Verification& result_;
+  std::vector<unsigned> label_pcs_; //!< PC of every label, sorted
+};
+
+} // namespace
+
+/**
+ * @brief Checks a program once, before it runs
+ * @param program The program
+ * @param labels Its labels, to report jumps to unknown labels, or null
+ * @returns Whether the program is safe and every problem found
+ * @throw std::bad_alloc If the results cannot be allocated
+ */
+Asm::Verification Asm::verify(Program const& program, Labels const* labels) {
+  Verification result;
+  Verifier{program, labels, result}.run();
+  return result;
+}
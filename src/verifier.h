@@ -0,0 +1,28 @@
+#ifndef __VERIFIER_H__
+#define __VERIFIER_H__
+
+#include <string> // std::string
+#include <vector> // std::vector
+
+#include "cpu.h"
+#include "program.h"
+
+namespace Asm {
+
+/**
+ * @brief What the verifier proved about a program
+ * @details A safe program, run from a PC it reaches with the stack depth
+ * recorded for it, cannot raise an error, overflow or underflow the stack, or
+ * jump past its end. The engines then run it without these checks.
+ */
+struct Verification {
+  bool safe = false;
+  std::vector<int> depth;            //!< Stack depth at each PC, -1 if unreachable from PC 0
+  std::vector<std::string> problems; //!< "line: message" for each problem found
+};
+
+Verification verify(Program const& program, Labels const* labels = nullptr);
+
+} // namespace Asm
+
+#endif // __VERIFIER_H__